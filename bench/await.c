@@ -0,0 +1,200 @@
+// Fan-out through cdnsAwaitRequests. Every query makes the callback send an A and an AAAA
+// request and wait on both, against the stub upstream and a sink socket that reads nothing:
+// all of the two from the stub, any of one from the stub and one from the sink, and a
+// deadline on two from the sink. Each cycle has to be resumed exactly once, with the
+// replies that mode promises, and the run fails otherwise.
+//
+// Usage: cdns-bench-await [stub port [queries per mode [in flight]]]
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "cdns.h"
+#include "bench.h"
+
+#define PORT 5320
+/// Long enough for the stub's latency, short next to a resend
+#define DEADLINE_MS 20
+/// A query that went unanswered this long is counted lost
+#define CLIENT_TIMEOUT_MS 1000
+#define QUESTION_SIZE 512
+
+typedef enum Mode {
+    ModeAll,
+    ModeAny,
+    ModeDeadline,
+    ModeCount
+} Mode;
+
+static const char* modeNames[ModeCount] = {"all", "any", "deadline"};
+
+typedef struct CycleData {
+    CdnsRequestId ids[2];
+    int resumes;
+} CycleData;
+
+static u_int16_t stubPort = 5301;
+static u_int16_t sinkPort;
+static int queries = 10000;
+static int inFlight = 32;
+static CdnsState* state;
+static atomic_uint_fast64_t started;
+static atomic_uint_fast64_t resumed;
+static atomic_uint_fast64_t wrong;
+
+static CdnsRequestId sendQuestion(CdnsResponseContext* context, CdnsPacketReadInfo* request, u_int16_t type,
+                                  u_int16_t port) {
+    // A single question, its type in the 4 bytes before the end
+    unsigned char question[QUESTION_SIZE];
+    memcpy(question, request->blob, request->blobSize);
+    question[request->blobSize - 4] = type >> 8;
+    question[request->blobSize - 3] = type & 0xFF;
+    CdnsRequestWriteInfo* writer;
+    CDNS_CHECK_ERROR(cdnsCreateRequest(context, &writer));
+    CdnsPacketHeader* header;
+    CDNS_CHECK_ERROR(cdnsWritableRequestHeader(writer, &header));
+    header->rd = 1;
+    header->qdcount = 1;
+    CDNS_CHECK_ERROR(cdnsWriteQuestion(writer, question, request->blobSize));
+    CdnsRequestDestination destination = {.netProtocol = CdnsNetProtoInet4, .protocol = CdnsProtoUdp,
+                                          .address = htonl(INADDR_LOOPBACK), .port = port};
+    CdnsRequestId id;
+    CDNS_CHECK_ERROR(cdnsSendRequest(writer, destination, &id));
+    return id;
+}
+static CdnsCallbackCycleInfo fanOut(CdnsResponseContext* context, void* data, bool first) {
+    CycleData* cycle = (CycleData*)data;
+    CdnsPacketReadInfo* request;
+    CDNS_CHECK_ERROR(cdnsGetRequestReadInfo(context, &request));
+    Mode mode = request->header->id % ModeCount;
+    if(first) {
+        atomic_fetch_add_explicit(&started, 1, memory_order_relaxed);
+        cycle->resumes = 0;
+        cycle->ids[0] = sendQuestion(context, request, CDNS_RR_A, mode == ModeDeadline ? sinkPort : stubPort);
+        cycle->ids[1] = sendQuestion(context, request, CDNS_RR_AAAA, mode == ModeAll ? stubPort : sinkPort);
+        CdnsCallbackCycleInfo out;
+        CDNS_CHECK_ERROR(cdnsAwaitRequests(context, cycle->ids, 2, mode == ModeAny ? CdnsAwaitAny : CdnsAwaitAll,
+                                           mode == ModeDeadline ? DEADLINE_MS : 0, &out));
+        return out;
+    }
+    atomic_fetch_add_explicit(&resumed, 1, memory_order_relaxed);
+    CdnsPacketReadInfo* a;
+    CdnsPacketReadInfo* aaaa;
+    CDNS_CHECK_ERROR(cdnsGetResponseReadInfo(context, cycle->ids[0], &a));
+    CDNS_CHECK_ERROR(cdnsGetResponseReadInfo(context, cycle->ids[1], &aaaa));
+    bool expected = (mode == ModeAll && a && aaaa) || (mode == ModeAny && a && !aaaa) ||
+                    (mode == ModeDeadline && !a && !aaaa);
+    if(++cycle->resumes != 1 || !expected) {
+        atomic_fetch_add_explicit(&wrong, 1, memory_order_relaxed);
+    }
+    CdnsResponseWriteinfo* writer;
+    CDNS_CHECK_ERROR(cdnsGetResponseWriter(context, &writer));
+    CdnsPacketHeader* header;
+    CDNS_CHECK_ERROR(cdnsWritableResponseHeader(writer, &header));
+    header->qdcount = request->header->qdcount;
+    header->rcode = expected ? 0 : 2;
+    CDNS_CHECK_ERROR(cdnsWriteRecord(writer, request->blob, request->blobSize));
+    CDNS_CHECK_ERROR(cdnsSendResponse(writer));
+    CdnsCallbackCycleInfo out = {.status = CdnsReturned};
+    return out;
+}
+// Sends the mode's share of queries with inFlight outstanding, returns how many came back
+static int runMode(int sock, Mode mode) {
+    unsigned char query[] = {0, 0, 1, 0, 0, 1, 0, 0, 0, 0, 0, 0, 3, 'w', 'w', 'w', 7, 'e', 'x', 'a', 'm', 'p', 'l',
+                             'e', 3, 'c', 'o', 'm', 0, 0, 1, 0, 1};
+    u_int16_t id = mode;
+    int sent = 0;
+    int replies = 0;
+    for(;sent < queries && sent < inFlight;sent++, id += ModeCount) {
+        query[0] = id >> 8;
+        query[1] = id & 0xFF;
+        send(sock, query, sizeof(query), 0);
+    }
+    unsigned char reply[512];
+    while(replies < sent && recv(sock, reply, sizeof(reply), 0) > 0) {
+        replies++;
+        if(sent < queries) {
+            query[0] = id >> 8;
+            query[1] = id & 0xFF;
+            send(sock, query, sizeof(query), 0);
+            sent++;
+            id += ModeCount;
+        }
+    }
+    return replies;
+}
+static void* runClient(void* arg) {
+    bool* failed = (bool*)arg;
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in to = {.sin_family = AF_INET, .sin_port = htons(PORT)};
+    to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    connect(sock, (struct sockaddr*)&to, sizeof(to));
+    struct timeval timeout = {.tv_usec = CLIENT_TIMEOUT_MS * 1000};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    for(Mode mode = 0;mode < ModeCount;mode++) {
+        u_int64_t startedBefore = atomic_load(&started);
+        u_int64_t resumedBefore = atomic_load(&resumed);
+        u_int64_t wrongBefore = atomic_load(&wrong);
+        double start = seconds();
+        int replies = runMode(sock, mode);
+        double elapsed = seconds() - start;
+        u_int64_t cycles = atomic_load(&started) - startedBefore;
+        u_int64_t resumes = atomic_load(&resumed) - resumedBefore;
+        u_int64_t wrongResumes = atomic_load(&wrong) - wrongBefore;
+        printf("%-8s %9.0f qps, %d of %d replies, %llu cycles resumed %llu times, %llu wrong\n", modeNames[mode],
+               replies / elapsed, replies, queries, (unsigned long long)cycles, (unsigned long long)resumes,
+               (unsigned long long)wrongResumes);
+        if(replies != queries || resumes != cycles || wrongResumes != 0) *failed = true;
+    }
+    close(sock);
+    cdnsStop(state);
+    return NULL;
+}
+// Bound so the deadline requests are delivered, and never read
+static int openSink(void) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t length = sizeof(addr);
+    bind(sock, (struct sockaddr*)&addr, sizeof(addr));
+    getsockname(sock, (struct sockaddr*)&addr, &length);
+    sinkPort = ntohs(addr.sin_port);
+    return sock;
+}
+
+int main(int argc, char** argv) {
+    if(argc > 1) stubPort = atoi(argv[1]);
+    if(argc > 2) queries = atoi(argv[2]);
+    if(argc > 3) inFlight = atoi(argv[3]);
+    int sink = openSink();
+    CdnsListenerConfig listener = {.netProto = CdnsNetProtoInet4, .proto = CdnsProtoUdp, .port = PORT};
+    u_int32_t loopback = htonl(INADDR_LOOPBACK);
+    memcpy(listener.addr, &loopback, sizeof(loopback));
+    CdnsConfig config = {
+        .numListeners = 1,
+        .listeners = &listener,
+        .initialThreads = 1,
+        .maxThreads = 1,
+        .threadRequests = inFlight,
+        .threadOutgoingRequests = 2 * inFlight,
+    };
+    CDNS_CHECK_ERROR(cdnsCreateDns(&state, &config));
+    CdnsCallbackDescriptor callback = {.callback = fanOut, .perCallbackDataSize = sizeof(CycleData)};
+    CDNS_CHECK_ERROR(cdnsSetCallback(state, &callback));
+    printf("%d queries per mode, %d in flight, stub on port %u\n", queries, inFlight, stubPort);
+    bool failed = false;
+    pthread_t client;
+    pthread_create(&client, NULL, runClient, &failed);
+    CDNS_CHECK_ERROR(cdnsPoll(state));
+    pthread_join(client, NULL);
+    CDNS_CHECK_ERROR(cdnsPause(state));
+    CDNS_CHECK_ERROR(cdnsDestroyDns(state));
+    close(sink);
+    return failed ? 1 : 0;
+}
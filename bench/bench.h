@@ -0,0 +1,44 @@
+#ifndef _CDNS_BENCH_H_
+#define _CDNS_BENCH_H_
+
+// Helpers shared by the benchmarks: a monotonic clock, a fast reproducible random source
+// and a name encoder for building queries and corpora.
+
+#include <stdbool.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+static inline double seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+/// xorshift64, state must not be 0
+static inline u_int64_t nextRandom(u_int64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+// Dotted name to length-prefixed labels, returns the length. With random, each letter is
+// upper cased or not at random
+static inline int encodeName(const char* dotted, unsigned char* out, u_int64_t* random) {
+    int length = 0;
+    while(*dotted != '\0') {
+        const char* dot = strchr(dotted, '.');
+        int label = dot != NULL ? (int)(dot - dotted) : (int)strlen(dotted);
+        out[length] = label;
+        for(int i = 0;i < label;i++) {
+            unsigned char c = dotted[i];
+            bool upper = random != NULL && c >= 'a' && c <= 'z' && (nextRandom(random) & 1);
+            out[length + 1 + i] = upper ? c - ('a' - 'A') : c;
+        }
+        length += 1 + label;
+        dotted += label + (dot != NULL);
+    }
+    out[length++] = 0;
+    return length;
+}
+
+#endif
@@ -0,0 +1,180 @@
+// Size and build time of responses written with the compressing packet builder, against
+// the same records written as raw uncompressed blobs the way cdnsWriteRecord takes them
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cdns.h"
+#include "bench.h"
+
+#define ITERATIONS 1000000
+#define MAX_RECORDS 32
+#define BUFFER_SIZE 4096
+#define HEADER_SIZE 12
+
+typedef struct Record {
+    CdnsSection section;
+    const char* name;
+    CdnsResourceRecordInfo info;
+    unsigned char rdata[64];
+} Record;
+
+typedef struct Response {
+    const char* qname;
+    u_int16_t qtype;
+    int numRecords;
+    Record records[MAX_RECORDS];
+} Response;
+
+static void addAddress(Response* r, CdnsSection section, const char* name, int last) {
+    Record* rec = &r->records[r->numRecords++];
+    rec->section = section;
+    rec->name = name;
+    rec->info = (CdnsResourceRecordInfo){.type = CDNS_RR_A, .clas = CDNS_RC_IN, .ttl = 300, .rdlength = 4};
+    unsigned char address[4] = {192, 0, 2, last};
+    memcpy(rec->rdata, address, 4);
+}
+static void addNameRecord(Response* r, CdnsSection section, const char* name, CdnsRecordType type,
+                          int preference, const char* target) {
+    Record* rec = &r->records[r->numRecords++];
+    rec->section = section;
+    rec->name = name;
+    int before = 0;
+    if(type == CDNS_RR_MX) {
+        rec->rdata[0] = preference >> 8;
+        rec->rdata[1] = preference & 0xFF;
+        before = 2;
+    }
+    int length = before + encodeName(target, rec->rdata + before, NULL);
+    rec->info = (CdnsResourceRecordInfo){.type = type, .clas = CDNS_RC_IN, .ttl = 3600, .rdlength = length};
+}
+
+// www.example.com A, answered through a CNAME with two addresses, two NS records and their glue
+static void buildTypical(Response* r) {
+    memset(r, 0, sizeof(Response));
+    r->qname = "www.example.com";
+    r->qtype = CDNS_RR_A;
+    addNameRecord(r, CdnsSectionAnswer, "www.example.com", CDNS_RR_CNAME, 0, "edge.example.com");
+    addAddress(r, CdnsSectionAnswer, "edge.example.com", 1);
+    addAddress(r, CdnsSectionAnswer, "edge.example.com", 2);
+    addNameRecord(r, CdnsSectionAuthority, "example.com", CDNS_RR_NS, 0, "ns1.example.com");
+    addNameRecord(r, CdnsSectionAuthority, "example.com", CDNS_RR_NS, 0, "ns2.example.com");
+    addAddress(r, CdnsSectionAdditional, "ns1.example.com", 53);
+    addAddress(r, CdnsSectionAdditional, "ns2.example.com", 54);
+}
+// MX lookup for a long zone name, with four name servers and glue for every host
+static void buildMail(Response* r) {
+    static const char* hosts[] = {"mx1.mail.corp.example.co.uk", "mx2.mail.corp.example.co.uk",
+                                  "mx3.mail.corp.example.co.uk", "mx4.mail.corp.example.co.uk"};
+    static const char* servers[] = {"ns-a.dns.corp.example.co.uk", "ns-b.dns.corp.example.co.uk",
+                                    "ns-c.dns.corp.example.co.uk", "ns-d.dns.corp.example.co.uk"};
+    memset(r, 0, sizeof(Response));
+    r->qname = "corp.example.co.uk";
+    r->qtype = CDNS_RR_MX;
+    for(int i = 0;i < 4;i++) {
+        addNameRecord(r, CdnsSectionAnswer, "corp.example.co.uk", CDNS_RR_MX, 10 * (i + 1), hosts[i]);
+    }
+    for(int i = 0;i < 4;i++) {
+        addNameRecord(r, CdnsSectionAuthority, "corp.example.co.uk", CDNS_RR_NS, 0, servers[i]);
+    }
+    for(int i = 0;i < 4;i++) {
+        addAddress(r, CdnsSectionAdditional, hosts[i], 10 + i);
+        addAddress(r, CdnsSectionAdditional, servers[i], 20 + i);
+    }
+}
+
+// Appends records uncompressed, as a callback using cdnsWriteRecord has to
+static int buildRaw(const Response* r, unsigned char* out) {
+    int counts[3] = {0, 0, 0};
+    int length = HEADER_SIZE;
+    length += encodeName(r->qname, out + length, NULL);
+    unsigned char question[4] = {r->qtype >> 8, r->qtype & 0xFF, 0, CDNS_RC_IN};
+    memcpy(out + length, question, 4);
+    length += 4;
+    for(int i = 0;i < r->numRecords;i++) {
+        const Record* rec = &r->records[i];
+        length += encodeName(rec->name, out + length, NULL);
+        const CdnsResourceRecordInfo* info = &rec->info;
+        unsigned char fixed[10] = {info->type >> 8, info->type & 0xFF, info->clas >> 8, info->clas & 0xFF,
+                                   info->ttl >> 24, (info->ttl >> 16) & 0xFF, (info->ttl >> 8) & 0xFF,
+                                   info->ttl & 0xFF, info->rdlength >> 8, info->rdlength & 0xFF};
+        memcpy(out + length, fixed, 10);
+        memcpy(out + length + 10, rec->rdata, info->rdlength);
+        length += 10 + info->rdlength;
+        counts[rec->section]++;
+    }
+    // Id 0, QR set, one question
+    unsigned char header[HEADER_SIZE] = {0, 0, 0x80, 0, 0, 1, 0, counts[0], 0, counts[1], 0, counts[2]};
+    memcpy(out, header, HEADER_SIZE);
+    return length;
+}
+static int buildCompressed(const Response* r, unsigned char* out) {
+    unsigned char name[256];
+    CdnsPacketBuilder builder;
+    cdnsInitPacketBuilder(&builder, out, BUFFER_SIZE);
+    builder.header.qr = 1;
+    encodeName(r->qname, name, NULL);
+    CDNS_CHECK_ERROR(cdnsBuildQuestion(&builder, name, r->qtype, CDNS_RC_IN));
+    for(int i = 0;i < r->numRecords;i++) {
+        encodeName(r->records[i].name, name, NULL);
+        CDNS_CHECK_ERROR(cdnsBuildRecord(&builder, r->records[i].section, name, &r->records[i].info,
+                                         r->records[i].rdata));
+    }
+    int length;
+    cdnsFinishPacket(&builder, &length);
+    return length;
+}
+
+// Both packets must parse and hold the same names
+static void check(const unsigned char* raw, int rawLength, const unsigned char* compressed, int compressedLength) {
+    CdnsPacketReadInfo a, b;
+    CdnsPacketHeader headerA, headerB;
+    void* entriesA[MAX_RECORDS + 1];
+    void* entriesB[MAX_RECORDS + 1];
+    CDNS_CHECK_ERROR(cdnsParsePacket(raw, rawLength, &a, &headerA, entriesA, MAX_RECORDS + 1));
+    CDNS_CHECK_ERROR(cdnsParsePacket(compressed, compressedLength, &b, &headerB, entriesB, MAX_RECORDS + 1));
+    if(a.numRecords != b.numRecords) {
+        printf("record counts differ\n");
+        exit(1);
+    }
+    for(u_int32_t i = 0;i < a.numRecords;i++) {
+        unsigned char nameA[256], nameB[256];
+        int lengthA, lengthB;
+        CDNS_CHECK_ERROR(cdnsReadName(&a, a.records[i], nameA, sizeof(nameA), &lengthA));
+        CDNS_CHECK_ERROR(cdnsReadName(&b, b.records[i], nameB, sizeof(nameB), &lengthB));
+        if(lengthA != lengthB || memcmp(nameA, nameB, lengthA) != 0) {
+            printf("record %u names differ\n", i);
+            exit(1);
+        }
+    }
+}
+static void run(const char* name, const Response* r) {
+    static unsigned char raw[BUFFER_SIZE], compressed[BUFFER_SIZE];
+    int rawLength = buildRaw(r, raw);
+    int compressedLength = buildCompressed(r, compressed);
+    check(raw, rawLength, compressed, compressedLength);
+
+    u_int64_t checksum = 0;
+    double start = seconds();
+    for(int i = 0;i < ITERATIONS;i++) {
+        checksum += buildRaw(r, raw);
+    }
+    double rawTime = seconds() - start;
+    start = seconds();
+    for(int i = 0;i < ITERATIONS;i++) {
+        checksum += buildCompressed(r, compressed);
+    }
+    double compressedTime = seconds() - start;
+    printf("%-8s %2d records: raw %4d bytes %6.2f Mpackets/s, compressed %4d bytes %6.2f Mpackets/s (%llu)\n",
+           name, r->numRecords, rawLength, ITERATIONS / rawTime / 1e6, compressedLength,
+           ITERATIONS / compressedTime / 1e6, (unsigned long long)checksum % 10);
+}
+
+int main(int argc, char** argv) {
+    static Response r;
+    buildTypical(&r);
+    run("typical", &r);
+    buildMail(&r);
+    run("mail", &r);
+    return 0;
+}
@@ -0,0 +1,41 @@
+#!/bin/sh
+# Runs the forwarder example on loopback between the stub upstream and the load generator,
+# and prints what the load generator measures. Settings come from the environment:
+#   PORT, STUB_PORT   where the forwarder and the stub listen (5300, 5301)
+#   THREADS           forwarder threads (1)
+#   LATENCY, JITTER   stub reply delay in ms, fixed and uniform extra (1, 1)
+#   LOSS              percent of queries the stub ignores (0)
+#   LOAD_THREADS      load generator threads (2)
+#   INFLIGHT          queries each load thread keeps in flight in closed loop (64)
+#   QPS               total rate for the open loop runs (20000)
+#   DURATION          length of every run in seconds (5)
+#   TIMEOUT           ms before the load generator counts a query as lost (2000)
+set -e
+BUILD=${BUILD:-build}
+PORT=${PORT:-5300}
+STUB_PORT=${STUB_PORT:-5301}
+THREADS=${THREADS:-1}
+LATENCY=${LATENCY:-1}
+JITTER=${JITTER:-1}
+LOSS=${LOSS:-0}
+LOAD_THREADS=${LOAD_THREADS:-2}
+INFLIGHT=${INFLIGHT:-64}
+QPS=${QPS:-20000}
+DURATION=${DURATION:-5}
+TIMEOUT=${TIMEOUT:-2000}
+
+$BUILD/cdns-bench-stub -p "$STUB_PORT" -l "$LATENCY" -j "$JITTER" -d "$LOSS" &
+STUB=$!
+$BUILD/cdns-basic "$PORT" 127.0.0.1 "$STUB_PORT" "$THREADS" > /dev/null &
+FORWARDER=$!
+trap 'kill $STUB $FORWARDER 2> /dev/null' EXIT INT TERM
+sleep 1
+
+LOAD="$BUILD/cdns-bench-load -p $PORT -t $LOAD_THREADS -d $DURATION -w $TIMEOUT"
+echo "== cached: the mix repeats, so all but the first of each question is answered from the cache"
+$LOAD -T udp -c "$INFLIGHT"
+$LOAD -T tcp -c "$INFLIGHT"
+echo "== forwarded: every query has a unique name and goes to the stub"
+$LOAD -T udp -c "$INFLIGHT" -u
+$LOAD -T tcp -c "$INFLIGHT" -u
+$LOAD -T udp -q "$QPS" -u
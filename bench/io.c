@@ -0,0 +1,158 @@
+// UDP throughput of the two I/O backends. The library answers every query from the callback
+// straight away, so the time goes to moving datagrams, and client threads on loopback each
+// keep a number of queries in flight in closed loop. Each backend gets the same run, and
+// what the load saw is printed next to the batch counters of the library.
+//
+// Usage: cdns-bench-io [seconds [client threads [in flight per thread [server threads]]]]
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "cdns.h"
+#include "bench.h"
+
+#define PORT 5310
+#define MAX_CLIENTS 64
+/// A query that went unanswered this long is sent again
+#define CLIENT_TIMEOUT_MS 100
+
+static int runSeconds = 5;
+static int numClients = 4;
+static int inFlight = 64;
+static unsigned int serverThreads = 1;
+static atomic_bool running;
+static CdnsState* state;
+
+typedef struct Client {
+    pthread_t thread;
+    u_int64_t replies;
+    u_int64_t timeouts;
+} Client;
+
+static CdnsCallbackCycleInfo answer(CdnsResponseContext* context, void* data, bool first) {
+    CdnsPacketReadInfo* request;
+    CDNS_CHECK_ERROR(cdnsGetRequestReadInfo(context, &request));
+    CdnsResponseWriteinfo* writer;
+    CDNS_CHECK_ERROR(cdnsGetResponseWriter(context, &writer));
+    CdnsPacketHeader* header;
+    CDNS_CHECK_ERROR(cdnsWritableResponseHeader(writer, &header));
+    header->qdcount = request->header->qdcount;
+    header->rcode = 3;
+    if(request->blobSize > 0) {
+        CDNS_CHECK_ERROR(cdnsWriteRecord(writer, request->blob, request->blobSize));
+    }
+    CDNS_CHECK_ERROR(cdnsSendResponse(writer));
+    CdnsCallbackCycleInfo out = {.status = CdnsReturned};
+    return out;
+}
+static void* runClient(void* arg) {
+    Client* client = (Client*)arg;
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in to = {.sin_family = AF_INET, .sin_port = htons(PORT)};
+    to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    connect(sock, (struct sockaddr*)&to, sizeof(to));
+    struct timeval timeout = {.tv_usec = CLIENT_TIMEOUT_MS * 1000};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    unsigned char query[] = {0, 0, 1, 0, 0, 1, 0, 0, 0, 0, 0, 0, 3, 'w', 'w', 'w', 7, 'e', 'x', 'a', 'm', 'p', 'l',
+                             'e', 3, 'c', 'o', 'm', 0, 0, 1, 0, 1};
+    u_int16_t id = 0;
+    while(atomic_load_explicit(&running, memory_order_relaxed)) {
+        for(int i = 0;i < inFlight;i++) {
+            query[0] = id >> 8;
+            query[1] = id++ & 0xFF;
+            send(sock, query, sizeof(query), 0);
+        }
+        // Every reply sends the next query, until one goes missing
+        unsigned char reply[512];
+        while(atomic_load_explicit(&running, memory_order_relaxed)) {
+            if(recv(sock, reply, sizeof(reply), 0) <= 0) {
+                client->timeouts++;
+                break;
+            }
+            client->replies++;
+            query[0] = id >> 8;
+            query[1] = id++ & 0xFF;
+            send(sock, query, sizeof(query), 0);
+        }
+    }
+    close(sock);
+    return NULL;
+}
+static void* stopLater(void* arg) {
+    (void)arg;
+    sleep(runSeconds);
+    atomic_store(&running, false);
+    cdnsStop(state);
+    return NULL;
+}
+static void runBackend(const char* name, CdnsIoBackend backend) {
+    CdnsListenerConfig listener = {.netProto = CdnsNetProtoInet4, .proto = CdnsProtoUdp, .port = PORT};
+    u_int32_t loopback = htonl(INADDR_LOOPBACK);
+    memcpy(listener.addr, &loopback, sizeof(loopback));
+    CdnsConfig config = {
+        .numListeners = 1,
+        .listeners = &listener,
+        .initialThreads = serverThreads,
+        .maxThreads = serverThreads,
+        .threadRequests = 1024,
+        .ioBackend = backend,
+    };
+    CDNS_CHECK_ERROR(cdnsCreateDns(&state, &config));
+    CdnsCallbackDescriptor callback = {.callback = answer};
+    CDNS_CHECK_ERROR(cdnsSetCallback(state, &callback));
+    Client clients[MAX_CLIENTS];
+    memset(clients, 0, sizeof(clients));
+    atomic_store(&running, true);
+    for(int i = 0;i < numClients;i++) {
+        pthread_create(&clients[i].thread, NULL, runClient, &clients[i]);
+    }
+    pthread_t stopper;
+    pthread_create(&stopper, NULL, stopLater, NULL);
+    double start = seconds();
+    CDNS_CHECK_ERROR(cdnsPoll(state));
+    double elapsed = seconds() - start;
+    pthread_join(stopper, NULL);
+    CDNS_CHECK_ERROR(cdnsPause(state));
+    u_int64_t replies = 0;
+    u_int64_t timeouts = 0;
+    for(int i = 0;i < numClients;i++) {
+        pthread_join(clients[i].thread, NULL);
+        replies += clients[i].replies;
+        timeouts += clients[i].timeouts;
+    }
+    CdnsBatchStats batch;
+    cdnsGetBatchStats(state, &batch);
+    CdnsStats stats;
+    cdnsGetStats(state, &stats);
+    printf("%-6s %9.0f qps, %llu timeouts, %.1f received and %.1f sent per batch, p50 %llu us, p99 %llu us, "
+           "%llu of %u threads on io_uring\n", name, replies / elapsed, (unsigned long long)timeouts,
+           batch.recvBatches > 0 ? (double)batch.recvPackets / batch.recvBatches : 0,
+           batch.sendBatches > 0 ? (double)batch.sendPackets / batch.sendBatches : 0,
+           (unsigned long long)cdnsLatencyPercentile(&stats.endToEnd, 50),
+           (unsigned long long)cdnsLatencyPercentile(&stats.endToEnd, 99), (unsigned long long)batch.ringThreads,
+           serverThreads);
+    CDNS_CHECK_ERROR(cdnsDestroyDns(state));
+}
+
+int main(int argc, char** argv) {
+    if(argc > 1) runSeconds = atoi(argv[1]);
+    if(argc > 2) numClients = atoi(argv[2]);
+    if(argc > 3) inFlight = atoi(argv[3]);
+    if(argc > 4) serverThreads = atoi(argv[4]);
+    if(numClients < 1 || numClients > MAX_CLIENTS) {
+        fprintf(stderr, "between 1 and %d client threads\n", MAX_CLIENTS);
+        return 1;
+    }
+    printf("%d s, %d clients with %d queries in flight each, %u server threads\n", runSeconds, numClients, inFlight,
+           serverThreads);
+    runBackend("epoll", CdnsIoEpoll);
+    runBackend("uring", CdnsIoUring);
+    return 0;
+}
@@ -0,0 +1,519 @@
+// Load generator for the benchmarks. Every thread sends queries from a mix over UDP, or
+// pipelined on one TCP connection, either keeping a fixed number in flight (closed loop)
+// or at a fixed rate whatever the replies do (open loop), and reports throughput and
+// latency percentiles. In open loop latency is measured from when a query was due to be
+// sent, so a server that stalls the sender is not flattered by it.
+//
+// Usage: cdns-bench-load [-s server] [-p port] [-T udp|tcp] [-t threads] [-c in flight per
+//        thread] [-q total qps] [-d seconds] [-w timeout ms] [-f query file] [-u]
+//
+// The query file has one "name type" per line, as dnsperf takes it. With -u every query
+// gets a unique extra label in front, so no cache can answer it.
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include "bench.h"
+
+#define MAX_THREADS 64
+#define MAX_QUERIES 65536
+#define MAX_QUERY_SIZE 300
+#define NUM_IDS 65536
+#define BATCH_SIZE 32
+#define HEADER_SIZE 12
+// Sends that may still be waiting for their timeout, per thread
+#define SENT_RING_SIZE (1 << 18)
+#define TCP_BUFFER_SIZE (256 * 1024)
+// Histogram buckets hold 2^HIST_SUB_BITS linear steps per power of two, for about 3%
+// precision at any magnitude
+#define HIST_SUB_BITS 5
+#define HIST_BUCKETS ((65 - HIST_SUB_BITS) << HIST_SUB_BITS)
+
+typedef struct Options {
+    struct sockaddr_in server;
+    bool tcp;
+    int threads;
+    int concurrency;
+    double qps;
+    double seconds;
+    u_int64_t timeoutNs;
+    bool unique;
+} Options;
+
+// A query in wire form without its id
+typedef struct Query {
+    int length;
+    unsigned char packet[MAX_QUERY_SIZE];
+} Query;
+
+typedef struct Histogram {
+    u_int64_t counts[HIST_BUCKETS];
+    u_int64_t max;
+} Histogram;
+
+typedef struct Sent {
+    u_int16_t id;
+    u_int64_t sent;
+} Sent;
+
+typedef struct Loader {
+    const Options* options;
+    int index;
+    int sock;
+    u_int64_t random;
+    u_int64_t uniqueCounter;
+    // Send time of every id in flight, zero when free
+    u_int64_t sentAt[NUM_IDS];
+    u_int16_t freeIds[NUM_IDS];
+    int numFree;
+    Sent ring[SENT_RING_SIZE];
+    u_int32_t ringHead;
+    u_int32_t ringTail;
+    unsigned char tcpIn[TCP_BUFFER_SIZE];
+    int tcpInLength;
+    u_int64_t sent;
+    u_int64_t answered;
+    u_int64_t lost;
+    u_int64_t errors;
+    Histogram latency;
+} Loader;
+
+static Query queries[MAX_QUERIES];
+static int numQueries;
+
+// Popular names and the types resolvers ask for them, roughly as often as they do
+static const char* defaultMix[] = {
+    "google.com A", "google.com AAAA", "www.google.com A", "www.google.com AAAA", "facebook.com A",
+    "www.youtube.com A", "www.youtube.com AAAA", "api.twitter.com A", "github.com A", "en.wikipedia.org A",
+    "www.amazon.com A", "outlook.office365.com A", "login.microsoftonline.com A", "fonts.gstatic.com A",
+    "i.ytimg.com A", "d1a2b3c4d5e6f7.cloudfront.net A", "e6858.dscx.akamaiedge.net A",
+    "s3.us-east-1.amazonaws.com A", "connectivitycheck.gstatic.com A", "settings-win.data.microsoft.com A",
+    "incoming.telemetry.mozilla.org A", "securepubads.g.doubleclick.net A", "ib.adnxs.com A",
+    "34.216.184.93.in-addr.arpa PTR", "gmail.com MX", "example.com TXT", "example.com NS",
+    "_sip._tls.example.org SRV", "time.apple.com A", "play.googleapis.com AAAA",
+    "r3---sn-q4fl6nsk.googlevideo.com A", "web.whatsapp.com A",
+};
+
+static u_int64_t nowNs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u_int64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static int histogramBucket(u_int64_t value) {
+    if(value < (1u << HIST_SUB_BITS)) {
+        return value;
+    }
+    int magnitude = 63 - __builtin_clzll(value);
+    int shift = magnitude - HIST_SUB_BITS;
+    return (shift << HIST_SUB_BITS) + (int)(value >> shift);
+}
+// Largest value that lands in a bucket
+static u_int64_t histogramBucketTop(int bucket) {
+    if(bucket < (2 << HIST_SUB_BITS)) {
+        return bucket;
+    }
+    int shift = (bucket >> HIST_SUB_BITS) - 1;
+    u_int64_t base = (u_int64_t)((bucket & ((1 << HIST_SUB_BITS) - 1)) | (1 << HIST_SUB_BITS)) << shift;
+    return base + ((1ull << shift) - 1);
+}
+static void histogramRecord(Histogram* h, u_int64_t value) {
+    h->counts[histogramBucket(value)]++;
+    if(value > h->max) {
+        h->max = value;
+    }
+}
+static u_int64_t histogramPercentile(const Histogram* h, u_int64_t total, double percentile) {
+    u_int64_t target = (u_int64_t)(total * percentile / 100.0 + 0.5);
+    u_int64_t seen = 0;
+    for(int i = 0;i < HIST_BUCKETS;i++) {
+        seen += h->counts[i];
+        if(seen >= target && seen > 0) {
+            u_int64_t top = histogramBucketTop(i);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+static int parseType(const char* name) {
+    static const struct {
+        const char* name;
+        int type;
+    } types[] = {{"A", 1}, {"NS", 2}, {"CNAME", 5}, {"SOA", 6}, {"PTR", 12}, {"MX", 15}, {"TXT", 16},
+                 {"AAAA", 28}, {"SRV", 33}, {"HTTPS", 65}, {"ANY", 255}};
+    for(size_t i = 0;i < sizeof(types) / sizeof(types[0]);i++) {
+        if(strcasecmp(name, types[i].name) == 0) {
+            return types[i].type;
+        }
+    }
+    int type = atoi(name);
+    return type > 0 && type <= 0xFFFF ? type : -1;
+}
+// Builds a query with RD set from "name type", returns false if the line is not one
+static bool addQuery(const char* line) {
+    char name[256], typeName[16];
+    if(numQueries >= MAX_QUERIES || sscanf(line, "%255s %15s", name, typeName) != 2) {
+        return false;
+    }
+    int type = parseType(typeName);
+    if(type < 0) {
+        return false;
+    }
+    Query* q = &queries[numQueries];
+    unsigned char header[HEADER_SIZE] = {0, 0, 0x01, 0, 0, 1, 0, 0, 0, 0, 0, 0};
+    memcpy(q->packet, header, HEADER_SIZE);
+    int length = HEADER_SIZE;
+    const char* label = name;
+    while(*label != '\0' && strcmp(label, ".") != 0) {
+        const char* dot = strchr(label, '.');
+        int labelLength = dot != NULL ? (int)(dot - label) : (int)strlen(label);
+        if(labelLength == 0 || labelLength > 63 || length + 1 + labelLength > HEADER_SIZE + 255 - 1) {
+            return false;
+        }
+        q->packet[length] = labelLength;
+        memcpy(q->packet + length + 1, label, labelLength);
+        length += 1 + labelLength;
+        label += labelLength + (dot != NULL);
+    }
+    unsigned char tail[5] = {0, type >> 8, type & 0xFF, 0, 1};
+    memcpy(q->packet + length, tail, 5);
+    q->length = length + 5;
+    numQueries++;
+    return true;
+}
+static bool loadQueries(const char* path) {
+    FILE* file = fopen(path, "r");
+    if(file == NULL) {
+        fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    char line[512];
+    while(fgets(line, sizeof(line), file) != NULL) {
+        if(line[0] != '#' && line[0] != '\n') {
+            addQuery(line);
+        }
+    }
+    fclose(file);
+    return numQueries > 0;
+}
+
+// Writes the next query of the mix into out with the given id, returns its length
+static int nextQuery(Loader* loader, u_int16_t id, unsigned char* out) {
+    const Query* q = &queries[nextRandom(&loader->random) % numQueries];
+    memcpy(out, q->packet, HEADER_SIZE);
+    out[0] = id >> 8;
+    out[1] = id & 0xFF;
+    int length = HEADER_SIZE;
+    if(loader->options->unique) {
+        // Thread and counter, so no two queries of the run share a name
+        length += 1 + sprintf((char*)out + length + 1, "u%02x%012llx", loader->index,
+                              (unsigned long long)loader->uniqueCounter++ & 0xFFFFFFFFFFFFull);
+        out[HEADER_SIZE] = length - HEADER_SIZE - 1;
+    }
+    memcpy(out + length, q->packet + HEADER_SIZE, q->length - HEADER_SIZE);
+    return length + q->length - HEADER_SIZE;
+}
+static bool takeId(Loader* loader, u_int64_t sent, u_int16_t* id) {
+    if(loader->numFree == 0) {
+        return false;
+    }
+    // Random ids, so replies to queries that already timed out are unlikely to match
+    int pick = nextRandom(&loader->random) % loader->numFree;
+    *id = loader->freeIds[pick];
+    loader->freeIds[pick] = loader->freeIds[--loader->numFree];
+    loader->sentAt[*id] = sent;
+    if(loader->ringHead - loader->ringTail == SENT_RING_SIZE) {
+        // Full of sends still in their timeout, the oldest is given up on early
+        Sent* oldest = &loader->ring[loader->ringTail++ % SENT_RING_SIZE];
+        if(loader->sentAt[oldest->id] == oldest->sent) {
+            loader->sentAt[oldest->id] = 0;
+            loader->freeIds[loader->numFree++] = oldest->id;
+            loader->lost++;
+        }
+    }
+    loader->ring[loader->ringHead++ % SENT_RING_SIZE] = (Sent){*id, sent};
+    loader->sent++;
+    return true;
+}
+static void expire(Loader* loader, u_int64_t now) {
+    while(loader->ringTail != loader->ringHead) {
+        Sent* oldest = &loader->ring[loader->ringTail % SENT_RING_SIZE];
+        if(loader->sentAt[oldest->id] == oldest->sent) {
+            if(now - oldest->sent < loader->options->timeoutNs) {
+                return;
+            }
+            loader->sentAt[oldest->id] = 0;
+            loader->freeIds[loader->numFree++] = oldest->id;
+            loader->lost++;
+        }
+        loader->ringTail++;
+    }
+}
+static void handleReply(Loader* loader, const unsigned char* packet, int length, u_int64_t now) {
+    if(length < HEADER_SIZE) {
+        return;
+    }
+    u_int16_t id = packet[0] << 8 | packet[1];
+    u_int64_t sent = loader->sentAt[id];
+    if(sent == 0) {
+        return;
+    }
+    loader->sentAt[id] = 0;
+    loader->freeIds[loader->numFree++] = id;
+    loader->answered++;
+    if((packet[3] & 0x0F) != 0) {
+        loader->errors++;
+    }
+    histogramRecord(&loader->latency, now > sent ? now - sent : 0);
+}
+
+static int inFlight(const Loader* loader) {
+    return NUM_IDS - loader->numFree;
+}
+// Sends up to count queries, each stamped with the time it was due
+static void sendQueries(Loader* loader, int count, u_int64_t due, u_int64_t interval) {
+    static __thread unsigned char packets[BATCH_SIZE][MAX_QUERY_SIZE + 16];
+    static __thread unsigned char stream[BATCH_SIZE * (MAX_QUERY_SIZE + 18)];
+    struct mmsghdr msgs[BATCH_SIZE];
+    struct iovec iovs[BATCH_SIZE];
+    while(count > 0) {
+        int batch = 0;
+        int streamLength = 0;
+        while(batch < BATCH_SIZE && batch < count) {
+            u_int16_t id;
+            if(!takeId(loader, due, &id)) {
+                break;
+            }
+            due += interval;
+            if(loader->options->tcp) {
+                int length = nextQuery(loader, id, stream + streamLength + 2);
+                stream[streamLength] = length >> 8;
+                stream[streamLength + 1] = length & 0xFF;
+                streamLength += 2 + length;
+            } else {
+                int length = nextQuery(loader, id, packets[batch]);
+                iovs[batch] = (struct iovec){.iov_base = packets[batch], .iov_len = length};
+                msgs[batch].msg_hdr = (struct msghdr){.msg_iov = &iovs[batch], .msg_iovlen = 1};
+            }
+            batch++;
+        }
+        if(batch == 0) {
+            return;
+        }
+        if(loader->options->tcp) {
+            for(int written = 0;written < streamLength;) {
+                ssize_t done = write(loader->sock, stream + written, streamLength - written);
+                if(done <= 0) {
+                    fprintf(stderr, "tcp write failed: %s\n", strerror(errno));
+                    exit(1);
+                }
+                written += done;
+            }
+        } else {
+            // Datagrams the socket would not take are left to time out, as on a real network
+            sendmmsg(loader->sock, msgs, batch, 0);
+        }
+        count -= batch;
+    }
+}
+static void receiveReplies(Loader* loader) {
+    u_int64_t now = nowNs();
+    if(loader->options->tcp) {
+        while(true) {
+            ssize_t got = recv(loader->sock, loader->tcpIn + loader->tcpInLength,
+                               TCP_BUFFER_SIZE - loader->tcpInLength, MSG_DONTWAIT);
+            if(got == 0) {
+                fprintf(stderr, "server closed the connection\n");
+                exit(1);
+            }
+            if(got < 0) {
+                return;
+            }
+            loader->tcpInLength += got;
+            int pos = 0;
+            while(pos + 2 <= loader->tcpInLength) {
+                int length = loader->tcpIn[pos] << 8 | loader->tcpIn[pos + 1];
+                if(pos + 2 + length > loader->tcpInLength) {
+                    break;
+                }
+                handleReply(loader, loader->tcpIn + pos + 2, length, now);
+                pos += 2 + length;
+            }
+            memmove(loader->tcpIn, loader->tcpIn + pos, loader->tcpInLength - pos);
+            loader->tcpInLength -= pos;
+        }
+    }
+    static __thread unsigned char packets[BATCH_SIZE][512];
+    struct mmsghdr msgs[BATCH_SIZE];
+    struct iovec iovs[BATCH_SIZE];
+    while(true) {
+        for(int i = 0;i < BATCH_SIZE;i++) {
+            iovs[i] = (struct iovec){.iov_base = packets[i], .iov_len = sizeof(packets[i])};
+            msgs[i].msg_hdr = (struct msghdr){.msg_iov = &iovs[i], .msg_iovlen = 1};
+        }
+        int got = recvmmsg(loader->sock, msgs, BATCH_SIZE, MSG_DONTWAIT, NULL);
+        if(got <= 0) {
+            return;
+        }
+        for(int i = 0;i < got;i++) {
+            handleReply(loader, packets[i], msgs[i].msg_len, now);
+        }
+    }
+}
+
+static void* runLoader(void* arg) {
+    Loader* loader = (Loader*)arg;
+    const Options* options = loader->options;
+    loader->sock = socket(AF_INET, options->tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+    int size = 4 * 1024 * 1024;
+    setsockopt(loader->sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(loader->sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    if(options->tcp) {
+        int one = 1;
+        setsockopt(loader->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    if(connect(loader->sock, (const struct sockaddr*)&options->server, sizeof(options->server)) != 0) {
+        fprintf(stderr, "cannot connect: %s\n", strerror(errno));
+        exit(1);
+    }
+    for(int i = 0;i < NUM_IDS;i++) {
+        loader->freeIds[loader->numFree++] = i;
+    }
+    u_int64_t start = nowNs();
+    u_int64_t end = start + (u_int64_t)(options->seconds * 1e9);
+    // Open loop sends are spread over the threads' share of the rate
+    u_int64_t interval = options->qps > 0 ? (u_int64_t)(1e9 * options->threads / options->qps) : 0;
+    u_int64_t nextDue = start + interval * loader->index / options->threads;
+    u_int64_t now = start;
+    // Sending stops at the end, then what is in flight gets its timeout to come back
+    while(now < end || (inFlight(loader) > 0 && now < end + options->timeoutNs)) {
+        if(now < end) {
+            if(interval > 0) {
+                if(nextDue <= now) {
+                    int due = (now - nextDue) / interval + 1;
+                    sendQueries(loader, due, nextDue, interval);
+                    nextDue += (u_int64_t)due * interval;
+                }
+            } else if(inFlight(loader) < options->concurrency) {
+                sendQueries(loader, options->concurrency - inFlight(loader), now, 0);
+            }
+        }
+        // Waits to the nanosecond, sleeping rather than spinning between open loop sends
+        u_int64_t wait = 10000000;
+        if(interval > 0 && now < end) {
+            wait = nextDue > now ? nextDue - now : 0;
+        }
+        struct timespec timeout = {.tv_sec = wait / 1000000000, .tv_nsec = wait % 1000000000};
+        struct pollfd pfd = {.fd = loader->sock, .events = POLLIN};
+        if(ppoll(&pfd, 1, &timeout, NULL) > 0) {
+            receiveReplies(loader);
+        }
+        now = nowNs();
+        expire(loader, now);
+    }
+    loader->lost += inFlight(loader);
+    close(loader->sock);
+    return NULL;
+}
+
+static void usage(const char* program) {
+    fprintf(stderr,
+            "usage: %s [-s server] [-p port] [-T udp|tcp] [-t threads] [-c in flight per thread] [-q total qps]\n"
+            "       [-d seconds] [-w timeout ms] [-f query file] [-u]\n",
+            program);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    Options options = {.threads = 1, .concurrency = 64, .seconds = 5, .timeoutNs = 1000000000ull};
+    options.server = (struct sockaddr_in){.sin_family = AF_INET, .sin_port = htons(5300),
+                                          .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    const char* queryFile = NULL;
+    int opt;
+    while((opt = getopt(argc, argv, "s:p:T:t:c:q:d:w:f:u")) != -1) {
+        switch(opt) {
+            case 's':
+                if(inet_pton(AF_INET, optarg, &options.server.sin_addr) != 1) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'p': options.server.sin_port = htons(atoi(optarg)); break;
+            case 'T': options.tcp = strcmp(optarg, "tcp") == 0; break;
+            case 't': options.threads = atoi(optarg); break;
+            case 'c': options.concurrency = atoi(optarg); break;
+            case 'q': options.qps = atof(optarg); break;
+            case 'd': options.seconds = atof(optarg); break;
+            case 'w': options.timeoutNs = (u_int64_t)(atof(optarg) * 1e6); break;
+            case 'f': queryFile = optarg; break;
+            case 'u': options.unique = true; break;
+            default: usage(argv[0]);
+        }
+    }
+    if(options.threads < 1 || options.threads > MAX_THREADS || options.concurrency < 1 ||
+       options.concurrency > NUM_IDS / 2) {
+        usage(argv[0]);
+    }
+    if(queryFile != NULL) {
+        if(!loadQueries(queryFile)) {
+            fprintf(stderr, "no queries in %s\n", queryFile);
+            return 1;
+        }
+    } else {
+        for(size_t i = 0;i < sizeof(defaultMix) / sizeof(defaultMix[0]);i++) {
+            addQuery(defaultMix[i]);
+        }
+    }
+
+    Loader* loaders = (Loader*)calloc(options.threads, sizeof(Loader));
+    pthread_t threads[MAX_THREADS];
+    u_int64_t start = nowNs();
+    for(int i = 0;i < options.threads;i++) {
+        loaders[i].options = &options;
+        loaders[i].index = i;
+        loaders[i].random = 0x9E3779B97F4A7C15ull * (i + 1) ^ start;
+        pthread_create(&threads[i], NULL, runLoader, &loaders[i]);
+    }
+    static Histogram latency;
+    u_int64_t sent = 0, answered = 0, lost = 0, errors = 0;
+    for(int i = 0;i < options.threads;i++) {
+        pthread_join(threads[i], NULL);
+        sent += loaders[i].sent;
+        answered += loaders[i].answered;
+        lost += loaders[i].lost;
+        errors += loaders[i].errors;
+        for(int j = 0;j < HIST_BUCKETS;j++) {
+            latency.counts[j] += loaders[i].latency.counts[j];
+        }
+        if(loaders[i].latency.max > latency.max) {
+            latency.max = loaders[i].latency.max;
+        }
+    }
+    if(options.qps > 0) {
+        printf("%s open loop at %.0f qps, %d threads, %.1f s:", options.tcp ? "tcp" : "udp", options.qps,
+               options.threads, options.seconds);
+    } else {
+        printf("%s closed loop, %d threads x %d in flight, %.1f s:", options.tcp ? "tcp" : "udp", options.threads,
+               options.concurrency, options.seconds);
+    }
+    printf(" sent %llu, answered %llu, lost %llu, error rcodes %llu\n", (unsigned long long)sent,
+           (unsigned long long)answered, (unsigned long long)lost, (unsigned long long)errors);
+    printf("  %.0f qps answered, latency p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms\n",
+           answered / options.seconds, histogramPercentile(&latency, answered, 50) / 1e6,
+           histogramPercentile(&latency, answered, 99) / 1e6, histogramPercentile(&latency, answered, 99.9) / 1e6,
+           latency.max / 1e6);
+    free(loaders);
+    return 0;
+}
@@ -0,0 +1,157 @@
+// Throughput of the name kernels on a mix of names shaped like real resolver traffic, in
+// the random case 0x20 encoding gives them. Every kernel set the CPU runs is timed
+// folding and hashing each name, and comparing it against a lowercased copy, next to the
+// byte at a time lowercase and FNV-1a loop they replaced
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "cdns_name.h"
+#include "bench.h"
+
+#define ROUNDS 20000
+#define MAX_NAMES 64
+
+// Popular sites, CDN and cloud endpoints, telemetry and ad hosts, reverse lookups and a
+// few long generated names, roughly in the proportions a recursive resolver sees them
+static const char* names[] = {
+    "google.com", "www.google.com", "facebook.com", "www.youtube.com", "api.twitter.com",
+    "t.co", "github.com", "en.wikipedia.org", "www.amazon.com", "mail.yahoo.com",
+    "outlook.office365.com", "login.microsoftonline.com", "www.googleapis.com",
+    "fonts.gstatic.com", "graph.facebook.com", "i.ytimg.com", "pbs.twimg.com",
+    "d1a2b3c4d5e6f7.cloudfront.net", "e6858.dscx.akamaiedge.net",
+    "star-mini.c10r.facebook.com", "s3.us-east-1.amazonaws.com",
+    "mybucket.s3.dualstack.eu-west-1.amazonaws.com", "connectivitycheck.gstatic.com",
+    "settings-win.data.microsoft.com", "v10.events.data.microsoft.com",
+    "incoming.telemetry.mozilla.org", "securepubads.g.doubleclick.net",
+    "pagead2.googlesyndication.com", "ib.adnxs.com", "tpc.googlesyndication.com",
+    "34.216.184.93.in-addr.arpa", "1.0.168.192.in-addr.arpa",
+    "b.a.9.8.7.6.5.0.4.0.0.0.3.0.0.0.2.0.0.0.1.0.0.0.0.0.0.0.1.2.3.4.ip6.arpa",
+    "_ldap._tcp.dc._msdcs.corp.example.com", "_sip._tls.example.org",
+    "time.apple.com", "gateway.icloud.com", "mesu.apple.com", "init.itunes.apple.com",
+    "clients4.google.com", "android.clients.google.com", "play.googleapis.com",
+    "r3---sn-q4fl6nsk.googlevideo.com", "rr5---sn-5hne6nzs.googlevideo.com",
+    "cdn.jsdelivr.net", "ajax.googleapis.com", "code.jquery.com", "static.xx.fbcdn.net",
+    "scontent-lhr8-1.xx.fbcdn.net", "edge-chat.facebook.com", "web.whatsapp.com",
+    "a1887.dscq.akamai.net", "prod.ipv4.us-west-2.mcdn.example-streaming-service.net",
+    "xn--80ak6aa92e.com", "localhost", "wpad.home.arpa", "router.lan",
+    "id5mgf3c2kbnq7gx1yhd0lu5gjv9a6i2.data.analytics.tracking-provider.example.com",
+    "ocsp.digicert.com", "crl.pki.goog", "api.stripe.com", "hooks.slack.com",
+    "github-cloud.s3.amazonaws.com", "registry-1.docker.io",
+};
+
+typedef struct Name {
+    unsigned char wire[CDNS_NAME_MAX_LENGTH];
+    unsigned char lower[CDNS_NAME_MAX_LENGTH];
+    int length;
+} Name;
+
+static Name corpus[MAX_NAMES];
+static int numNames;
+
+
+// What the cache and reply matching did before the kernels
+static int foldNameFnv(const unsigned char* name, int limit, unsigned char* out, u_int64_t* hash) {
+    int length = uncompressedNameLength(name, limit);
+    if(length < 0) {
+        return -1;
+    }
+    u_int64_t h = 0xcbf29ce484222325ull;
+    for(int i = 0;i < length;i++) {
+        out[i] = foldAscii(name[i]);
+        h = (h ^ out[i]) * 0x100000001b3ull;
+    }
+    *hash = h;
+    return length;
+}
+static double runFold(DnsFoldName foldName, u_int64_t* checksum) {
+    unsigned char out[CDNS_NAME_MAX_LENGTH];
+    double start = seconds();
+    for(int round = 0;round < ROUNDS;round++) {
+        for(int i = 0;i < numNames;i++) {
+            u_int64_t hash;
+            *checksum += foldName(corpus[i].wire, sizeof(corpus[i].wire), out, &hash) + hash;
+        }
+    }
+    return (double)ROUNDS * numNames / (seconds() - start) / 1e6;
+}
+static double runEqual(DnsNameEqual nameEqual, u_int64_t* checksum) {
+    double start = seconds();
+    for(int round = 0;round < ROUNDS;round++) {
+        for(int i = 0;i < numNames;i++) {
+            *checksum += nameEqual(corpus[i].wire, corpus[i].lower, corpus[i].length);
+        }
+    }
+    return (double)ROUNDS * numNames / (seconds() - start) / 1e6;
+}
+// Every kernel set must fold, hash and compare exactly like the scalar one
+static void check(const DnsNameKernels* kernels) {
+    for(int i = 0;i < numNames;i++) {
+        unsigned char expected[CDNS_NAME_MAX_LENGTH], out[CDNS_NAME_MAX_LENGTH];
+        u_int64_t expectedHash = 0;
+        u_int64_t hash = 0;
+        // Both with room to spare past the name, and with none
+        int length = nameKernelsScalar.foldName(corpus[i].wire, corpus[i].length, expected, &expectedHash);
+        if(kernels->foldName(corpus[i].wire, corpus[i].length, out, &hash) != length || hash != expectedHash ||
+           memcmp(out, expected, length) != 0 ||
+           kernels->foldName(corpus[i].wire, sizeof(corpus[i].wire), out, &hash) != length || hash != expectedHash ||
+           memcmp(out, expected, length) != 0 || memcmp(out, corpus[i].lower, length) != 0) {
+            printf("%s: name %d folds differently\n", kernels->name, i);
+            exit(1);
+        }
+        if(!kernels->nameEqual(corpus[i].wire, corpus[i].lower, length)) {
+            printf("%s: name %d does not equal its lowercase\n", kernels->name, i);
+            exit(1);
+        }
+        // Changing any one byte must be noticed
+        for(int j = 0;j < length;j++) {
+            memcpy(out, corpus[i].lower, length);
+            out[j] ^= 0x01;
+            if(kernels->nameEqual(corpus[i].wire, out, length)) {
+                printf("%s: name %d equals a copy with byte %d changed\n", kernels->name, i, j);
+                exit(1);
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    u_int64_t random = 0x9E3779B97F4A7C15ull;
+    int totalLength = 0;
+    numNames = sizeof(names) / sizeof(names[0]);
+    for(int i = 0;i < numNames;i++) {
+        corpus[i].length = encodeName(names[i], corpus[i].wire, &random);
+        for(int j = 0;j < corpus[i].length;j++) {
+            corpus[i].lower[j] = foldAscii(corpus[i].wire[j]);
+        }
+        totalLength += corpus[i].length;
+    }
+    printf("%d names, %.1f bytes on average, selected kernels: %s\n", numNames, (double)totalLength / numNames,
+           nameKernels()->name);
+
+    const DnsNameKernels* sets[3] = {&nameKernelsScalar};
+    int numSets = 1;
+#ifdef CDNS_NAME_X86
+    __builtin_cpu_init();
+    sets[numSets++] = &nameKernelsSse2;
+    if(__builtin_cpu_supports("avx2")) {
+        sets[numSets++] = &nameKernelsAvx2;
+    }
+#endif
+    u_int64_t checksum = 0;
+    double fnv = runFold(foldNameFnv, &checksum);
+    printf("%-8s fold + hash %7.1f Mnames/s\n", "fnv", fnv);
+    double scalarFold = 0, scalarEqual = 0;
+    for(int i = 0;i < numSets;i++) {
+        check(sets[i]);
+        double fold = runFold(sets[i]->foldName, &checksum);
+        double equal = runEqual(sets[i]->nameEqual, &checksum);
+        if(i == 0) {
+            scalarFold = fold;
+            scalarEqual = equal;
+        }
+        printf("%-8s fold + hash %7.1f Mnames/s (%.2fx scalar, %.2fx fnv), equal %7.1f Mnames/s (%.2fx scalar)\n",
+               sets[i]->name, fold, fold / scalarFold, fold / fnv, equal, equal / scalarEqual);
+    }
+    printf("(%llu)\n", (unsigned long long)checksum % 10);
+    return 0;
+}
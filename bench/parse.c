@@ -0,0 +1,131 @@
+// Parse throughput of cdnsParsePacket, for a typical response and for a worst case packet
+// where every name is a chain of compression pointers
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "cdns.h"
+#include "bench.h"
+
+#define ITERATIONS 2000000
+#define MAX_ENTRIES 128
+
+typedef struct PacketBuilder {
+    unsigned char data[512];
+    int length;
+} PacketBuilder;
+
+static void put(PacketBuilder* b, const void* bytes, int length) {
+    memcpy(b->data + b->length, bytes, length);
+    b->length += length;
+}
+static void putU16(PacketBuilder* b, u_int16_t value) {
+    unsigned char bytes[2] = {value >> 8, value & 0xFF};
+    put(b, bytes, 2);
+}
+static void putPointer(PacketBuilder* b, int offset) {
+    putU16(b, 0xC000 | offset);
+}
+// Type, class IN, ttl 300, rdlength
+static void putRecordFixed(PacketBuilder* b, u_int16_t type, u_int16_t rdlength) {
+    unsigned char bytes[10] = {type >> 8, type & 0xFF, 0, 1, 0, 0, 1, 44, rdlength >> 8, rdlength & 0xFF};
+    put(b, bytes, 10);
+}
+static void putHeader(PacketBuilder* b, int qd, int an, int ns, int ar) {
+    unsigned char bytes[4] = {0x12, 0x34, 0x81, 0x80};
+    put(b, bytes, 4);
+    putU16(b, qd);
+    putU16(b, an);
+    putU16(b, ns);
+    putU16(b, ar);
+}
+
+// www.example.com A, answered through a CNAME with two addresses, two NS records and their glue
+static void buildTypical(PacketBuilder* b) {
+    b->length = 0;
+    putHeader(b, 1, 3, 2, 2);
+    int qname = b->length;
+    put(b, "\3www\7example\3com\0", 17);
+    putU16(b, CDNS_RR_A);
+    putU16(b, CDNS_RC_IN);
+    putPointer(b, qname);
+    putRecordFixed(b, CDNS_RR_CNAME, 7);
+    int edge = b->length;
+    put(b, "\4edge", 5);
+    putPointer(b, qname + 4);
+    for(int i = 0;i < 2;i++) {
+        putPointer(b, edge);
+        putRecordFixed(b, CDNS_RR_A, 4);
+        put(b, "\x5d\xb8\xd8\x22", 4);
+    }
+    int ns[2];
+    for(int i = 0;i < 2;i++) {
+        putPointer(b, qname + 4);
+        putRecordFixed(b, CDNS_RR_NS, 6);
+        ns[i] = b->length;
+        put(b, i == 0 ? "\3ns1" : "\3ns2", 4);
+        putPointer(b, qname + 4);
+    }
+    for(int i = 0;i < 2;i++) {
+        putPointer(b, ns[i]);
+        putRecordFixed(b, CDNS_RR_A, 4);
+        put(b, "\xc0\x00\x02\x01", 4);
+    }
+}
+// Every record's owner adds one label in front of the previous owner, and its CNAME points
+// back at the previous owner, so names are long chains of pointers
+static void buildCompressed(PacketBuilder* b) {
+    b->length = 0;
+    int numRecords = 29;
+    putHeader(b, 1, numRecords, 0, 0);
+    int previous = b->length;
+    put(b, "\3www\7example\3com\0", 17);
+    putU16(b, CDNS_RR_CNAME);
+    putU16(b, CDNS_RC_IN);
+    for(int i = 0;i < numRecords;i++) {
+        int owner = b->length;
+        put(b, "\1x", 2);
+        putPointer(b, previous);
+        putRecordFixed(b, CDNS_RR_CNAME, 2);
+        putPointer(b, previous);
+        previous = owner;
+    }
+}
+
+static void run(const char* name, const PacketBuilder* b) {
+    CdnsPacketReadInfo info;
+    CdnsPacketHeader header;
+    void* entries[MAX_ENTRIES];
+    CDNS_CHECK_ERROR(cdnsParsePacket(b->data, b->length, &info, &header, entries, MAX_ENTRIES));
+
+    double start = seconds();
+    u_int64_t checksum = 0;
+    for(int i = 0;i < ITERATIONS;i++) {
+        cdnsParsePacket(b->data, b->length, &info, &header, entries, MAX_ENTRIES);
+        checksum += info.numRecords;
+    }
+    double parseTime = seconds() - start;
+
+    start = seconds();
+    unsigned char nameBuf[256];
+    int nameLength;
+    for(int i = 0;i < ITERATIONS;i++) {
+        cdnsParsePacket(b->data, b->length, &info, &header, entries, MAX_ENTRIES);
+        for(u_int32_t j = 0;j < info.numRecords;j++) {
+            cdnsReadName(&info, info.records[j], nameBuf, sizeof(nameBuf), &nameLength);
+            checksum += nameLength;
+        }
+    }
+    double readTime = seconds() - start;
+    printf("%-12s %4d bytes %3u records: parse %6.2f Mpackets/s, parse + read all names %6.2f Mpackets/s (%llu)\n",
+           name, b->length, info.numRecords, ITERATIONS / parseTime / 1e6, ITERATIONS / readTime / 1e6,
+           (unsigned long long)checksum % 10);
+}
+
+int main(int argc, char** argv) {
+    PacketBuilder b;
+    buildTypical(&b);
+    run("typical", &b);
+    buildCompressed(&b);
+    run("compressed", &b);
+    return 0;
+}
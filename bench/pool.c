@@ -0,0 +1,167 @@
+// Throughput of the slot pool under cross thread frees. One owner thread allocates and
+// hands every entry to one of the freeing threads, which return it with
+// freePoolEntryRemote. The same workload against a free list behind a mutex is shown for
+// comparison, along with owner only allocate and free
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <time.h>
+#include "cdns_pool.h"
+
+#define OPERATIONS 5000000
+#define POOL_ENTRIES 4096
+#define RING_SIZE 1024
+#define MAX_FREERS 8
+#define ENTRY_SIZE 704
+
+// Single producer, single consumer queue of indexes from the owner to a freeing thread
+typedef struct Ring {
+    _Alignas(CDNS_CACHE_LINE) _Atomic u_int32_t head;
+    _Alignas(CDNS_CACHE_LINE) _Atomic u_int32_t tail;
+    u_int32_t items[RING_SIZE];
+} Ring;
+
+typedef struct MutexPool {
+    pthread_mutex_t lock;
+    u_int32_t free[POOL_ENTRIES];
+    u_int32_t numFree;
+    unsigned char* entries;
+} MutexPool;
+
+typedef struct Bench {
+    bool useMutex;
+    int numFreers;
+    DnsPool pool;
+    MutexPool mutexPool;
+    Ring rings[MAX_FREERS];
+    atomic_bool done;
+} Bench;
+
+typedef struct Freer {
+    Bench* bench;
+    Ring* ring;
+} Freer;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+static bool mutexAlloc(MutexPool* pool, u_int32_t* out) {
+    pthread_mutex_lock(&pool->lock);
+    bool ok = pool->numFree > 0;
+    if(ok) {
+        *out = pool->free[--pool->numFree];
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return ok;
+}
+static void mutexFree(MutexPool* pool, u_int32_t idx) {
+    pthread_mutex_lock(&pool->lock);
+    pool->free[pool->numFree++] = idx;
+    pthread_mutex_unlock(&pool->lock);
+}
+static void* freerThread(void* arg) {
+    Freer* freer = (Freer*)arg;
+    Bench* bench = freer->bench;
+    Ring* ring = freer->ring;
+    for(;;) {
+        u_int32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        if(tail == atomic_load_explicit(&ring->head, memory_order_acquire)) {
+            if(atomic_load(&bench->done) && tail == atomic_load(&ring->head)) {
+                return NULL;
+            }
+            // Yield rather than spin, so the benchmark still means something on fewer cores
+            sched_yield();
+            continue;
+        }
+        u_int32_t idx = ring->items[tail % RING_SIZE];
+        atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+        if(bench->useMutex) {
+            mutexFree(&bench->mutexPool, idx);
+        } else {
+            freePoolEntryRemote(&bench->pool, idx);
+        }
+    }
+}
+static double runCrossThread(Bench* bench, bool useMutex, int numFreers) {
+    bench->useMutex = useMutex;
+    bench->numFreers = numFreers;
+    atomic_store(&bench->done, false);
+    createPool(&bench->pool, ENTRY_SIZE, POOL_ENTRIES, NULL, NULL);
+    pthread_mutex_init(&bench->mutexPool.lock, NULL);
+    bench->mutexPool.entries = (unsigned char*)malloc((size_t)ENTRY_SIZE * POOL_ENTRIES);
+    bench->mutexPool.numFree = POOL_ENTRIES;
+    for(u_int32_t i = 0;i < POOL_ENTRIES;i++) {
+        bench->mutexPool.free[i] = POOL_ENTRIES - 1 - i;
+    }
+    pthread_t threads[MAX_FREERS];
+    Freer freers[MAX_FREERS];
+    for(int i = 0;i < numFreers;i++) {
+        atomic_store(&bench->rings[i].head, 0);
+        atomic_store(&bench->rings[i].tail, 0);
+        freers[i].bench = bench;
+        freers[i].ring = &bench->rings[i];
+        pthread_create(&threads[i], NULL, freerThread, &freers[i]);
+    }
+    double start = now();
+    int next = 0;
+    for(long done = 0;done < OPERATIONS;) {
+        u_int32_t idx;
+        bool ok = useMutex ? mutexAlloc(&bench->mutexPool, &idx) : allocPoolEntry(&bench->pool, &idx);
+        if(!ok) {
+            sched_yield();
+            continue;
+        }
+        // Touch the entry as a real cycle would
+        void* entry = useMutex ? bench->mutexPool.entries + (size_t)idx * ENTRY_SIZE : poolEntry(&bench->pool, idx);
+        *(volatile unsigned char*)entry = 1;
+        Ring* ring = &bench->rings[next];
+        next = (next + 1) % numFreers;
+        u_int32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        while(head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= RING_SIZE) {
+            sched_yield();
+        }
+        ring->items[head % RING_SIZE] = idx;
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+        done++;
+    }
+    atomic_store(&bench->done, true);
+    for(int i = 0;i < numFreers;i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now() - start;
+    destroyPool(&bench->pool);
+    free(bench->mutexPool.entries);
+    pthread_mutex_destroy(&bench->mutexPool.lock);
+    return OPERATIONS / elapsed / 1e6;
+}
+static double runOwnerOnly(void) {
+    DnsPool pool;
+    createPool(&pool, ENTRY_SIZE, POOL_ENTRIES, NULL, NULL);
+    u_int32_t held[32];
+    double start = now();
+    for(long done = 0;done < OPERATIONS;done += 32) {
+        for(int i = 0;i < 32;i++) {
+            allocPoolEntry(&pool, &held[i]);
+        }
+        for(int i = 0;i < 32;i++) {
+            freePoolEntry(&pool, held[i]);
+        }
+    }
+    double elapsed = now() - start;
+    destroyPool(&pool);
+    return OPERATIONS / elapsed / 1e6;
+}
+
+int main() {
+    static Bench bench;
+    printf("owner only: %.1f Mallocs/s\n", runOwnerOnly());
+    printf("%-8s %12s %12s\n", "freers", "pool", "mutex");
+    for(int freers = 1;freers <= MAX_FREERS;freers *= 2) {
+        double pool = runCrossThread(&bench, false, freers);
+        double mutex = runCrossThread(&bench, true, freers);
+        printf("%-8d %9.1f M/s %9.1f M/s\n", freers, pool, mutex);
+    }
+    return 0;
+}
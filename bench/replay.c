@@ -0,0 +1,553 @@
+// Replays the DNS traffic of a capture through the library with cdnsReplay, so a change to
+// the dispatch path can be measured on real queries without a network. Queries to the
+// port are run through a callback that forwards them like cdns-basic, and the upstream is
+// a stub answering from the responses in the same capture, matched by question, or with
+// NXDOMAIN for questions it has no response for. Every DNS message of the capture is also
+// run through cdnsParsePacket, and those it rejects are counted.
+//
+// Reads pcap, with us or ns timestamps in either byte order, and pcapng. Ethernet (with
+// VLAN tags), raw IP, Linux cooked and BSD loopback captures of UDP over IPv4 and IPv6 are
+// understood, other packets are skipped. IPv6 clients are folded into an IPv4 address,
+// which only matters for rate limiting.
+//
+// Usage: cdns-bench-replay capture [port [fast|timed [rounds [cache bytes]]]]
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cdns.h"
+
+#define DEFAULT_ROUNDS 1
+#define DEFAULT_CACHE_BYTES (16 * 1024 * 1024)
+#define MAX_ENTRIES 512
+/// Recorded responses are looked up in an open addressing table of this many slots at least
+#define MIN_RESPONSE_SLOTS 1024
+
+#define LINKTYPE_NULL 0
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_LINUX_SLL2 276
+/// Raw IP as some BSDs number it
+#define LINKTYPE_RAW_BSD 12
+#define LINKTYPE_RAW_OPENBSD 14
+
+#define PCAPNG_SECTION 0x0A0D0D0A
+#define PCAPNG_INTERFACE 1
+#define PCAPNG_SIMPLE_PACKET 3
+#define PCAPNG_ENHANCED_PACKET 6
+#define PCAPNG_MAX_INTERFACES 64
+
+typedef struct Message {
+    const unsigned char* data;
+    int length;
+    u_int64_t timeUs;
+    u_int32_t clientAddress;
+    u_int16_t clientPort;
+} Message;
+
+typedef struct MessageList {
+    Message* items;
+    int count;
+    int capacity;
+} MessageList;
+
+/// Recorded responses by question, the first one seen for each
+typedef struct ResponseTable {
+    const Message** slots;
+    u_int32_t mask;
+    int count;
+} ResponseTable;
+
+typedef struct Capture {
+    u_int16_t port;
+    MessageList queries;
+    MessageList responses;
+    int packets;
+    int skipped;
+    int malformed;
+} Capture;
+
+typedef struct Replay {
+    ResponseTable table;
+    u_int64_t recorded;
+    u_int64_t synthesized;
+    u_int64_t responseBytes;
+} Replay;
+
+static u_int16_t read16(const unsigned char* p, bool swap) {
+    u_int16_t value;
+    memcpy(&value, p, 2);
+    return swap ? __builtin_bswap16(value) : value;
+}
+static u_int32_t read32(const unsigned char* p, bool swap) {
+    u_int32_t value;
+    memcpy(&value, p, 4);
+    return swap ? __builtin_bswap32(value) : value;
+}
+static u_int16_t readBig16(const unsigned char* p) {
+    return (u_int16_t)(p[0] << 8 | p[1]);
+}
+
+// The bytes of the first question, name and type and class, or 0 if there is none or its
+// name is compressed
+static int questionLength(const unsigned char* packet, int length) {
+    if(length < 12 || readBig16(packet + 4) == 0) {
+        return 0;
+    }
+    int at = 12;
+    while(at < length && packet[at] != 0) {
+        if(packet[at] >= 0x40) {
+            return 0;
+        }
+        at += packet[at] + 1;
+    }
+    return at + 5 <= length ? at + 5 - 12 : 0;
+}
+static u_int32_t hashQuestion(const unsigned char* question, int length) {
+    u_int32_t hash = 2166136261u;
+    for(int i = 0;i < length;i++) {
+        unsigned char c = question[i];
+        hash = (hash ^ (c >= 'A' && c <= 'Z' ? c + 32 : c)) * 16777619u;
+    }
+    return hash;
+}
+static bool sameQuestion(const unsigned char* a, const unsigned char* b, int length) {
+    for(int i = 0;i < length;i++) {
+        unsigned char x = a[i] >= 'A' && a[i] <= 'Z' ? a[i] + 32 : a[i];
+        unsigned char y = b[i] >= 'A' && b[i] <= 'Z' ? b[i] + 32 : b[i];
+        if(x != y) {
+            return false;
+        }
+    }
+    return true;
+}
+static const Message** findResponse(ResponseTable* table, const unsigned char* packet, int length) {
+    int question = questionLength(packet, length);
+    if(question == 0) {
+        return NULL;
+    }
+    u_int32_t slot = hashQuestion(packet + 12, question) & table->mask;
+    while(table->slots[slot] != NULL) {
+        const Message* response = table->slots[slot];
+        if(questionLength(response->data, response->length) == question &&
+           sameQuestion(response->data + 12, packet + 12, question)) {
+            break;
+        }
+        slot = (slot + 1) & table->mask;
+    }
+    return &table->slots[slot];
+}
+static void indexResponses(ResponseTable* table, const MessageList* responses) {
+    u_int32_t slots = MIN_RESPONSE_SLOTS;
+    while(slots < (u_int32_t)responses->count * 2) {
+        slots *= 2;
+    }
+    table->slots = (const Message**)calloc(slots, sizeof(Message*));
+    table->mask = slots - 1;
+    for(int i = 0;i < responses->count;i++) {
+        const Message** slot = findResponse(table, responses->items[i].data, responses->items[i].length);
+        if(slot != NULL && *slot == NULL) {
+            *slot = &responses->items[i];
+            table->count++;
+        }
+    }
+}
+
+static void addMessage(MessageList* list, const Message* message) {
+    if(list->count == list->capacity) {
+        list->capacity = list->capacity > 0 ? list->capacity * 2 : 1024;
+        list->items = (Message*)realloc(list->items, list->capacity * sizeof(Message));
+        if(list->items == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    list->items[list->count++] = *message;
+}
+// Sorts a UDP payload into queries to the port and responses from it, and checks that it
+// parses
+static void addDatagram(Capture* capture, const unsigned char* payload, int length, u_int64_t timeUs,
+                        u_int32_t clientAddress, u_int16_t sourcePort, u_int16_t destinationPort) {
+    bool query = destinationPort == capture->port;
+    if((!query && sourcePort != capture->port) || length < 12 || (payload[2] >> 7) == query) {
+        capture->skipped++;
+        return;
+    }
+    CdnsPacketReadInfo info;
+    CdnsPacketHeader header;
+    void* entries[MAX_ENTRIES];
+    if(cdnsParsePacket(payload, length, &info, &header, entries, MAX_ENTRIES) != 0) {
+        capture->malformed++;
+    }
+    Message message = {
+        .data = payload,
+        .length = length,
+        .timeUs = timeUs,
+        .clientAddress = clientAddress,
+        .clientPort = sourcePort,
+    };
+    addMessage(query ? &capture->queries : &capture->responses, &message);
+}
+// Finds the UDP datagram in an IP packet, skipping fragments and other protocols
+static void addPacket(Capture* capture, const unsigned char* ip, int length, u_int64_t timeUs) {
+    capture->packets++;
+    int version = length > 0 ? ip[0] >> 4 : 0;
+    int at;
+    int end;
+    u_int32_t clientAddress;
+    if(version == 4 && length >= 20) {
+        at = (ip[0] & 0xF) * 4;
+        end = readBig16(ip + 2);
+        if(ip[9] != IPPROTO_UDP || (readBig16(ip + 6) & 0x3FFF) != 0 || at < 20 || end > length) {
+            capture->skipped++;
+            return;
+        }
+        memcpy(&clientAddress, ip + 12, 4);
+    } else if(version == 6 && length >= 40) {
+        int next = ip[6];
+        at = 40;
+        end = 40 + readBig16(ip + 4);
+        // Hop by hop, routing and destination options headers
+        while((next == 0 || next == 43 || next == 60) && at + 8 <= length) {
+            next = ip[at];
+            at += (ip[at + 1] + 1) * 8;
+        }
+        if(next != IPPROTO_UDP || end > length) {
+            capture->skipped++;
+            return;
+        }
+        u_int32_t words[4];
+        memcpy(words, ip + 8, 16);
+        clientAddress = words[0] ^ words[1] ^ words[2] ^ words[3];
+    } else {
+        capture->skipped++;
+        return;
+    }
+    if(at + 8 > end || readBig16(ip + at + 4) < 8 || at + readBig16(ip + at + 4) > end) {
+        capture->skipped++;
+        return;
+    }
+    addDatagram(capture, ip + at + 8, readBig16(ip + at + 4) - 8, timeUs, clientAddress, readBig16(ip + at),
+                readBig16(ip + at + 2));
+}
+// Strips the link layer header of a frame
+static void addFrame(Capture* capture, int linkType, const unsigned char* frame, int length, u_int64_t timeUs) {
+    int at;
+    switch(linkType) {
+    case LINKTYPE_ETHERNET:
+        at = 12;
+        // 802.1Q and 802.1ad tags
+        while(at + 2 <= length && (readBig16(frame + at) == 0x8100 || readBig16(frame + at) == 0x88A8)) {
+            at += 4;
+        }
+        at += 2;
+        break;
+    case LINKTYPE_RAW:
+    case LINKTYPE_RAW_BSD:
+    case LINKTYPE_RAW_OPENBSD:
+        at = 0;
+        break;
+    case LINKTYPE_LINUX_SLL:
+        at = 16;
+        break;
+    case LINKTYPE_LINUX_SLL2:
+        at = 20;
+        break;
+    case LINKTYPE_NULL:
+        at = 4;
+        break;
+    default:
+        capture->packets++;
+        capture->skipped++;
+        return;
+    }
+    if(at > length) {
+        capture->packets++;
+        capture->skipped++;
+        return;
+    }
+    addPacket(capture, frame + at, length - at, timeUs);
+}
+
+static bool readPcap(Capture* capture, const unsigned char* file, size_t size) {
+    u_int32_t magic = read32(file, false);
+    bool swap = magic == 0xD4C3B2A1 || magic == 0x4D3CB2A1;
+    bool nanoseconds = magic == 0xA1B23C4D || magic == 0x4D3CB2A1;
+    int linkType = (int)(read32(file + 20, swap) & 0xFFFF);
+    size_t at = 24;
+    while(at + 16 <= size) {
+        u_int64_t seconds = read32(file + at, swap);
+        u_int64_t fraction = read32(file + at + 4, swap);
+        u_int32_t captured = read32(file + at + 8, swap);
+        if(captured > size - at - 16) {
+            return false;
+        }
+        u_int64_t timeUs = seconds * 1000000 + (nanoseconds ? fraction / 1000 : fraction);
+        addFrame(capture, linkType, file + at + 16, (int)captured, timeUs);
+        at += 16 + captured;
+    }
+    return true;
+}
+// Ticks per second of an interface, from its if_tsresol option
+static u_int64_t pcapngResolution(const unsigned char* options, size_t length, bool swap) {
+    size_t at = 0;
+    while(at + 4 <= length) {
+        u_int16_t code = read16(options + at, swap);
+        u_int16_t size = read16(options + at + 2, swap);
+        if(code == 0 || at + 4 + size > length) {
+            break;
+        }
+        if(code == 9 && size >= 1) {
+            int exponent = options[at + 4] & 0x7F;
+            u_int64_t resolution = 1;
+            for(int i = 0;i < exponent && resolution < UINT64_MAX / 10;i++) {
+                resolution *= options[at + 4] & 0x80 ? 2 : 10;
+            }
+            return resolution;
+        }
+        at += 4 + ((size + 3) & ~3);
+    }
+    return 1000000;
+}
+static bool readPcapng(Capture* capture, const unsigned char* file, size_t size) {
+    bool swap = false;
+    int linkTypes[PCAPNG_MAX_INTERFACES];
+    u_int64_t resolutions[PCAPNG_MAX_INTERFACES];
+    int numInterfaces = 0;
+    u_int64_t lastTimeUs = 0;
+    size_t at = 0;
+    while(at + 12 <= size) {
+        u_int32_t type = read32(file + at, false);
+        if(type == PCAPNG_SECTION) {
+            swap = read32(file + at + 8, false) != 0x1A2B3C4D;
+            numInterfaces = 0;
+        } else {
+            type = swap ? __builtin_bswap32(type) : type;
+        }
+        u_int32_t length = read32(file + at + 4, swap);
+        if(length < 12 || length > size - at) {
+            return false;
+        }
+        const unsigned char* block = file + at;
+        if(type == PCAPNG_INTERFACE && length >= 20 && numInterfaces < PCAPNG_MAX_INTERFACES) {
+            linkTypes[numInterfaces] = read16(block + 8, swap);
+            resolutions[numInterfaces] = pcapngResolution(block + 16, length - 20, swap);
+            numInterfaces++;
+        } else if(type == PCAPNG_ENHANCED_PACKET && length >= 32) {
+            u_int32_t interface = read32(block + 8, swap);
+            u_int32_t captured = read32(block + 20, swap);
+            if(interface < (u_int32_t)numInterfaces && captured <= length - 32) {
+                u_int64_t ticks = (u_int64_t)read32(block + 12, swap) << 32 | read32(block + 16, swap);
+                u_int64_t resolution = resolutions[interface];
+                lastTimeUs = resolution >= 1000000 ? ticks / (resolution / 1000000) :
+                                                     ticks * (1000000 / resolution);
+                addFrame(capture, linkTypes[interface], block + 28, (int)captured, lastTimeUs);
+            }
+        } else if(type == PCAPNG_SIMPLE_PACKET && length >= 16 && numInterfaces > 0) {
+            // No timestamp, so it counts as arriving with the packet before it
+            u_int32_t captured = read32(block + 8, swap);
+            if(captured > length - 16) {
+                captured = length - 16;
+            }
+            addFrame(capture, linkTypes[0], block + 12, (int)captured, lastTimeUs);
+        }
+        at += length;
+    }
+    return true;
+}
+static unsigned char* readFile(const char* path, size_t* size) {
+    FILE* file = fopen(path, "rb");
+    if(file == NULL) {
+        return NULL;
+    }
+    size_t capacity = 1 << 20;
+    unsigned char* data = (unsigned char*)malloc(capacity);
+    *size = 0;
+    size_t n;
+    while(data != NULL && (n = fread(data + *size, 1, capacity - *size, file)) > 0) {
+        *size += n;
+        if(*size == capacity) {
+            capacity *= 2;
+            data = (unsigned char*)realloc(data, capacity);
+        }
+    }
+    fclose(file);
+    return data;
+}
+
+// Answers from the recorded response to the same question, under the request's id, or
+// with NXDOMAIN if there is none
+static int answerUpstream(void* context, const void* request, int length, void* reply, int capacity) {
+    Replay* replay = (Replay*)context;
+    const Message** slot = findResponse(&replay->table, (const unsigned char*)request, length);
+    if(slot != NULL && *slot != NULL && (*slot)->length <= capacity) {
+        memcpy(reply, (*slot)->data, (*slot)->length);
+        memcpy(reply, request, 2);
+        replay->recorded++;
+        return (*slot)->length;
+    }
+    int question = slot != NULL ? questionLength((const unsigned char*)request, length) : 0;
+    unsigned char* out = (unsigned char*)reply;
+    memcpy(out, request, 12 + question);
+    out[2] = (out[2] & 0x01) | 0x80;
+    out[3] = 0x80 | 3;
+    out[4] = 0;
+    out[5] = question > 0;
+    memset(out + 6, 0, 6);
+    replay->synthesized++;
+    return 12 + question;
+}
+static void countResponse(void* context, u_int32_t clientAddress, u_int16_t clientPort, const void* packet,
+                          int length) {
+    ((Replay*)context)->responseBytes += length;
+}
+// Forwards each query to the stub upstream and relays the reply, as cdns-basic does
+static CdnsCallbackCycleInfo forward(CdnsResponseContext* context, void* data, bool first) {
+    CdnsCallbackCycleInfo out = {.status = CdnsReturned};
+    if(first) {
+        CdnsPacketReadInfo* request;
+        CDNS_CHECK_ERROR(cdnsGetRequestReadInfo(context, &request));
+        CdnsRequestWriteInfo* writer;
+        CDNS_CHECK_ERROR(cdnsCreateRequest(context, &writer));
+        CdnsPacketHeader* header;
+        CDNS_CHECK_ERROR(cdnsWritableRequestHeader(writer, &header));
+        u_int16_t id = header->id;
+        *header = *request->header;
+        header->id = id;
+        if(header->qdcount > 0) {
+            CDNS_CHECK_ERROR(cdnsWriteQuestion(writer, request->blob, request->blobSize));
+        }
+        CdnsRequestDestination destination = {
+            .netProtocol = CdnsNetProtoInet4,
+            .protocol = CdnsProtoUdp,
+            .address = htonl(0x7F000001),
+            .port = CDNS_PORT,
+        };
+        CdnsRequestId requestId;
+        CDNS_CHECK_ERROR(cdnsSendRequest(writer, destination, &requestId));
+        *(CdnsRequestId*)data = requestId;
+        out.status = CdnsPoll;
+        out.data.id = requestId;
+        return out;
+    }
+    CdnsPacketReadInfo* reply;
+    if(cdnsGetResponseReadInfo(context, *(CdnsRequestId*)data, &reply) != 0) {
+        // Gave up on the upstream, the client will ask again
+        return out;
+    }
+    cdnsCacheStore(context, reply);
+    CdnsResponseWriteinfo* writer;
+    CDNS_CHECK_ERROR(cdnsGetResponseWriter(context, &writer));
+    CdnsPacketHeader* header;
+    CDNS_CHECK_ERROR(cdnsWritableResponseHeader(writer, &header));
+    u_int16_t id = header->id;
+    *header = *reply->header;
+    header->id = id;
+    if(reply->blobSize > 0) {
+        CDNS_CHECK_ERROR(cdnsWriteRecord(writer, reply->blob, reply->blobSize));
+    }
+    CDNS_CHECK_ERROR(cdnsSendResponse(writer));
+    return out;
+}
+
+int main(int argc, char** argv) {
+    if(argc < 2) {
+        fprintf(stderr, "usage: %s capture [port [fast|timed [rounds [cache bytes]]]]\n", argv[0]);
+        return 1;
+    }
+    Capture capture;
+    memset(&capture, 0, sizeof(Capture));
+    capture.port = argc > 2 ? (u_int16_t)atoi(argv[2]) : CDNS_PORT;
+    bool timed = argc > 3 && strcmp(argv[3], "timed") == 0;
+    int rounds = argc > 4 ? atoi(argv[4]) : DEFAULT_ROUNDS;
+    unsigned int cacheBytes = argc > 5 ? (unsigned int)strtoul(argv[5], NULL, 10) : DEFAULT_CACHE_BYTES;
+    size_t size;
+    unsigned char* file = readFile(argv[1], &size);
+    if(file == NULL || size < 24) {
+        fprintf(stderr, "can't read %s\n", argv[1]);
+        return 1;
+    }
+    u_int32_t magic = read32(file, false);
+    bool read;
+    if(magic == PCAPNG_SECTION) {
+        read = readPcapng(&capture, file, size);
+    } else if(magic == 0xA1B2C3D4 || magic == 0xD4C3B2A1 || magic == 0xA1B23C4D || magic == 0x4D3CB2A1) {
+        read = readPcap(&capture, file, size);
+    } else {
+        fprintf(stderr, "%s is neither pcap nor pcapng\n", argv[1]);
+        return 1;
+    }
+    if(!read) {
+        fprintf(stderr, "%s is cut short, replaying what came before\n", argv[1]);
+    }
+    Replay replay;
+    memset(&replay, 0, sizeof(Replay));
+    indexResponses(&replay.table, &capture.responses);
+    printf("%d packets: %d queries, %d responses to %d questions, %d skipped, %d failed to parse\n",
+           capture.packets, capture.queries.count, capture.responses.count, replay.table.count, capture.skipped,
+           capture.malformed);
+    if(capture.queries.count == 0) {
+        return 0;
+    }
+
+    CdnsReplayQuery* queries = (CdnsReplayQuery*)malloc(capture.queries.count * sizeof(CdnsReplayQuery));
+    for(int i = 0;i < capture.queries.count;i++) {
+        const Message* message = &capture.queries.items[i];
+        queries[i].packet = message->data;
+        queries[i].length = message->length;
+        queries[i].timeUs = message->timeUs;
+        queries[i].clientAddress = message->clientAddress;
+        queries[i].clientPort = message->clientPort;
+    }
+    CdnsState* state;
+    CdnsConfig config = {
+        .initialThreads = 1,
+        .maxThreads = 1,
+        .threadOutgoingRequests = 256,
+        .cacheBytes = cacheBytes,
+    };
+    CDNS_CHECK_ERROR(cdnsCreateDns(&state, &config));
+    CdnsCallbackDescriptor callback = {
+        .callback = forward,
+        .perCallbackDataSize = sizeof(CdnsRequestId),
+    };
+    CDNS_CHECK_ERROR(cdnsSetCallback(state, &callback));
+    CdnsReplayConfig replayConfig = {
+        .queries = queries,
+        .numQueries = capture.queries.count,
+        .pace = timed ? CdnsReplayTimed : CdnsReplayFast,
+        .upstream = answerUpstream,
+        .response = countResponse,
+        .context = &replay,
+    };
+    for(int round = 0;round < rounds;round++) {
+        CdnsReplayStats stats;
+        replay.recorded = 0;
+        replay.synthesized = 0;
+        CDNS_CHECK_ERROR(cdnsReplay(state, &replayConfig, &stats));
+        double queriesRun = stats.queries > 0 ? (double)stats.queries : 1;
+        double elapsed = stats.elapsedUs > 0 ? stats.elapsedUs / 1e6 : 1e-6;
+        printf("round %d: %llu queries, %llu responses in %.3f s, %.0f callbacks/s, %.0f queries/s\n", round + 1,
+               (unsigned long long)stats.queries, (unsigned long long)stats.responses, elapsed,
+               stats.callbacks / elapsed, stats.queries / elapsed);
+        printf("  upstream: %llu requests, %llu replies, %llu recorded and %llu NXDOMAIN\n",
+               (unsigned long long)stats.upstreamRequests, (unsigned long long)stats.upstreamReplies,
+               (unsigned long long)replay.recorded, (unsigned long long)replay.synthesized);
+        printf("  allocations per query: %.3f slots, %.4f chunks, %.3f cache entries\n",
+               stats.slotAllocations / queriesRun, stats.chunkAllocations / queriesRun,
+               stats.cacheAllocations / queriesRun);
+        printf("  cycles per query: dispatch %.0f, callback %.0f, upstream %.0f, send %.0f\n",
+               stats.dispatchCycles / queriesRun, stats.callbackCycles / queriesRun,
+               stats.upstreamCycles / queriesRun, stats.sendCycles / queriesRun);
+    }
+    CDNS_CHECK_ERROR(cdnsDestroyDns(state));
+    free(queries);
+    free(replay.table.slots);
+    free(capture.queries.items);
+    free(capture.responses.items);
+    free(file);
+    return 0;
+}
@@ -0,0 +1,76 @@
+// Counting responses for rate limiting under attack. Each second a flood of responses
+// reflected at one victim prefix for one name is mixed with legitimate traffic from many
+// clients, each well under the limit, and spoofed sources spread over random prefixes. The
+// sketch should limit the flood, and only rarely a legitimate client that happens to share
+// all of its counters with heavier keys.
+//
+// Usage: cdns-bench-rrl [legitimate clients [responses per second limit]]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "cdns_rrl.h"
+#include "bench.h"
+
+#define DEFAULT_CLIENTS 20000
+#define DEFAULT_LIMIT 20
+#define SECONDS 10
+/// Responses each second for the reflected flood and for random spoofed keys
+#define FLOOD_PER_SECOND 300000
+#define SPOOFED_PER_SECOND 500000
+/// Responses each legitimate client gets in a second, at most
+#define CLIENT_PER_SECOND 10
+
+int main(int argc, char** argv) {
+    int clients = argc > 1 ? atoi(argv[1]) : DEFAULT_CLIENTS;
+    u_int32_t limit = argc > 2 ? (u_int32_t)atoi(argv[2]) : DEFAULT_LIMIT;
+    DnsRateSketch sketch;
+    if(!createRateSketch(&sketch)) {
+        return 1;
+    }
+    // Each response of a second is drawn at random from the flood, a spoofed key or the
+    // next legitimate client in turn, in proportion to their rates
+    u_int64_t perSecond = FLOOD_PER_SECOND + SPOOFED_PER_SECOND + (u_int64_t)clients * CLIENT_PER_SECOND;
+    u_int64_t random = 0x9E3779B97F4A7C15ull;
+    u_int64_t flood = nextRandom(&random);
+    u_int64_t floodSent = 0;
+    u_int64_t floodLimited = 0;
+    u_int64_t legitimate = 0;
+    u_int64_t falselyLimited = 0;
+    u_int64_t counted = 0;
+    double start = seconds();
+    for(u_int32_t second = 0;second < SECONDS;second++) {
+        int nextClient = 0;
+        int clientSent = 0;
+        for(u_int64_t i = 0;i < perSecond;i++) {
+            u_int64_t draw = nextRandom(&random) % perSecond;
+            u_int32_t estimate;
+            if(draw < FLOOD_PER_SECOND) {
+                estimate = countRate(&sketch, flood, second);
+                floodSent++;
+                floodLimited += estimate > limit;
+            } else if(draw < FLOOD_PER_SECOND + SPOOFED_PER_SECOND) {
+                countRate(&sketch, nextRandom(&random), second);
+            } else {
+                // Clients are keys 1 to clients, each sending in one burst per second
+                estimate = countRate(&sketch, nextClient + 1, second);
+                legitimate++;
+                falselyLimited += estimate > limit;
+                if(++clientSent == CLIENT_PER_SECOND) {
+                    clientSent = 0;
+                    nextClient = (nextClient + 1) % clients;
+                }
+            }
+            counted++;
+        }
+    }
+    double elapsed = seconds() - start;
+    printf("%d clients, limit %u per second, %d KB sketch\n", clients, limit,
+           (int)(sizeof(u_int32_t) * RATE_ROWS * RATE_COLUMNS / 1024));
+    printf("%llu responses counted, %.0f ns each, flood %.2f%% limited, legitimate %.4f%% limited\n",
+           (unsigned long long)counted, elapsed / counted * 1e9,
+           floodSent > 0 ? 100.0 * floodLimited / floodSent : 0,
+           legitimate > 0 ? 100.0 * falselyLimited / legitimate : 0);
+    destroyRateSketch(&sketch);
+    return 0;
+}
@@ -0,0 +1,259 @@
+// Stub upstream for the benchmarks. Answers every UDP query with a single A record after a
+// fixed latency plus uniform jitter, and drops a given share of queries unanswered, so a
+// forwarder can be measured on loopback without a real resolver behind it.
+//
+// Usage: cdns-bench-stub [-p port] [-l latency ms] [-j jitter ms] [-d drop %] [-t threads]
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include "bench.h"
+
+#define BATCH_SIZE 32
+#define PACKET_SIZE 512
+#define MAX_PENDING 65536
+#define MAX_THREADS 64
+#define HEADER_SIZE 12
+// Pointer to the question name, A, IN, ttl 60, 4 bytes of address
+#define ANSWER_SIZE 16
+
+typedef struct Options {
+    u_int16_t port;
+    double latencyMs;
+    double jitterMs;
+    double dropPercent;
+    int threads;
+} Options;
+
+// A reply waiting for its latency to pass
+typedef struct Pending {
+    u_int64_t due;
+    struct sockaddr_in to;
+    int length;
+    unsigned char packet[PACKET_SIZE];
+} Pending;
+
+typedef struct Stub {
+    const Options* options;
+    int sock;
+    u_int64_t random;
+    // Min heap of replies by due time
+    Pending** heap;
+    int numPending;
+    Pending* entries;
+    Pending** free;
+    int numFree;
+    u_int64_t answered;
+    u_int64_t dropped;
+} Stub;
+
+static u_int64_t nowNs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u_int64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+// Uniform in [0, 1)
+static double randomUnit(u_int64_t* state) {
+    return (nextRandom(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void heapPush(Stub* stub, Pending* p) {
+    int i = stub->numPending++;
+    while(i > 0 && stub->heap[(i - 1) / 2]->due > p->due) {
+        stub->heap[i] = stub->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    stub->heap[i] = p;
+}
+static Pending* heapPop(Stub* stub) {
+    Pending* top = stub->heap[0];
+    Pending* last = stub->heap[--stub->numPending];
+    int i = 0;
+    while(true) {
+        int child = 2 * i + 1;
+        if(child >= stub->numPending) {
+            break;
+        }
+        if(child + 1 < stub->numPending && stub->heap[child + 1]->due < stub->heap[child]->due) {
+            child++;
+        }
+        if(stub->heap[child]->due >= last->due) {
+            break;
+        }
+        stub->heap[i] = stub->heap[child];
+        i = child;
+    }
+    stub->heap[i] = last;
+    return top;
+}
+
+// Turns the query in packet into its answer, returns the new length or -1 to ignore it
+static int makeAnswer(unsigned char* packet, int length) {
+    if(length < HEADER_SIZE || (packet[2] & 0x80) != 0) {
+        return -1;
+    }
+    int qdcount = packet[4] << 8 | packet[5];
+    // Only the question is kept
+    int pos = HEADER_SIZE;
+    if(qdcount == 1) {
+        while(pos < length && packet[pos] != 0 && packet[pos] <= 63) {
+            pos += 1 + packet[pos];
+        }
+        if(pos >= length || packet[pos] != 0 || pos + 5 > length) {
+            return -1;
+        }
+        pos += 5;
+    } else {
+        qdcount = 0;
+    }
+    // QR and RA set, opcode and RD kept, no error
+    packet[2] = (packet[2] & 0x79) | 0x80;
+    packet[3] = 0x80;
+    memset(packet + 4, 0, 8);
+    packet[5] = qdcount;
+    if(qdcount == 0 || pos + ANSWER_SIZE > PACKET_SIZE) {
+        return pos;
+    }
+    packet[7] = 1;
+    unsigned char answer[ANSWER_SIZE] = {0xC0, HEADER_SIZE, 0, 1, 0, 1, 0, 0, 0, 60, 0, 4, 192, 0, 2, 1};
+    memcpy(packet + pos, answer, ANSWER_SIZE);
+    return pos + ANSWER_SIZE;
+}
+static void sendDue(Stub* stub, u_int64_t now) {
+    struct mmsghdr msgs[BATCH_SIZE];
+    struct iovec iovs[BATCH_SIZE];
+    Pending* sent[BATCH_SIZE];
+    while(stub->numPending > 0 && stub->heap[0]->due <= now) {
+        int count = 0;
+        while(count < BATCH_SIZE && stub->numPending > 0 && stub->heap[0]->due <= now) {
+            Pending* p = heapPop(stub);
+            iovs[count] = (struct iovec){.iov_base = p->packet, .iov_len = p->length};
+            msgs[count].msg_hdr = (struct msghdr){
+                .msg_name = &p->to, .msg_namelen = sizeof(p->to), .msg_iov = &iovs[count], .msg_iovlen = 1};
+            sent[count++] = p;
+        }
+        int done = sendmmsg(stub->sock, msgs, count, 0);
+        stub->answered += done > 0 ? done : 0;
+        for(int i = 0;i < count;i++) {
+            stub->free[stub->numFree++] = sent[i];
+        }
+    }
+}
+static void* runStub(void* arg) {
+    Stub* stub = (Stub*)arg;
+    const Options* options = stub->options;
+    u_int64_t latency = options->latencyMs * 1e6;
+    struct mmsghdr msgs[BATCH_SIZE];
+    struct iovec iovs[BATCH_SIZE];
+    Pending* taken[BATCH_SIZE];
+    while(true) {
+        u_int64_t now = nowNs();
+        sendDue(stub, now);
+        struct timespec timeout;
+        if(stub->numPending > 0) {
+            u_int64_t wait = stub->heap[0]->due - now;
+            timeout = (struct timespec){.tv_sec = wait / 1000000000, .tv_nsec = wait % 1000000000};
+        }
+        struct pollfd pfd = {.fd = stub->sock, .events = POLLIN};
+        if(ppoll(&pfd, 1, stub->numPending > 0 ? &timeout : NULL, NULL) <= 0) {
+            continue;
+        }
+        int count = 0;
+        while(count < BATCH_SIZE && stub->numFree > 0) {
+            Pending* p = stub->free[--stub->numFree];
+            iovs[count] = (struct iovec){.iov_base = p->packet, .iov_len = PACKET_SIZE};
+            msgs[count].msg_hdr = (struct msghdr){
+                .msg_name = &p->to, .msg_namelen = sizeof(p->to), .msg_iov = &iovs[count], .msg_iovlen = 1};
+            taken[count++] = p;
+        }
+        int received = recvmmsg(stub->sock, msgs, count, MSG_DONTWAIT, NULL);
+        if(received < 0) {
+            received = 0;
+        }
+        now = nowNs();
+        for(int i = 0;i < count;i++) {
+            Pending* p = taken[i];
+            int length = i < received ? makeAnswer(p->packet, msgs[i].msg_len) : -1;
+            if(i < received && randomUnit(&stub->random) * 100 < options->dropPercent) {
+                stub->dropped++;
+                length = -1;
+            }
+            if(length < 0) {
+                stub->free[stub->numFree++] = p;
+                continue;
+            }
+            p->length = length;
+            p->due = now + latency + (u_int64_t)(randomUnit(&stub->random) * options->jitterMs * 1e6);
+            heapPush(stub, p);
+        }
+    }
+    return NULL;
+}
+
+static int openSocket(u_int16_t port) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    int one = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    int size = 4 * 1024 * 1024;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    if(bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "cannot bind 127.0.0.1:%u: %s\n", port, strerror(errno));
+        exit(1);
+    }
+    return sock;
+}
+
+int main(int argc, char** argv) {
+    Options options = {.port = 5301, .threads = 1};
+    int opt;
+    while((opt = getopt(argc, argv, "p:l:j:d:t:")) != -1) {
+        switch(opt) {
+            case 'p': options.port = atoi(optarg); break;
+            case 'l': options.latencyMs = atof(optarg); break;
+            case 'j': options.jitterMs = atof(optarg); break;
+            case 'd': options.dropPercent = atof(optarg); break;
+            case 't': options.threads = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-p port] [-l latency ms] [-j jitter ms] [-d drop %%] [-t threads]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(options.threads < 1 || options.threads > MAX_THREADS) {
+        fprintf(stderr, "threads must be between 1 and %d\n", MAX_THREADS);
+        return 1;
+    }
+    printf("stub upstream on 127.0.0.1:%u, %d threads, latency %.2f ms + up to %.2f ms, dropping %.1f%%\n",
+           options.port, options.threads, options.latencyMs, options.jitterMs, options.dropPercent);
+    fflush(stdout);
+    static Stub stubs[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    for(int i = 0;i < options.threads;i++) {
+        Stub* stub = &stubs[i];
+        stub->options = &options;
+        stub->sock = openSocket(options.port);
+        stub->random = 0x9E3779B97F4A7C15ull * (i + 1);
+        stub->entries = (Pending*)malloc(sizeof(Pending) * MAX_PENDING);
+        stub->heap = (Pending**)malloc(sizeof(Pending*) * MAX_PENDING);
+        stub->free = (Pending**)malloc(sizeof(Pending*) * MAX_PENDING);
+        for(int j = 0;j < MAX_PENDING;j++) {
+            stub->free[stub->numFree++] = &stub->entries[j];
+        }
+        pthread_create(&threads[i], NULL, runStub, stub);
+    }
+    for(int i = 0;i < options.threads;i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return 0;
+}
@@ -0,0 +1,122 @@
+// Compiling and serving a large zone. A zone of hosts with A records, some delegated
+// subzones with glue and a wildcard is written out as a master file, compiled to an image,
+// mapped, and looked up at random: names that exist, names under a delegation, names the
+// wildcard answers and names that don't exist, in random case as 0x20 encoding sends them.
+//
+// Usage: cdns-bench-zone [hosts]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "cdns_zone.h"
+#include "bench.h"
+
+#define DEFAULT_HOSTS 1000000
+#define LOOKUPS 4000000
+/// One host in this many is a delegated subzone instead
+#define DELEGATION_EVERY 100
+#define ZONE_PATH "/tmp/cdns-bench-zone.zone"
+#define IMAGE_PATH "/tmp/cdns-bench-zone.image"
+
+static void writeZone(int hosts) {
+    FILE* file = fopen(ZONE_PATH, "w");
+    if(file == NULL) {
+        perror(ZONE_PATH);
+        exit(1);
+    }
+    fprintf(file, "$ORIGIN example.com.\n$TTL 3600\n");
+    fprintf(file, "@ IN SOA ns1 hostmaster ( 2024010101 7200 900 1209600 300 )\n");
+    fprintf(file, "  IN NS ns1\n  IN NS ns2\nns1 IN A 192.0.2.1\nns2 IN A 192.0.2.2\n");
+    fprintf(file, "*.wild IN A 192.0.2.3\n");
+    for(int i = 0;i < hosts;i++) {
+        if(i % DELEGATION_EVERY == 0) {
+            fprintf(file, "sub%d IN NS ns.sub%d\nns.sub%d IN A 198.51.%d.%d\n", i, i, i, (i >> 8) & 0xFF, i & 0xFF);
+        } else {
+            fprintf(file, "host%d 300 IN A 10.%d.%d.%d\n", i, (i >> 16) & 0xFF, (i >> 8) & 0xFF, i & 0xFF);
+        }
+    }
+    fclose(file);
+}
+
+typedef struct Query {
+    unsigned char name[64];
+    int length;
+    DnsZoneResult expected;
+} Query;
+
+int main(int argc, char** argv) {
+    int hosts = argc > 1 ? atoi(argv[1]) : DEFAULT_HOSTS;
+    writeZone(hosts);
+    double start = seconds();
+    int line;
+    int err = compileZone(ZONE_PATH, "example.com.", IMAGE_PATH, &line);
+    double compiled = seconds() - start;
+    if(err != 0) {
+        printf("compiling failed with %d at line %d\n", err, line);
+        return 1;
+    }
+    start = seconds();
+    int fd = open(IMAGE_PATH, O_RDONLY);
+    struct stat info;
+    fstat(fd, &info);
+    const unsigned char* image = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    DnsZone zone;
+    if(image == MAP_FAILED || !openZoneImage(image, info.st_size, &zone)) {
+        printf("the image does not open\n");
+        return 1;
+    }
+    double opened = seconds() - start;
+    const DnsZoneHeader* header = (const DnsZoneHeader*)image;
+    printf("%d hosts: %u names, %llu records, %.1f MB image, compiled in %.2f s, mapped in %.3f ms\n", hosts,
+           header->numNodes, (unsigned long long)header->numRecords, info.st_size / 1e6, compiled, opened * 1e3);
+
+    // A quarter each of hosts, names below delegations, wildcard matches and names that
+    // don't exist
+    u_int64_t random = 0x9E3779B97F4A7C15ull;
+    Query* queries = (Query*)malloc(sizeof(Query) * LOOKUPS);
+    for(int i = 0;i < LOOKUPS;i++) {
+        char dotted[64];
+        int host = (int)(nextRandom(&random) % hosts);
+        switch(i % 4) {
+        case 0:
+            host += host % DELEGATION_EVERY == 0;
+            snprintf(dotted, sizeof(dotted), "host%d.example.com", host);
+            queries[i].expected = host < hosts ? ZONE_FOUND : ZONE_NXDOMAIN;
+            break;
+        case 1:
+            snprintf(dotted, sizeof(dotted), "www.sub%d.example.com", host - host % DELEGATION_EVERY);
+            queries[i].expected = ZONE_DELEGATION;
+            break;
+        case 2:
+            snprintf(dotted, sizeof(dotted), "h%d.wild.example.com", host);
+            queries[i].expected = ZONE_WILDCARD;
+            break;
+        default:
+            snprintf(dotted, sizeof(dotted), "missing%d.example.com", host);
+            queries[i].expected = ZONE_NXDOMAIN;
+            break;
+        }
+        queries[i].length = encodeName(dotted, queries[i].name, &random);
+    }
+    start = seconds();
+    int wrong = 0;
+    u_int64_t checksum = 0;
+    for(int i = 0;i < LOOKUPS;i++) {
+        DnsZoneMatch match;
+        lookupZone(&zone, queries[i].name, queries[i].length, CDNS_RR_A, &match);
+        if(match.result == ZONE_FOUND || match.result == ZONE_WILDCARD) {
+            const DnsZoneRRset* rrset = findZoneRRset(match.node, CDNS_RR_A);
+            checksum += rrset != NULL ? rrset->ttl : 0;
+        }
+        wrong += match.result != queries[i].expected;
+    }
+    double elapsed = seconds() - start;
+    printf("%d lookups, %.1f Mlookups/s, %.0f ns each, %d wrong (%llu)\n", LOOKUPS, LOOKUPS / elapsed / 1e6,
+           elapsed / LOOKUPS * 1e9, wrong, (unsigned long long)checksum % 10);
+    munmap((void*)image, info.st_size);
+    unlink(ZONE_PATH);
+    unlink(IMAGE_PATH);
+    free(queries);
+    return wrong != 0;
+}
@@ -1,6 +1,12 @@
+#include <arpa/inet.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "cdns.h"
 
+// Where queries are forwarded, 8.8.8.8 unless given on the command line
+static u_int32_t upstreamAddress;
+static u_int16_t upstreamPort = CDNS_PORT;
+
 CdnsCallbackCycleInfo callback(CdnsResponseContext* context, void* data, bool first) {
     // Brief explanation: when a request is received, immediately forward it to a server and await the response.
     if(first) {
@@ -17,13 +23,13 @@ CdnsCallbackCycleInfo callback(CdnsResponseContext* context, void* data, bool fi
         header->id = reqId;
 
         if(header->qdcount > 0) {
-            CDNS_CHECK_ERROR(cdnsWriteQuestion(wReq, req->records[0], req->blobSize));
+            CDNS_CHECK_ERROR(cdnsWriteQuestion(wReq, req->blob, req->blobSize));
         }
         CdnsRequestDestination dest = {
             .netProtocol = CdnsNetProtoInet4,
             .protocol = CdnsProtoUdp,
-            .address = htonl(0x08080808), // 8.8.8.8, google's public DNS 
-            .port = htonl(CDNS_PORT)
+            .address = upstreamAddress,
+            .port = upstreamPort
         };
         CdnsRequestId id;
         CDNS_CHECK_ERROR(cdnsSendRequest(wReq, dest, &id));
@@ -37,14 +43,17 @@ CdnsCallbackCycleInfo callback(CdnsResponseContext* context, void* data, bool fi
     } else {
         CdnsPacketReadInfo *info;
         CDNS_CHECK_ERROR(cdnsGetResponseReadInfo(context, *(CdnsRequestId*)data, &info));
+        // Repeats of this question are answered from the cache without running the callback
+        CDNS_CHECK_ERROR(cdnsCacheStore(context, info));
         CdnsResponseWriteinfo *wRes;
         CDNS_CHECK_ERROR(cdnsGetResponseWriter(context, &wRes));
         CdnsPacketHeader *header;
+        CDNS_CHECK_ERROR(cdnsWritableResponseHeader(wRes, &header));
         u_int16_t resId = header->id;
         *header = *info->header;
         header->id = resId;
-        if(info->numRecords > 0) {
-            CDNS_CHECK_ERROR(cdnsWriteRecord(wRes, info->records[0], info->blobSize));
+        if(info->blobSize > 0) {
+            CDNS_CHECK_ERROR(cdnsWriteRecord(wRes, info->blob, info->blobSize));
         }
         CDNS_CHECK_ERROR(cdnsSendResponse(wRes));
 
@@ -55,20 +64,44 @@ CdnsCallbackCycleInfo callback(CdnsResponseContext* context, void* data, bool fi
     }
 }
 
+// Usage: cdns-basic [port [upstream address [upstream port [threads [zone image]]]]]
+// Listens for UDP and TCP on port, 53 by default, and forwards to the upstream over UDP.
+// Names in the zone image, made by cdns-zonec, are answered without forwarding
 int main(int argc, char** argv) {
     printf("Hello, world!\n");
+    u_int16_t port = argc > 1 ? atoi(argv[1]) : CDNS_DNS_UDP_PORT;
+    struct in_addr upstream = {.s_addr = htonl(0x08080808)}; // 8.8.8.8, google's public DNS
+    if(argc > 2 && inet_pton(AF_INET, argv[2], &upstream) != 1) {
+        fprintf(stderr, "bad upstream address %s\n", argv[2]);
+        return 1;
+    }
+    upstreamAddress = upstream.s_addr;
+    if(argc > 3) {
+        upstreamPort = atoi(argv[3]);
+    }
+    unsigned int threads = argc > 4 ? atoi(argv[4]) : 1;
     CdnsState* state;
-    CdnsListenerConfig configs[1] = {
+    CdnsListenerConfig configs[2] = {
         {
             .addr = 0,
             .netProto = CdnsNetProtoInet4,
             .proto = CdnsProtoUdp,
-            .port = CDNS_DNS_UDP_PORT,
+            .port = port,
+        },
+        {
+            .addr = 0,
+            .netProto = CdnsNetProtoInet4,
+            .proto = CdnsProtoTcp,
+            .port = port,
         }
     };
     CdnsConfig config = {
-        .numListeners = 1,
+        .numListeners = 2,
         .listeners = configs,
+        .initialThreads = threads,
+        .maxThreads = threads,
+        .threadOutgoingRequests = 256,
+        .cacheBytes = 16 * 1024 * 1024,
     };
     CDNS_CHECK_ERROR(cdnsCreateDns(&state, &config));
     CdnsCallbackDescriptor callbackConfig = {
@@ -76,8 +109,11 @@ int main(int argc, char** argv) {
         .perCallbackDataSize = 8
     };
     CDNS_CHECK_ERROR(cdnsSetCallback(state, &callbackConfig));
+    if(argc > 5) {
+        CDNS_CHECK_ERROR(cdnsLoadZone(state, argv[5]));
+    }
     CDNS_CHECK_ERROR(cdnsPoll(state));
     CDNS_CHECK_ERROR(cdnsPause(state));
     CDNS_CHECK_ERROR(cdnsDestroyDns(state));
     return 0;
-}
\ No newline at end of file
+}
@@ -2,7 +2,13 @@
 // https://datatracker.ietf.org/doc/html/rfc1035
 // https://www.cloudflare.com/learning/dns/dns-records/
 
+#define _GNU_SOURCE
 #include "cdns.h"
+#include "cdns_pool.h"
+#include "cdns_name.h"
+#include "cdns_zone.h"
+#include "cdns_ring.h"
+#include "cdns_rrl.h"
 #include <bits/sockaddr.h>
 #include <netinet/in.h>
 #include <string.h>
@@ -12,335 +18,7192 @@
 #include <pthread.h>
 #include <sys/un.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/random.h>
+#include <netinet/tcp.h>
+#include <dirent.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/mempolicy.h>
+#include <time.h>
+#include <limits.h>
 
 #define CDNS_ERR_UNDEFINED -1
-#define CDNS_NUM_ERR 12
-
-typedef struct ReusableDataCollection {
-    int dataSize;
-    int numDataPieces;
-    void *allocation;
-    size_t *unused;
-    size_t unusedStartIndex;
-    size_t unusedEndIndex;
-} ReusableDataCollection;
-
-static int createCollection(ReusableDataCollection *collection, int dataSize, size_t numDataPieces) {
-    collection->dataSize = dataSize;
-    collection->numDataPieces = numDataPieces;
-    collection->allocation = malloc((size_t)dataSize * numDataPieces);
-    collection->unused = malloc(sizeof(size_t) * numDataPieces);
-    if(collection->allocation == NULL || collection->unused == NULL) {
-        return CDNS_ERR_MEM;
+#define CDNS_NUM_ERR 18
+
+#define CDNS_HEADER_SIZE 12
+/// Largest message handled, which is also the largest UDP payload offered with EDNS(0)
+#define CDNS_UDP_BUFFER_SIZE 1232
+/// Largest message over TCP and HTTP, as much as the two byte length prefix allows
+#define CDNS_STREAM_BUFFER_SIZE 65535
+/// Largest UDP payload a client that sent no OPT record can receive
+#define CDNS_CLASSIC_UDP_SIZE 512
+/// Upper bound on questions plus records in a packet of the given size, as each takes at
+/// least 5 bytes
+#define CDNS_MAX_ENTRIES(SIZE) (((SIZE) - CDNS_HEADER_SIZE) / 5)
+#define CDNS_MAX_NAME_LENGTH 255
+#define CDNS_RR_OPT_TYPE 41
+/// An OPT record without options: the root name, type, class, TTL and an empty RDATA
+#define OPT_RECORD_SIZE 11
+
+typedef union DnsSockAddr {
+    struct sockaddr sa;
+    struct sockaddr_in in4;
+    struct sockaddr_in6 in6;
+} DnsSockAddr;
+
+typedef struct DnsState DnsState;
+typedef struct DnsWorker DnsWorker;
+
+typedef struct ResponseContext {
+    DnsState* dns;
+    DnsWorker* worker;
+    int index;
+} ResponseContext;
+
+typedef struct ResponseWriteinfo {
+    CdnsPacketHeader header;
+    /// Bytes written after the header
+    int length;
+    /// Names written by cdnsAddQuestion and cdnsAddRecord
+    CdnsNameTable names;
+    bool queued;
+    bool flushed;
+} ResponseWriteInfo;
+
+typedef struct RequestWriteInfo {
+    CdnsPacketHeader header;
+    /// Bytes written after the header
+    int length;
+} RequestWriteInfo;
+
+/// Intrusive timer node, embedded in whatever it belongs to so scheduling never allocates
+typedef struct DnsTimer {
+    struct DnsTimer* next;
+    /// Points at whichever pointer points at this node, NULL while not scheduled
+    struct DnsTimer** pprev;
+    /// CLOCK_MONOTONIC time in ms at which the timer fires
+    u_int64_t expiry;
+    u_int8_t level;
+    u_int8_t slot;
+    u_int8_t kind;
+    int index;
+} DnsTimer;
+
+#define WHEEL_BITS 8
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+/// Hierarchical timing wheel with 1ms ticks. Level l holds timers due within the current
+/// 2^(8(l+1))ms block of time but not the current 2^(8l)ms one, so inserting and cancelling
+/// are O(1), and each timer is moved down a level at most WHEEL_LEVELS - 1 times. Timers due
+/// after the current top level block wait on the overflow list until it ends
+typedef struct DnsTimerWheel {
+    /// Every timer due before now has been handed out
+    u_int64_t now;
+    DnsTimer* heads[WHEEL_LEVELS][WHEEL_SIZE];
+    DnsTimer* overflow;
+    /// Bit per non-empty slot, to find the next due slot without scanning lists
+    u_int64_t occupied[WHEEL_LEVELS][WHEEL_SIZE / 64];
+} DnsTimerWheel;
+
+static void initTimerWheel(DnsTimerWheel* wheel, u_int64_t now) {
+    memset(wheel, 0, sizeof(DnsTimerWheel));
+    wheel->now = now;
+}
+static bool timerScheduled(const DnsTimer* timer) {
+    return timer->pprev != NULL;
+}
+static void scheduleTimer(DnsTimerWheel* wheel, DnsTimer* timer, u_int64_t expiry) {
+    if(expiry < wheel->now) {
+        expiry = wheel->now;
     }
-    collection->unusedStartIndex = 0;
-    collection->unusedEndIndex = 0;
-    for(size_t i = 0;i < numDataPieces;i++) {
-        collection->unused[i] = i;
+    timer->expiry = expiry;
+    if(expiry >> (WHEEL_BITS * WHEEL_LEVELS) != wheel->now >> (WHEEL_BITS * WHEEL_LEVELS)) {
+        timer->level = WHEEL_LEVELS;
+        timer->next = wheel->overflow;
+        if(timer->next != NULL) {
+            timer->next->pprev = &timer->next;
+        }
+        timer->pprev = &wheel->overflow;
+        wheel->overflow = timer;
+        return;
     }
-
-    return 0;
+    int level = 0;
+    while(level < WHEEL_LEVELS - 1 && expiry >> (WHEEL_BITS * (level + 1)) != wheel->now >> (WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    int slot = (expiry >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+    timer->level = level;
+    timer->slot = slot;
+    timer->next = wheel->heads[level][slot];
+    if(timer->next != NULL) {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = &wheel->heads[level][slot];
+    wheel->heads[level][slot] = timer;
+    wheel->occupied[level][slot / 64] |= 1ull << (slot % 64);
 }
-static int resizeCollection(ReusableDataCollection *collection, size_t newNumDataPieces) {
-    collection->allocation = realloc(collection->allocation, newNumDataPieces * collection->dataSize);
-    collection->unused = realloc(collection->unused, sizeof(size_t) * newNumDataPieces);
-    if(collection->allocation == 0 || collection->unused == 0) {
-        return CDNS_ERR_MEM;
+static void cancelTimer(DnsTimerWheel* wheel, DnsTimer* timer) {
+    if(!timerScheduled(timer)) {
+        return;
     }
-    if(collection->unusedStartIndex >= collection->unusedEndIndex) {
-        for(size_t i = collection->numDataPieces;i < newNumDataPieces;i++) {
-            collection->unused[i] = i;
+    *timer->pprev = timer->next;
+    if(timer->next != NULL) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->pprev = NULL;
+    if(timer->level < WHEEL_LEVELS && wheel->heads[timer->level][timer->slot] == NULL) {
+        wheel->occupied[timer->level][timer->slot / 64] &= ~(1ull << (timer->slot % 64));
+    }
+}
+// First occupied slot of a level after the given one, -1 if none
+static int nextOccupiedSlot(const u_int64_t* occupied, int after) {
+    for(int slot = after + 1;slot < WHEEL_SIZE;) {
+        u_int64_t bits = occupied[slot / 64] >> (slot % 64);
+        if(bits != 0) {
+            return slot + __builtin_ctzll(bits);
         }
-    } else {
+        slot = (slot / 64 + 1) * 64;
     }
-    return 0;
+    return -1;
 }
-// Double check this, wrote while tired
-static size_t popNextIndexCollection(ReusableDataCollection *collection) {
-    size_t idx = collection->unused[collection->unusedStartIndex];
-    collection->unusedStartIndex = (collection->unusedStartIndex + 1) % collection->numDataPieces;
-    return idx;
+// The next tick after now at which a timer fires or a slot has to be moved down a level
+static u_int64_t nextTimerEvent(const DnsTimerWheel* wheel) {
+    for(int level = 0;level < WHEEL_LEVELS;level++) {
+        int shift = WHEEL_BITS * level;
+        int current = (wheel->now >> shift) & (WHEEL_SIZE - 1);
+        int slot = nextOccupiedSlot(wheel->occupied[level], current);
+        if(slot != -1) {
+            return (wheel->now >> (shift + WHEEL_BITS) << (shift + WHEEL_BITS)) | (u_int64_t)slot << shift;
+        }
+    }
+    if(wheel->overflow != NULL) {
+        return ((wheel->now >> (WHEEL_BITS * WHEEL_LEVELS)) + 1) << (WHEEL_BITS * WHEEL_LEVELS);
+    }
+    return UINT64_MAX;
 }
-static void* getPtrCollection(ReusableDataCollection *collection, size_t idx) {
-    return (void*)(((char*)collection->allocation) + idx * collection->dataSize);
+// When the wheel should next be looked at, UINT64_MAX if it is empty
+static u_int64_t nextTimerDeadline(const DnsTimerWheel* wheel) {
+    if(wheel->heads[0][wheel->now & (WHEEL_SIZE - 1)] != NULL) {
+        return wheel->now;
+    }
+    return nextTimerEvent(wheel);
 }
-static void returnSpotCollection(ReusableDataCollection *collection, size_t idx) {
-    collection->unused[collection->unusedEndIndex] = idx;
-    collection->unusedEndIndex = (collection->unusedEndIndex + 1) % collection->dataSize;
+// Moves the timers of the slot now has just entered down to lower levels, or those of the
+// overflow list into the top level block now has just entered
+static void cascadeTimers(DnsTimerWheel* wheel, int level) {
+    DnsTimer* timer;
+    if(level == WHEEL_LEVELS) {
+        timer = wheel->overflow;
+        wheel->overflow = NULL;
+    } else {
+        int slot = (wheel->now >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+        timer = wheel->heads[level][slot];
+        wheel->heads[level][slot] = NULL;
+        wheel->occupied[level][slot / 64] &= ~(1ull << (slot % 64));
+    }
+    while(timer != NULL) {
+        DnsTimer* next = timer->next;
+        scheduleTimer(wheel, timer, timer->expiry);
+        timer = next;
+    }
 }
-static void destroyCollection(ReusableDataCollection *collection) {
-    free(collection->allocation);
-    free(collection->unused);
+// Unschedules and returns one timer that is due at or before the given time, or NULL once
+// there are none left. Skips straight over ticks where nothing happens
+static DnsTimer* popExpiredTimer(DnsTimerWheel* wheel, u_int64_t to) {
+    while(true) {
+        DnsTimer* head = wheel->heads[0][wheel->now & (WHEEL_SIZE - 1)];
+        if(head != NULL) {
+            cancelTimer(wheel, head);
+            return head;
+        }
+        if(wheel->now >= to) {
+            return NULL;
+        }
+        u_int64_t next = nextTimerEvent(wheel);
+        if(next > to) {
+            wheel->now = to;
+            return NULL;
+        }
+        wheel->now = next;
+        for(int level = WHEEL_LEVELS;level > 0;level--) {
+            if((wheel->now & ((1ull << (WHEEL_BITS * level)) - 1)) == 0) {
+                cascadeTimers(wheel, level);
+            }
+        }
+    }
 }
 
+/// What a DnsTimer belongs to
+enum DnsTimerKind {
+    /// A ResponseCycleData parked on CdnsWaitMs
+    TIMER_WAIT,
+    /// An OutgoingRequestTrackingData due for a resend or to give up
+    TIMER_RESEND,
+    /// A DnsTcpConnection that may have been idle for too long
+    TIMER_IDLE,
+    /// A pooled OutgoingRequestTrackingData due to be hedged to a second upstream
+    TIMER_HEDGE,
+    /// A DnsUpstreamConnection due to reconnect, or that may have been idle for too long
+    TIMER_UPSTREAM_CONNECTION,
+    /// The worker's cache is due to be copied out for the snapshot, or the next slice of it
+    TIMER_SNAPSHOT,
+    /// TCP listeners held back for lack of file descriptors are due to accept again
+    TIMER_ACCEPT,
+};
+
 /// Followed by data in memory
 typedef struct ResponseCycleData {
+    /// Must come first, the callback's CdnsResponseContext points here
+    ResponseContext context;
     CdnsCallbackCycleInfo info;
+    int listener;
+    DnsSockAddr client;
+    socklen_t clientLength;
+    int requestLength;
+    CdnsPacketHeader requestHeader;
+    CdnsPacketReadInfo requestInfo;
+    /// 0 until the request is first read, then the result of indexing it
+    int requestIndexResult;
+    bool requestIndexed;
+    ResponseWriteInfo writer;
+    /// Head of the list of outgoing requests created by this cycle, -1 if none
+    int ownedRequests;
+    /// For CdnsPollMany, awaited requests that have not settled yet and whether all of
+    /// them are needed. Those that had settled before the wait began count in awaitDone
+    int awaitPending;
+    int awaitDone;
+    bool awaitAll;
+    bool finished;
+    /// Scheduled while parked on CdnsWaitMs, or until the deadline of CdnsPollMany
+    DnsTimer waitTimer;
+    /// TCP connection the query came in on and its generation at the time, -1 for UDP
+    int connection;
+    u_int32_t connectionGeneration;
+    /// Next response in the connection's write queue, -1 if none
+    int nextWrite;
+    /// Bytes of the framing and response already written to the connection
+    int written;
+    /// For HTTP, the error status sent in place of a response, 0 to send the response
+    int httpStatus;
+    /// CLOCK_MONOTONIC us at which the query was read
+    u_int64_t receivedAt;
+    /// responseBuffer, or once a TCP or HTTP answer outgrows it a heap buffer of up to
+    /// CDNS_STREAM_BUFFER_SIZE, freed along with the slot
+    unsigned char* response;
+    int responseCapacity;
+    unsigned char request[CDNS_UDP_BUFFER_SIZE];
+    unsigned char responseBuffer[CDNS_UDP_BUFFER_SIZE];
+    void* requestEntries[CDNS_MAX_ENTRIES(CDNS_UDP_BUFFER_SIZE)];
 } ResponseCycleData;
 
-typedef struct DnsConnections {
-    pthread_t* threads;
-} DnsConnections;
-static void destroyDnsConnections(DnsConnections* connections) {
-    if(connections->threads != 0) {
-        free(connections->threads);
-    }
-}
+enum DnsUpstreamCounter {
+    UPSTREAM_QUERIES,
+    UPSTREAM_REPLIES,
+    UPSTREAM_TIMEOUTS,
+    UPSTREAM_HEDGES,
+    UPSTREAM_HEDGES_WON,
+    UPSTREAM_NUM_COUNTERS,
+};
+
+/// One worker's view of an upstream. Only that worker writes it, relaxed atomics let
+/// cdnsGetUpstreamStats read it from any thread. A cache line each, so workers never
+/// share one
+typedef struct DnsUpstreamEstimate {
+    /// Smoothed RTT and its mean variation in us, as RFC 6298 keeps them. 0 until the
+    /// first sample
+    _Alignas(CDNS_CACHE_LINE) _Atomic u_int32_t srttUs;
+    _Atomic u_int32_t rttVarUs;
+    /// Moving average of timeouts per query sent, in 1/65536ths
+    _Atomic u_int32_t loss;
+    _Atomic u_int64_t counters[UPSTREAM_NUM_COUNTERS];
+} DnsUpstreamEstimate;
+
+typedef struct DnsUpstreamPool {
+    DnsState* state;
+    /// Next pool of the same state
+    struct DnsUpstreamPool* next;
+    int numUpstreams;
+    DnsSockAddr* destinations;
+    /// Whether each upstream is reached over TCP
+    bool* streams;
+    int explorePercent;
+    bool hedge;
+    int hedgeMinDelay;
+    /// numUpstreams estimates per worker, maxThreads workers
+    DnsUpstreamEstimate* estimates;
+} DnsUpstreamPool;
+
+typedef struct OutgoingRequestTrackingData {
+    /// Must come first, the CdnsRequestWriteInfo handed out points here
+    RequestWriteInfo writer;
+    DnsWorker* worker;
+    CdnsRequestId id;
+    /// Generation of the slot, so that ids of freed requests can be told apart
+    u_int32_t generation;
+    /// ResponseCycleData slot that created the request, -1 while the slot is free
+    int owner;
+    /// Next request owned by the same cycle, -1 if none
+    int nextOwned;
+    bool sent;
+    bool answered;
+    /// Set once maxResendCount resends went unanswered
+    bool failed;
+    /// Counted in its owner's awaitPending
+    bool awaited;
+    int resendCount;
+    DnsTimer resendTimer;
+    /// CLOCK_MONOTONIC us of the first send
+    u_int64_t sentAt;
+    /// Index into the worker's upstreamSockets, or UPSTREAM_TCP_SOCKET_BASE plus the index
+    /// of the upstream connection
+    int socketIndex;
+    /// Hash of the first question, part of the key a reply is matched on
+    u_int64_t questionHash;
+    /// Whether the request is in the worker's match table
+    bool matchable;
+    /// Whether the request is in the worker's in-flight table, so later identical
+    /// requests can share its query
+    bool inflight;
+    /// Request whose query this one shares, -1 if it sent its own
+    int leader;
+    /// Requests sharing this one's query, linked through nextFollower and prevFollower
+    int followers;
+    int nextFollower;
+    int prevFollower;
+    DnsSockAddr destination;
+    socklen_t destinationLength;
+    /// Whether the destination is reached over TCP
+    bool tcp;
+    /// Upstream connection the request is sent on, -1 if none
+    int connection;
+    /// Whether the request is in the connection's write queue, linked through nextWrite and
+    /// prevWrite, rather than written and waiting for its reply
+    bool queuedWrite;
+    int nextWrite;
+    int prevWrite;
+    /// Bytes of the length prefix and request already written to the connection
+    int written;
+    /// Pool the destination was picked from, NULL if the callback gave it
+    DnsUpstreamPool* pool;
+    /// Index of the destination in pool
+    int upstream;
+    /// Copy of the request sent to another upstream of the pool once hedgeTimer fired,
+    /// -1 if none
+    int hedge;
+    /// For such a copy, the request it duplicates, -1 otherwise
+    int hedgeOf;
+    DnsTimer hedgeTimer;
+    int requestLength;
+    int responseLength;
+    CdnsPacketHeader responseHeader;
+    CdnsPacketReadInfo responseInfo;
+    int responseIndexResult;
+    bool responseIndexed;
+    unsigned char request[CDNS_UDP_BUFFER_SIZE];
+    /// responseBuffer and responseEntriesBuffer, or one heap block holding both for a reply
+    /// over TCP larger than the UDP buffer, up to CDNS_STREAM_BUFFER_SIZE
+    unsigned char* response;
+    void** responseEntries;
+    int responseCapacity;
+    unsigned char responseBuffer[CDNS_UDP_BUFFER_SIZE];
+    void* responseEntriesBuffer[CDNS_MAX_ENTRIES(CDNS_UDP_BUFFER_SIZE)];
+} OutgoingRequestTrackingData;
+
 typedef struct DnsLitener {
     int socket;
     CdnsListenerConfig config;
     bool isOpen;
+    /// Taken out of the epoll set until acceptTimer fires, as the process ran out of file
+    /// descriptors and the pending connection can't be accepted yet
+    bool acceptPaused;
 } DnsListener;
+
+/// Where the HTTP parser is in a request
+enum DnsHttpState {
+    HTTP_METHOD,
+    HTTP_PATH,
+    HTTP_PARAM_NAME,
+    HTTP_PARAM_VALUE,
+    HTTP_PARAM_SKIP,
+    HTTP_VERSION,
+    HTTP_LINE_START,
+    HTTP_HEADER_NAME,
+    HTTP_CONTENT_LENGTH,
+    HTTP_CONTENT_TYPE,
+    HTTP_CONNECTION,
+    HTTP_HEADER_SKIP,
+    HTTP_BODY
+};
+/// What the HTTP parser has seen of a request, for DnsTcpConnection.httpFlags
+#define HTTP_GET 0x1
+#define HTTP_POST 0x2
+#define HTTP_HAS_DNS 0x4
+#define HTTP_DNS_MESSAGE 0x8
+#define HTTP_HAS_LENGTH 0x10
+#define HTTP_CLOSE 0x20
+#define HTTP_KEEP_ALIVE 0x40
+#define HTTP_VERSION_10 0x80
+
+/// A client connection to a TCP listener. Queries are read straight into response cycle
+/// slots, so an idle connection costs no more than this
+typedef struct DnsTcpConnection {
+    int socket;
+    int listener;
+    /// DNS over HTTP rather than length-prefixed DNS over TCP
+    bool http;
+    /// Bumped on close, so responses to queries from an earlier connection are dropped
+    u_int32_t generation;
+    bool open;
+    /// Set once the client has shut down its side, or asked over HTTP for the connection
+    /// to be closed. Queries already read are still answered
+    bool readClosed;
+    /// Whether the connection is in the worker's list of those waiting for a free slot
+    bool paused;
+    /// Events currently registered with epoll
+    u_int32_t events;
+    /// Queries dispatched and not yet finished
+    int inFlight;
+    /// Entries in the write queue
+    int numQueued;
+    /// Length prefix of the next query, of which lengthHave bytes are read
+    unsigned char lengthBytes[2];
+    int lengthHave;
+    /// Slot being filled with a query, -1 if none
+    int readCycle;
+    int readLength;
+    int readHave;
+    /// HTTP request parser, see parseHttp
+    u_int8_t httpState;
+    /// Characters of the token being matched so far
+    u_int8_t httpMatch;
+    /// Tokens still matching, one bit each
+    u_int8_t httpCandidates;
+    u_int16_t httpFlags;
+    /// Bytes of the request line and headers, which are limited
+    int httpCount;
+    /// Base64 bits of the dns parameter not yet decoded into a byte, and how many there
+    /// are. Once the request line is read, httpBits holds the Content-Length instead, and
+    /// then the body bytes still to come
+    u_int32_t httpBits;
+    int httpNumBits;
+    /// Responses waiting to be written, linked through ResponseCycleData.nextWrite. For
+    /// HTTP every request is linked in as soon as it is read, to keep them in order
+    int writeHead;
+    int writeTail;
+    int nextPaused;
+    int prevPaused;
+    DnsTimer idleTimer;
+} DnsTcpConnection;
+
+/// A connection to a TCP upstream, shared by every request the worker sends there. Requests
+/// are written in the order they are sent and their replies matched by id in any order
+typedef struct DnsUpstreamConnection {
+    /// Whether the slot is in use, connected or waiting to reconnect
+    bool active;
+    /// -1 while waiting to reconnect
+    int socket;
+    /// Set once the non-blocking connect has completed
+    bool connected;
+    DnsSockAddr destination;
+    /// Events currently registered with epoll
+    u_int32_t events;
+    /// Requests not yet fully written, linked through OutgoingRequestTrackingData.nextWrite
+    int writeHead;
+    int writeTail;
+    int numQueued;
+    /// Requests written and waiting for their reply
+    int outstanding;
+    /// Connections in a row that failed without a reply, for the reconnect backoff
+    int failures;
+    /// Rest of a request freed while partly written, which is written before anything else
+    /// so the stream stays framed
+    unsigned char partial[2 + CDNS_UDP_BUFFER_SIZE];
+    int partialLength;
+    int partialWritten;
+    /// Length prefix of the next reply, of which lengthHave bytes are read
+    unsigned char lengthBytes[2];
+    int lengthHave;
+    int readLength;
+    int readHave;
+    /// Allocated on the first reply and grown to the largest since, up to
+    /// CDNS_STREAM_BUFFER_SIZE. Kept while the slot is reused
+    unsigned char* reply;
+    int replyCapacity;
+    /// The reconnect backoff, or the idle timeout once nothing waits on the connection
+    DnsTimer timer;
+} DnsUpstreamConnection;
+
+/// CdnsBatchStats as a worker keeps them. Like DnsStats they are only written by the worker
+/// and read by cdnsGetBatchStats with relaxed atomics, which cost nothing over plain adds
+typedef struct DnsBatchStats {
+    _Atomic u_int64_t recvBatches;
+    _Atomic u_int64_t recvPackets;
+    _Atomic u_int64_t sendBatches;
+    _Atomic u_int64_t sendPackets;
+    _Atomic u_int64_t sendDropped;
+    _Atomic u_int64_t recvFill[CDNS_BATCH_FILL_BUCKETS];
+    _Atomic u_int64_t sendFill[CDNS_BATCH_FILL_BUCKETS];
+    _Atomic u_int64_t ringThreads;
+} DnsBatchStats;
+
+/// Preallocated message headers for recvmmsg/sendmmsg. The iovecs point straight into
+/// the request/response buffers of ResponseCycleData slots so nothing is copied
+typedef struct DnsBatchIo {
+    int batchSize;
+    struct mmsghdr* recvMessages;
+    struct iovec* recvIovecs;
+    u_int32_t* recvSlots;
+    struct mmsghdr* sendMessages;
+    struct iovec* sendIovecs;
+    u_int32_t* sendSlots;
+    int numQueued;
+    /// Receive buffers for upstream replies, which are copied into their request slot once matched
+    unsigned char* scratch;
+    DnsSockAddr* scratchAddrs;
+    DnsBatchStats stats;
+} DnsBatchIo;
+
+static int createBatchIo(DnsBatchIo* batch, int batchSize) {
+    memset(batch, 0, sizeof(DnsBatchIo));
+    batch->batchSize = batchSize;
+    batch->recvMessages = calloc(batchSize, sizeof(struct mmsghdr));
+    batch->recvIovecs = calloc(batchSize, sizeof(struct iovec));
+    batch->recvSlots = calloc(batchSize, sizeof(u_int32_t));
+    batch->sendMessages = calloc(batchSize, sizeof(struct mmsghdr));
+    batch->sendIovecs = calloc(batchSize, sizeof(struct iovec));
+    batch->sendSlots = calloc(batchSize, sizeof(u_int32_t));
+    batch->scratch = malloc((size_t)batchSize * CDNS_UDP_BUFFER_SIZE);
+    batch->scratchAddrs = calloc(batchSize, sizeof(DnsSockAddr));
+    if(batch->recvMessages == NULL || batch->recvIovecs == NULL || batch->recvSlots == NULL ||
+       batch->sendMessages == NULL || batch->sendIovecs == NULL || batch->sendSlots == NULL ||
+       batch->scratch == NULL || batch->scratchAddrs == NULL) {
+        return CDNS_ERR_MEM;
+    }
+    for(int i = 0;i < batchSize;i++) {
+        batch->recvMessages[i].msg_hdr.msg_iov = &batch->recvIovecs[i];
+        batch->recvMessages[i].msg_hdr.msg_iovlen = 1;
+        batch->sendMessages[i].msg_hdr.msg_iov = &batch->sendIovecs[i];
+        batch->sendMessages[i].msg_hdr.msg_iovlen = 1;
+    }
+    return 0;
+}
+static void destroyBatchIo(DnsBatchIo* batch) {
+    free(batch->recvMessages);
+    free(batch->recvIovecs);
+    free(batch->recvSlots);
+    free(batch->sendMessages);
+    free(batch->sendIovecs);
+    free(batch->sendSlots);
+    free(batch->scratch);
+    free(batch->scratchAddrs);
+}
+static void recordBatchFill(_Atomic u_int64_t* fill, int count, int batchSize) {
+    _Atomic u_int64_t* bucket = &fill[(count * CDNS_BATCH_FILL_BUCKETS - 1) / batchSize];
+    atomic_store_explicit(bucket, atomic_load_explicit(bucket, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+/// A datagram that arrived on a listener while every slot was busy, still in its buffer
+typedef struct DnsRingHeld {
+    u_int16_t listener;
+    u_int16_t buffer;
+    int length;
+} DnsRingHeld;
+
+/// The io_uring of a worker using CdnsIoUring. UDP listeners are registered files 0 to
+/// numListeners - 1, upstream sockets follow them as they are opened, and each has a
+/// multishot receive armed into its own group of buffers, so that listener datagrams held
+/// back while slots are busy don't starve the upstream replies that free them
+typedef struct DnsWorkerRing {
+    DnsRing ring;
+    DnsBufferRing listenerBuffers;
+    DnsBufferRing upstreamBuffers;
+    /// Gives every multishot receive room for the source address
+    struct msghdr recvHeader;
+    /// Per registered file, the socket or -1 and whether its receive is armed
+    int* files;
+    bool* armed;
+    u_int32_t numFiles;
+    /// Set when a receive completed without rearming
+    bool needsArming;
+    /// Set when the kernel rejects multishot receives, to fall back to epoll
+    bool unsupported;
+    /// Circular queue of listener datagrams waiting for a slot, with room for every listener
+    /// buffer. Listener receives are only rearmed once it is empty
+    DnsRingHeld* held;
+    u_int32_t heldStart;
+    u_int32_t numHeld;
+} DnsWorkerRing;
+
+/// A cached response, followed in memory by its lowercased qname and then the packet
+typedef struct DnsCacheEntry {
+    struct DnsCacheEntry* hashNext;
+    /// Neighbours in the circular list the CLOCK hand sweeps
+    struct DnsCacheEntry* clockPrev;
+    struct DnsCacheEntry* clockNext;
+    u_int64_t hash;
+    /// CLOCK_MONOTONIC ms at which the packet was stored and at which its shortest TTL runs out
+    u_int64_t storedAt;
+    u_int64_t expiresAt;
+    /// Set on every hit, cleared when the CLOCK hand passes
+    bool referenced;
+    u_int16_t qtype;
+    u_int16_t qclass;
+    /// The DO bit of the OPT record, as DNSSEC records are only sent to clients asking for them
+    bool dnssecOk;
+    u_int16_t nameLength;
+    u_int16_t packetLength;
+    /// Offsets into the packet of every TTL field, to be decremented at serve time
+    u_int16_t numTtls;
+    u_int16_t ttlOffsets[];
+} DnsCacheEntry;
+
+#define CDNS_SNAPSHOT_MAGIC "CDNSSNAP"
+#define CDNS_SNAPSHOT_VERSION 2
+#define CDNS_SNAPSHOT_BYTE_ORDER 0x01020304u
+
+/// A cache snapshot is a header, a hash table and the entries, in the byte order of the
+/// machine that wrote it. The table is keyed on the cache key hash, open addressed with
+/// linear probing and at most half full, as in zone images
+typedef struct DnsSnapshotHeader {
+    char magic[8];
+    u_int32_t version;
+    u_int32_t byteOrder;
+    /// CLOCK_REALTIME ms at which it was written, and at which its last entry expires
+    u_int64_t savedAt;
+    u_int64_t expiresAt;
+    /// Slots in the table, a power of two
+    u_int32_t tableSize;
+    u_int32_t numEntries;
+    u_int64_t tableOffset;
+    u_int64_t entriesOffset;
+    u_int64_t entriesLength;
+    /// Of the whole snapshot
+    u_int64_t length;
+} DnsSnapshotHeader;
+
+typedef struct DnsSnapshotSlot {
+    /// High half of the key's hash
+    u_int32_t tag;
+    /// Offset of the entry / 8 + 1, 0 if the slot is empty
+    u_int32_t entry;
+} DnsSnapshotSlot;
+
+/// A DnsCacheEntry as saved, 8 byte aligned and followed by its TTL offsets, its name and
+/// its packet, which holds the TTLs as they were when it was stored
+typedef struct DnsSnapshotEntry {
+    /// Of the whole entry, padded to 8 bytes
+    u_int32_t length;
+    /// Low half of the FNV-1a hash of everything after it up to length, so a damaged packet
+    /// is never served
+    u_int32_t checksum;
+    u_int64_t hash;
+    /// CLOCK_REALTIME ms at which the packet was stored and at which its shortest TTL runs out
+    u_int64_t storedAt;
+    u_int64_t expiresAt;
+    u_int16_t qtype;
+    u_int16_t qclass;
+    u_int16_t dnssecOk;
+    u_int16_t nameLength;
+    u_int16_t packetLength;
+    u_int16_t numTtls;
+    u_int16_t ttlOffsets[];
+} DnsSnapshotEntry;
+
+/// A snapshot mapped by cdnsCreateDns, read by every worker and never written
+typedef struct DnsSnapshot {
+    const unsigned char* image;
+    size_t length;
+    const DnsSnapshotSlot* table;
+    u_int32_t mask;
+    u_int32_t numEntries;
+    const unsigned char* entries;
+    u_int64_t entriesLength;
+    /// CLOCK_REALTIME ms after which none of its entries are fresh
+    u_int64_t expiresAt;
+    /// CLOCK_REALTIME minus CLOCK_MONOTONIC in ms when it was mapped, to tell the age of its
+    /// entries without reading the wall clock on every miss
+    int64_t wallOffset;
+} DnsSnapshot;
+
+/// Entries copied out of one worker's cache, back to back as in a snapshot
+typedef struct DnsSnapshotShard {
+    unsigned char* data;
+    size_t length;
+    size_t capacity;
+    u_int32_t numEntries;
+} DnsSnapshotShard;
+
+/// Per worker response cache, so lookups never take a lock. Entries are evicted by CLOCK
+/// once the byte budget is used up
+typedef struct DnsCache {
+    DnsCacheEntry** buckets;
+    size_t numBuckets;
+    /// Next entry to be considered for eviction
+    DnsCacheEntry* hand;
+    size_t usedBytes;
+    size_t maxBytes;
+    u_int64_t hits;
+    u_int64_t misses;
+    /// Entries ever stored, each one a malloc
+    u_int64_t stores;
+    /// Misses are looked up here while it holds fresh entries, NULL if there is none
+    const DnsSnapshot* snapshot;
+    /// Entries taken from the snapshot
+    u_int64_t restored;
+} DnsCache;
+
+/// Indexes into DnsStats.counters, one per counter of CdnsStats
+enum DnsStatCounter {
+    STAT_QUERIES_RECEIVED,
+    STAT_RESPONSES_SENT,
+    STAT_QUERIES_DROPPED,
+    STAT_UPSTREAM_SENT,
+    STAT_UPSTREAM_REPLIES,
+    STAT_UPSTREAM_RETRANSMITS,
+    STAT_UPSTREAM_TIMEOUTS,
+    STAT_REQUEST_SLOTS_EXHAUSTED,
+    STAT_OUTGOING_SLOTS_EXHAUSTED,
+    STAT_ZONE_ANSWERS,
+    STAT_RRL_LIMITED,
+    STAT_RRL_SLIPPED,
+    STAT_UPSTREAM_TCP_FALLBACKS,
+    STAT_UPSTREAM_TCP_CONNECTS,
+    STAT_CACHE_RESTORED,
+    STAT_NUM_COUNTERS
+};
+
+typedef struct DnsHistogram {
+    _Atomic u_int64_t counts[CDNS_LATENCY_BUCKETS];
+    _Atomic u_int64_t sumUs;
+    _Atomic u_int64_t maxUs;
+} DnsHistogram;
+
+/// A worker's counters and latencies. Only the worker writes them, and a relaxed load
+/// and store of a word no other thread writes is a plain add, so keeping them costs no
+/// more than it would if cdnsGetStats did not read them concurrently. They start on a
+/// cache line of their own, so workers never share a line of them
+typedef struct DnsStats {
+    _Alignas(CDNS_CACHE_LINE) _Atomic u_int64_t counters[STAT_NUM_COUNTERS];
+    DnsHistogram endToEnd;
+    DnsHistogram upstreamRtt;
+} DnsStats;
+
+/// Bytes from getrandom, handed out a few at a time
+typedef struct DnsRandom {
+    unsigned char buffer[256];
+    int used;
+    /// State for the fallback generator, used only if getrandom fails
+    u_int64_t fallback;
+} DnsRandom;
+
+typedef struct DnsMatchEntry {
+    u_int32_t hash;
+    /// Outgoing request index, CDNS_POOL_NONE if the entry is empty
+    u_int32_t request;
+} DnsMatchEntry;
+
+/// Open addressing table with linear probing from (upstream address, source port, DNS id,
+/// question hash) to the outgoing request waiting on that reply
+typedef struct DnsMatchTable {
+    DnsMatchEntry* entries;
+    /// Capacity minus one, the capacity being a power of two
+    u_int32_t mask;
+} DnsMatchTable;
+
+/// Where cdnsReplay charges the time of a run, see CdnsReplayStats. Time spent waiting for a
+/// timer or a timed query goes to REPLAY_IDLE, which is not reported
+enum DnsReplayStage {
+    REPLAY_DISPATCH,
+    REPLAY_CALLBACK,
+    REPLAY_UPSTREAM,
+    REPLAY_SEND,
+    REPLAY_IDLE,
+    REPLAY_NUM_STAGES,
+};
+/// Stub replies cdnsReplay holds until the callback that asked for them returns
+#define REPLAY_MAX_PENDING 256
+
+typedef struct DnsReplayReply {
+    int socketIndex;
+    DnsSockAddr from;
+    int length;
+    unsigned char packet[CDNS_UDP_BUFFER_SIZE];
+} DnsReplayReply;
+
+/// A cdnsReplay run, which stands in for the sockets of the worker it runs on
+typedef struct DnsReplay {
+    const CdnsReplayConfig* config;
+    CdnsReplayStats stats;
+    enum DnsReplayStage stage;
+    /// readCycles when the current stage was entered
+    u_int64_t stageStart;
+    u_int64_t stageCycles[REPLAY_NUM_STAGES];
+    /// Ring of REPLAY_MAX_PENDING replies not handled yet
+    DnsReplayReply* pending;
+    int pendingHead;
+    int numPending;
+} DnsReplay;
+
+/// Everything owned by a single worker thread. Each worker has its own SO_REUSEPORT socket
+/// per listener config, so the kernel spreads queries across workers without a shared lock
+typedef struct DnsWorker {
+    DnsState* state;
+    int index;
+    /// One per listener config
+    DnsListener* listeners;
+    /// Response cycles, each followed by the callback's per cycle data
+    DnsPool cyclePool;
+    DnsPool requestPool;
+    DnsPool connectionPool;
+    /// Head of the list of TCP connections waiting for a free slot, -1 if none
+    int pausedConnections;
+    DnsBatchIo batch;
+    /// NULL unless the UDP sockets are on io_uring
+    DnsWorkerRing* ring;
+    /// NULL unless cdnsReplay is running on the worker
+    DnsReplay* replay;
+    /// UDP sockets for upstream queries, each bound to a random source port. Created on
+    /// first use, NULL until then
+    int* upstreamSockets;
+    /// UPSTREAM_TCP_MAX_CONNECTIONS connections to TCP upstreams, NULL until the first
+    /// request to one
+    DnsUpstreamConnection* upstreamConnections;
+    DnsMatchTable matches;
+    /// Unanswered requests by destination and question, for coalescing duplicates
+    DnsMatchTable inflight;
+    DnsRandom random;
+    int epollFd;
+    /// Armed for the next deadline of the timer wheel
+    int timerFd;
+    u_int64_t armedDeadline;
+    DnsTimerWheel timers;
+    struct epoll_event* events;
+    /// Whether the listeners were taken out of the epoll set because every slot is busy
+    bool listenersPaused;
+    /// For listeners with acceptPaused set
+    DnsTimer acceptTimer;
+    DnsCache cache;
+    /// Copy of the cache being made for the periodic snapshot, a slice of buckets per
+    /// snapshotTimer, NULL between copies
+    DnsSnapshotShard* snapshotBuilding;
+    size_t snapshotCursor;
+    DnsTimer snapshotTimer;
+    /// The latest finished copy, until the snapshot thread takes it
+    _Atomic(DnsSnapshotShard*) snapshotShard;
+    /// Responses counted for rate limiting, and those over the limit since the last slip
+    DnsRateSketch rateSketch;
+    u_int32_t sinceSlip;
+    /// CLOCK_MONOTONIC us of the latest read from a listener or connection, given to the
+    /// queries it delivered
+    u_int64_t readAt;
+    /// The zone epoch read when the worker last woke, ZONE_IDLE while it waits for events
+    /// and so holds no zone
+    _Atomic u_int64_t zoneEpoch;
+    DnsStats stats;
+} DnsWorker;
+
+/// A zone image mapped by cdnsLoadZone
+typedef struct DnsLoadedZone {
+    DnsZone zone;
+    /// Once replaced, the zone epoch at which that happened
+    u_int64_t retiredAt;
+    struct DnsLoadedZone* next;
+} DnsLoadedZone;
+
+typedef struct DnsConnections {
+    /// Worker 0 runs inside cdnsPoll, so its entry is unused
+    pthread_t* threads;
+    /// maxThreads entries, the first numThreads of which are initialized
+    DnsWorker* workers;
+    /// Held while adding or joining workers
+    pthread_mutex_t lock;
+    /// Background threads started by cdnsPoll or added under load, not yet joined
+    int numRunning;
+    /// CLOCK_MONOTONIC time in ms before which no worker is added, set when adding one fails
+    _Atomic u_int64_t growRetryAt;
+} DnsConnections;
+
+/// The reuseport program of a listener with pinned workers, and the map it picks a socket
+/// from by the receiving CPU. Both -1 where the kernel would not make them
+typedef struct DnsSteering {
+    int map;
+    int program;
+} DnsSteering;
+
 typedef struct DnsState {
     int numListeners;
-    DnsListener* listeners;
+    CdnsListenerConfig* listenerConfigs;
 
     int threadRequests;
     int threadOutgoingRequests;
-    int numThreads;
+    atomic_int numThreads;
     int maxThreads;
+    /// Copied from the config, NULL if threads are not pinned
+    unsigned int* workerCpus;
+    unsigned int numWorkerCpus;
+    /// numListeners entries if threads are pinned, NULL otherwise
+    DnsSteering* steering;
     int resendDelay;
     int maxResendCount;
-
-    int requestMakers[6];
+    size_t cacheBytes;
+    bool cacheAutoAnswer;
+    /// NULL if caches are not saved
+    char* snapshotPath;
+    unsigned int snapshotInterval;
+    /// The snapshot of an earlier run, NULL if there was none
+    DnsSnapshot* snapshot;
+    /// Whether workers ran since the caches were last saved
+    bool snapshotStale;
+    /// Saves every snapshotInterval while cdnsPoll runs, from the copies workers hand it
+    pthread_t snapshotThread;
+    bool snapshotThreadRunning;
+    bool snapshotStop;
+    pthread_mutex_t snapshotLock;
+    pthread_cond_t snapshotWake;
+    bool coalesce;
+    int upstreamTcpConnections;
+    bool tcpFallback;
 
     CdnsCallbackDescriptor callback;
     bool listening;
     bool paused;
+    atomic_bool stopRequested;
+    /// eventfd used to wake cdnsPoll when cdnsStop is called
+    int wakeFd;
     DnsConnections connections;
-    ReusableDataCollection resDataCollection;
-    ReusableDataCollection reqDataCollection;
+    int batchSize;
+    int upstreamPorts;
+    int tcpMaxConnections;
+    int tcpIdleTimeout;
+    CdnsIoBackend ioBackend;
+    /// 0 if response rate limiting is off
+    u_int32_t rrlRate;
+    CdnsRrlAction rrlAction;
+    u_int32_t rrlSlip;
+    /// UDP payload size offered in OPT records
+    u_int16_t ednsUdpSize;
+    /// Made by cdnsCreateUpstreamPool, linked through next. Guarded by connections.lock
+    DnsUpstreamPool* pools;
+    /// Read by workers without a lock. Replacing it bumps zoneEpoch, and the old zone is
+    /// unmapped once every worker has woken since or is idle
+    _Atomic(DnsLoadedZone*) zone;
+    _Atomic u_int64_t zoneEpoch;
+    /// Replaced zones not yet unmapped, linked through next. Guarded by connections.lock
+    DnsLoadedZone* retiredZones;
+    atomic_int numRetiredZones;
 } DnsState;
 
-typedef struct OutgoingRequestTrackingData {
-    CdnsRequestId id;
-} OutgoingRequestTrackingData;
-
-typedef struct ResponseContext {
-    DnsState* dns;
-    int index;
-} ResponseContext;
-
-typedef struct ResponseWriteinfo {
-
-} ResponseWriteInfo;
-
-typedef struct RequestWriteInfo {
-
-} RequestWriteInfo;
-
-char *cdnsGetErrorString(int error) {
-    char* strings[CDNS_NUM_ERR + 1] = {
-        "NONE",
-        "MEMORY ERROR",
-        "TCP UNSUPPORTED",
-        "THREADS UNSUPPORTED",
-        "HTTP UNSUPPORTED",
-        "SOCKET CLOSE ERROR",
-        "NO CALLBACK SPECIFIED",
-        "ALREADY LISTENING",
-        "INVALID CALLBACK",
-        "INVALID PAUSE",
-        "ERROR IN RESPONSE FROM EXTERNAL SERVER",
-        "STATE MDOFIIED WHILE UNPAUSED",
-        "NONBLOCKING SOCKETS UNSUPPORTED"
-    };
-    if(error <= CDNS_NUM_ERR && error >= 0) {
-        return strings[error];
-    } else {
-        return "UNKNOWN ERROR";
-    }
+static ResponseCycleData* getCycle(DnsWorker* worker, size_t idx) {
+    return (ResponseCycleData*)poolEntry(&worker->cyclePool, (u_int32_t)idx);
 }
-
-#define DEFAULT_THREAD_REQUESTS 256
-#define DEFAULT_RESEND_DELAY 1000
-#define DEFAULT_RESEND_ATTEMPTS 10
-
-inline int getProtoTypeIndex(CdnsNetworkProtocolType net, CdnsProtocolType typ) {
-    return (int)net * 3 + (int)typ;
+static void initCycle(void* entry, u_int32_t idx, void* arg) {
+    ResponseCycleData* cycle = (ResponseCycleData*)entry;
+    cycle->response = cycle->responseBuffer;
+    cycle->responseCapacity = CDNS_UDP_BUFFER_SIZE;
 }
-static int makeListener(const CdnsListenerConfig* config, DnsListener* out) {
-    // Socket creation timeline:
-    // Create socket, with protocol type(socket)
-    // Set socket options(setsockopt, fcntl)
-    // Bind socket()
-    // Destroy socket()
-    int sock;
-    int domain, type, protocol;
-    int port;
-    if(config->port == 0) {
-        if(config->proto == CdnsProtoUdp) {
-            port = htons(CDNS_DNS_UDP_PORT);
-        } else if(config->proto == CdnsProtoTcp) {
-            port = htons(CDNS_DNS_TCP_PORT);
-        } else if(config->proto == CdnsProtoHttp) {
-            port = htons(CDNS_DNS_HTTP_PORT);
+// Returns a slot to the pool, along with the buffer of a large stream answer
+static void freeCycle(DnsWorker* worker, size_t idx) {
+    ResponseCycleData* cycle = getCycle(worker, idx);
+    if(cycle->response != cycle->responseBuffer) {
+        free(cycle->response);
+        initCycle(cycle, (u_int32_t)idx, NULL);
+    }
+    freePoolEntry(&worker->cyclePool, (u_int32_t)idx);
+}
+static void destroyCyclePool(DnsWorker* worker) {
+    for(u_int32_t idx = 0;poolCreated(&worker->cyclePool) && idx < worker->cyclePool.numEntries;idx++) {
+        ResponseCycleData* cycle = getCycle(worker, idx);
+        if(cycle->response != cycle->responseBuffer) {
+            free(cycle->response);
         }
-        // No need for error check, that will happen later
-    } else {
-        port = htons(config->port);
     }
-    if(config->netProto == CdnsNetProtoInet4) {
-        domain = AF_INET;
-    } else if(config->netProto == CdnsNetProtoInet6) {
-        domain = AF_INET6;
-    } else {
-        return CDNS_ERR_UNDEFINED;
+    destroyPool(&worker->cyclePool);
+}
+// Makes room for at least needed bytes of response, which only TCP and HTTP answers may
+// take beyond the UDP buffer size. The buffer doubles, so a large answer written record by
+// record is copied a few times at most
+static bool growResponse(ResponseCycleData* cycle, int needed) {
+    if(needed <= cycle->responseCapacity) {
+        return true;
     }
-    if(config->proto == CdnsProtoTcp) {
-        type = SOCK_STREAM;
-        protocol = 0;
-        return CDNS_ERR_TCP;
-    } else if(config->proto == CdnsProtoHttp) {
-        type = SOCK_STREAM;
-        protocol = 0;
-        return CDNS_ERR_HTTP;
-    } else if(config->proto == CdnsProtoUdp) {
-        type = SOCK_DGRAM;
-        protocol = 0;
-        sock = socket(domain, type, protocol);
-    } else {
-        return CDNS_ERR_UNDEFINED;
+    if(cycle->connection == -1 || needed > CDNS_STREAM_BUFFER_SIZE) {
+        return false;
     }
-    int flags = fcntl(sock, F_GETFL, 0);
-    if(flags == -1) return CDNS_ERR_UNDEFINED;
-    flags |= O_NONBLOCK;
-    if(fcntl(sock, F_SETFL, flags) != 0) {
-        return CDNS_ERR_UNDEFINED;
+    int capacity = cycle->responseCapacity * 2 > needed ? cycle->responseCapacity * 2 : needed;
+    capacity = capacity < CDNS_STREAM_BUFFER_SIZE ? capacity : CDNS_STREAM_BUFFER_SIZE;
+    unsigned char* response = cycle->response != cycle->responseBuffer ? realloc(cycle->response, capacity)
+                                                                       : malloc(capacity);
+    if(response == NULL) {
+        return false;
     }
-    if(config->netProto == CdnsNetProtoInet4) {
-        struct sockaddr_in addr = {
-            .sin_family = AF_INET,
-            .sin_port = port,
-            .sin_addr = *((u_int32_t*)config->addr),
-            .sin_zero = 0,
-        };
-        int err = bind(sock, (struct sockaddr*)&addr, sizeof(struct sockaddr_in));
-        if(err != 0) {
-            return CDNS_ERR_UNDEFINED;
-        }
-    } else {
-        struct sockaddr_in6 addr = {
-            .sin6_family = AF_INET,
-            .sin6_port = port,
-        };
-        memcpy((void*)&addr.sin6_addr, config->addr, 16);
-        int err = bind(sock, (struct sockaddr*)&addr, sizeof(struct sockaddr_in));
-        if(err != 0) {
-            return CDNS_ERR_UNDEFINED;
-        }
+    if(cycle->response == cycle->responseBuffer) {
+        memcpy(response, cycle->responseBuffer, CDNS_UDP_BUFFER_SIZE);
     }
-    out->config = *config;
-    out->isOpen = true;
-    out->socket = sock;
-    return 0;
+    cycle->response = response;
+    cycle->responseCapacity = capacity;
+    return true;
 }
-int cdnsCreateDns(CdnsState **out, const CdnsConfig *config) {
-    DnsState* state = (DnsState*)malloc(sizeof(DnsState));
-    if(state == 0) {
-        return CDNS_ERR_MEM;
-    }
-    if(config->threadRequests != 0) {
-        state->threadRequests = config->threadRequests;
-    } else {
-        state->threadRequests = DEFAULT_THREAD_REQUESTS;
+static OutgoingRequestTrackingData* getRequest(DnsWorker* worker, size_t idx) {
+    return (OutgoingRequestTrackingData*)poolEntry(&worker->requestPool, (u_int32_t)idx);
+}
+// Puts a request back on its inline reply buffers, freeing those of a large TCP reply
+static void releaseReply(OutgoingRequestTrackingData* req) {
+    if(req->response != req->responseBuffer) {
+        free(req->responseEntries);
     }
-    state->threadOutgoingRequests = config->threadOutgoingRequests;
-    if(config->resendDelayMs != 0) {
-        state->resendDelay = config->resendDelayMs;
-    } else {
-        state->resendDelay = DEFAULT_RESEND_DELAY;
+    req->response = req->responseBuffer;
+    req->responseEntries = req->responseEntriesBuffer;
+    req->responseCapacity = CDNS_UDP_BUFFER_SIZE;
+}
+// Makes room in a request for a reply of length bytes and the entries indexing it. The
+// previous reply, if any, is dropped
+static bool reserveReply(OutgoingRequestTrackingData* req, int length) {
+    if(length <= req->responseCapacity) {
+        return true;
     }
-    if(config->maxResendCount != 0) {
-        state->maxResendCount = config->maxResendCount;
-    } else {
-        state->maxResendCount = DEFAULT_RESEND_ATTEMPTS;
+    size_t entries = CDNS_MAX_ENTRIES(length);
+    void** block = (void**)malloc(entries * sizeof(void*) + length);
+    if(block == NULL) {
+        return false;
     }
-    state->numThreads = 1;
-    state->maxThreads = 1;
-    memset(&state->callback, 0, sizeof(CdnsCallbackDescriptor));
-    state->listening = false;
-    state->paused = true;
-    memset(&state->connections, 0, sizeof(DnsConnections));
+    releaseReply(req);
+    req->responseEntries = block;
+    req->response = (unsigned char*)(block + entries);
+    req->responseCapacity = length;
+    return true;
+}
+static void freeRequest(DnsWorker* worker, u_int32_t idx) {
+    releaseReply(getRequest(worker, idx));
+    freePoolEntry(&worker->requestPool, idx);
+}
+static ResponseCycleData* writerCycle(ResponseWriteInfo* writer) {
+    return (ResponseCycleData*)((char*)writer - offsetof(ResponseCycleData, writer));
+}
 
-    memset(state->requestMakers, 0, sizeof(DnsState) * 6); // Set these all to be uncreated
+static void readHeader(const unsigned char* wire, CdnsPacketHeader* out) {
+    out->id = (u_int16_t)(wire[0] << 8 | wire[1]);
+    out->qr = wire[2] >> 7;
+    out->opcode = (wire[2] >> 3) & 0xF;
+    out->aa = (wire[2] >> 2) & 1;
+    out->tc = (wire[2] >> 1) & 1;
+    out->rd = wire[2] & 1;
+    out->ra = wire[3] >> 7;
+    out->z = (wire[3] >> 4) & 7;
+    out->rcode = wire[3] & 0xF;
+    out->qdcount = (u_int16_t)(wire[4] << 8 | wire[5]);
+    out->ancount = (u_int16_t)(wire[6] << 8 | wire[7]);
+    out->nscount = (u_int16_t)(wire[8] << 8 | wire[9]);
+    out->arcount = (u_int16_t)(wire[10] << 8 | wire[11]);
+}
+static void writeHeader(const CdnsPacketHeader* header, unsigned char* wire) {
+    wire[0] = header->id >> 8;
+    wire[1] = header->id & 0xFF;
+    wire[2] = header->qr << 7 | header->opcode << 3 | header->aa << 2 | header->tc << 1 | header->rd;
+    wire[3] = header->ra << 7 | header->z << 4 | header->rcode;
+    wire[4] = header->qdcount >> 8;
+    wire[5] = header->qdcount & 0xFF;
+    wire[6] = header->ancount >> 8;
+    wire[7] = header->ancount & 0xFF;
+    wire[8] = header->nscount >> 8;
+    wire[9] = header->nscount & 0xFF;
+    wire[10] = header->arcount >> 8;
+    wire[11] = header->arcount & 0xFF;
+}
 
-    createCollection(&state->reqDataCollection, sizeof(OutgoingRequestTrackingData), state->threadOutgoingRequests * state->maxThreads);
-    ReusableDataCollection resDataCollection = {};
-    state->resDataCollection = resDataCollection;
+// Packet parsing. Packets are indexed in place: the index is an array of pointers to the
+// start of each question and record, filled in by a single pass that also validates every
+// length and compression pointer, so that reading names later never has to check anything.
 
-    state->numListeners = config->numListeners;
-    state->listeners = (DnsListener*)malloc(config->numListeners * sizeof(DnsListener));
-    if(state->listeners == NULL) {
-        return CDNS_ERR_MEM;
+static u_int16_t readU16(const unsigned char* wire) {
+    return (u_int16_t)(wire[0] << 8 | wire[1]);
+}
+static u_int32_t readU32(const unsigned char* wire) {
+    return (u_int32_t)wire[0] << 24 | (u_int32_t)wire[1] << 16 | (u_int32_t)wire[2] << 8 | wire[3];
+}
+// Validates the name starting at pos and returns the offset just past it, or -1. suffix
+// holds, for every label start seen so far, the uncompressed length from there to the end
+// of its name, and zero everywhere else. Compression pointers must lead to such a label
+// start, which means they always point backwards and can never loop
+static int scanName(const unsigned char* packet, int length, int pos, unsigned char* suffix) {
+    int labels[CDNS_MAX_NAME_LENGTH / 2];
+    int numLabels = 0;
+    int total = 0;
+    int tail;
+    int end;
+    while(true) {
+        if(pos >= length) {
+            return -1;
+        }
+        int len = packet[pos];
+        if(len == 0) {
+            tail = 1;
+            end = pos + 1;
+            break;
+        }
+        if((len & 0xC0) == 0xC0) {
+            if(pos + 1 >= length) {
+                return -1;
+            }
+            int target = (len & 0x3F) << 8 | packet[pos + 1];
+            if(target >= length || suffix[target] == 0) {
+                return -1;
+            }
+            tail = suffix[target];
+            end = pos + 2;
+            break;
+        }
+        // 0x40 and 0x80 are obsolete/reserved label types
+        if(len & 0xC0) {
+            return -1;
+        }
+        total += len + 1;
+        if(total >= CDNS_MAX_NAME_LENGTH) {
+            return -1;
+        }
+        labels[numLabels++] = pos;
+        pos += len + 1;
     }
-    for(int i = 0;i < config->numListeners;i++) {
-        int err = makeListener(&config->listeners[i], &state->listeners[i]);
-        if(err != 0) {
-            return err;
+    if(total + tail > CDNS_MAX_NAME_LENGTH) {
+        return -1;
+    }
+    int remaining = total + tail;
+    for(int i = 0;i < numLabels;i++) {
+        suffix[labels[i]] = remaining;
+        remaining -= packet[labels[i]] + 1;
+    }
+    return end;
+}
+// Offset just past a name that was already validated by scanName
+static int skipName(const unsigned char* packet, int pos) {
+    while(packet[pos] != 0) {
+        if((packet[pos] & 0xC0) == 0xC0) {
+            return pos + 2;
         }
+        pos += packet[pos] + 1;
     }
-
-    *out = (CdnsState*)state;
-    
-    return 0;
+    return pos + 1;
 }
-int cdnsDestroyDns(CdnsState *_state) {
-    DnsState* state = (DnsState*)_state;
-    if(state->listening) {
+// Validates the names inside the RDATA of the types RFC 3597 allows compression in
+static bool scanRdata(const unsigned char* packet, int length, int type, int pos, int end, unsigned char* suffix) {
+    switch(type) {
+    case CDNS_RR_NS:
+    case CDNS_RR_CNAME:
+    case CDNS_RR_PTR:
+        return scanName(packet, end, pos, suffix) == end;
+    case CDNS_RR_MX:
+        return pos + 2 < end && scanName(packet, end, pos + 2, suffix) == end;
+    case CDNS_RR_SOA:
+        pos = scanName(packet, end, pos, suffix);
+        if(pos == -1) return false;
+        pos = scanName(packet, end, pos, suffix);
+        return pos != -1 && pos + 20 == end;
+    default:
+        return true;
+    }
+}
+// Indexes a packet whose header was already decoded. entries needs room for every question
+// and record
+static int indexPacket(const unsigned char* packet, int length, CdnsPacketHeader* header, CdnsPacketReadInfo* out,
+                       void** entries, int capacity) {
+    int numQuestions = header->qdcount;
+    int numRecords = header->ancount + header->nscount + header->arcount;
+    if(length < CDNS_HEADER_SIZE || numQuestions + numRecords > capacity ||
+       numQuestions + numRecords > CDNS_MAX_ENTRIES(length)) {
+        return CDNS_ERR_MALFORMED;
+    }
+    unsigned char suffix[length];
+    memset(suffix, 0, length);
+    int pos = CDNS_HEADER_SIZE;
+    for(int i = 0;i < numQuestions;i++) {
+        entries[i] = (void*)(packet + pos);
+        pos = scanName(packet, length, pos, suffix);
+        if(pos == -1 || pos + 4 > length) {
+            return CDNS_ERR_MALFORMED;
+        }
+        pos += 4;
+    }
+    for(int i = 0;i < numRecords;i++) {
+        entries[numQuestions + i] = (void*)(packet + pos);
+        pos = scanName(packet, length, pos, suffix);
+        if(pos == -1 || pos + 10 > length) {
+            return CDNS_ERR_MALFORMED;
+        }
+        int type = readU16(packet + pos);
+        int rdlength = readU16(packet + pos + 8);
+        pos += 10;
+        if(pos + rdlength > length || !scanRdata(packet, length, type, pos, pos + rdlength, suffix)) {
+            return CDNS_ERR_MALFORMED;
+        }
+        pos += rdlength;
+    }
+    out->numRecords = numRecords;
+    out->blobSize = length - CDNS_HEADER_SIZE;
+    out->header = header;
+    out->blob = (void*)(packet + CDNS_HEADER_SIZE);
+    out->questions = (CdnsQuestion**)entries;
+    out->records = entries + numQuestions;
+    return 0;
+}
+int cdnsParsePacket(const void *packet, int length, CdnsPacketReadInfo *out, CdnsPacketHeader *header, void **entries,
+                    int capacity) {
+    if(length < CDNS_HEADER_SIZE) {
+        return CDNS_ERR_MALFORMED;
+    }
+    readHeader(packet, header);
+    return indexPacket(packet, length, header, out, entries, capacity);
+}
+static const unsigned char* packetStart(const CdnsPacketReadInfo* info) {
+    return (const unsigned char*)info->blob - CDNS_HEADER_SIZE;
+}
+int cdnsReadName(const CdnsPacketReadInfo *info, const void *name, unsigned char *out, int capacity, int *length) {
+    const unsigned char* packet = packetStart(info);
+    const unsigned char* pos = name;
+    int written = 0;
+    while(true) {
+        int len = *pos;
+        if((len & 0xC0) == 0xC0) {
+            pos = packet + ((len & 0x3F) << 8 | pos[1]);
+            continue;
+        }
+        if(written + len + 1 > capacity) {
+            return CDNS_ERR_TOO_LARGE;
+        }
+        memcpy(out + written, pos, len + 1);
+        written += len + 1;
+        if(len == 0) {
+            break;
+        }
+        pos += len + 1;
+    }
+    *length = written;
+    return 0;
+}
+int cdnsGetQuestion(const CdnsPacketReadInfo *info, u_int32_t index, CdnsQuestion *out) {
+    if(index >= info->header->qdcount) {
+        return CDNS_ERR_UNDEFINED;
+    }
+    const unsigned char* packet = packetStart(info);
+    const unsigned char* fixed = packet + skipName(packet, (const unsigned char*)info->questions[index] - packet);
+    out->qtype = readU16(fixed);
+    out->qclass = readU16(fixed + 2);
+    return 0;
+}
+int cdnsGetRecord(const CdnsPacketReadInfo *info, u_int32_t index, CdnsResourceRecordInfo *out, const void **rdata) {
+    if(index >= info->numRecords) {
+        return CDNS_ERR_UNDEFINED;
+    }
+    const unsigned char* packet = packetStart(info);
+    const unsigned char* fixed = packet + skipName(packet, (const unsigned char*)info->records[index] - packet);
+    out->type = readU16(fixed);
+    out->clas = readU16(fixed + 2);
+    out->ttl = readU32(fixed + 4);
+    out->rdlength = readU16(fixed + 8);
+    if(rdata != NULL) {
+        *rdata = fixed + 10;
+    }
+    return 0;
+}
+int cdnsGetEdns(const CdnsPacketReadInfo *info, CdnsEdns *out) {
+    // The OPT record is normally the last one, or just before a TSIG
+    for(u_int32_t i = info->numRecords;i > info->numRecords - info->header->arcount;i--) {
+        CdnsResourceRecordInfo record;
+        int err = cdnsGetRecord(info, i - 1, &record, NULL);
+        if(err != 0) {
+            return err;
+        }
+        if(record.type == CDNS_RR_OPT_TYPE) {
+            // The class is the payload size and the TTL holds the rest
+            out->udpSize = record.clas;
+            out->extendedRcode = record.ttl >> 24;
+            out->version = (record.ttl >> 16) & 0xFF;
+            out->dnssecOk = (record.ttl >> 15) & 1;
+            return 0;
+        }
+    }
+    return CDNS_ERR_UNDEFINED;
+}
+
+// Packet writing. Names are compressed against a table of where earlier names start in
+// the packet. Every label start written gets an entry with a case-insensitive hash of the
+// name from there to its end, so the longest suffix already present is found by comparing
+// hashes, with the bytes only compared when they match. Everything lives in the packet
+// buffer and the table, nothing is allocated.
+
+static void writeU16(unsigned char* wire, u_int16_t value) {
+    wire[0] = value >> 8;
+    wire[1] = value & 0xFF;
+}
+static void writeU32(unsigned char* wire, u_int32_t value) {
+    writeU16(wire, value >> 16);
+    writeU16(wire + 2, value & 0xFFFF);
+}
+static char lowerAscii(unsigned char c) {
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+// Finds the labels of an uncompressed name no longer than limit, and hashes every suffix.
+// starts[numLabels] is the offset of the final zero byte. Returns the number of labels,
+// or -1 if the name is malformed
+static int nameSuffixes(const unsigned char* name, int limit, int* starts, u_int32_t* hashes) {
+    int numLabels = 0;
+    int pos = 0;
+    while(true) {
+        if(pos >= limit || pos >= CDNS_MAX_NAME_LENGTH) {
+            return -1;
+        }
+        int len = name[pos];
+        starts[numLabels] = pos;
+        if(len == 0) {
+            break;
+        }
+        if(len > 63) {
+            return -1;
+        }
+        numLabels++;
+        pos += 1 + len;
+    }
+    u_int32_t hash = 2166136261u;
+    for(int i = numLabels - 1;i >= 0;i--) {
+        const unsigned char* label = name + starts[i];
+        hash = (hash ^ label[0]) * 16777619u;
+        for(int j = 1;j <= label[0];j++) {
+            hash = (hash ^ (unsigned char)lowerAscii(label[j])) * 16777619u;
+        }
+        hashes[i] = hash;
+    }
+    return numLabels;
+}
+// Whether the possibly compressed name at offset, which this writer put there, equals the
+// uncompressed name, ignoring case
+static bool nameAt(const unsigned char* packet, int offset, const unsigned char* name) {
+    while(true) {
+        int len = packet[offset];
+        if((len & 0xC0) == 0xC0) {
+            offset = (len & 0x3F) << 8 | packet[offset + 1];
+            continue;
+        }
+        if(len != name[0]) {
+            return false;
+        }
+        if(len == 0) {
+            return true;
+        }
+        if(!nameKernels()->nameEqual(packet + offset + 1, name + 1, len)) {
+            return false;
+        }
+        offset += 1 + len;
+        name += 1 + len;
+    }
+}
+#define NAME_SLOTS (2 * CDNS_COMPRESSION_NAMES)
+// The entry for a suffix of name, or -1
+static int findName(const unsigned char* packet, const CdnsNameTable* names, u_int32_t hash,
+                    const unsigned char* name) {
+    for(u_int32_t slot = hash & (NAME_SLOTS - 1);names->slots[slot] != 0;slot = (slot + 1) & (NAME_SLOTS - 1)) {
+        int entry = names->slots[slot] - 1;
+        if(names->hashes[entry] == hash && nameAt(packet, names->offsets[entry], name)) {
+            return entry;
+        }
+    }
+    return -1;
+}
+static void insertName(CdnsNameTable* names, int offset, u_int32_t hash) {
+    u_int32_t slot = hash & (NAME_SLOTS - 1);
+    while(names->slots[slot] != 0) {
+        slot = (slot + 1) & (NAME_SLOTS - 1);
+    }
+    names->offsets[names->numNames] = offset;
+    names->hashes[names->numNames] = hash;
+    names->slots[slot] = ++names->numNames;
+}
+// Forgets the names added after the first numNames. As entries are never removed
+// otherwise, nothing older can sit behind them in a probe sequence
+static void truncateNames(CdnsNameTable* names, int numNames) {
+    for(int slot = 0;slot < NAME_SLOTS && names->numNames > numNames;slot++) {
+        if(names->slots[slot] > numNames) {
+            names->slots[slot] = 0;
+        }
+    }
+    names->numNames = numNames;
+}
+// Writes an uncompressed name, of at most limit bytes, at *length. It ends in a pointer to
+// the longest suffix already in the packet, and its new labels go into the table. consumed
+// is set to the name's uncompressed size
+static int writeName(unsigned char* packet, int capacity, int* length, CdnsNameTable* names,
+                     const unsigned char* name, int limit, int* consumed) {
+    int starts[CDNS_MAX_NAME_LENGTH / 2 + 1];
+    u_int32_t hashes[CDNS_MAX_NAME_LENGTH / 2];
+    int numLabels = nameSuffixes(name, limit, starts, hashes);
+    if(numLabels < 0) {
+        return CDNS_ERR_MALFORMED;
+    }
+    int match = numLabels;
+    int target = -1;
+    for(int i = 0;i < numLabels;i++) {
+        int entry = findName(packet, names, hashes[i], name + starts[i]);
+        if(entry != -1) {
+            match = i;
+            target = names->offsets[entry];
+            break;
+        }
+    }
+    int size = starts[match] + (target != -1 ? 2 : 1);
+    if(*length + size > capacity) {
+        return CDNS_ERR_TOO_LARGE;
+    }
+    memcpy(packet + *length, name, starts[match]);
+    for(int i = 0;i < match && names->numNames < CDNS_COMPRESSION_NAMES;i++) {
+        // Pointers only have 14 bits
+        if(*length + starts[i] < 0x4000) {
+            insertName(names, *length + starts[i], hashes[i]);
+        }
+    }
+    if(target != -1) {
+        writeU16(packet + *length + starts[match], 0xC000 | target);
+    } else {
+        packet[*length + starts[match]] = 0;
+    }
+    *length += size;
+    *consumed = starts[numLabels] + 1;
+    return 0;
+}
+static int addQuestion(unsigned char* packet, int capacity, int* length, CdnsNameTable* names,
+                       CdnsPacketHeader* header, const void* name, u_int16_t type, u_int16_t clas) {
+    if(names->section != 0) {
+        return CDNS_ERR_SECTION_ORDER;
+    }
+    int start = *length;
+    int numNames = names->numNames;
+    int consumed;
+    int err = writeName(packet, capacity, length, names, name, CDNS_MAX_NAME_LENGTH, &consumed);
+    if(err == 0 && *length + 4 > capacity) {
+        err = CDNS_ERR_TOO_LARGE;
+    }
+    if(err != 0) {
+        *length = start;
+        truncateNames(names, numNames);
+        return err;
+    }
+    writeU16(packet + *length, type);
+    writeU16(packet + *length + 2, clas);
+    *length += 4;
+    header->qdcount++;
+    return 0;
+}
+// Writes rdata, compressing the names in it for the types RFC 3597 allows that for
+static int writeRdata(unsigned char* packet, int capacity, int* length, CdnsNameTable* names,
+                      u_int16_t type, const unsigned char* rdata, int rdlength) {
+    // Bytes before the first name, the number of names, and fixed bytes after them
+    int before = 0;
+    int numNames = 0;
+    int after = 0;
+    switch(type) {
+    case CDNS_RR_NS:
+    case CDNS_RR_CNAME:
+    case CDNS_RR_PTR:
+        numNames = 1;
+        break;
+    case CDNS_RR_MX:
+        before = 2;
+        numNames = 1;
+        break;
+    case CDNS_RR_SOA:
+        numNames = 2;
+        after = 20;
+        break;
+    default:
+        break;
+    }
+    if(numNames == 0) {
+        if(*length + rdlength > capacity) {
+            return CDNS_ERR_TOO_LARGE;
+        }
+        memcpy(packet + *length, rdata, rdlength);
+        *length += rdlength;
+        return 0;
+    }
+    if(rdlength < before + after || *length + before > capacity) {
+        return rdlength < before + after ? CDNS_ERR_MALFORMED : CDNS_ERR_TOO_LARGE;
+    }
+    memcpy(packet + *length, rdata, before);
+    *length += before;
+    int pos = before;
+    for(int i = 0;i < numNames;i++) {
+        int consumed;
+        int err = writeName(packet, capacity, length, names, rdata + pos, rdlength - after - pos, &consumed);
+        if(err != 0) {
+            return err;
+        }
+        pos += consumed;
+    }
+    if(pos + after != rdlength) {
+        return CDNS_ERR_MALFORMED;
+    }
+    if(*length + after > capacity) {
+        return CDNS_ERR_TOO_LARGE;
+    }
+    memcpy(packet + *length, rdata + pos, after);
+    *length += after;
+    return 0;
+}
+static int addRecord(unsigned char* packet, int capacity, int* length, CdnsNameTable* names,
+                     CdnsPacketHeader* header, CdnsSection section, const void* name,
+                     const CdnsResourceRecordInfo* info, const void* rdata) {
+    if((int)section < 0 || section > CdnsSectionAdditional) {
+        return CDNS_ERR_UNDEFINED;
+    }
+    if((int)section + 1 < names->section) {
+        return CDNS_ERR_SECTION_ORDER;
+    }
+    int start = *length;
+    int numNames = names->numNames;
+    int consumed;
+    int err = writeName(packet, capacity, length, names, name, CDNS_MAX_NAME_LENGTH, &consumed);
+    if(err == 0 && *length + 10 > capacity) {
+        err = CDNS_ERR_TOO_LARGE;
+    }
+    int fixed = *length;
+    if(err == 0) {
+        *length += 10;
+        err = writeRdata(packet, capacity, length, names, info->type, rdata, info->rdlength);
+    }
+    if(err != 0) {
+        *length = start;
+        truncateNames(names, numNames);
+        return err;
+    }
+    writeU16(packet + fixed, info->type);
+    writeU16(packet + fixed + 2, info->clas);
+    writeU32(packet + fixed + 4, info->ttl);
+    writeU16(packet + fixed + 8, *length - fixed - 10);
+    if(section == CdnsSectionAnswer) {
+        header->ancount++;
+    } else if(section == CdnsSectionAuthority) {
+        header->nscount++;
+    } else {
+        header->arcount++;
+    }
+    names->section = (int)section + 1;
+    return 0;
+}
+int cdnsInitPacketBuilder(CdnsPacketBuilder *builder, void *buffer, int capacity) {
+    if(capacity < CDNS_HEADER_SIZE) {
+        return CDNS_ERR_TOO_LARGE;
+    }
+    memset(builder, 0, sizeof(CdnsPacketBuilder));
+    builder->buffer = (unsigned char*)buffer;
+    builder->capacity = capacity;
+    builder->length = CDNS_HEADER_SIZE;
+    return 0;
+}
+int cdnsBuildQuestion(CdnsPacketBuilder *builder, const void *name, u_int16_t type, u_int16_t clas) {
+    return addQuestion(builder->buffer, builder->capacity, &builder->length, &builder->names, &builder->header,
+                       name, type, clas);
+}
+int cdnsBuildRecord(CdnsPacketBuilder *builder, CdnsSection section, const void *name,
+                    const CdnsResourceRecordInfo *info, const void *rdata) {
+    return addRecord(builder->buffer, builder->capacity, &builder->length, &builder->names, &builder->header,
+                     section, name, info, rdata);
+}
+int cdnsFinishPacket(CdnsPacketBuilder *builder, int *length) {
+    writeHeader(&builder->header, builder->buffer);
+    *length = builder->length;
+    return 0;
+}
+// Offset just past the name at pos, or -1 if it runs past length. Unlike skipName the name
+// may be anything a callback wrote
+static int skipNameChecked(const unsigned char* packet, int length, int pos) {
+    while(pos < length) {
+        int len = packet[pos];
+        if((len & 0xC0) == 0xC0) {
+            return pos + 2 <= length ? pos + 2 : -1;
+        }
+        if(len & 0xC0) {
+            return -1;
+        }
+        if(len == 0) {
+            return pos + 1;
+        }
+        pos += len + 1;
+    }
+    return -1;
+}
+// Offset of the type of the OPT record among a message's additional records, or -1 if it
+// has none or its records don't add up
+static int findOpt(const unsigned char* packet, int length, const CdnsPacketHeader* header) {
+    int pos = CDNS_HEADER_SIZE;
+    for(int i = 0;i < header->qdcount;i++) {
+        pos = skipNameChecked(packet, length, pos);
+        if(pos == -1 || pos + 4 > length) {
+            return -1;
+        }
+        pos += 4;
+    }
+    for(int i = 0;i < header->ancount + header->nscount + header->arcount;i++) {
+        pos = skipNameChecked(packet, length, pos);
+        if(pos == -1 || pos + 10 > length) {
+            return -1;
+        }
+        if(i >= header->ancount + header->nscount && readU16(packet + pos) == CDNS_RR_OPT_TYPE) {
+            return pos;
+        }
+        pos += 10 + readU16(packet + pos + 8);
+    }
+    return -1;
+}
+// Reads what the type, class and TTL of an OPT record hold
+static void readOptFields(const unsigned char* fixed, CdnsEdns* out) {
+    out->udpSize = readU16(fixed + 2);
+    out->extendedRcode = fixed[4];
+    out->version = fixed[5];
+    out->dnssecOk = fixed[6] >> 7;
+}
+// Writes the type, class and TTL of an OPT record
+static void writeOptFields(unsigned char* fixed, const CdnsEdns* edns) {
+    writeU16(fixed, CDNS_RR_OPT_TYPE);
+    writeU16(fixed + 2, edns->udpSize);
+    writeU32(fixed + 4, (u_int32_t)edns->extendedRcode << 24 | (u_int32_t)edns->version << 16 |
+                        (u_int32_t)edns->dnssecOk << 15);
+}
+// Moves the compression pointers of a message that lead past the size bytes cut out at cut
+// back by size, or only checks them if apply is false. The record at cut is skipped. Returns
+// false if a pointer leads into the cut. The message's records were already checked to add up
+static bool shiftPointers(unsigned char* packet, int end, const CdnsPacketHeader* header, int cut, int size,
+                          bool apply) {
+    int numRecords = header->ancount + header->nscount + header->arcount;
+    int pos = CDNS_HEADER_SIZE;
+    for(int i = 0;i < header->qdcount + numRecords;i++) {
+        int names[3] = {pos, -1, -1};
+        int fixed = skipNameChecked(packet, end, pos);
+        if(i < header->qdcount) {
+            pos = fixed + 4;
+        } else {
+            int rdata = fixed + 10;
+            pos = rdata + readU16(packet + fixed + 8);
+            switch(readU16(packet + fixed)) {
+            case CDNS_RR_NS:
+            case CDNS_RR_CNAME:
+            case CDNS_RR_PTR:
+                names[1] = rdata;
+                break;
+            case CDNS_RR_MX:
+                names[1] = rdata + 2;
+                break;
+            case CDNS_RR_SOA:
+                names[1] = rdata;
+                names[2] = skipNameChecked(packet, pos, rdata);
+                break;
+            }
+        }
+        if(names[0] == cut) {
+            continue;
+        }
+        for(int j = 0;j < 3;j++) {
+            // Names a callback wrote that run past their record hold nothing to move
+            if(names[j] == -1 || skipNameChecked(packet, pos, names[j]) == -1) {
+                continue;
+            }
+            int label = names[j];
+            while(packet[label] != 0 && (packet[label] & 0xC0) != 0xC0) {
+                label += packet[label] + 1;
+            }
+            if(packet[label] == 0) {
+                continue;
+            }
+            int target = readU16(packet + label) & 0x3FFF;
+            if(target >= cut && target < cut + size) {
+                return false;
+            }
+            if(target >= cut + size && apply) {
+                writeU16(packet + label, 0xC000 | (target - size));
+            }
+        }
+    }
+    return true;
+}
+// Fits a message into limit bytes with edns as its OPT record, or without one if edns is
+// NULL. An OPT record already there is rewritten in place, or cut out with the compression
+// pointers past it moved back. Additional records that don't fit are left out, and if more
+// doesn't fit only the questions are kept, with TC set. Returns false, leaving the message
+// alone, if its counts don't match its records or a compression pointer leads into an OPT
+// record that has to go
+static bool fitMessage(unsigned char* packet, int* length, CdnsPacketHeader* header, int limit, const CdnsEdns* edns) {
+    int end = *length;
+    int pos = CDNS_HEADER_SIZE;
+    for(int i = 0;i < header->qdcount;i++) {
+        pos = skipNameChecked(packet, end, pos);
+        if(pos == -1 || pos + 4 > end) {
+            return false;
+        }
+        pos += 4;
+    }
+    int questionsEnd = pos;
+    int numRecords = header->ancount + header->nscount + header->arcount;
+    int ends[CDNS_MAX_ENTRIES(CDNS_STREAM_BUFFER_SIZE)];
+    if(numRecords > CDNS_MAX_ENTRIES(end)) {
+        return false;
+    }
+    // The offset of the OPT record's type, and which record it is
+    int optFixed = -1;
+    int optIndex = -1;
+    for(int i = 0;i < numRecords;i++) {
+        pos = skipNameChecked(packet, end, pos);
+        if(pos == -1 || pos + 10 > end) {
+            return false;
+        }
+        if(optIndex == -1 && readU16(packet + pos) == CDNS_RR_OPT_TYPE &&
+           i >= header->ancount + header->nscount) {
+            optFixed = pos;
+            optIndex = i;
+        }
+        pos += 10 + readU16(packet + pos + 8);
+        if(pos > end) {
+            return false;
+        }
+        ends[i] = pos;
+    }
+    if(pos != end) {
+        return false;
+    }
+    if(edns == NULL && optIndex != -1) {
+        int cut = optIndex > 0 ? ends[optIndex - 1] : questionsEnd;
+        int size = ends[optIndex] - cut;
+        if(!shiftPointers(packet, end, header, cut, size, false)) {
+            return false;
+        }
+        shiftPointers(packet, end, header, cut, size, true);
+        memmove(packet + cut, packet + cut + size, end - cut - size);
+        for(int i = optIndex;i < numRecords - 1;i++) {
+            ends[i] = ends[i + 1] - size;
+        }
+        numRecords--;
+        end -= size;
+        optIndex = -1;
+    }
+    // The most records that fit along with the OPT record
+    int kept = numRecords;
+    while(true) {
+        int size = kept > 0 ? ends[kept - 1] : questionsEnd;
+        bool appended = edns != NULL && (optIndex == -1 || optIndex >= kept);
+        if(size + (appended ? OPT_RECORD_SIZE : 0) <= limit || kept == 0) {
+            break;
+        }
+        kept--;
+    }
+    if(kept < header->ancount + header->nscount) {
+        kept = 0;
+        header->tc = 1;
+    }
+    header->ancount = kept < header->ancount ? kept : header->ancount;
+    header->nscount = kept - header->ancount < header->nscount ? kept - header->ancount : header->nscount;
+    header->arcount = kept - header->ancount - header->nscount;
+    *length = kept > 0 ? ends[kept - 1] : questionsEnd;
+    if(edns == NULL) {
+        return true;
+    }
+    if(optIndex != -1 && optIndex < kept) {
+        writeOptFields(packet + optFixed, edns);
+        // Options are dropped when nothing follows them
+        if(optIndex == kept - 1) {
+            writeU16(packet + optFixed + 8, 0);
+            *length = optFixed + 10;
+        }
+    } else if(*length + OPT_RECORD_SIZE <= limit) {
+        packet[*length] = 0;
+        writeOptFields(packet + *length + 1, edns);
+        writeU16(packet + *length + 9, 0);
+        *length += OPT_RECORD_SIZE;
+        header->arcount++;
+    }
+    return true;
+}
+
+// Response cache
+
+/// A cache key, the lowercased uncompressed qname plus the question's type and class and
+/// the DO bit of the OPT record
+typedef struct DnsCacheKey {
+    unsigned char name[CDNS_MAX_NAME_LENGTH];
+    int nameLength;
+    u_int16_t qtype;
+    u_int16_t qclass;
+    bool dnssecOk;
+    u_int64_t hash;
+} DnsCacheKey;
+
+static u_int64_t hashBytes(const unsigned char* data, int length, u_int64_t hash) {
+    // FNV-1a
+    for(int i = 0;i < length;i++) {
+        hash = (hash ^ data[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+// Builds the key for the first question of a packet. Fails for anything but a single
+// question, which is all real resolvers send
+static bool makeCacheKey(const CdnsPacketReadInfo* info, DnsCacheKey* key) {
+    CdnsQuestion question;
+    if(info->header->qdcount != 1 || cdnsGetQuestion(info, 0, &question) != 0 ||
+       cdnsReadName(info, info->questions[0], key->name, sizeof(key->name), &key->nameLength) != 0) {
+        return false;
+    }
+    // Lowercased and hashed in place, in one pass
+    u_int64_t hash;
+    if(nameKernels()->foldName(key->name, sizeof(key->name), key->name, &hash) != key->nameLength) {
+        return false;
+    }
+    key->qtype = question.qtype;
+    key->qclass = question.qclass;
+    // A response echoes the DO bit of its request
+    CdnsEdns edns;
+    key->dnssecOk = cdnsGetEdns(info, &edns) == 0 && edns.dnssecOk;
+    unsigned char typeClassDo[5] = {question.qtype >> 8, question.qtype & 0xFF, question.qclass >> 8,
+                                    question.qclass & 0xFF, key->dnssecOk};
+    key->hash = hashBytes(typeClassDo, 5, hash);
+    return true;
+}
+static unsigned char* cacheEntryName(DnsCacheEntry* entry) {
+    return (unsigned char*)&entry->ttlOffsets[entry->numTtls];
+}
+static unsigned char* cacheEntryPacket(DnsCacheEntry* entry) {
+    return cacheEntryName(entry) + entry->nameLength;
+}
+static size_t cacheEntrySize(const DnsCacheEntry* entry) {
+    return sizeof(DnsCacheEntry) + entry->numTtls * sizeof(u_int16_t) + entry->nameLength + entry->packetLength;
+}
+static int createCache(DnsCache* cache, size_t maxBytes) {
+    memset(cache, 0, sizeof(DnsCache));
+    if(maxBytes == 0) {
+        return 0;
+    }
+    // Roughly one bucket per typical 256 byte entry
+    cache->numBuckets = 64;
+    while(cache->numBuckets < maxBytes / 256) {
+        cache->numBuckets *= 2;
+    }
+    cache->buckets = calloc(cache->numBuckets, sizeof(DnsCacheEntry*));
+    if(cache->buckets == NULL) {
+        return CDNS_ERR_MEM;
+    }
+    cache->maxBytes = maxBytes;
+    return 0;
+}
+static void removeCacheEntry(DnsCache* cache, DnsCacheEntry* entry) {
+    DnsCacheEntry** link = &cache->buckets[entry->hash & (cache->numBuckets - 1)];
+    while(*link != entry) {
+        link = &(*link)->hashNext;
+    }
+    *link = entry->hashNext;
+    if(entry->clockNext == entry) {
+        cache->hand = NULL;
+    } else {
+        entry->clockPrev->clockNext = entry->clockNext;
+        entry->clockNext->clockPrev = entry->clockPrev;
+        if(cache->hand == entry) {
+            cache->hand = entry->clockNext;
+        }
+    }
+    cache->usedBytes -= cacheEntrySize(entry);
+    free(entry);
+}
+static void destroyCache(DnsCache* cache) {
+    while(cache->hand != NULL) {
+        removeCacheEntry(cache, cache->hand);
+    }
+    free(cache->buckets);
+}
+static DnsCacheEntry* findCacheEntry(DnsCache* cache, const DnsCacheKey* key) {
+    DnsCacheEntry* entry = cache->buckets[key->hash & (cache->numBuckets - 1)];
+    while(entry != NULL) {
+        if(entry->hash == key->hash && entry->qtype == key->qtype && entry->qclass == key->qclass &&
+           entry->dnssecOk == key->dnssecOk && entry->nameLength == key->nameLength &&
+           nameKernels()->nameEqual(cacheEntryName(entry), key->name, key->nameLength)) {
+            return entry;
+        }
+        entry = entry->hashNext;
+    }
+    return NULL;
+}
+// Sweeps the CLOCK hand until there is room for the given number of bytes
+static void evictCacheEntries(DnsCache* cache, size_t needed) {
+    while(cache->hand != NULL && cache->usedBytes + needed > cache->maxBytes) {
+        DnsCacheEntry* entry = cache->hand;
+        if(entry->referenced) {
+            entry->referenced = false;
+            cache->hand = entry->clockNext;
+        } else {
+            removeCacheEntry(cache, entry);
+        }
+    }
+}
+// Links a filled in entry into its bucket and the CLOCK list
+static void insertCacheEntry(DnsCache* cache, DnsCacheEntry* entry, size_t size) {
+    size_t bucket = entry->hash & (cache->numBuckets - 1);
+    entry->hashNext = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    // New entries go just behind the hand, so they get a full sweep before being considered
+    if(cache->hand == NULL) {
+        entry->clockNext = entry;
+        entry->clockPrev = entry;
+        cache->hand = entry;
+    } else {
+        entry->clockNext = cache->hand;
+        entry->clockPrev = cache->hand->clockPrev;
+        entry->clockPrev->clockNext = entry;
+        cache->hand->clockPrev = entry;
+    }
+    cache->usedBytes += size;
+}
+// Stores a response packet under the key of its first question
+static int storeCacheEntry(DnsCache* cache, const CdnsPacketReadInfo* info, u_int64_t now) {
+    const CdnsPacketHeader* header = info->header;
+    if(cache->buckets == NULL || header->tc || header->qr == 0 ||
+       (header->rcode != CDNS_RC_NOERROR && header->rcode != CDNS_RC_NAME_ERR)) {
+        return 0;
+    }
+    DnsCacheKey key;
+    if(!makeCacheKey(info, &key)) {
+        return 0;
+    }
+    // The entry lives as long as its shortest TTL. Responses without records are not kept,
+    // as there is no TTL to go by
+    u_int32_t minTtl = UINT32_MAX;
+    int numTtls = 0;
+    // A negative answer lives no longer than the SOA's MINIMUM either, as RFC 2308 asks,
+    // and is not kept without a SOA in the authority section
+    bool negative = header->rcode == CDNS_RC_NAME_ERR || header->ancount == 0;
+    int soa = -1;
+    u_int32_t soaTtl = 0;
+    for(u_int32_t i = 0;i < info->numRecords;i++) {
+        CdnsResourceRecordInfo record;
+        const void* rdata;
+        cdnsGetRecord(info, i, &record, &rdata);
+        if(record.type == CDNS_RR_OPT_TYPE) {
+            continue;
+        }
+        numTtls++;
+        if(record.ttl < minTtl) {
+            minTtl = record.ttl;
+        }
+        if(negative && soa == -1 && record.type == CDNS_RR_SOA && record.rdlength >= 20 &&
+           i >= header->ancount && i < (u_int32_t)header->ancount + header->nscount) {
+            u_int32_t minimum = readU32((const unsigned char*)rdata + record.rdlength - 4);
+            soa = numTtls - 1;
+            soaTtl = record.ttl < minimum ? record.ttl : minimum;
+        }
+    }
+    if(negative) {
+        if(soa == -1) {
+            return 0;
+        }
+        minTtl = soaTtl < minTtl ? soaTtl : minTtl;
+    }
+    if(numTtls == 0 || minTtl == 0) {
+        return 0;
+    }
+    int packetLength = info->blobSize + CDNS_HEADER_SIZE;
+    size_t size = sizeof(DnsCacheEntry) + numTtls * sizeof(u_int16_t) + key.nameLength + packetLength;
+    if(size > cache->maxBytes) {
+        return 0;
+    }
+    DnsCacheEntry* existing = findCacheEntry(cache, &key);
+    if(existing != NULL) {
+        removeCacheEntry(cache, existing);
+    }
+    evictCacheEntries(cache, size);
+    DnsCacheEntry* entry = malloc(size);
+    if(entry == NULL) {
+        return CDNS_ERR_MEM;
+    }
+    cache->stores++;
+    entry->hash = key.hash;
+    entry->storedAt = now;
+    entry->expiresAt = now + (u_int64_t)minTtl * 1000;
+    entry->referenced = false;
+    entry->qtype = key.qtype;
+    entry->qclass = key.qclass;
+    entry->dnssecOk = key.dnssecOk;
+    entry->nameLength = key.nameLength;
+    entry->packetLength = packetLength;
+    entry->numTtls = numTtls;
+    const unsigned char* packet = (const unsigned char*)info->blob - CDNS_HEADER_SIZE;
+    int ttl = 0;
+    for(u_int32_t i = 0;i < info->numRecords;i++) {
+        CdnsResourceRecordInfo record;
+        const void* rdata;
+        cdnsGetRecord(info, i, &record, &rdata);
+        if(record.type != CDNS_RR_OPT_TYPE) {
+            // The TTL sits 6 bytes before the RDATA
+            entry->ttlOffsets[ttl++] = (const unsigned char*)rdata - packet - 6;
+        }
+    }
+    memcpy(cacheEntryName(entry), key.name, key.nameLength);
+    memcpy(cacheEntryPacket(entry), packet, packetLength);
+    if(soa != -1) {
+        // So that clients hold on to it no longer than the cache does
+        writeU32(cacheEntryPacket(entry) + entry->ttlOffsets[soa], soaTtl);
+    }
+    insertCacheEntry(cache, entry, size);
+    return 0;
+}
+static size_t snapshotEntrySize(int numTtls, int nameLength, int packetLength) {
+    size_t size = sizeof(DnsSnapshotEntry) + numTtls * sizeof(u_int16_t) + nameLength + packetLength;
+    return (size + 7) & ~(size_t)7;
+}
+static const unsigned char* snapshotEntryName(const DnsSnapshotEntry* entry) {
+    return (const unsigned char*)&entry->ttlOffsets[entry->numTtls];
+}
+static const unsigned char* snapshotEntryPacket(const DnsSnapshotEntry* entry) {
+    return snapshotEntryName(entry) + entry->nameLength;
+}
+static u_int32_t snapshotEntryChecksum(const DnsSnapshotEntry* entry) {
+    size_t skipped = offsetof(DnsSnapshotEntry, hash);
+    return (u_int32_t)hashBytes((const unsigned char*)entry + skipped, entry->length - skipped, 0xcbf29ce484222325ull);
+}
+// Entry at an offset into the entries of a snapshot, or NULL if it runs past them or its
+// fields do not fit together. Only ever called on entries about to be used
+static const DnsSnapshotEntry* snapshotEntryAt(const unsigned char* entries, u_int64_t length, u_int64_t offset) {
+    if(offset % 8 != 0 || offset > length || length - offset < sizeof(DnsSnapshotEntry)) {
+        return NULL;
+    }
+    const DnsSnapshotEntry* entry = (const DnsSnapshotEntry*)(entries + offset);
+    if(entry->length % 8 != 0 || entry->length > length - offset || entry->nameLength == 0 ||
+       entry->nameLength > CDNS_MAX_NAME_LENGTH || entry->packetLength < CDNS_HEADER_SIZE ||
+       entry->expiresAt <= entry->storedAt ||
+       snapshotEntrySize(entry->numTtls, entry->nameLength, entry->packetLength) > entry->length ||
+       snapshotEntryChecksum(entry) != entry->checksum) {
+        return NULL;
+    }
+    for(int i = 0;i < entry->numTtls;i++) {
+        if(entry->ttlOffsets[i] > entry->packetLength - 4) {
+            return NULL;
+        }
+    }
+    return entry;
+}
+static bool snapshotEntryMatches(const DnsSnapshotEntry* entry, u_int64_t hash, u_int16_t qtype, u_int16_t qclass,
+                                 bool dnssecOk, const unsigned char* name, int nameLength) {
+    return entry->hash == hash && entry->qtype == qtype && entry->qclass == qclass && entry->dnssecOk == dnssecOk &&
+           entry->nameLength == nameLength && nameKernels()->nameEqual(snapshotEntryName(entry), name, nameLength);
+}
+static const DnsSnapshotEntry* findSnapshotEntry(const DnsSnapshot* snapshot, const DnsCacheKey* key) {
+    u_int32_t tag = (u_int32_t)(key->hash >> 32);
+    for(u_int32_t pos = (u_int32_t)key->hash & snapshot->mask, probes = 0;probes <= snapshot->mask;
+        pos = (pos + 1) & snapshot->mask, probes++) {
+        const DnsSnapshotSlot* slot = &snapshot->table[pos];
+        if(slot->entry == 0) {
+            return NULL;
+        }
+        if(slot->tag != tag) {
+            continue;
+        }
+        const DnsSnapshotEntry* entry = snapshotEntryAt(snapshot->entries, snapshot->entriesLength,
+                                                        (u_int64_t)(slot->entry - 1) * 8);
+        if(entry != NULL &&
+           snapshotEntryMatches(entry, key->hash, key->qtype, key->qclass, key->dnssecOk, key->name, key->nameLength)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+// Copies the snapshot's entry for a key into the cache if it is still fresh, as though it
+// had been stored now with TTLs reduced by the time since it really was
+static DnsCacheEntry* restoreCacheEntry(DnsCache* cache, const DnsCacheKey* key, u_int64_t now) {
+    const DnsSnapshot* snapshot = cache->snapshot;
+    u_int64_t wallNow = now + snapshot->wallOffset;
+    if(wallNow >= snapshot->expiresAt) {
+        return NULL;
+    }
+    const DnsSnapshotEntry* saved = findSnapshotEntry(snapshot, key);
+    if(saved == NULL || saved->expiresAt <= wallNow) {
+        return NULL;
+    }
+    size_t size = sizeof(DnsCacheEntry) + saved->numTtls * sizeof(u_int16_t) + saved->nameLength + saved->packetLength;
+    if(size > cache->maxBytes) {
+        return NULL;
+    }
+    evictCacheEntries(cache, size);
+    DnsCacheEntry* entry = malloc(size);
+    if(entry == NULL) {
+        return NULL;
+    }
+    cache->stores++;
+    cache->restored++;
+    entry->hash = key->hash;
+    entry->storedAt = now;
+    entry->expiresAt = now + (saved->expiresAt - wallNow);
+    entry->referenced = false;
+    entry->qtype = saved->qtype;
+    entry->qclass = saved->qclass;
+    entry->dnssecOk = saved->dnssecOk;
+    entry->nameLength = saved->nameLength;
+    entry->packetLength = saved->packetLength;
+    entry->numTtls = saved->numTtls;
+    memcpy(entry->ttlOffsets, saved->ttlOffsets, saved->numTtls * sizeof(u_int16_t));
+    memcpy(cacheEntryName(entry), snapshotEntryName(saved), saved->nameLength);
+    unsigned char* packet = cacheEntryPacket(entry);
+    memcpy(packet, snapshotEntryPacket(saved), saved->packetLength);
+    // A clock stepped back since the save only means the TTLs are not reduced
+    u_int32_t elapsed = wallNow > saved->storedAt ? (wallNow - saved->storedAt) / 1000 : 0;
+    for(int i = 0;i < entry->numTtls;i++) {
+        unsigned char* field = packet + entry->ttlOffsets[i];
+        u_int32_t ttl = readU32(field);
+        writeU32(field, ttl > elapsed ? ttl - elapsed : 0);
+    }
+    insertCacheEntry(cache, entry, size);
+    return entry;
+}
+// Appends the fresh entries in buckets [from, to) of a cache to a shard, with their times
+// moved to the wall clock by wallOffset. Returns false if out of memory
+static bool copyCacheEntries(DnsCache* cache, size_t from, size_t to, u_int64_t now, int64_t wallOffset,
+                             DnsSnapshotShard* shard) {
+    for(size_t bucket = from;bucket < to;bucket++) {
+        for(DnsCacheEntry* entry = cache->buckets[bucket];entry != NULL;entry = entry->hashNext) {
+            if(entry->expiresAt <= now) {
+                continue;
+            }
+            size_t size = snapshotEntrySize(entry->numTtls, entry->nameLength, entry->packetLength);
+            if(shard->capacity - shard->length < size) {
+                size_t capacity = shard->capacity > 0 ? shard->capacity * 2 : 65536;
+                while(capacity - shard->length < size) {
+                    capacity *= 2;
+                }
+                unsigned char* data = realloc(shard->data, capacity);
+                if(data == NULL) {
+                    return false;
+                }
+                shard->data = data;
+                shard->capacity = capacity;
+            }
+            DnsSnapshotEntry* saved = (DnsSnapshotEntry*)(shard->data + shard->length);
+            // Zeroed first so the padding is the same in every file
+            memset(saved, 0, size);
+            saved->hash = entry->hash;
+            saved->storedAt = entry->storedAt + wallOffset;
+            saved->expiresAt = entry->expiresAt + wallOffset;
+            saved->length = size;
+            saved->qtype = entry->qtype;
+            saved->qclass = entry->qclass;
+            saved->dnssecOk = entry->dnssecOk;
+            saved->nameLength = entry->nameLength;
+            saved->packetLength = entry->packetLength;
+            saved->numTtls = entry->numTtls;
+            memcpy(saved->ttlOffsets, entry->ttlOffsets, entry->numTtls * sizeof(u_int16_t));
+            memcpy((unsigned char*)snapshotEntryName(saved), cacheEntryName(entry), entry->nameLength);
+            memcpy((unsigned char*)snapshotEntryPacket(saved), cacheEntryPacket(entry), entry->packetLength);
+            saved->checksum = snapshotEntryChecksum(saved);
+            shard->length += size;
+            shard->numEntries++;
+        }
+    }
+    return true;
+}
+static void freeSnapshotShard(DnsSnapshotShard* shard) {
+    if(shard != NULL) {
+        free(shard->data);
+        free(shard);
+    }
+}
+// Finds a fresh cached response to the request no larger than capacity, or returns NULL on
+// a miss
+static DnsCacheEntry* lookupCacheEntry(DnsCache* cache, const CdnsPacketReadInfo* request, u_int64_t now,
+                                       int capacity) {
+    DnsCacheKey key;
+    if(cache->buckets == NULL || !makeCacheKey(request, &key)) {
+        return NULL;
+    }
+    DnsCacheEntry* entry = findCacheEntry(cache, &key);
+    if(entry != NULL && entry->expiresAt <= now) {
+        removeCacheEntry(cache, entry);
+        entry = NULL;
+    }
+    if(entry == NULL && cache->snapshot != NULL) {
+        entry = restoreCacheEntry(cache, &key, now);
+    }
+    if(entry == NULL || entry->packetLength > capacity) {
+        cache->misses++;
+        return NULL;
+    }
+    cache->hits++;
+    entry->referenced = true;
+    return entry;
+}
+// Copies a cached response into out, with the request's id, RD and CD bits and question,
+// and every TTL decremented by the time spent in the cache. The question keeps the case
+// the client sent, which it may have randomised to check replies against. Returns the
+// packet length
+static int copyCacheEntry(DnsCacheEntry* entry, const CdnsPacketReadInfo* request, u_int64_t now, unsigned char* out) {
+    memcpy(out, cacheEntryPacket(entry), entry->packetLength);
+    // Both names fold to the key, so they are the same bytes but for case when neither is
+    // compressed, which a compressed one can't be at the same length
+    const unsigned char* start = packetStart(request);
+    int pos = (int)((const unsigned char*)request->questions[0] - start);
+    if(skipNameChecked(start, CDNS_HEADER_SIZE + request->blobSize, pos) == pos + entry->nameLength &&
+       skipNameChecked(out, entry->packetLength, CDNS_HEADER_SIZE) == CDNS_HEADER_SIZE + entry->nameLength) {
+        memcpy(out + CDNS_HEADER_SIZE, start + pos, entry->nameLength);
+    }
+    out[2] = (out[2] & ~0x01) | request->header->rd;
+    out[3] = (out[3] & ~0x10) | (request->header->z & 1) << 4;
+    u_int32_t elapsed = (now - entry->storedAt) / 1000;
+    for(int i = 0;i < entry->numTtls;i++) {
+        unsigned char* field = out + entry->ttlOffsets[i];
+        u_int32_t ttl = readU32(field) - elapsed;
+        field[0] = ttl >> 24;
+        field[1] = (ttl >> 16) & 0xFF;
+        field[2] = (ttl >> 8) & 0xFF;
+        field[3] = ttl & 0xFF;
+    }
+    out[0] = request->header->id >> 8;
+    out[1] = request->header->id & 0xFF;
+    return entry->packetLength;
+}
+
+char *cdnsGetErrorString(int error) {
+    char* strings[CDNS_NUM_ERR + 1] = {
+        "NONE",
+        "MEMORY ERROR",
+        "TCP UNSUPPORTED",
+        "THREADS UNSUPPORTED",
+        "HTTP UNSUPPORTED",
+        "SOCKET CLOSE ERROR",
+        "NO CALLBACK SPECIFIED",
+        "ALREADY LISTENING",
+        "INVALID CALLBACK",
+        "INVALID PAUSE",
+        "ERROR IN RESPONSE FROM EXTERNAL SERVER",
+        "STATE MDOFIIED WHILE UNPAUSED",
+        "NONBLOCKING SOCKETS UNSUPPORTED",
+        "PACKET TOO LARGE",
+        "NO FREE OUTGOING REQUEST SLOTS",
+        "UNKNOWN REQUEST ID",
+        "MALFORMED PACKET",
+        "RECORD SECTIONS OUT OF ORDER",
+        "INVALID ZONE"
+    };
+    if(error <= CDNS_NUM_ERR && error >= 0) {
+        return strings[error];
+    } else {
+        return "UNKNOWN ERROR";
+    }
+}
+
+#define DEFAULT_THREAD_REQUESTS 256
+#define DEFAULT_RESEND_DELAY 1000
+#define DEFAULT_RESEND_ATTEMPTS 10
+#define DEFAULT_EXPLORE_PERCENT 5
+#define DEFAULT_BATCH_SIZE 32
+#define DEFAULT_UPSTREAM_PORTS 8
+#define DEFAULT_TCP_MAX_CONNECTIONS 1024
+#define DEFAULT_TCP_IDLE_TIMEOUT 10000
+#define DEFAULT_RRL_SLIP 2
+/// Bytes of an IPv4 or IPv6 client address that rate limiting counts it under, a /24 and
+/// a /56
+#define RRL_IPV4_PREFIX_BYTES 3
+#define RRL_IPV6_PREFIX_BYTES 7
+/// Receive buffers in each provided buffer ring, at least this many and four per batch
+#define RING_MIN_BUFFERS 256
+/// Completions handled in one reap of the io_uring before the timers get a turn, in batches
+#define RING_REAP_BATCHES 4
+/// Queries from one TCP connection that may be in flight at once, so that a single client
+/// cannot take every slot
+#define TCP_MAX_PIPELINED 64
+/// How long a TCP listener is left alone after accept ran out of file descriptors
+#define ACCEPT_BACKOFF_MS 100
+/// Responses gathered into a single sendmsg on a TCP connection
+#define TCP_WRITE_BATCH 16
+/// Request line and headers of an HTTP request together, which are parsed as they arrive
+/// and never stored
+#define HTTP_MAX_HEADER_BYTES 8192
+/// Of the shortest request parseHttp accepts, "GET  HTTP/1.1\n\n" with an empty path
+#define HTTP_MIN_REQUEST_BYTES 15
+/// Room for the status line and headers in front of an HTTP response
+#define HTTP_MAX_FRAMING 128
+/// Tries at picking an unused DNS id before cdnsSendRequest gives up
+#define MATCH_ID_ATTEMPTS 16
+#define DEFAULT_UPSTREAM_TCP_CONNECTIONS 2
+/// Connections to TCP upstreams a worker keeps open at once, over all upstreams
+#define UPSTREAM_TCP_MAX_CONNECTIONS 64
+/// Requests waiting on each connection to an upstream before another one is opened
+#define UPSTREAM_TCP_SHARE 32
+/// Backoff in ms before the second reconnect in a row, doubled for each one after that
+/// up to the maximum. The first reconnect is immediate
+#define UPSTREAM_TCP_BACKOFF 100
+#define UPSTREAM_TCP_MAX_BACKOFF 10000
+/// Socket index of requests on the first upstream connection, above any UDP socket's
+#define UPSTREAM_TCP_SOCKET_BASE 0x8000
+/// A new worker is added once fewer than 1/GROW_FREE_FRACTION of a worker's slots are free
+#define GROW_FREE_FRACTION 8
+/// How long adding workers is held off after adding one failed, as it is likely out of
+/// file descriptors or memory and would fail again
+#define GROW_RETRY_MS 1000
+/// Zone epoch of a worker that is waiting for events
+#define ZONE_IDLE UINT64_MAX
+/// CNAMEs followed within a zone before the answer is sent as it is
+#define ZONE_MAX_CNAMES 8
+
+/// What an epoll event refers to, stored in the upper half of epoll_data.u64
+enum DnsEventKind {
+    EVENT_LISTENER,
+    EVENT_UPSTREAM,
+    EVENT_CONNECTION,
+    EVENT_TIMER,
+    EVENT_WAKE,
+    EVENT_RING,
+    EVENT_UPSTREAM_CONNECTION,
+};
+static u_int64_t eventTag(enum DnsEventKind kind, int index) {
+    return (u_int64_t)kind << 32 | (u_int32_t)index;
+}
+/// What an io_uring completion is for, stored in the top byte of its user_data. The rest
+/// holds the registered file of a receive, or the latency of a response until it was sent
+enum DnsRingOp {
+    RING_RECV_LISTENER,
+    RING_RECV_UPSTREAM,
+    RING_SEND,
+};
+#define RING_PAYLOAD_MASK ((1ull << 56) - 1)
+static u_int64_t ringTag(enum DnsRingOp op, u_int64_t payload) {
+    return (u_int64_t)op << 56 | (payload & RING_PAYLOAD_MASK);
+}
+static u_int64_t monotonicMs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u_int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+static u_int64_t monotonicUs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u_int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+static u_int64_t wallClockMs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (u_int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+// Adds an entry to the snapshot being written unless it is stale, its key is already in
+// or the table is as full as it may get
+static void addSnapshotEntry(DnsSnapshotSlot* table, u_int32_t tableSize, DnsSnapshotShard* entries,
+                             const DnsSnapshotEntry* entry, u_int64_t now) {
+    if(entry->expiresAt <= now || entries->numEntries >= tableSize / 2 ||
+       entries->length / 8 >= UINT32_MAX - 1 || entries->capacity - entries->length < entry->length) {
+        return;
+    }
+    u_int32_t mask = tableSize - 1;
+    u_int32_t tag = (u_int32_t)(entry->hash >> 32);
+    u_int32_t pos = (u_int32_t)entry->hash & mask;
+    while(table[pos].entry != 0) {
+        const DnsSnapshotEntry* other = (const DnsSnapshotEntry*)(entries->data + (u_int64_t)(table[pos].entry - 1) * 8);
+        if(table[pos].tag == tag &&
+           snapshotEntryMatches(other, entry->hash, entry->qtype, entry->qclass, entry->dnssecOk,
+                                snapshotEntryName(entry), entry->nameLength)) {
+            return;
+        }
+        pos = (pos + 1) & mask;
+    }
+    table[pos].tag = tag;
+    table[pos].entry = (u_int32_t)(entries->length / 8) + 1;
+    memcpy(entries->data + entries->length, entry, entry->length);
+    entries->length += entry->length;
+    entries->numEntries++;
+}
+// Writes the entries copied out of the caches to the snapshot file, followed by those of the
+// mapped snapshot that are still fresh and were not looked up since, so entries a thread
+// never needed survive more than one run. Returns false if it could not be written, which
+// only costs the next run its warm start
+static bool writeSnapshot(DnsState* state, DnsSnapshotShard* const* shards, int numShards) {
+    u_int64_t now = wallClockMs();
+    const DnsSnapshot* old = state->snapshot;
+    size_t capacity = old != NULL ? old->entriesLength : 0;
+    // The count in the header is only trusted as far as the entries could hold that many
+    u_int64_t numCandidates = 0;
+    if(old != NULL) {
+        numCandidates = old->numEntries < old->entriesLength / sizeof(DnsSnapshotEntry)
+                            ? old->numEntries : old->entriesLength / sizeof(DnsSnapshotEntry);
+    }
+    for(int i = 0;i < numShards;i++) {
+        if(shards[i] != NULL) {
+            capacity += shards[i]->length;
+            numCandidates += shards[i]->numEntries;
+        }
+    }
+    u_int32_t tableSize = 64;
+    while(tableSize < numCandidates * 2 && tableSize < 1u << 31) {
+        tableSize *= 2;
+    }
+    DnsSnapshotSlot* table = calloc(tableSize, sizeof(DnsSnapshotSlot));
+    DnsSnapshotShard entries = {.data = malloc(capacity > 0 ? capacity : 1), .capacity = capacity};
+    if(table == NULL || entries.data == NULL) {
+        free(table);
+        free(entries.data);
+        return false;
+    }
+    // The copies are newer than the mapped snapshot, so they go first and win on a duplicate
+    for(int i = 0;i < numShards;i++) {
+        for(size_t offset = 0;shards[i] != NULL && offset < shards[i]->length;) {
+            const DnsSnapshotEntry* entry = (const DnsSnapshotEntry*)(shards[i]->data + offset);
+            addSnapshotEntry(table, tableSize, &entries, entry, now);
+            offset += entry->length;
+        }
+    }
+    if(old != NULL && now < old->expiresAt) {
+        const DnsSnapshotEntry* entry;
+        for(u_int64_t offset = 0;(entry = snapshotEntryAt(old->entries, old->entriesLength, offset)) != NULL;
+            offset += entry->length) {
+            addSnapshotEntry(table, tableSize, &entries, entry, now);
+        }
+    }
+    DnsSnapshotHeader header = {0};
+    memcpy(header.magic, CDNS_SNAPSHOT_MAGIC, 8);
+    header.version = CDNS_SNAPSHOT_VERSION;
+    header.byteOrder = CDNS_SNAPSHOT_BYTE_ORDER;
+    header.savedAt = now;
+    for(size_t offset = 0;offset < entries.length;) {
+        const DnsSnapshotEntry* entry = (const DnsSnapshotEntry*)(entries.data + offset);
+        if(entry->expiresAt > header.expiresAt) {
+            header.expiresAt = entry->expiresAt;
+        }
+        offset += entry->length;
+    }
+    header.tableSize = tableSize;
+    header.numEntries = entries.numEntries;
+    header.tableOffset = (sizeof(DnsSnapshotHeader) + CDNS_CACHE_LINE - 1) & ~(u_int64_t)(CDNS_CACHE_LINE - 1);
+    header.entriesOffset = header.tableOffset + (u_int64_t)tableSize * sizeof(DnsSnapshotSlot);
+    header.entriesLength = entries.length;
+    header.length = header.entriesOffset + entries.length;
+    // Written beside the snapshot and renamed over it, so a restart never maps half of one
+    char* temporary = (char*)malloc(strlen(state->snapshotPath) + 5);
+    bool written = false;
+    if(temporary != NULL) {
+        sprintf(temporary, "%s.tmp", state->snapshotPath);
+        FILE* file = fopen(temporary, "wb");
+        static const unsigned char padding[CDNS_CACHE_LINE] = {0};
+        written = file != NULL && fwrite(&header, sizeof(header), 1, file) == 1 &&
+                       fwrite(padding, header.tableOffset - sizeof(header), 1, file) == 1 &&
+                       fwrite(table, sizeof(DnsSnapshotSlot), tableSize, file) == tableSize &&
+                       (entries.length == 0 || fwrite(entries.data, entries.length, 1, file) == 1) &&
+                       fflush(file) == 0 && fsync(fileno(file)) == 0;
+        if(file != NULL && fclose(file) != 0) {
+            written = false;
+        }
+        if(written && (rename(temporary, state->snapshotPath) != 0 || !syncParentDirectory(state->snapshotPath))) {
+            written = false;
+        }
+        if(!written && file != NULL) {
+            unlink(temporary);
+        }
+    }
+    free(temporary);
+    free(table);
+    free(entries.data);
+    return written;
+}
+// Maps the snapshot left at path, or returns NULL if there is none or its header is not one
+// this build wrote. Entries are checked as they are read
+static DnsSnapshot* openSnapshot(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    void* image = MAP_FAILED;
+    if(fd != -1 && fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(DnsSnapshotHeader)) {
+        image = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    if(fd != -1) {
+        close(fd);
+    }
+    if(image == MAP_FAILED) {
+        return NULL;
+    }
+    size_t length = info.st_size;
+    const DnsSnapshotHeader* header = (const DnsSnapshotHeader*)image;
+    DnsSnapshot* snapshot = NULL;
+    if(memcmp(header->magic, CDNS_SNAPSHOT_MAGIC, 8) == 0 && header->version == CDNS_SNAPSHOT_VERSION &&
+       header->byteOrder == CDNS_SNAPSHOT_BYTE_ORDER && header->length == length && header->tableSize != 0 &&
+       (header->tableSize & (header->tableSize - 1)) == 0 && header->tableOffset % 8 == 0 &&
+       header->tableOffset <= length &&
+       (u_int64_t)header->tableSize * sizeof(DnsSnapshotSlot) <= length - header->tableOffset &&
+       header->entriesOffset % 8 == 0 && header->entriesOffset <= length &&
+       header->entriesLength <= length - header->entriesOffset) {
+        snapshot = (DnsSnapshot*)calloc(1, sizeof(DnsSnapshot));
+    }
+    if(snapshot == NULL) {
+        munmap(image, length);
+        return NULL;
+    }
+    snapshot->image = (const unsigned char*)image;
+    snapshot->length = length;
+    snapshot->table = (const DnsSnapshotSlot*)(snapshot->image + header->tableOffset);
+    snapshot->mask = header->tableSize - 1;
+    snapshot->numEntries = header->numEntries;
+    snapshot->entries = snapshot->image + header->entriesOffset;
+    snapshot->entriesLength = header->entriesLength;
+    snapshot->expiresAt = header->expiresAt;
+    snapshot->wallOffset = (int64_t)(wallClockMs() - monotonicMs());
+    return snapshot;
+}
+static void closeSnapshot(DnsSnapshot* snapshot) {
+    if(snapshot != NULL) {
+        munmap((void*)snapshot->image, snapshot->length);
+        free(snapshot);
+    }
+}
+// TSC ticks where there is one, CLOCK_MONOTONIC ns elsewhere. Only differences are used
+static u_int64_t readCycles(void) {
+#if defined(__x86_64__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u_int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+// Charges the cycles since the last switch to the stage being left, and returns that
+// stage so the caller can switch back to it
+static enum DnsReplayStage switchStage(DnsReplay* replay, enum DnsReplayStage stage) {
+    u_int64_t now = readCycles();
+    enum DnsReplayStage previous = replay->stage;
+    replay->stageCycles[previous] += now - replay->stageStart;
+    replay->stageStart = now;
+    replay->stage = stage;
+    return previous;
+}
+
+// Statistics
+
+static void addStat(_Atomic u_int64_t* stat, u_int64_t n) {
+    atomic_store_explicit(stat, atomic_load_explicit(stat, memory_order_relaxed) + n, memory_order_relaxed);
+}
+static void countStat(DnsWorker* worker, enum DnsStatCounter counter, u_int64_t n) {
+    addStat(&worker->stats.counters[counter], n);
+}
+static int latencyBucket(u_int64_t us) {
+    if(us < 16) {
+        return (int)us;
+    }
+    int shift = 63 - __builtin_clzll(us) - 3;
+    int bucket = (shift << 3) + (int)(us >> shift);
+    return bucket < CDNS_LATENCY_BUCKETS ? bucket : CDNS_LATENCY_BUCKETS - 1;
+}
+// Largest latency that lands in a bucket
+static u_int64_t latencyBucketTop(int bucket) {
+    if(bucket < 16) {
+        return bucket;
+    }
+    int shift = (bucket >> 3) - 1;
+    return ((u_int64_t)((bucket & 7) + 9) << shift) - 1;
+}
+static void recordLatency(DnsHistogram* histogram, u_int64_t us) {
+    addStat(&histogram->counts[latencyBucket(us)], 1);
+    addStat(&histogram->sumUs, us);
+    if(us > atomic_load_explicit(&histogram->maxUs, memory_order_relaxed)) {
+        atomic_store_explicit(&histogram->maxUs, us, memory_order_relaxed);
+    }
+}
+static void sumHistogram(CdnsLatencyHistogram* out, const DnsHistogram* histogram) {
+    for(int i = 0;i < CDNS_LATENCY_BUCKETS;i++) {
+        u_int64_t count = atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+        out->counts[i] += count;
+        out->total += count;
+    }
+    out->sumUs += atomic_load_explicit(&histogram->sumUs, memory_order_relaxed);
+    u_int64_t max = atomic_load_explicit(&histogram->maxUs, memory_order_relaxed);
+    if(max > out->maxUs) {
+        out->maxUs = max;
+    }
+}
+
+static bool sameAddress(const DnsSockAddr* a, const DnsSockAddr* b) {
+    if(a->sa.sa_family != b->sa.sa_family) {
+        return false;
+    }
+    if(a->sa.sa_family == AF_INET) {
+        return a->in4.sin_port == b->in4.sin_port && a->in4.sin_addr.s_addr == b->in4.sin_addr.s_addr;
+    }
+    return a->in6.sin6_port == b->in6.sin6_port && memcmp(&a->in6.sin6_addr, &b->in6.sin6_addr, 16) == 0;
+}
+// Refills from getrandom, so ids and ports cannot be predicted from earlier queries
+static void fillRandom(DnsRandom* random) {
+    ssize_t got = getrandom(random->buffer, sizeof(random->buffer), GRND_NONBLOCK);
+    if(got != (ssize_t)sizeof(random->buffer)) {
+        // Only before the entropy pool is initialized, which a DNS server should not see
+        u_int64_t x = monotonicMs() ^ (u_int64_t)(uintptr_t)random ^ random->fallback;
+        for(size_t i = 0;i < sizeof(random->buffer);i++) {
+            // splitmix64
+            x += 0x9e3779b97f4a7c15ull;
+            u_int64_t z = x;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            random->buffer[i] = (unsigned char)(z ^ (z >> 31));
+        }
+        random->fallback = x;
+    }
+    random->used = 0;
+}
+static u_int16_t randomU16(DnsRandom* random) {
+    if(random->used + 2 > (int)sizeof(random->buffer)) {
+        fillRandom(random);
+    }
+    u_int16_t value = readU16(random->buffer + random->used);
+    random->used += 2;
+    return value;
+}
+// Hash of the first question, case folded, so replies can be matched without indexing
+// them. Names in the first question never need compression pointers, so they are refused
+static bool questionHash(const unsigned char* packet, int length, u_int64_t* out) {
+    u_int64_t hash = 0xcbf29ce484222325ull;
+    if(length < CDNS_HEADER_SIZE) {
+        return false;
+    }
+    if(readU16(packet + 4) == 0) {
+        *out = hash;
+        return true;
+    }
+    unsigned char folded[CDNS_MAX_NAME_LENGTH];
+    int nameLength = nameKernels()->foldName(packet + CDNS_HEADER_SIZE, length - CDNS_HEADER_SIZE, folded, &hash);
+    // Then type and class
+    if(nameLength < 0 || CDNS_HEADER_SIZE + nameLength + 4 > length) {
+        return false;
+    }
+    *out = hashBytes(packet + CDNS_HEADER_SIZE + nameLength, 4, hash);
+    return true;
+}
+static u_int32_t matchHash(const DnsSockAddr* from, int socketIndex, u_int16_t id, u_int64_t question) {
+    u_int64_t x = question ^ ((u_int64_t)id << 48 | (u_int64_t)(u_int16_t)socketIndex << 32);
+    x ^= (u_int64_t)from->in4.sin_addr.s_addr << 16 ^ from->in4.sin_port;
+    // Finalizer from murmur3, as the fields are not spread over the whole word
+    x = (x ^ (x >> 33)) * 0xff51afd7ed558ccdull;
+    x = (x ^ (x >> 33)) * 0xc4ceb9fe1a85ec53ull;
+    return (u_int32_t)(x ^ (x >> 33));
+}
+static int createMatchTable(DnsMatchTable* table, u_int32_t maxRequests) {
+    // At most half full, so probe sequences stay short
+    u_int32_t capacity = 16;
+    while(capacity < maxRequests * 2) {
+        capacity *= 2;
+    }
+    table->entries = (DnsMatchEntry*)malloc(sizeof(DnsMatchEntry) * capacity);
+    if(table->entries == NULL) {
+        return CDNS_ERR_MEM;
+    }
+    for(u_int32_t i = 0;i < capacity;i++) {
+        table->entries[i].request = CDNS_POOL_NONE;
+    }
+    table->mask = capacity - 1;
+    return 0;
+}
+static void destroyMatchTable(DnsMatchTable* table) {
+    free(table->entries);
+    table->entries = NULL;
+}
+// Returns the request an upstream reply answers, or CDNS_POOL_NONE. The random id and
+// source port make up most of the key, so this is also the check against spoofed replies
+static u_int32_t findMatch(DnsWorker* worker, const DnsSockAddr* from, int socketIndex, u_int16_t id,
+                           u_int64_t question) {
+    DnsMatchTable* table = &worker->matches;
+    u_int32_t hash = matchHash(from, socketIndex, id, question);
+    for(u_int32_t pos = hash & table->mask;;pos = (pos + 1) & table->mask) {
+        DnsMatchEntry* entry = &table->entries[pos];
+        if(entry->request == CDNS_POOL_NONE) {
+            return CDNS_POOL_NONE;
+        }
+        if(entry->hash != hash) {
+            continue;
+        }
+        OutgoingRequestTrackingData* req = getRequest(worker, entry->request);
+        if(req->socketIndex == socketIndex && req->writer.header.id == id && req->questionHash == question &&
+           sameAddress(from, &req->destination)) {
+            return entry->request;
+        }
+    }
+}
+static void insertTableEntry(DnsMatchTable* table, u_int32_t hash, u_int32_t idx) {
+    u_int32_t pos = hash & table->mask;
+    while(table->entries[pos].request != CDNS_POOL_NONE) {
+        pos = (pos + 1) & table->mask;
+    }
+    table->entries[pos].hash = hash;
+    table->entries[pos].request = idx;
+}
+// Backward shift deletion: later entries of the probe run are moved up into the hole, so
+// the table never fills with tombstones
+static void removeTableEntry(DnsMatchTable* table, u_int32_t hash, u_int32_t idx) {
+    u_int32_t hole = hash & table->mask;
+    while(table->entries[hole].request != idx) {
+        hole = (hole + 1) & table->mask;
+    }
+    for(u_int32_t pos = (hole + 1) & table->mask;table->entries[pos].request != CDNS_POOL_NONE;
+        pos = (pos + 1) & table->mask) {
+        u_int32_t home = table->entries[pos].hash & table->mask;
+        // Moving is only allowed if the entry's home is not between the hole and it
+        if(((pos - home) & table->mask) >= ((pos - hole) & table->mask)) {
+            table->entries[hole] = table->entries[pos];
+            hole = pos;
+        }
+    }
+    table->entries[hole].request = CDNS_POOL_NONE;
+}
+static void insertMatch(DnsWorker* worker, u_int32_t idx) {
+    OutgoingRequestTrackingData* req = getRequest(worker, idx);
+    insertTableEntry(&worker->matches, matchHash(&req->destination, req->socketIndex, req->writer.header.id,
+                                                 req->questionHash), idx);
+    req->matchable = true;
+}
+static void unlinkWrite(DnsWorker* worker, DnsUpstreamConnection* conn, OutgoingRequestTrackingData* req) {
+    if(req->prevWrite == -1) {
+        conn->writeHead = req->nextWrite;
+    } else {
+        getRequest(worker, req->prevWrite)->nextWrite = req->nextWrite;
+    }
+    if(req->nextWrite == -1) {
+        conn->writeTail = req->prevWrite;
+    } else {
+        getRequest(worker, req->nextWrite)->prevWrite = req->prevWrite;
+    }
+    req->queuedWrite = false;
+    conn->numQueued--;
+}
+// Closes a connection nothing waits on after the idle timeout, or frees its slot at once
+// if it is only waiting to reconnect
+static void settleUpstreamConnection(DnsWorker* worker, int c) {
+    DnsUpstreamConnection* conn = &worker->upstreamConnections[c];
+    if(conn->numQueued + conn->outstanding > 0) {
+        return;
+    }
+    cancelTimer(&worker->timers, &conn->timer);
+    if(conn->socket == -1) {
+        conn->active = false;
+    } else {
+        scheduleTimer(&worker->timers, &conn->timer, worker->timers.now + worker->state->tcpIdleTimeout);
+    }
+}
+// Takes a request that no longer waits for its reply off its upstream connection. If it
+// was partly written, the rest is still written, as the upstream would otherwise read
+// the next request from the middle of it
+static void leaveConnection(DnsWorker* worker, u_int32_t idx) {
+    OutgoingRequestTrackingData* req = getRequest(worker, idx);
+    if(req->connection == -1) {
+        return;
+    }
+    DnsUpstreamConnection* conn = &worker->upstreamConnections[req->connection];
+    int c = req->connection;
+    req->connection = -1;
+    if(!req->queuedWrite) {
+        conn->outstanding--;
+    } else {
+        if(req->written > 0) {
+            writeU16(conn->partial, req->requestLength);
+            memcpy(conn->partial + 2, req->request, req->requestLength);
+            conn->partialLength = 2 + req->requestLength;
+            conn->partialWritten = req->written;
+        }
+        unlinkWrite(worker, conn, req);
+    }
+    settleUpstreamConnection(worker, c);
+}
+static void removeMatch(DnsWorker* worker, u_int32_t idx) {
+    OutgoingRequestTrackingData* req = getRequest(worker, idx);
+    if(!req->matchable) {
+        return;
+    }
+    req->matchable = false;
+    removeTableEntry(&worker->matches, matchHash(&req->destination, req->socketIndex, req->writer.header.id,
+                                                 req->questionHash), idx);
+    leaveConnection(worker, idx);
+}
+// The in-flight table leaves the socket and id out of the key, as those are exactly what
+// duplicate queries differ in
+static u_int32_t inflightHash(const OutgoingRequestTrackingData* req) {
+    return matchHash(&req->destination, 0, 0, req->questionHash);
+}
+// Returns an unanswered request that sent the same query to the same server, or
+// CDNS_POOL_NONE. Everything but the id has to be identical, flags included
+static u_int32_t findInflight(DnsWorker* worker, const OutgoingRequestTrackingData* req) {
+    DnsMatchTable* table = &worker->inflight;
+    u_int32_t hash = inflightHash(req);
+    for(u_int32_t pos = hash & table->mask;;pos = (pos + 1) & table->mask) {
+        DnsMatchEntry* entry = &table->entries[pos];
+        if(entry->request == CDNS_POOL_NONE) {
+            return CDNS_POOL_NONE;
+        }
+        if(entry->hash != hash) {
+            continue;
+        }
+        OutgoingRequestTrackingData* other = getRequest(worker, entry->request);
+        if(other->requestLength == req->requestLength && other->questionHash == req->questionHash &&
+           sameAddress(&other->destination, &req->destination) &&
+           memcmp(other->request + 2, req->request + 2, req->requestLength - 2) == 0) {
+            return entry->request;
+        }
+    }
+}
+static void insertInflight(DnsWorker* worker, u_int32_t idx) {
+    OutgoingRequestTrackingData* req = getRequest(worker, idx);
+    insertTableEntry(&worker->inflight, inflightHash(req), idx);
+    req->inflight = true;
+}
+static void removeInflight(DnsWorker* worker, u_int32_t idx) {
+    OutgoingRequestTrackingData* req = getRequest(worker, idx);
+    if(!req->inflight) {
+        return;
+    }
+    req->inflight = false;
+    removeTableEntry(&worker->inflight, inflightHash(req), idx);
+}
+// Picks a random id that no other request waiting on the same socket and upstream has
+static bool pickRequestId(DnsWorker* worker, OutgoingRequestTrackingData* req) {
+    for(int attempt = 0;attempt < MATCH_ID_ATTEMPTS;attempt++) {
+        req->writer.header.id = randomU16(&worker->random);
+        if(findMatch(worker, &req->destination, req->socketIndex, req->writer.header.id, req->questionHash) ==
+           CDNS_POOL_NONE) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Upstream TCP connections
+
+static void updateUpstreamEvents(DnsWorker* worker, int c) {
+    DnsUpstreamConnection* conn = &worker->upstreamConnections[c];
+    u_int32_t events = EPOLLIN;
+    if(!conn->connected || conn->numQueued > 0 || conn->partialLength > 0) {
+        events |= EPOLLOUT;
+    }
+    if(events != conn->events) {
+        struct epoll_event event = {.events = events};
+        event.data.u64 = eventTag(EVENT_UPSTREAM_CONNECTION, c);
+        epoll_ctl(worker->epollFd, EPOLL_CTL_MOD, conn->socket, &event);
+        conn->events = events;
+    }
+}
+// Writes as much of the write queue as the socket takes, each request behind its length
+// prefix, TCP_WRITE_BATCH requests to a sendmsg. Errors are left for the next read to see
+static void writeUpstreamConnection(DnsWorker* worker, int c) {
+    DnsUpstreamConnection* conn = &worker->upstreamConnections[c];
+    while(conn->partialLength > 0 || conn->writeHead != -1) {
+        struct iovec iov[1 + 2 * TCP_WRITE_BATCH];
+        unsigned char prefixes[TCP_WRITE_BATCH][2];
+        int count = 0;
+        if(conn->partialLength > 0) {
+            iov[count].iov_base = conn->partial + conn->partialWritten;
+            iov[count++].iov_len = conn->partialLength - conn->partialWritten;
+        }
+        int next = conn->writeHead;
+        for(int n = 0;n < TCP_WRITE_BATCH && next != -1;n++) {
+            OutgoingRequestTrackingData* req = getRequest(worker, next);
+            writeU16(prefixes[n], req->requestLength);
+            int written = req->written;
+            if(written < 2) {
+                iov[count].iov_base = prefixes[n] + written;
+                iov[count++].iov_len = 2 - written;
+                written = 0;
+            } else {
+                written -= 2;
+            }
+            iov[count].iov_base = req->request + written;
+            iov[count++].iov_len = req->requestLength - written;
+            next = req->nextWrite;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t sent = sendmsg(conn->socket, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if(sent <= 0) {
+            break;
+        }
+        if(conn->partialLength > 0) {
+            int left = conn->partialLength - conn->partialWritten;
+            if(sent < left) {
+                conn->partialWritten += (int)sent;
+                break;
+            }
+            sent -= left;
+            conn->partialLength = 0;
+            conn->partialWritten = 0;
+        }
+        while(sent > 0) {
+            OutgoingRequestTrackingData* req = getRequest(worker, conn->writeHead);
+            int left = 2 + req->requestLength - req->written;
+            if(sent < left) {
+                req->written += (int)sent;
+                break;
+            }
+            sent -= left;
+            unlinkWrite(worker, conn, req);
+            conn->outstanding++;
+        }
+    }
+    updateUpstreamEvents(worker, c);
+}
+// Starts a non-blocking connect, which completes once the socket turns writable
+static bool openUpstreamConnection(DnsWorker* worker, int c) {
+    DnsUpstreamConnection* conn = &worker->upstreamConnections[c];
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(sock == -1) {
+        return false;
+    }
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct epoll_event event = {.events = EPOLLIN | EPOLLOUT};
+    event.data.u64 = eventTag(EVENT_UPSTREAM_CONNECTION, c);
+    if((connect(sock, &conn->destination.sa, sizeof(struct sockaddr_in)) != 0 && errno != EINPROGRESS) ||
+       epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, sock, &event) != 0) {
+        close(sock);
+        return false;
+    }
+    conn->socket = sock;
+    conn->connected = false;
+    conn->events = event.events;
+    conn->lengthHave = 0;
+    countStat(worker, STAT_UPSTREAM_TCP_CONNECTS, 1);
+    return true;
+}
+// The connection could not be made, or broke. Requests already written to it are queued
+// to be written again, and while any request waits it is reconnected, at once if it had
+// worked and after a backoff if it keeps failing
+static void failUpstreamConnection(DnsWorker* worker, int c) {
+    DnsUpstreamConnection* conn = &worker->upstreamConnections[c];
+    if(conn->socket != -1) {
+        close(conn->socket);
+        conn->socket = -1;
+    }
+    conn->connected = false;
+    conn->partialLength = 0;
+    conn->partialWritten = 0;
+    for(int next = conn->writeHead;next != -1;next = getRequest(worker, next)->nextWrite) {
+        getRequest(worker, next)->written = 0;
+    }
+    for(u_int32_t i = 0;conn->outstanding > 0 && i < worker->requestPool.numEntries;i++) {
+        OutgoingRequestTrackingData* req = getRequest(worker, i);
+        if(req->owner != -1 && req->connection == c && !req->queuedWrite) {
+            req->queuedWrite = true;
+            req->written = 0;
+            req->nextWrite = -1;
+            req->prevWrite = conn->writeTail;
+            if(conn->writeTail == -1) {
+                conn->writeHead = (int)i;
+            } else {
+                getRequest(worker, conn->writeTail)->nextWrite = (int)i;
+            }
+            conn->writeTail = (int)i;
+            conn->numQueued++;
+            conn->outstanding--;
+        }
+    }
+    cancelTimer(&worker->timers, &conn->timer);
+    if(conn->numQueued == 0) {
+        conn->active = false;
+        return;
+    }
+    u_int64_t backoff = 0;
+    if(conn->failures > 0) {
+        int doublings = conn->failures - 1 < 16 ? conn->failures - 1 : 16;
+        backoff = (u_int64_t)UPSTREAM_TCP_BACKOFF << doublings;
+        backoff = backoff < UPSTREAM_TCP_MAX_BACKOFF ? backoff : UPSTREAM_TCP_MAX_BACKOFF;
+    }
+    conn->failures++;
+    scheduleTimer(&worker->timers, &conn->timer, worker->timers.now + backoff);
+}
+// Reconnects once the backoff is over, or closes a connection that stayed idle
+static void upstreamConnectionTimer(DnsWorker* worker, int c) {
+    DnsUpstreamConnection* conn = &worker->upstreamConnections[c];
+    if(conn->socket != -1) {
+        close(conn->socket);
+        conn->socket = -1;
+        conn->active = false;
+    } else if(!openUpstreamConnection(worker, c)) {
+        failUpstreamConnection(worker, c);
+    }
+}
+// Returns the connection to the destination the next request should go on: the least
+// loaded one, unless each carries UPSTREAM_TCP_SHARE requests and another may be opened.
+// -1 if there is none and no slot to open one in
+static int pickUpstreamConnection(DnsWorker* worker, const DnsSockAddr* destination) {
+    if(worker->upstreamConnections == NULL) {
+        worker->upstreamConnections =
+            (DnsUpstreamConnection*)malloc(sizeof(DnsUpstreamConnection) * UPSTREAM_TCP_MAX_CONNECTIONS);
+        if(worker->upstreamConnections == NULL) {
+            return -1;
+        }
+        for(int c = 0;c < UPSTREAM_TCP_MAX_CONNECTIONS;c++) {
+            DnsUpstreamConnection* conn = &worker->upstreamConnections[c];
+            conn->active = false;
+            conn->reply = NULL;
+            conn->replyCapacity = 0;
+            conn->timer.pprev = NULL;
+            conn->timer.kind = TIMER_UPSTREAM_CONNECTION;
+            conn->timer.index = c;
+        }
+    }
+    int best = -1;
+    int bestLoad = 0;
+    int open = 0;
+    int unused = -1;
+    for(int c = 0;c < UPSTREAM_TCP_MAX_CONNECTIONS;c++) {
+        DnsUpstreamConnection* conn = &worker->upstreamConnections[c];
+        if(!conn->active) {
+            unused = unused == -1 ? c : unused;
+            continue;
+        }
+        if(!sameAddress(&conn->destination, destination)) {
+            continue;
+        }
+        open++;
+        int load = conn->numQueued + conn->outstanding;
+        if(best == -1 || load < bestLoad) {
+            best = c;
+            bestLoad = load;
+        }
+    }
+    if(best != -1 && (bestLoad < UPSTREAM_TCP_SHARE || open >= worker->state->upstreamTcpConnections)) {
+        return best;
+    }
+    if(unused == -1) {
+        return best;
+    }
+    DnsUpstreamConnection* conn = &worker->upstreamConnections[unused];
+    conn->destination = *destination;
+    conn->writeHead = -1;
+    conn->writeTail = -1;
+    conn->numQueued = 0;
+    conn->outstanding = 0;
+    conn->failures = 0;
+    conn->partialLength = 0;
+    conn->partialWritten = 0;
+    if(!openUpstreamConnection(worker, unused)) {
+        return best;
+    }
+    conn->active = true;
+    return unused;
+}
+// Queues a request on a connection to its upstream and writes it if the connection is up
+static int transmitStream(DnsWorker* worker, u_int32_t idx) {
+    OutgoingRequestTrackingData* req = getRequest(worker, idx);
+    int c = pickUpstreamConnection(worker, &req->destination);
+    if(c == -1) {
+        return CDNS_ERR_UNDEFINED;
+    }
+    DnsUpstreamConnection* conn = &worker->upstreamConnections[c];
+    req->socketIndex = UPSTREAM_TCP_SOCKET_BASE + c;
+    if(!pickRequestId(worker, req)) {
+        settleUpstreamConnection(worker, c);
+        return CDNS_ERR_OUTGOING_FULL;
+    }
+    writeHeader(&req->writer.header, req->request);
+    insertMatch(worker, idx);
+    if(conn->socket != -1) {
+        cancelTimer(&worker->timers, &conn->timer);
+    }
+    req->connection = c;
+    req->queuedWrite = true;
+    req->written = 0;
+    req->nextWrite = -1;
+    req->prevWrite = conn->writeTail;
+    if(conn->writeTail == -1) {
+        conn->writeHead = (int)idx;
+    } else {
+        getRequest(worker, conn->writeTail)->nextWrite = (int)idx;
+    }
+    conn->writeTail = (int)idx;
+    conn->numQueued++;
+    if(conn->connected) {
+        writeUpstreamConnection(worker, c);
+    }
+    return 0;
+}
+// Gives a request that is being freed a follower to take its place on its upstream
+// connection, in the write queue if it is still there
+static void handOverConnection(DnsWorker* worker, u_int32_t idx, u_int32_t heirIdx) {
+    OutgoingRequestTrackingData* req = getRequest(worker, idx);
+    OutgoingRequestTrackingData* heir = getRequest(worker, heirIdx);
+    heir->tcp = req->tcp;
+    heir->connection = req->connection;
+    heir->queuedWrite = req->queuedWrite;
+    if(req->connection == -1) {
+        return;
+    }
+    DnsUpstreamConnection* conn = &worker->upstreamConnections[req->connection];
+    req->connection = -1;
+    if(!req->queuedWrite) {
+        return;
+    }
+    // The heir's request is the same bytes, so a partial write carries on with it
+    req->queuedWrite = false;
+    heir->written = req->written;
+    heir->nextWrite = req->nextWrite;
+    heir->prevWrite = req->prevWrite;
+    if(req->prevWrite == -1) {
+        conn->writeHead = (int)heirIdx;
+    } else {
+        getRequest(worker, req->prevWrite)->nextWrite = (int)heirIdx;
+    }
+    if(req->nextWrite == -1) {
+        conn->writeTail = (int)heirIdx;
+    } else {
+        getRequest(worker, req->nextWrite)->prevWrite = (int)heirIdx;
+    }
+}
+// Hands a request to the replay's upstream hook in place of sending it. The reply is
+// held until the callback returns, as if it had come back off the wire
+static void askReplayStub(DnsWorker* worker, OutgoingRequestTrackingData* req) {
+    DnsReplay* replay = worker->replay;
+    const CdnsReplayConfig* config = replay->config;
+    replay->stats.upstreamRequests++;
+    if(config->upstream == NULL || replay->numPending == REPLAY_MAX_PENDING) {
+        // Lost, the request times out as it would on a real network
+        return;
+    }
+    enum DnsReplayStage stage = switchStage(replay, REPLAY_UPSTREAM);
+    DnsReplayReply* reply = &replay->pending[(replay->pendingHead + replay->numPending) % REPLAY_MAX_PENDING];
+    int length = config->upstream(config->context, req->request, req->requestLength, reply->packet,
+                                  CDNS_UDP_BUFFER_SIZE);
+    if(length >= CDNS_HEADER_SIZE && length <= CDNS_UDP_BUFFER_SIZE) {
+        reply->socketIndex = req->socketIndex;
+        reply->from = req->destination;
+        reply->length = length;
+        replay->numPending++;
+    }
+    switchStage(replay, stage);
+}
+// transmitRequest during a replay. Requests to TCP upstreams are matched like those that
+// came back on a connection, but there is none
+static int replayRequest(DnsWorker* worker, u_int32_t idx) {
+    OutgoingRequestTrackingData* req = getRequest(worker, idx);
+    req->socketIndex = req->tcp ? UPSTREAM_TCP_SOCKET_BASE : 0;
+    if(!pickRequestId(worker, req)) {
+        return CDNS_ERR_OUTGOING_FULL;
+    }
+    writeHeader(&req->writer.header, req->request);
+    insertMatch(worker, idx);
+    askReplayStub(worker, req);
+    return 0;
+}
+// Picks the socket and id of a request at random, so that a spoofed reply has to guess
+// both, sends it and makes its reply matchable. Requests to TCP upstreams go on one of
+// the worker's connections to them instead
+static int transmitRequest(DnsWorker* worker, u_int32_t idx) {
+    OutgoingRequestTrackingData* req = getRequest(worker, idx);
+    if(worker->replay != NULL) {
+        return replayRequest(worker, idx);
+    }
+    if(req->tcp) {
+        return transmitStream(worker, idx);
+    }
+    req->socketIndex = randomU16(&worker->random) % worker->state->upstreamPorts;
+    if(!pickRequestId(worker, req)) {
+        return CDNS_ERR_OUTGOING_FULL;
+    }
+    writeHeader(&req->writer.header, req->request);
+    if(sendto(worker->upstreamSockets[req->socketIndex], req->request, req->requestLength, MSG_DONTWAIT,
+              &req->destination.sa, req->destinationLength) == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        return CDNS_ERR_UNDEFINED;
+    }
+    insertMatch(worker, idx);
+    return 0;
+}
+
+// Upstream pools
+
+static DnsUpstreamEstimate* upstreamEstimate(DnsWorker* worker, DnsUpstreamPool* pool, int upstream) {
+    return &pool->estimates[(size_t)worker->index * pool->numUpstreams + upstream];
+}
+static void countUpstream(DnsWorker* worker, DnsUpstreamPool* pool, int upstream, enum DnsUpstreamCounter counter) {
+    addStat(&upstreamEstimate(worker, pool, upstream)->counters[counter], 1);
+}
+// Expected time to an answer, the smoothed RTT inflated by the loss rate. Upstreams
+// without a sample yet score 0, so each is tried once before the fastest is settled on
+static u_int64_t upstreamScore(const DnsUpstreamEstimate* estimate) {
+    u_int64_t srtt = atomic_load_explicit(&estimate->srttUs, memory_order_relaxed);
+    u_int64_t loss = atomic_load_explicit(&estimate->loss, memory_order_relaxed);
+    return srtt + (srtt * loss >> 13);
+}
+// Returns the upstream with the lowest score other than skip, or a random other one now
+// and then if explore is set. -1 if the pool has no other upstream
+static int pickUpstream(DnsWorker* worker, DnsUpstreamPool* pool, int skip, bool explore) {
+    int candidates = pool->numUpstreams - (skip != -1);
+    if(candidates == 0) {
+        return -1;
+    }
+    if(explore && candidates > 1 && randomU16(&worker->random) % 100 < pool->explorePercent) {
+        int pick = randomU16(&worker->random) % candidates;
+        return skip != -1 && pick >= skip ? pick + 1 : pick;
+    }
+    int best = -1;
+    u_int64_t bestScore = 0;
+    for(int i = 0;i < pool->numUpstreams;i++) {
+        u_int64_t score = upstreamScore(upstreamEstimate(worker, pool, i));
+        if(i != skip && (best == -1 || score < bestScore)) {
+            best = i;
+            bestScore = score;
+        }
+    }
+    return best;
+}
+static void setUpstream(OutgoingRequestTrackingData* req, DnsUpstreamPool* pool, int upstream) {
+    req->pool = pool;
+    req->upstream = upstream;
+    req->destination = pool->destinations[upstream];
+    req->destinationLength = sizeof(struct sockaddr_in);
+    req->tcp = pool->streams[upstream];
+}
+static void smoothRtt(DnsUpstreamEstimate* estimate, u_int64_t us) {
+    u_int32_t sample = us < UINT32_MAX ? (u_int32_t)us : UINT32_MAX;
+    u_int32_t srtt = atomic_load_explicit(&estimate->srttUs, memory_order_relaxed);
+    u_int32_t rttVar = atomic_load_explicit(&estimate->rttVarUs, memory_order_relaxed);
+    if(srtt == 0) {
+        srtt = sample > 0 ? sample : 1;
+        rttVar = sample / 2;
+    } else {
+        u_int32_t deviation = sample > srtt ? sample - srtt : srtt - sample;
+        rttVar = (u_int32_t)(((u_int64_t)rttVar * 3 + deviation) / 4);
+        srtt = (u_int32_t)(((u_int64_t)srtt * 7 + sample) / 8);
+        srtt = srtt > 0 ? srtt : 1;
+    }
+    atomic_store_explicit(&estimate->srttUs, srtt, memory_order_relaxed);
+    atomic_store_explicit(&estimate->rttVarUs, rttVar, memory_order_relaxed);
+}
+// Loss is averaged over the last 16 or so queries
+static void updateLoss(DnsUpstreamEstimate* estimate, bool lost) {
+    u_int32_t loss = atomic_load_explicit(&estimate->loss, memory_order_relaxed);
+    loss = lost ? loss + ((65536 - loss) >> 4) : loss - (loss >> 4);
+    atomic_store_explicit(&estimate->loss, loss, memory_order_relaxed);
+}
+// A reply from the upstream a request was sent to. Only requests sent once are timed, as
+// a reply to a resent one could be to any of its sends
+static void noteUpstreamReply(DnsWorker* worker, OutgoingRequestTrackingData* req, u_int64_t now) {
+    DnsUpstreamEstimate* estimate = upstreamEstimate(worker, req->pool, req->upstream);
+    addStat(&estimate->counters[UPSTREAM_REPLIES], 1);
+    if(req->hedgeOf != -1) {
+        addStat(&estimate->counters[UPSTREAM_HEDGES_WON], 1);
+    }
+    if(req->resendCount == 0) {
+        smoothRtt(estimate, now - req->sentAt);
+    }
+    updateLoss(estimate, false);
+}
+// The other upstream answered first, so this one takes at least elapsed us. Without this
+// an upstream that is always beaten would never be measured as slow
+static void noteUpstreamBeaten(DnsWorker* worker, OutgoingRequestTrackingData* req, u_int64_t elapsed) {
+    DnsUpstreamEstimate* estimate = upstreamEstimate(worker, req->pool, req->upstream);
+    if(req->resendCount == 0 && elapsed > atomic_load_explicit(&estimate->srttUs, memory_order_relaxed)) {
+        smoothRtt(estimate, elapsed);
+    }
+}
+// The resend delay passed without a reply, which counts as a sample of that long as well,
+// so an upstream that has never answered stops scoring 0
+static void noteUpstreamTimeout(DnsWorker* worker, OutgoingRequestTrackingData* req) {
+    DnsUpstreamEstimate* estimate = upstreamEstimate(worker, req->pool, req->upstream);
+    addStat(&estimate->counters[UPSTREAM_TIMEOUTS], 1);
+    u_int64_t delay = (u_int64_t)worker->state->resendDelay * 1000;
+    if(delay > atomic_load_explicit(&estimate->srttUs, memory_order_relaxed)) {
+        smoothRtt(estimate, delay);
+    }
+    updateLoss(estimate, true);
+}
+// Time in ms to wait for the upstream before hedging, the retransmission timeout RFC 6298
+// would use. Half the resend delay until it has been measured
+static u_int64_t hedgeDelay(DnsWorker* worker, OutgoingRequestTrackingData* req) {
+    DnsUpstreamEstimate* estimate = upstreamEstimate(worker, req->pool, req->upstream);
+    u_int64_t srtt = atomic_load_explicit(&estimate->srttUs, memory_order_relaxed);
+    u_int64_t rttVar = atomic_load_explicit(&estimate->rttVarUs, memory_order_relaxed);
+    u_int64_t delay = srtt == 0 ? (u_int64_t)worker->state->resendDelay / 2 : (srtt + 4 * rttVar + 999) / 1000;
+    return delay > (u_int64_t)req->pool->hedgeMinDelay ? delay : (u_int64_t)req->pool->hedgeMinDelay;
+}
+// Sends a copy of a request that is taking too long to the next fastest upstream. The copy
+// is not owned by the cycle, it lives only as long as the request stays unanswered
+static void sendHedge(DnsWorker* worker, u_int32_t idx) {
+    OutgoingRequestTrackingData* req = getRequest(worker, idx);
+    int upstream = pickUpstream(worker, req->pool, req->upstream, false);
+    u_int32_t hedgeIdx;
+    if(upstream == -1 || !allocPoolEntry(&worker->requestPool, &hedgeIdx)) {
+        return;
+    }
+    OutgoingRequestTrackingData* hedge = getRequest(worker, hedgeIdx);
+    hedge->worker = worker;
+    hedge->id.data = (u_int64_t)hedge->generation << 32 | hedgeIdx;
+    hedge->owner = req->owner;
+    hedge->nextOwned = -1;
+    hedge->sent = true;
+    hedge->answered = false;
+    hedge->failed = false;
+    hedge->awaited = false;
+    hedge->resendCount = 0;
+    hedge->hedge = -1;
+    hedge->hedgeOf = (int)idx;
+    hedge->connection = -1;
+    hedge->writer = req->writer;
+    hedge->requestLength = req->requestLength;
+    hedge->questionHash = req->questionHash;
+    memcpy(hedge->request, req->request, req->requestLength);
+    setUpstream(hedge, req->pool, upstream);
+    if(transmitRequest(worker, hedgeIdx) != 0) {
+        hedge->owner = -1;
+        hedge->generation++;
+        freeRequest(worker, hedgeIdx);
+        return;
+    }
+    hedge->sentAt = monotonicUs();
+    req->hedge = (int)hedgeIdx;
+    countUpstream(worker, req->pool, upstream, UPSTREAM_QUERIES);
+    countUpstream(worker, req->pool, upstream, UPSTREAM_HEDGES);
+}
+// Stops a request from being hedged, and drops its copy if one was sent, so a late reply
+// to it is ignored
+static void cancelHedge(DnsWorker* worker, u_int32_t idx) {
+    OutgoingRequestTrackingData* req = getRequest(worker, idx);
+    cancelTimer(&worker->timers, &req->hedgeTimer);
+    if(req->hedge == -1) {
+        return;
+    }
+    u_int32_t hedgeIdx = req->hedge;
+    OutgoingRequestTrackingData* hedge = getRequest(worker, hedgeIdx);
+    req->hedge = -1;
+    removeMatch(worker, hedgeIdx);
+    hedge->owner = -1;
+    hedge->generation++;
+    freeRequest(worker, hedgeIdx);
+}
+// Thread placement
+
+/// Bits of the node masks passed to the memory policy calls, enough for any machine
+#define NODE_MASK_BITS 1024
+#define NODE_MASK_WORDS (NODE_MASK_BITS / (8 * sizeof(unsigned long)))
+/// Instructions of the steering program
+#define STEER_PROGRAM_LENGTH 12
+
+/// A thread's memory policy, as saved by preferNode
+typedef struct DnsMemoryPolicy {
+    bool saved;
+    int mode;
+    unsigned long mask[NODE_MASK_WORDS];
+} DnsMemoryPolicy;
+
+static unsigned int workerCpu(const DnsState* state, int index) {
+    return state->workerCpus[index % state->numWorkerCpus];
+}
+// The NUMA node of a CPU, from the nodeN link sysfs gives it. -1 if there is none, as on
+// kernels without NUMA support
+static int cpuNode(unsigned int cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u", cpu);
+    DIR* dir = opendir(path);
+    if(dir == NULL) {
+        return -1;
+    }
+    int node = -1;
+    struct dirent* entry;
+    while((entry = readdir(dir)) != NULL) {
+        if(strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+// Makes the pages the calling thread touches from now on come from the given node, saving
+// its policy for restoreMemoryPolicy. Does nothing for node -1, or where the kernel
+// refuses, as placement only affects speed
+static void preferNode(int node, DnsMemoryPolicy* previous) {
+    previous->saved = false;
+    if(node < 0 || node >= NODE_MASK_BITS ||
+       syscall(SYS_get_mempolicy, &previous->mode, previous->mask, NODE_MASK_BITS, NULL, 0) != 0) {
+        return;
+    }
+    unsigned long mask[NODE_MASK_WORDS] = {0};
+    mask[node / (8 * sizeof(unsigned long))] = 1ul << (node % (8 * sizeof(unsigned long)));
+    previous->saved = syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, NODE_MASK_BITS) == 0;
+}
+static void restoreMemoryPolicy(const DnsMemoryPolicy* previous) {
+    if(previous->saved) {
+        syscall(SYS_set_mempolicy, previous->mode, previous->mask, NODE_MASK_BITS);
+    }
+}
+// Pins the calling thread to the CPU of the worker it runs. Once pinned, the pages it
+// touches first come from that CPU's node under the default policy
+static void pinWorker(DnsWorker* worker) {
+    unsigned int cpu = workerCpu(worker->state, worker->index);
+    if(cpu >= CPU_SETSIZE) {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+}
+// Whether no worker before the given one is pinned to its CPU
+static bool firstOnCpu(const DnsState* state, int index) {
+    for(int i = 0;i < index;i++) {
+        if(workerCpu(state, i) == workerCpu(state, index)) {
+            return false;
+        }
+    }
+    return true;
+}
+// Makes the map and program that steer a listener's packets or connections to the first
+// worker pinned to the CPU that received them, so each is handled on the CPU its RX queue
+// interrupts and on the same node. The program looks the CPU up in a map of sockets, and
+// the kernel falls back to its hash for a CPU without one. A map holds the sockets
+// themselves, unlike a classic program's index into the group, so it stays right when
+// sockets close or another process joins the group. Best effort, as loading the program
+// needs CAP_BPF or CAP_SYS_ADMIN and kernels before 4.19 have no such maps
+static void createSteering(DnsState* state, DnsSteering* out) {
+    out->map = -1;
+    out->program = -1;
+    unsigned int numCpus = 0;
+    for(unsigned int i = 0;i < state->numWorkerCpus;i++) {
+        numCpus = state->workerCpus[i] >= numCpus ? state->workerCpus[i] + 1 : numCpus;
+    }
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_REUSEPORT_SOCKARRAY;
+    attr.key_size = sizeof(u_int32_t);
+    attr.value_size = sizeof(u_int64_t);
+    attr.max_entries = numCpus;
+    out->map = syscall(SYS_bpf, BPF_MAP_CREATE, &attr, sizeof(attr));
+    if(out->map < 0) {
+        out->map = -1;
+        return;
+    }
+    // key = cpu; bpf_sk_select_reuseport(ctx, map, &key, 0); return SK_PASS
+    struct bpf_insn code[STEER_PROGRAM_LENGTH] = {
+        {.code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_6, .src_reg = BPF_REG_1},
+        {.code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_get_smp_processor_id},
+        {.code = BPF_STX | BPF_MEM | BPF_W, .dst_reg = BPF_REG_10, .src_reg = BPF_REG_0, .off = -4},
+        {.code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_1, .src_reg = BPF_REG_6},
+        {.code = BPF_LD | BPF_DW | BPF_IMM, .dst_reg = BPF_REG_2, .src_reg = BPF_PSEUDO_MAP_FD, .imm = out->map},
+        {0},
+        {.code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_3, .src_reg = BPF_REG_10},
+        {.code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_3, .imm = -4},
+        {.code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_4, .imm = 0},
+        {.code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_sk_select_reuseport},
+        {.code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0, .imm = SK_PASS},
+        {.code = BPF_JMP | BPF_EXIT},
+    };
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_SK_REUSEPORT;
+    attr.insns = (u_int64_t)(uintptr_t)code;
+    attr.insn_cnt = STEER_PROGRAM_LENGTH;
+    attr.license = (u_int64_t)(uintptr_t)"Dual MIT/GPL";
+    out->program = syscall(SYS_bpf, BPF_PROG_LOAD, &attr, sizeof(attr));
+    if(out->program < 0) {
+        close(out->map);
+        out->map = -1;
+        out->program = -1;
+    }
+}
+static void destroySteering(DnsSteering* steering) {
+    if(steering->program != -1) {
+        close(steering->program);
+    }
+    if(steering->map != -1) {
+        close(steering->map);
+    }
+}
+// Puts a worker's listener socket in the steering map if it is the first worker on its CPU,
+// and attaches the program to the group, which every socket of the group can do
+static void steerListener(DnsState* state, DnsSteering* steering, int index, int socket) {
+    if(steering->program == -1) {
+        return;
+    }
+    if(firstOnCpu(state, index)) {
+        u_int32_t cpu = workerCpu(state, index);
+        u_int64_t value = socket;
+        union bpf_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.map_fd = steering->map;
+        attr.key = (u_int64_t)(uintptr_t)&cpu;
+        attr.value = (u_int64_t)(uintptr_t)&value;
+        attr.flags = BPF_ANY;
+        syscall(SYS_bpf, BPF_MAP_UPDATE_ELEM, &attr, sizeof(attr));
+    }
+    setsockopt(socket, SOL_SOCKET, SO_ATTACH_REUSEPORT_EBPF, &steering->program, sizeof(steering->program));
+}
+static int makeListener(const CdnsListenerConfig* config, DnsListener* out) {
+    // Socket creation timeline:
+    // Create socket, with protocol type(socket)
+    // Set socket options(setsockopt, fcntl)
+    // Bind socket()
+    // Destroy socket()
+    int sock;
+    int domain, type, protocol;
+    int port = htons(config->port);
+    if(config->port == 0) {
+        if(config->proto == CdnsProtoUdp) {
+            port = htons(CDNS_DNS_UDP_PORT);
+        } else if(config->proto == CdnsProtoTcp) {
+            port = htons(CDNS_DNS_TCP_PORT);
+        } else if(config->proto == CdnsProtoHttp) {
+            port = htons(CDNS_DNS_HTTP_PORT);
+        }
+        // No need for error check, that will happen later
+    }
+    if(config->netProto == CdnsNetProtoInet4) {
+        domain = AF_INET;
+    } else if(config->netProto == CdnsNetProtoInet6) {
+        domain = AF_INET6;
+    } else {
+        return CDNS_ERR_UNDEFINED;
+    }
+    if(config->proto == CdnsProtoTcp || config->proto == CdnsProtoHttp) {
+        type = SOCK_STREAM;
+        protocol = 0;
+        sock = socket(domain, type, protocol);
+    } else if(config->proto == CdnsProtoUdp) {
+        type = SOCK_DGRAM;
+        protocol = 0;
+        sock = socket(domain, type, protocol);
+    } else {
+        return CDNS_ERR_UNDEFINED;
+    }
+    if(sock == -1) {
+        return CDNS_ERR_UNDEFINED;
+    }
+    int one = 1;
+    // Every worker binds its own socket to the same address
+    if(setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) {
+        close(sock);
+        return CDNS_ERR_UNDEFINED;
+    }
+    int flags = fcntl(sock, F_GETFL, 0);
+    if(flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) != 0) {
+        close(sock);
+        return CDNS_ERR_UNDEFINED;
+    }
+    if(config->netProto == CdnsNetProtoInet4) {
+        struct sockaddr_in addr = {
+            .sin_family = AF_INET,
+            .sin_port = port,
+        };
+        // config->addr has no alignment guarantees
+        memcpy(&addr.sin_addr, config->addr, 4);
+        int err = bind(sock, (struct sockaddr*)&addr, sizeof(struct sockaddr_in));
+        if(err != 0) {
+            close(sock);
+            return CDNS_ERR_UNDEFINED;
+        }
+    } else {
+        struct sockaddr_in6 addr = {
+            .sin6_family = AF_INET6,
+            .sin6_port = port,
+        };
+        memcpy((void*)&addr.sin6_addr, config->addr, 16);
+        int err = bind(sock, (struct sockaddr*)&addr, sizeof(struct sockaddr_in6));
+        if(err != 0) {
+            close(sock);
+            return CDNS_ERR_UNDEFINED;
+        }
+    }
+    if(type == SOCK_STREAM && listen(sock, SOMAXCONN) != 0) {
+        close(sock);
+        return CDNS_ERR_UNDEFINED;
+    }
+    out->config = *config;
+    out->isOpen = true;
+    out->socket = sock;
+    return 0;
+}
+static void initRequest(void* entry, u_int32_t idx, void* arg) {
+    OutgoingRequestTrackingData* req = (OutgoingRequestTrackingData*)entry;
+    req->owner = -1;
+    req->generation = 0;
+    req->matchable = false;
+    req->inflight = false;
+    req->leader = -1;
+    req->followers = -1;
+    req->connection = -1;
+    req->queuedWrite = false;
+    req->resendTimer.pprev = NULL;
+    req->resendTimer.kind = TIMER_RESEND;
+    req->resendTimer.index = idx;
+    req->hedgeTimer.pprev = NULL;
+    req->hedgeTimer.kind = TIMER_HEDGE;
+    req->hedgeTimer.index = idx;
+    req->response = req->responseBuffer;
+    req->responseEntries = req->responseEntriesBuffer;
+    req->responseCapacity = CDNS_UDP_BUFFER_SIZE;
+}
+static void initConnection(void* entry, u_int32_t idx, void* arg) {
+    DnsTcpConnection* conn = (DnsTcpConnection*)entry;
+    conn->open = false;
+    conn->generation = 0;
+    conn->idleTimer.pprev = NULL;
+    conn->idleTimer.kind = TIMER_IDLE;
+    conn->idleTimer.index = idx;
+}
+static u_int32_t roundUpPowerOfTwo(u_int32_t value) {
+    u_int32_t out = 1;
+    while(out < value) {
+        out <<= 1;
+    }
+    return out;
+}
+static void destroyWorkerRing(DnsWorkerRing* ring) {
+    if(ring == NULL) {
+        return;
+    }
+    // The buffers are taken back from the kernel before the ring is closed, as closing it
+    // cancels the armed receives asynchronously
+    destroyBufferRing(&ring->ring, &ring->listenerBuffers);
+    destroyBufferRing(&ring->ring, &ring->upstreamBuffers);
+    destroyRing(&ring->ring);
+    free(ring->files);
+    free(ring->armed);
+    free(ring->held);
+    free(ring);
+}
+// Sets up the io_uring for a worker's UDP sockets, or returns NULL for it to stay on epoll
+static DnsWorkerRing* createWorkerRing(DnsWorker* worker) {
+    DnsState* state = worker->state;
+    DnsWorkerRing* ring = (DnsWorkerRing*)calloc(1, sizeof(DnsWorkerRing));
+    if(ring == NULL) {
+        return NULL;
+    }
+    ring->ring.fd = -1;
+    ring->numFiles = state->numListeners + state->upstreamPorts;
+    u_int32_t numBuffers = roundUpPowerOfTwo(state->batchSize * 4 > RING_MIN_BUFFERS ? state->batchSize * 4 :
+                                             RING_MIN_BUFFERS);
+    // Buffer ids are 16 bits, and the kernel takes at most 32768 buffers per ring
+    numBuffers = numBuffers > 32768 ? 32768 : numBuffers;
+    // Every buffer starts with the kernel's io_uring_recvmsg_out and the source address
+    u_int32_t bufferSize = (sizeof(struct io_uring_recvmsg_out) + sizeof(DnsSockAddr) + CDNS_UDP_BUFFER_SIZE + 63) &
+                           ~63u;
+    // Room for a full batch of responses next to the armed receives, so that flushing never
+    // has to submit early
+    u_int32_t entries = roundUpPowerOfTwo(state->batchSize + ring->numFiles);
+    ring->files = (int*)malloc(sizeof(int) * ring->numFiles);
+    ring->armed = (bool*)calloc(ring->numFiles, sizeof(bool));
+    ring->held = (DnsRingHeld*)malloc(sizeof(DnsRingHeld) * numBuffers);
+    if(ring->files == NULL || ring->armed == NULL || ring->held == NULL ||
+       !createRing(&ring->ring, entries, entries * 4) ||
+       !createBufferRing(&ring->ring, &ring->listenerBuffers, 0, numBuffers, bufferSize) ||
+       !createBufferRing(&ring->ring, &ring->upstreamBuffers, 1, numBuffers, bufferSize)) {
+        destroyWorkerRing(ring);
+        return NULL;
+    }
+    for(u_int32_t i = 0;i < ring->numFiles;i++) {
+        ring->files[i] = -1;
+    }
+    for(int i = 0;i < state->numListeners;i++) {
+        if(state->listenerConfigs[i].proto == CdnsProtoUdp) {
+            ring->files[i] = worker->listeners[i].socket;
+        }
+    }
+    if(!ringRegisterFiles(&ring->ring, ring->files, ring->numFiles)) {
+        destroyWorkerRing(ring);
+        return NULL;
+    }
+    ring->recvHeader.msg_namelen = sizeof(DnsSockAddr);
+    ring->needsArming = true;
+    return ring;
+}
+static int initWorker(DnsState* state, DnsWorker* worker, int index) {
+    memset(worker, 0, sizeof(DnsWorker));
+    worker->state = state;
+    worker->index = index;
+    int err = createBatchIo(&worker->batch, state->batchSize);
+    if(err != 0) {
+        return err;
+    }
+    if(state->threadOutgoingRequests > 0) {
+        if(createPool(&worker->requestPool, sizeof(OutgoingRequestTrackingData), state->threadOutgoingRequests,
+                      initRequest, NULL) != 0) {
+            return CDNS_ERR_MEM;
+        }
+        err = createMatchTable(&worker->matches, state->threadOutgoingRequests);
+        if(err == 0) {
+            err = createMatchTable(&worker->inflight, state->threadOutgoingRequests);
+        }
+        if(err != 0) {
+            return err;
+        }
+    }
+    if(createPool(&worker->connectionPool, sizeof(DnsTcpConnection), state->tcpMaxConnections, initConnection,
+                  NULL) != 0) {
+        return CDNS_ERR_MEM;
+    }
+    worker->pausedConnections = -1;
+    worker->listeners = (DnsListener*)calloc(state->numListeners, sizeof(DnsListener));
+    if(worker->listeners == NULL && state->numListeners > 0) {
+        return CDNS_ERR_MEM;
+    }
+    err = createCache(&worker->cache, state->cacheBytes);
+    if(err != 0) {
+        return err;
+    }
+    worker->cache.snapshot = state->snapshot;
+    worker->snapshotTimer.kind = TIMER_SNAPSHOT;
+    if(state->rrlRate != 0 && !createRateSketch(&worker->rateSketch)) {
+        return CDNS_ERR_MEM;
+    }
+    worker->events = calloc(state->batchSize, sizeof(struct epoll_event));
+    worker->armedDeadline = UINT64_MAX;
+    atomic_store(&worker->zoneEpoch, ZONE_IDLE);
+    initTimerWheel(&worker->timers, monotonicMs());
+    fillRandom(&worker->random);
+    worker->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    worker->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(worker->events == NULL || worker->epollFd == -1 || worker->timerFd == -1) {
+        return CDNS_ERR_MEM;
+    }
+    struct epoll_event event = {.events = EPOLLIN};
+    event.data.u64 = eventTag(EVENT_TIMER, 0);
+    epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->timerFd, &event);
+    event.data.u64 = eventTag(EVENT_WAKE, 0);
+    epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, state->wakeFd, &event);
+    for(int i = 0;i < state->numListeners;i++) {
+        err = makeListener(&state->listenerConfigs[i], &worker->listeners[i]);
+        if(err != 0) {
+            return err;
+        }
+        if(state->steering != NULL) {
+            steerListener(state, &state->steering[i], index, worker->listeners[i].socket);
+        }
+    }
+    if(state->ioBackend == CdnsIoUring) {
+        worker->ring = createWorkerRing(worker);
+        if(worker->ring != NULL) {
+            event.data.u64 = eventTag(EVENT_RING, 0);
+            if(epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->ring->ring.fd, &event) != 0) {
+                return CDNS_ERR_UNDEFINED;
+            }
+            atomic_store_explicit(&worker->batch.stats.ringThreads, 1, memory_order_relaxed);
+        }
+    }
+    for(int i = 0;i < state->numListeners;i++) {
+        if(worker->ring != NULL && state->listenerConfigs[i].proto == CdnsProtoUdp) {
+            continue;
+        }
+        event.data.u64 = eventTag(EVENT_LISTENER, i);
+        if(epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->listeners[i].socket, &event) != 0) {
+            return CDNS_ERR_UNDEFINED;
+        }
+    }
+    return 0;
+}
+// With pinned workers, the pages a worker's setup touches come from the node of its CPU,
+// although it runs on whichever thread adds the worker. The policy only places pages that
+// are faulted while it is set, so what setup allocates but leaves untouched, such as large
+// calloc blocks, is placed on first touch by the worker once it is pinned, which is local too
+static int createWorker(DnsState* state, DnsWorker* worker, int index) {
+    DnsMemoryPolicy previous;
+    preferNode(state->numWorkerCpus > 0 ? cpuNode(workerCpu(state, index)) : -1, &previous);
+    int err = initWorker(state, worker, index);
+    restoreMemoryPolicy(&previous);
+    return err;
+}
+// Closes the sockets of every open TCP connection, without touching the slots they hold
+static void closeConnectionSockets(DnsWorker* worker) {
+    for(u_int32_t i = 0;i < worker->connectionPool.numEntries;i++) {
+        DnsTcpConnection* conn = (DnsTcpConnection*)poolEntry(&worker->connectionPool, i);
+        if(conn->open) {
+            close(conn->socket);
+            conn->open = false;
+            conn->generation++;
+        }
+    }
+}
+static void destroyWorker(DnsWorker* worker) {
+    // Registered files keep their sockets open until the ring is gone
+    destroyWorkerRing(worker->ring);
+    worker->ring = NULL;
+    if(poolCreated(&worker->connectionPool)) {
+        closeConnectionSockets(worker);
+    }
+    if(worker->listeners != NULL) {
+        for(int i = 0;i < worker->state->numListeners;i++) {
+            DnsListener* listener = &worker->listeners[i];
+            if(listener->isOpen) {
+                close(listener->socket);
+            }
+        }
+        free(worker->listeners);
+    }
+    if(worker->upstreamSockets != NULL) {
+        for(int i = 0;i < worker->state->upstreamPorts;i++) {
+            if(worker->upstreamSockets[i] != -1) {
+                close(worker->upstreamSockets[i]);
+            }
+        }
+        free(worker->upstreamSockets);
+    }
+    if(worker->upstreamConnections != NULL) {
+        for(int c = 0;c < UPSTREAM_TCP_MAX_CONNECTIONS;c++) {
+            DnsUpstreamConnection* conn = &worker->upstreamConnections[c];
+            if(conn->active && conn->socket != -1) {
+                close(conn->socket);
+            }
+            free(conn->reply);
+        }
+        free(worker->upstreamConnections);
+    }
+    destroyMatchTable(&worker->matches);
+    destroyMatchTable(&worker->inflight);
+    if(worker->epollFd > 0) close(worker->epollFd);
+    if(worker->timerFd > 0) close(worker->timerFd);
+    free(worker->events);
+    destroyBatchIo(&worker->batch);
+    destroyCache(&worker->cache);
+    freeSnapshotShard(worker->snapshotBuilding);
+    freeSnapshotShard(atomic_load(&worker->snapshotShard));
+    destroyRateSketch(&worker->rateSketch);
+    for(u_int32_t idx = 0;poolCreated(&worker->requestPool) && idx < worker->requestPool.numEntries;idx++) {
+        releaseReply(getRequest(worker, idx));
+    }
+    destroyPool(&worker->requestPool);
+    destroyCyclePool(worker);
+    destroyPool(&worker->connectionPool);
+}
+static void unmapZone(DnsLoadedZone* zone) {
+    munmap((void*)zone->zone.image, zone->zone.length);
+    free(zone);
+}
+// Unmaps the replaced zones no worker can still be reading: a worker that woke after a zone
+// was replaced read the new one, and an idle worker reads none. Must be called with
+// connections.lock held
+static void reclaimZones(DnsState* state) {
+    u_int64_t oldest = ZONE_IDLE;
+    for(int i = 0;i < atomic_load(&state->numThreads);i++) {
+        u_int64_t epoch = atomic_load(&state->connections.workers[i].zoneEpoch);
+        oldest = epoch < oldest ? epoch : oldest;
+    }
+    DnsLoadedZone** link = &state->retiredZones;
+    while(*link != NULL) {
+        DnsLoadedZone* zone = *link;
+        if(zone->retiredAt <= oldest) {
+            *link = zone->next;
+            unmapZone(zone);
+            atomic_fetch_sub(&state->numRetiredZones, 1);
+        } else {
+            link = &zone->next;
+        }
+    }
+}
+static void destroyDnsConnections(DnsState* state) {
+    DnsConnections* connections = &state->connections;
+    if(connections->workers != NULL) {
+        for(int i = 0;i < atomic_load(&state->numThreads);i++) {
+            destroyWorker(&connections->workers[i]);
+        }
+        free(connections->workers);
+    }
+    if(connections->threads != 0) {
+        free(connections->threads);
+    }
+    pthread_mutex_destroy(&connections->lock);
+}
+// Saves the caches every snapshotInterval from the copies the workers hand over. A worker
+// that has not finished a copy since the last save is saved from its previous one
+static void* runSnapshotThread(void* arg) {
+    DnsState* state = (DnsState*)arg;
+    DnsSnapshotShard** shards = (DnsSnapshotShard**)calloc(state->maxThreads, sizeof(DnsSnapshotShard*));
+    pthread_mutex_lock(&state->snapshotLock);
+    while(shards != NULL && !state->snapshotStop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += state->snapshotInterval / 1000;
+        deadline.tv_nsec += (long)(state->snapshotInterval % 1000) * 1000000;
+        if(deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while(!state->snapshotStop &&
+              pthread_cond_timedwait(&state->snapshotWake, &state->snapshotLock, &deadline) != ETIMEDOUT) {}
+        if(state->snapshotStop) {
+            break;
+        }
+        pthread_mutex_unlock(&state->snapshotLock);
+        int numWorkers = atomic_load(&state->numThreads);
+        bool copied = false;
+        for(int i = 0;i < numWorkers;i++) {
+            DnsSnapshotShard* shard = atomic_exchange(&state->connections.workers[i].snapshotShard, NULL);
+            if(shard != NULL) {
+                freeSnapshotShard(shards[i]);
+                shards[i] = shard;
+                copied = true;
+            }
+        }
+        if(copied) {
+            writeSnapshot(state, shards, numWorkers);
+        }
+        pthread_mutex_lock(&state->snapshotLock);
+    }
+    pthread_mutex_unlock(&state->snapshotLock);
+    for(int i = 0;shards != NULL && i < state->maxThreads;i++) {
+        freeSnapshotShard(shards[i]);
+    }
+    free(shards);
+    return NULL;
+}
+static void startSnapshotThread(DnsState* state) {
+    if(state->snapshotInterval == 0 || state->snapshotThreadRunning) {
+        return;
+    }
+    state->snapshotStop = false;
+    state->snapshotThreadRunning = pthread_create(&state->snapshotThread, NULL, runSnapshotThread, state) == 0;
+}
+static void stopSnapshotThread(DnsState* state) {
+    if(!state->snapshotThreadRunning) {
+        return;
+    }
+    pthread_mutex_lock(&state->snapshotLock);
+    state->snapshotStop = true;
+    pthread_cond_signal(&state->snapshotWake);
+    pthread_mutex_unlock(&state->snapshotLock);
+    pthread_join(state->snapshotThread, NULL);
+    state->snapshotThreadRunning = false;
+}
+// Saves every worker's cache in full, once no worker is running so the caller is the only
+// thread touching them
+static void saveCaches(DnsState* state) {
+    if(state->snapshotPath == NULL || !state->snapshotStale || state->connections.numRunning > 0) {
+        return;
+    }
+    int numWorkers = atomic_load(&state->numThreads);
+    DnsSnapshotShard** shards = (DnsSnapshotShard**)calloc(numWorkers, sizeof(DnsSnapshotShard*));
+    u_int64_t now = monotonicMs();
+    int64_t wallOffset = (int64_t)(wallClockMs() - now);
+    bool copied = shards != NULL;
+    for(int i = 0;copied && i < numWorkers;i++) {
+        DnsCache* cache = &state->connections.workers[i].cache;
+        shards[i] = (DnsSnapshotShard*)calloc(1, sizeof(DnsSnapshotShard));
+        copied = shards[i] != NULL && copyCacheEntries(cache, 0, cache->numBuckets, now, wallOffset, shards[i]);
+    }
+    if(copied && writeSnapshot(state, shards, numWorkers)) {
+        state->snapshotStale = false;
+    }
+    for(int i = 0;shards != NULL && i < numWorkers;i++) {
+        freeSnapshotShard(shards[i]);
+    }
+    free(shards);
+}
+// Fills in a zeroed state from the config and creates the initial workers. On failure the
+// state is left for freeState
+static int initState(DnsState* state, const CdnsConfig* config) {
+    if(config->threadRequests != 0) {
+        state->threadRequests = config->threadRequests;
+    } else {
+        state->threadRequests = DEFAULT_THREAD_REQUESTS;
+    }
+    state->threadOutgoingRequests = config->threadOutgoingRequests;
+    if(config->resendDelayMs != 0) {
+        state->resendDelay = config->resendDelayMs;
+    } else {
+        state->resendDelay = DEFAULT_RESEND_DELAY;
+    }
+    if(config->maxResendCount != 0) {
+        state->maxResendCount = config->maxResendCount;
+    } else {
+        state->maxResendCount = DEFAULT_RESEND_ATTEMPTS;
+    }
+    unsigned int initialThreads = config->initialThreads != 0 ? config->initialThreads : 1;
+    unsigned int maxThreads = config->maxThreads > initialThreads ? config->maxThreads : initialThreads;
+    if(maxThreads > INT_MAX) {
+        return CDNS_ERR_THREADS;
+    }
+    state->maxThreads = maxThreads;
+    if(config->numWorkerCpus > 0) {
+        state->workerCpus = (unsigned int*)malloc(config->numWorkerCpus * sizeof(unsigned int));
+        if(state->workerCpus == NULL) {
+            return CDNS_ERR_MEM;
+        }
+        memcpy(state->workerCpus, config->workerCpus, config->numWorkerCpus * sizeof(unsigned int));
+        state->numWorkerCpus = config->numWorkerCpus;
+    }
+    state->batchSize = config->batchSize != 0 ? config->batchSize : DEFAULT_BATCH_SIZE;
+    state->cacheBytes = config->cacheBytes;
+    state->cacheAutoAnswer = !config->cacheSkipAutoAnswer;
+    // Without a cache there is nothing to save or warm up
+    state->snapshotPath = NULL;
+    state->snapshotInterval = 0;
+    state->snapshot = NULL;
+    if(config->cacheSnapshotPath != NULL && config->cacheBytes > 0) {
+        state->snapshotPath = strdup(config->cacheSnapshotPath);
+        if(state->snapshotPath == NULL) {
+            return CDNS_ERR_MEM;
+        }
+        state->snapshotInterval = config->cacheSnapshotIntervalMs;
+        state->snapshot = openSnapshot(state->snapshotPath);
+    }
+    state->snapshotStale = false;
+    state->snapshotThreadRunning = false;
+    state->snapshotStop = false;
+    state->coalesce = !config->upstreamSkipCoalescing;
+    state->upstreamTcpConnections = config->upstreamTcpConnections != 0 ? config->upstreamTcpConnections
+                                                                        : DEFAULT_UPSTREAM_TCP_CONNECTIONS;
+    state->tcpFallback = !config->upstreamSkipTcpFallback;
+    state->upstreamPorts = config->upstreamPorts != 0 ? config->upstreamPorts : DEFAULT_UPSTREAM_PORTS;
+    state->tcpMaxConnections = config->tcpMaxConnections != 0 ? config->tcpMaxConnections
+                                                              : DEFAULT_TCP_MAX_CONNECTIONS;
+    state->tcpIdleTimeout = config->tcpIdleTimeoutMs != 0 ? config->tcpIdleTimeoutMs : DEFAULT_TCP_IDLE_TIMEOUT;
+    state->ioBackend = config->ioBackend;
+    state->rrlRate = config->rrlResponsesPerSecond < RATE_MAX_COUNT ? config->rrlResponsesPerSecond
+                                                                    : RATE_MAX_COUNT - 1;
+    state->rrlAction = config->rrlAction;
+    state->rrlSlip = config->rrlSlip != 0 ? config->rrlSlip : DEFAULT_RRL_SLIP;
+    state->ednsUdpSize = config->ednsUdpSize == 0 || config->ednsUdpSize > CDNS_UDP_BUFFER_SIZE ? CDNS_UDP_BUFFER_SIZE
+                         : config->ednsUdpSize < CDNS_CLASSIC_UDP_SIZE ? CDNS_CLASSIC_UDP_SIZE
+                         : config->ednsUdpSize;
+    state->pools = NULL;
+    atomic_init(&state->zone, NULL);
+    atomic_init(&state->zoneEpoch, 0);
+    state->retiredZones = NULL;
+    atomic_init(&state->numRetiredZones, 0);
+    memset(&state->callback, 0, sizeof(CdnsCallbackDescriptor));
+    state->listening = false;
+    state->paused = true;
+    atomic_init(&state->stopRequested, false);
+    atomic_init(&state->numThreads, 0);
+
+    state->wakeFd = eventfd(0, EFD_NONBLOCK);
+    if(state->wakeFd == -1) {
+        return CDNS_ERR_UNDEFINED;
+    }
+
+    state->numListeners = config->numListeners;
+    state->listenerConfigs = (CdnsListenerConfig*)malloc(config->numListeners * sizeof(CdnsListenerConfig));
+    if(state->listenerConfigs == NULL && config->numListeners > 0) {
+        return CDNS_ERR_MEM;
+    }
+    if(config->numListeners > 0) {
+        memcpy(state->listenerConfigs, config->listeners, config->numListeners * sizeof(CdnsListenerConfig));
+    }
+
+    if(state->numWorkerCpus > 0 && state->numListeners > 0) {
+        state->steering = (DnsSteering*)malloc(state->numListeners * sizeof(DnsSteering));
+        if(state->steering == NULL) {
+            return CDNS_ERR_MEM;
+        }
+        for(int i = 0;i < state->numListeners;i++) {
+            createSteering(state, &state->steering[i]);
+        }
+    }
+    DnsConnections* connections = &state->connections;
+    connections->threads = (pthread_t*)calloc(state->maxThreads, sizeof(pthread_t));
+    // Aligned for the cache line aligned stats in each worker
+    connections->workers = (DnsWorker*)aligned_alloc(CDNS_CACHE_LINE, state->maxThreads * sizeof(DnsWorker));
+    if(connections->threads == NULL || connections->workers == NULL) {
+        return CDNS_ERR_MEM;
+    }
+    memset(connections->workers, 0, state->maxThreads * sizeof(DnsWorker));
+    // The initial workers' sockets are bound up front so that address errors surface here
+    for(int i = 0;i < (int)initialThreads;i++) {
+        int err = createWorker(state, &connections->workers[i], i);
+        atomic_store(&state->numThreads, i + 1);
+        if(err != 0) {
+            return err;
+        }
+    }
+    return 0;
+}
+// Frees a state made by cdnsCreateDns, including one whose initState failed partway
+static void freeState(DnsState* state) {
+    destroyDnsConnections(state);
+    while(state->pools != NULL) {
+        DnsUpstreamPool* pool = state->pools;
+        state->pools = pool->next;
+        free(pool->destinations);
+        free(pool->streams);
+        free(pool->estimates);
+        free(pool);
+    }
+    while(state->retiredZones != NULL) {
+        DnsLoadedZone* zone = state->retiredZones;
+        state->retiredZones = zone->next;
+        unmapZone(zone);
+    }
+    if(atomic_load(&state->zone) != NULL) {
+        unmapZone(atomic_load(&state->zone));
+    }
+    closeSnapshot(state->snapshot);
+    free(state->snapshotPath);
+    pthread_mutex_destroy(&state->snapshotLock);
+    pthread_cond_destroy(&state->snapshotWake);
+    for(int i = 0;state->steering != NULL && i < state->numListeners;i++) {
+        destroySteering(&state->steering[i]);
+    }
+    free(state->steering);
+    free(state->listenerConfigs);
+    free(state->workerCpus);
+    if(state->wakeFd != -1) {
+        close(state->wakeFd);
+    }
+    free(state);
+}
+int cdnsCreateDns(CdnsState **out, const CdnsConfig *config) {
+    DnsState* state = (DnsState*)calloc(1, sizeof(DnsState));
+    if(state == NULL) {
+        return CDNS_ERR_MEM;
+    }
+    state->wakeFd = -1;
+    pthread_mutex_init(&state->connections.lock, NULL);
+    pthread_mutex_init(&state->snapshotLock, NULL);
+    // Waits are timed on the monotonic clock, so stepping the wall clock does not skip a save
+    pthread_condattr_t snapshotWakeAttributes;
+    pthread_condattr_init(&snapshotWakeAttributes);
+    pthread_condattr_setclock(&snapshotWakeAttributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&state->snapshotWake, &snapshotWakeAttributes);
+    pthread_condattr_destroy(&snapshotWakeAttributes);
+    int err = initState(state, config);
+    if(err != 0) {
+        freeState(state);
+        return err;
+    }
+    *out = (CdnsState*)state;
+    return 0;
+}
+int cdnsDestroyDns(CdnsState *_state) {
+    DnsState* state = (DnsState*)_state;
+    if(state->listening) {
         int a = cdnsPause(_state);
         if(a != 0) {
             return a;
         }
     }
-
-    for(int i = 0;i < state->numListeners;i++) {
-        DnsListener* listener = &state->listeners[i];
-        if(listener->isOpen) {
-            close(listener->socket);
+    stopSnapshotThread(state);
+    saveCaches(state);
+    freeState(state);
+    return 0;
+}
+int cdnsSetCallback(CdnsState *_state, const CdnsCallbackDescriptor* callback) {
+    if(callback->callback == NULL) {
+        return CDNS_ERR_INVALID_CALLBACK;
+    }
+    DnsState* state = (DnsState*)_state;
+    if(!state->paused) {
+        return CDNS_ERR_MODIFY_WHILE_RUNNING;
+    }
+    state->callback = *callback;
+    // Slots are sized for the callback data, so each worker recreates them when it next starts.
+    // TCP connections may be holding slots, so they are dropped too
+    for(int i = 0;i < atomic_load(&state->numThreads);i++) {
+        DnsWorker* worker = &state->connections.workers[i];
+        closeConnectionSockets(worker);
+        destroyPool(&worker->connectionPool);
+        worker->pausedConnections = -1;
+        if(createPool(&worker->connectionPool, sizeof(DnsTcpConnection), state->tcpMaxConnections, initConnection,
+                      NULL) != 0) {
+            return CDNS_ERR_MEM;
+        }
+        destroyCyclePool(worker);
+    }
+    return 0;
+}
+// Sends the queued responses with one sendmsg each and a single submission. The sends fail
+// rather than wait for room, so they are done with the slots once it returns, and their
+// completions are counted by reapRing
+static void submitResponses(DnsWorker* worker, u_int64_t now) {
+    DnsBatchIo* batch = &worker->batch;
+    DnsRing* ring = &worker->ring->ring;
+    for(int i = 0;i < batch->numQueued;i++) {
+        ResponseCycleData* cycle = getCycle(worker, batch->sendSlots[i]);
+        struct msghdr* hdr = &batch->sendMessages[i].msg_hdr;
+        hdr->msg_name = &cycle->client;
+        hdr->msg_namelen = cycle->clientLength;
+        batch->sendIovecs[i].iov_base = cycle->response;
+        batch->sendIovecs[i].iov_len = CDNS_HEADER_SIZE + cycle->writer.length;
+        ringSend(ring, cycle->listener, hdr, ringTag(RING_SEND, now - cycle->receivedAt));
+    }
+    if(ringSubmit(ring) < 0) {
+        addStat(&batch->stats.sendDropped, batch->numQueued);
+        countStat(worker, STAT_QUERIES_DROPPED, batch->numQueued);
+        return;
+    }
+    addStat(&batch->stats.sendBatches, 1);
+    recordBatchFill(batch->stats.sendFill, batch->numQueued, batch->batchSize);
+}
+// Sends the queued responses with one sendmmsg per run of them on the same listener
+static void sendResponses(DnsWorker* worker, u_int64_t now) {
+    DnsBatchIo* batch = &worker->batch;
+    int start = 0;
+    while(start < batch->numQueued) {
+        int listener = getCycle(worker, batch->sendSlots[start])->listener;
+        int end = start;
+        while(end < batch->numQueued && getCycle(worker, batch->sendSlots[end])->listener == listener) {
+            ResponseCycleData* cycle = getCycle(worker, batch->sendSlots[end]);
+            struct msghdr* hdr = &batch->sendMessages[end].msg_hdr;
+            hdr->msg_name = &cycle->client;
+            hdr->msg_namelen = cycle->clientLength;
+            batch->sendIovecs[end].iov_base = cycle->response;
+            batch->sendIovecs[end].iov_len = CDNS_HEADER_SIZE + cycle->writer.length;
+            end++;
+        }
+        int sent = start;
+        while(sent < end) {
+            int r = sendmmsg(worker->listeners[listener].socket, &batch->sendMessages[sent], end - sent, MSG_DONTWAIT);
+            if(r <= 0) {
+                if(r == -1 && errno == EINTR) continue;
+                // Socket buffer full or the client is unreachable, UDP responses are best effort
+                addStat(&batch->stats.sendDropped, end - sent);
+                countStat(worker, STAT_QUERIES_DROPPED, end - sent);
+                break;
+            }
+            addStat(&batch->stats.sendBatches, 1);
+            addStat(&batch->stats.sendPackets, r);
+            recordBatchFill(batch->stats.sendFill, r, batch->batchSize);
+            countStat(worker, STAT_RESPONSES_SENT, r);
+            for(int i = sent;i < sent + r;i++) {
+                recordLatency(&worker->stats.endToEnd, now - getCycle(worker, batch->sendSlots[i])->receivedAt);
+            }
+            sent += r;
+        }
+        start = end;
+    }
+}
+// Hands the queued responses to the replay's response hook in place of sending them
+static void replayResponses(DnsWorker* worker, u_int64_t now) {
+    DnsBatchIo* batch = &worker->batch;
+    DnsReplay* replay = worker->replay;
+    const CdnsReplayConfig* config = replay->config;
+    enum DnsReplayStage stage = switchStage(replay, REPLAY_SEND);
+    for(int i = 0;i < batch->numQueued;i++) {
+        ResponseCycleData* cycle = getCycle(worker, batch->sendSlots[i]);
+        if(config->response != NULL) {
+            config->response(config->context, cycle->client.in4.sin_addr.s_addr, ntohs(cycle->client.in4.sin_port),
+                             cycle->response, CDNS_HEADER_SIZE + cycle->writer.length);
+        }
+        recordLatency(&worker->stats.endToEnd, now - cycle->receivedAt);
+    }
+    countStat(worker, STAT_RESPONSES_SENT, batch->numQueued);
+    replay->stats.responses += batch->numQueued;
+    switchStage(replay, stage);
+}
+// Sends everything queued by cdnsSendResponse, then releases the slots
+static void flushResponses(DnsWorker* worker) {
+    DnsBatchIo* batch = &worker->batch;
+    if(batch->numQueued == 0) {
+        return;
+    }
+    u_int64_t now = monotonicUs();
+    if(worker->replay != NULL) {
+        replayResponses(worker, now);
+    } else if(worker->ring != NULL) {
+        submitResponses(worker, now);
+    } else {
+        sendResponses(worker, now);
+    }
+    for(int i = 0;i < batch->numQueued;i++) {
+        ResponseCycleData* cycle = getCycle(worker, batch->sendSlots[i]);
+        cycle->writer.flushed = true;
+        // A callback may respond before it is done, finishCycle releases those slots
+        if(cycle->finished) {
+            freeCycle(worker, batch->sendSlots[i]);
+        }
+    }
+    batch->numQueued = 0;
+}
+// Returns the outgoing request with the given id, or NULL if it was freed or never existed
+static OutgoingRequestTrackingData* findRequest(DnsWorker* worker, CdnsRequestId id) {
+    size_t idx = id.data & 0xFFFFFFFF;
+    if(!poolContains(&worker->requestPool, idx)) {
+        return NULL;
+    }
+    OutgoingRequestTrackingData* req = getRequest(worker, idx);
+    if(req->owner == -1 || req->generation != id.data >> 32) {
+        return NULL;
+    }
+    return req;
+}
+// Points the timerfd at the wheel's next deadline, if that changed
+static void armTimer(DnsWorker* worker) {
+    if(worker->replay != NULL) {
+        // cdnsReplay sleeps until the deadline itself
+        return;
+    }
+    u_int64_t deadline = nextTimerDeadline(&worker->timers);
+    if(deadline == worker->armedDeadline) {
+        return;
+    }
+    worker->armedDeadline = deadline;
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if(deadline != UINT64_MAX) {
+        spec.it_value.tv_sec = deadline / 1000;
+        spec.it_value.tv_nsec = (deadline % 1000) * 1000000;
+        if(spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+            spec.it_value.tv_nsec = 1;
+        }
+    }
+    timerfd_settime(worker->timerFd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+static DnsTcpConnection* getConnection(DnsWorker* worker, u_int32_t idx) {
+    return (DnsTcpConnection*)poolEntry(&worker->connectionPool, idx);
+}
+// Returns the connection a TCP query came in on, or NULL if it has since been closed
+static DnsTcpConnection* liveConnection(DnsWorker* worker, const ResponseCycleData* cycle) {
+    DnsTcpConnection* conn = getConnection(worker, cycle->connection);
+    if(!conn->open || conn->generation != cycle->connectionGeneration) {
+        return NULL;
+    }
+    return conn;
+}
+static void unlinkPausedConnection(DnsWorker* worker, u_int32_t idx) {
+    DnsTcpConnection* conn = getConnection(worker, idx);
+    if(conn->prevPaused == -1) {
+        worker->pausedConnections = conn->nextPaused;
+    } else {
+        getConnection(worker, conn->prevPaused)->nextPaused = conn->nextPaused;
+    }
+    if(conn->nextPaused != -1) {
+        getConnection(worker, conn->nextPaused)->prevPaused = conn->prevPaused;
+    }
+    conn->paused = false;
+}
+// Slots held by queries from the connection, counting those both running and queued twice
+// for TCP. Every HTTP query is queued from the moment it is read
+static int connectionBacklog(const DnsTcpConnection* conn) {
+    return conn->http ? conn->numQueued : conn->inFlight + conn->numQueued;
+}
+// Reading is held back while the client has TCP_MAX_PIPELINED queries in flight or waiting
+// to be written, or no slot is free, leaving further queries in the socket buffer
+static void updateConnectionEvents(DnsWorker* worker, u_int32_t idx) {
+    DnsTcpConnection* conn = getConnection(worker, idx);
+    bool slotsFree = conn->readCycle != -1 || poolAvailable(&worker->cyclePool) > 0;
+    bool canRead = !conn->readClosed && connectionBacklog(conn) < TCP_MAX_PIPELINED && slotsFree;
+    bool canWrite = conn->writeHead != -1 && getCycle(worker, conn->writeHead)->writer.queued;
+    u_int32_t events = (canRead ? EPOLLIN : 0) | (canWrite ? EPOLLOUT : 0);
+    if(events != conn->events) {
+        struct epoll_event event = {.events = events};
+        event.data.u64 = eventTag(EVENT_CONNECTION, idx);
+        epoll_ctl(worker->epollFd, EPOLL_CTL_MOD, conn->socket, &event);
+        conn->events = events;
+    }
+    // Connections starved of slots are woken by resumeConnections
+    if(!conn->readClosed && !slotsFree && !conn->paused) {
+        countStat(worker, STAT_REQUEST_SLOTS_EXHAUSTED, 1);
+        conn->paused = true;
+        conn->prevPaused = -1;
+        conn->nextPaused = worker->pausedConnections;
+        if(worker->pausedConnections != -1) {
+            getConnection(worker, worker->pausedConnections)->prevPaused = (int)idx;
+        }
+        worker->pausedConnections = (int)idx;
+    }
+}
+// Closes a connection. Queries from it that are still running finish normally, but their
+// responses are dropped
+static void closeConnection(DnsWorker* worker, u_int32_t idx) {
+    DnsTcpConnection* conn = getConnection(worker, idx);
+    close(conn->socket);
+    cancelTimer(&worker->timers, &conn->idleTimer);
+    if(conn->paused) {
+        unlinkPausedConnection(worker, idx);
+    }
+    if(conn->readCycle != -1) {
+        freeCycle(worker, conn->readCycle);
+    }
+    int next = conn->writeHead;
+    while(next != -1) {
+        ResponseCycleData* cycle = getCycle(worker, next);
+        int following = cycle->nextWrite;
+        // Those not queued yet are counted when they finish
+        if(cycle->writer.queued) {
+            countStat(worker, STAT_QUERIES_DROPPED, 1);
+        }
+        cycle->writer.flushed = true;
+        if(cycle->finished) {
+            freeCycle(worker, next);
+        }
+        next = following;
+    }
+    conn->open = false;
+    conn->generation++;
+    freePoolEntry(&worker->connectionPool, idx);
+}
+// Closes the connection once the client has stopped sending and every answer is written,
+// otherwise brings its epoll events up to date
+static void settleConnection(DnsWorker* worker, u_int32_t idx) {
+    DnsTcpConnection* conn = getConnection(worker, idx);
+    if(conn->readClosed && conn->inFlight == 0 && conn->writeHead == -1 && conn->readCycle == -1) {
+        closeConnection(worker, idx);
+    } else {
+        updateConnectionEvents(worker, idx);
+    }
+}
+static int appendText(char* out, int pos, const char* text) {
+    int length = (int)strlen(text);
+    memcpy(out + pos, text, length);
+    return pos + length;
+}
+static int appendNumber(char* out, int pos, int value) {
+    char digits[12];
+    int numDigits = 0;
+    do {
+        digits[numDigits++] = '0' + value % 10;
+        value /= 10;
+    } while(value > 0);
+    while(numDigits > 0) {
+        out[pos++] = digits[--numDigits];
+    }
+    return pos;
+}
+static const char* httpReason(int status) {
+    switch(status) {
+    case 400: return "Bad Request";
+    case 405: return "Method Not Allowed";
+    case 411: return "Length Required";
+    case 413: return "Content Too Large";
+    case 415: return "Unsupported Media Type";
+    default: return "Internal Server Error";
+    }
+}
+// Bytes written from the cycle's response buffer, none for an HTTP error
+static int streamResponseLength(const DnsTcpConnection* conn, const ResponseCycleData* cycle) {
+    if(conn->http && cycle->httpStatus != 0) {
+        return 0;
+    }
+    return CDNS_HEADER_SIZE + cycle->writer.length;
+}
+// Writes what goes in front of a response into out and returns its length: the length
+// prefix for TCP, the status line and headers for HTTP
+static int responseFraming(const DnsTcpConnection* conn, const ResponseCycleData* cycle, char* out) {
+    int length = streamResponseLength(conn, cycle);
+    if(!conn->http) {
+        out[0] = length >> 8;
+        out[1] = length & 0xFF;
+        return 2;
+    }
+    int pos;
+    if(cycle->httpStatus == 0) {
+        pos = appendText(out, 0, "HTTP/1.1 200 OK\r\nContent-Type: application/dns-message\r\nContent-Length: ");
+        pos = appendNumber(out, pos, length);
+        return appendText(out, pos, "\r\n\r\n");
+    }
+    pos = appendText(out, 0, "HTTP/1.1 ");
+    pos = appendNumber(out, pos, cycle->httpStatus);
+    pos = appendText(out, pos, " ");
+    pos = appendText(out, pos, httpReason(cycle->httpStatus));
+    if(cycle->httpStatus == 405) {
+        pos = appendText(out, pos, "\r\nAllow: GET, POST");
+    }
+    return appendText(out, pos, "\r\nContent-Length: 0\r\n\r\n");
+}
+// Writes queued responses, several per sendmsg, until the socket would block. Over TCP
+// responses go out in the order their callbacks finished, not the order the queries came
+// in. HTTP responses carry nothing to match them to their request by, so there writing
+// stops at the first request still waiting for its answer
+static void writeConnection(DnsWorker* worker, u_int32_t idx) {
+    DnsTcpConnection* conn = getConnection(worker, idx);
+    u_int64_t now = 0;
+    while(conn->writeHead != -1 && getCycle(worker, conn->writeHead)->writer.queued) {
+        struct iovec iov[2 * TCP_WRITE_BATCH];
+        char framing[TCP_WRITE_BATCH][HTTP_MAX_FRAMING];
+        int totals[TCP_WRITE_BATCH];
+        int numIov = 0;
+        int next = conn->writeHead;
+        for(int i = 0;i < TCP_WRITE_BATCH && next != -1;i++) {
+            ResponseCycleData* cycle = getCycle(worker, next);
+            if(!cycle->writer.queued) {
+                break;
+            }
+            int framingLength = responseFraming(conn, cycle, framing[i]);
+            int length = streamResponseLength(conn, cycle);
+            totals[i] = framingLength + length;
+            // Only the first response can have been partly written already
+            if(cycle->written < framingLength) {
+                iov[numIov].iov_base = framing[i] + cycle->written;
+                iov[numIov++].iov_len = framingLength - cycle->written;
+                if(length > 0) {
+                    iov[numIov].iov_base = cycle->response;
+                    iov[numIov++].iov_len = length;
+                }
+            } else {
+                iov[numIov].iov_base = cycle->response + cycle->written - framingLength;
+                iov[numIov++].iov_len = totals[i] - cycle->written;
+            }
+            next = cycle->nextWrite;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = numIov;
+        ssize_t sent = sendmsg(conn->socket, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if(sent < 0) {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+            closeConnection(worker, idx);
+            return;
+        }
+        for(int i = 0;sent > 0;i++) {
+            ResponseCycleData* cycle = getCycle(worker, conn->writeHead);
+            int remaining = totals[i] - cycle->written;
+            if(sent < remaining) {
+                cycle->written += sent;
+                break;
+            }
+            sent -= remaining;
+            if(now == 0) {
+                now = monotonicUs();
+            }
+            countStat(worker, STAT_RESPONSES_SENT, 1);
+            recordLatency(&worker->stats.endToEnd, now - cycle->receivedAt);
+            u_int32_t done = conn->writeHead;
+            conn->writeHead = cycle->nextWrite;
+            conn->numQueued--;
+            cycle->writer.flushed = true;
+            if(cycle->finished) {
+                freeCycle(worker, done);
+            }
+        }
+        if(conn->writeHead != -1 && getCycle(worker, conn->writeHead)->written > 0) {
+            // A partial write means the socket buffer is full
+            break;
+        }
+    }
+    if(conn->writeHead == -1) {
+        conn->writeTail = -1;
+    }
+}
+// Links a cycle in at the end of the connection's write queue
+static void appendWrite(DnsWorker* worker, DnsTcpConnection* conn, ResponseCycleData* cycle) {
+    cycle->written = 0;
+    cycle->nextWrite = -1;
+    if(conn->writeHead == -1) {
+        conn->writeHead = cycle->context.index;
+    } else {
+        getCycle(worker, conn->writeTail)->nextWrite = cycle->context.index;
+    }
+    conn->writeTail = cycle->context.index;
+    conn->numQueued++;
+}
+// Called from cdnsSendResponse for queries that came in over TCP or HTTP
+static void queueTcpResponse(DnsWorker* worker, ResponseCycleData* cycle) {
+    DnsTcpConnection* conn = liveConnection(worker, cycle);
+    if(conn == NULL) {
+        cycle->writer.flushed = true;
+        return;
+    }
+    u_int32_t idx = cycle->connection;
+    // HTTP queries are queued as they are read
+    if(!conn->http) {
+        appendWrite(worker, conn, cycle);
+    }
+    // Responses behind the head go out along with it, and a head that was not ready until
+    // now is not waiting on EPOLLOUT, so try right away
+    if(conn->writeHead == cycle->context.index) {
+        u_int32_t generation = conn->generation;
+        writeConnection(worker, idx);
+        if(conn->generation == generation) {
+            updateConnectionEvents(worker, idx);
+        }
+    }
+}
+// Closes a connection that has been quiet for tcpIdleTimeoutMs, unless it still has
+// queries to answer
+static void expireConnection(DnsWorker* worker, u_int32_t idx) {
+    DnsTcpConnection* conn = getConnection(worker, idx);
+    if(conn->inFlight > 0 || conn->writeHead != -1) {
+        scheduleTimer(&worker->timers, &conn->idleTimer, monotonicMs() + worker->state->tcpIdleTimeout);
+        return;
+    }
+    closeConnection(worker, idx);
+}
+// Whether the cycle that made a request, which was just answered or gave up, is to be
+// resumed: it waits on that request alone, or on a set of them that is now complete
+static bool requestSettled(DnsWorker* worker, OutgoingRequestTrackingData* req) {
+    ResponseCycleData* cycle = getCycle(worker, req->owner);
+    if(cycle->info.status == CdnsPoll) {
+        return cycle->info.data.id.data == req->id.data;
+    }
+    if(cycle->info.status != CdnsPollMany || !req->awaited) {
+        return false;
+    }
+    req->awaited = false;
+    cycle->awaitPending--;
+    return !cycle->awaitAll || cycle->awaitPending == 0;
+}
+// Ends a CdnsPollMany wait before the callback is resumed
+static void stopAwaiting(DnsWorker* worker, ResponseCycleData* cycle) {
+    cancelTimer(&worker->timers, &cycle->waitTimer);
+    for(int next = cycle->ownedRequests;next != -1;next = getRequest(worker, next)->nextOwned) {
+        getRequest(worker, next)->awaited = false;
+    }
+    cycle->awaitPending = 0;
+}
+// Hands the reply of a request, or its failure, to every request sharing its query, each
+// copy with the follower's own id. Waiting cycles are resumed through their wait timer
+// rather than run here, so no callback can free followers while the list is walked
+static void completeFollowers(DnsWorker* worker, u_int32_t leaderIdx) {
+    OutgoingRequestTrackingData* leader = getRequest(worker, leaderIdx);
+    int next = leader->followers;
+    leader->followers = -1;
+    while(next != -1) {
+        OutgoingRequestTrackingData* follower = getRequest(worker, next);
+        next = follower->nextFollower;
+        follower->leader = -1;
+        if(leader->answered && reserveReply(follower, leader->responseLength)) {
+            memcpy(follower->response, leader->response, leader->responseLength);
+            follower->response[0] = follower->writer.header.id >> 8;
+            follower->response[1] = follower->writer.header.id & 0xFF;
+            follower->responseLength = leader->responseLength;
+            readHeader(follower->response, &follower->responseHeader);
+            follower->responseIndexed = false;
+            follower->answered = true;
+        } else {
+            follower->failed = true;
+        }
+        if(requestSettled(worker, follower)) {
+            ResponseCycleData* cycle = getCycle(worker, follower->owner);
+            // Pulls a CdnsPollMany deadline in to now
+            cancelTimer(&worker->timers, &cycle->waitTimer);
+            cycle->waitTimer.kind = TIMER_WAIT;
+            cycle->waitTimer.index = follower->owner;
+            scheduleTimer(&worker->timers, &cycle->waitTimer, worker->timers.now);
+        }
+    }
+}
+static void attachFollower(DnsWorker* worker, u_int32_t leaderIdx, u_int32_t idx) {
+    OutgoingRequestTrackingData* leader = getRequest(worker, leaderIdx);
+    OutgoingRequestTrackingData* req = getRequest(worker, idx);
+    req->writer.header.id = randomU16(&worker->random);
+    req->leader = (int)leaderIdx;
+    req->prevFollower = -1;
+    req->nextFollower = leader->followers;
+    if(leader->followers != -1) {
+        getRequest(worker, leader->followers)->prevFollower = (int)idx;
+    }
+    leader->followers = (int)idx;
+}
+// Takes a request that is being freed out of query sharing. A follower is unlinked, and a
+// leader that still has followers hands its query over to the first of them
+static void detachRequest(DnsWorker* worker, u_int32_t idx) {
+    OutgoingRequestTrackingData* req = getRequest(worker, idx);
+    if(req->leader != -1) {
+        OutgoingRequestTrackingData* leader = getRequest(worker, req->leader);
+        if(req->prevFollower == -1) {
+            leader->followers = req->nextFollower;
+        } else {
+            getRequest(worker, req->prevFollower)->nextFollower = req->nextFollower;
+        }
+        if(req->nextFollower != -1) {
+            getRequest(worker, req->nextFollower)->prevFollower = req->prevFollower;
+        }
+        req->leader = -1;
+        return;
+    }
+    if(req->followers == -1) {
+        return;
+    }
+    u_int32_t heirIdx = req->followers;
+    OutgoingRequestTrackingData* heir = getRequest(worker, heirIdx);
+    req->followers = -1;
+    heir->leader = -1;
+    heir->followers = heir->nextFollower;
+    if(heir->followers != -1) {
+        getRequest(worker, heir->followers)->prevFollower = -1;
+    }
+    for(int next = heir->followers;next != -1;next = getRequest(worker, next)->nextFollower) {
+        getRequest(worker, next)->leader = (int)heirIdx;
+    }
+    // The query is already out, so the heir takes over its socket, id and resend schedule
+    heir->socketIndex = req->socketIndex;
+    heir->writer.header.id = req->writer.header.id;
+    heir->request[0] = req->request[0];
+    heir->request[1] = req->request[1];
+    heir->resendCount = req->resendCount;
+    handOverConnection(worker, idx, heirIdx);
+    removeMatch(worker, idx);
+    removeInflight(worker, idx);
+    insertMatch(worker, heirIdx);
+    insertInflight(worker, heirIdx);
+    u_int64_t expiry = timerScheduled(&req->resendTimer) ? req->resendTimer.expiry
+                                                         : worker->timers.now + worker->state->resendDelay;
+    cancelTimer(&worker->timers, &req->resendTimer);
+    scheduleTimer(&worker->timers, &heir->resendTimer, expiry);
+    // Along with the upstream it was picked from and its hedge
+    heir->pool = req->pool;
+    heir->upstream = req->upstream;
+    heir->sentAt = req->sentAt;
+    heir->hedge = req->hedge;
+    req->hedge = -1;
+    if(heir->hedge != -1) {
+        getRequest(worker, heir->hedge)->hedgeOf = (int)heirIdx;
+    }
+    if(timerScheduled(&req->hedgeTimer)) {
+        scheduleTimer(&worker->timers, &heir->hedgeTimer, req->hedgeTimer.expiry);
+        cancelTimer(&worker->timers, &req->hedgeTimer);
+    }
+}
+// Releases everything a completed cycle holds. If its response is still queued, the slot
+// itself is released by flushResponses instead
+static void finishCycle(DnsWorker* worker, size_t idx) {
+    ResponseCycleData* cycle = getCycle(worker, idx);
+    int next = cycle->ownedRequests;
+    while(next != -1) {
+        OutgoingRequestTrackingData* req = getRequest(worker, next);
+        int following = req->nextOwned;
+        detachRequest(worker, next);
+        cancelHedge(worker, next);
+        cancelTimer(&worker->timers, &req->resendTimer);
+        removeMatch(worker, next);
+        removeInflight(worker, next);
+        req->owner = -1;
+        req->generation++;
+        freeRequest(worker, next);
+        next = following;
+    }
+    cycle->ownedRequests = -1;
+    int connection = cycle->connection;
+    DnsTcpConnection* conn = connection != -1 ? liveConnection(worker, cycle) : NULL;
+    cycle->finished = true;
+    // Every HTTP request is answered, or the ones pipelined behind it could never be
+    bool unanswered = conn != NULL && conn->http && !cycle->writer.queued;
+    if(unanswered) {
+        cycle->writer.queued = true;
+        if(cycle->httpStatus == 0) {
+            cycle->httpStatus = 500;
+        }
+    }
+    if(!cycle->writer.queued) {
+        countStat(worker, STAT_QUERIES_DROPPED, 1);
+    }
+    if(!cycle->writer.queued || cycle->writer.flushed) {
+        freeCycle(worker, idx);
+    }
+    // Writing or settling may close the connection, which releases this slot if its
+    // response is queued
+    if(conn != NULL) {
+        conn->inFlight--;
+        if(unanswered && conn->writeHead == (int)idx) {
+            u_int32_t generation = conn->generation;
+            writeConnection(worker, connection);
+            if(conn->generation != generation) {
+                return;
+            }
+        }
+        settleConnection(worker, connection);
+    }
+}
+// Runs a callback until it completes or parks itself on a timer or an outgoing request
+static void runCycle(DnsWorker* worker, size_t idx, bool first) {
+    DnsState* state = worker->state;
+    ResponseCycleData* cycle = getCycle(worker, idx);
+    void* data = (char*)cycle + sizeof(ResponseCycleData);
+    while(true) {
+        if(cycle->info.status == CdnsPollMany) {
+            stopAwaiting(worker, cycle);
+        }
+        if(worker->replay != NULL) {
+            worker->replay->stats.callbacks++;
+            enum DnsReplayStage stage = switchStage(worker->replay, REPLAY_CALLBACK);
+            cycle->info = state->callback.callback((CdnsResponseContext*)cycle, data, first);
+            switchStage(worker->replay, stage);
+        } else {
+            cycle->info = state->callback.callback((CdnsResponseContext*)cycle, data, first);
+        }
+        first = false;
+        if(cycle->info.status == CdnsWaitMs) {
+            cycle->waitTimer.kind = TIMER_WAIT;
+            cycle->waitTimer.index = (int)idx;
+            scheduleTimer(&worker->timers, &cycle->waitTimer, monotonicMs() + cycle->info.data.ms);
+            return;
+        } else if(cycle->info.status == CdnsPoll) {
+            OutgoingRequestTrackingData* req = findRequest(worker, cycle->info.data.id);
+            if(req != NULL && req->sent && !req->answered && !req->failed) {
+                // Resumed by receiveUpstream once the reply arrives, or once the request gives up
+                return;
+            }
+            // Already answered or not a live request, so there is nothing to wait for
+        } else if(cycle->info.status == CdnsPollMany) {
+            if(cycle->awaitPending > 0 && (cycle->awaitAll || cycle->awaitDone == 0)) {
+                // Resumed once the set settles, or by the wait timer at the deadline
+                if(cycle->info.data.ms != 0) {
+                    cycle->waitTimer.kind = TIMER_WAIT;
+                    cycle->waitTimer.index = (int)idx;
+                    scheduleTimer(&worker->timers, &cycle->waitTimer, monotonicMs() + cycle->info.data.ms);
+                }
+                return;
+            }
+            // Settled already, or nothing to wait for
+        } else {
+            finishCycle(worker, idx);
+            return;
+        }
+    }
+}
+// Gives up on a request, along with those sharing its reply, and resumes whoever waits
+static void failRequest(DnsWorker* worker, size_t idx) {
+    OutgoingRequestTrackingData* req = getRequest(worker, idx);
+    req->failed = true;
+    cancelHedge(worker, idx);
+    removeMatch(worker, idx);
+    removeInflight(worker, idx);
+    completeFollowers(worker, idx);
+    if(requestSettled(worker, req)) {
+        runCycle(worker, req->owner, false);
+    }
+}
+// Resends an unanswered request, or gives up on it after maxResendCount resends and resumes
+// the cycle waiting on it
+static void resendRequest(DnsWorker* worker, size_t idx) {
+    DnsState* state = worker->state;
+    OutgoingRequestTrackingData* req = getRequest(worker, idx);
+    if(req->pool != NULL) {
+        noteUpstreamTimeout(worker, req);
+    }
+    if(req->resendCount < state->maxResendCount) {
+        req->resendCount++;
+        scheduleTimer(&worker->timers, &req->resendTimer, worker->timers.now + state->resendDelay);
+        if(req->tcp) {
+            // Nothing is lost over TCP, requests are written again if their connection breaks
+            return;
+        }
+        countStat(worker, STAT_UPSTREAM_RETRANSMITS, 1);
+        int upstream = req->pool != NULL ? pickUpstream(worker, req->pool, -1, false) : -1;
+        if(upstream != -1 && upstream != req->upstream) {
+            // Another upstream looks faster now that this one timed out, so the resend goes
+            // there, under a new id
+            int previous = req->upstream;
+            removeMatch(worker, idx);
+            removeInflight(worker, idx);
+            setUpstream(req, req->pool, upstream);
+            if(transmitRequest(worker, idx) != 0) {
+                // The new upstream can't be sent to, which counts against it as a timeout
+                // would so it isn't picked straight away again. The resend goes where the
+                // request went before, and the request fails if that can't be sent to either
+                noteUpstreamTimeout(worker, req);
+                setUpstream(req, req->pool, previous);
+                if(transmitRequest(worker, idx) != 0) {
+                    cancelTimer(&worker->timers, &req->resendTimer);
+                    failRequest(worker, idx);
+                    return;
+                }
+            }
+            if(state->coalesce) {
+                insertInflight(worker, idx);
+            }
+        } else if(worker->replay != NULL) {
+            askReplayStub(worker, req);
+        } else {
+            sendto(worker->upstreamSockets[req->socketIndex], req->request, req->requestLength, MSG_DONTWAIT,
+                   &req->destination.sa, req->destinationLength);
+        }
+        if(req->pool != NULL) {
+            countUpstream(worker, req->pool, req->upstream, UPSTREAM_QUERIES);
+        }
+        return;
+    }
+    countStat(worker, STAT_UPSTREAM_TIMEOUTS, 1);
+    failRequest(worker, idx);
+}
+/// Buckets of its cache a worker copies out for the snapshot per turn, so a copy never holds
+/// up queries for long
+#define SNAPSHOT_BUCKETS_PER_TURN 4096
+// Copies the next slice of the worker's cache for the snapshot thread, handing the copy over
+// once every bucket is in
+static void copyCacheSlice(DnsWorker* worker) {
+    DnsState* state = worker->state;
+    DnsCache* cache = &worker->cache;
+    u_int64_t now = monotonicMs();
+    if(worker->snapshotBuilding == NULL) {
+        worker->snapshotBuilding = (DnsSnapshotShard*)calloc(1, sizeof(DnsSnapshotShard));
+        worker->snapshotCursor = 0;
+    }
+    size_t end = worker->snapshotCursor + SNAPSHOT_BUCKETS_PER_TURN;
+    if(end > cache->numBuckets) {
+        end = cache->numBuckets;
+    }
+    if(worker->snapshotBuilding == NULL ||
+       !copyCacheEntries(cache, worker->snapshotCursor, end, now, (int64_t)(wallClockMs() - now),
+                         worker->snapshotBuilding)) {
+        // Out of memory, so this copy is dropped and the next one tried an interval later
+        freeSnapshotShard(worker->snapshotBuilding);
+        worker->snapshotBuilding = NULL;
+        scheduleTimer(&worker->timers, &worker->snapshotTimer, now + state->snapshotInterval);
+        return;
+    }
+    worker->snapshotCursor = end;
+    if(end < cache->numBuckets) {
+        scheduleTimer(&worker->timers, &worker->snapshotTimer, now + 1);
+        return;
+    }
+    freeSnapshotShard(atomic_exchange(&worker->snapshotShard, worker->snapshotBuilding));
+    worker->snapshotBuilding = NULL;
+    scheduleTimer(&worker->timers, &worker->snapshotTimer, now + state->snapshotInterval);
+}
+static void resumeAccepting(DnsWorker* worker);
+// Handles every timer that is due and rearms the timerfd
+static void runTimers(DnsWorker* worker) {
+    u_int64_t now = monotonicMs();
+    DnsTimer* timer;
+    while((timer = popExpiredTimer(&worker->timers, now)) != NULL) {
+        if(timer->kind == TIMER_WAIT) {
+            runCycle(worker, timer->index, false);
+        } else if(timer->kind == TIMER_RESEND) {
+            resendRequest(worker, timer->index);
+        } else if(timer->kind == TIMER_HEDGE) {
+            sendHedge(worker, timer->index);
+        } else if(timer->kind == TIMER_UPSTREAM_CONNECTION) {
+            upstreamConnectionTimer(worker, timer->index);
+        } else if(timer->kind == TIMER_SNAPSHOT) {
+            copyCacheSlice(worker);
+        } else if(timer->kind == TIMER_ACCEPT) {
+            resumeAccepting(worker);
+        } else {
+            expireConnection(worker, timer->index);
+        }
+    }
+    armTimer(worker);
+}
+// Queues a response straight from the cache if it has a fresh answer to the request
+static bool answerFromCache(DnsWorker* worker, ResponseCycleData* cycle) {
+    CdnsPacketReadInfo* request;
+    if(cdnsGetRequestReadInfo((CdnsResponseContext*)cycle, &request) != 0) {
+        return false;
+    }
+    u_int64_t now = monotonicMs();
+    u_int64_t restored = worker->cache.restored;
+    // Answers over TCP and HTTP may outgrow the slot's own buffer
+    DnsCacheEntry* entry = lookupCacheEntry(&worker->cache, request, now,
+                                            cycle->connection != -1 ? CDNS_STREAM_BUFFER_SIZE : cycle->responseCapacity);
+    if(worker->cache.restored != restored) {
+        countStat(worker, STAT_CACHE_RESTORED, 1);
+    }
+    if(entry == NULL || !growResponse(cycle, entry->packetLength)) {
+        return false;
+    }
+    int length = copyCacheEntry(entry, request, now, cycle->response);
+    readHeader(cycle->response, &cycle->writer.header);
+    cycle->writer.length = length - CDNS_HEADER_SIZE;
+    cdnsSendResponse((CdnsResponseWriteinfo*)&cycle->writer);
+    return true;
+}
+// Adds the records of an RRset under owner
+static int addZoneRRset(ResponseWriteInfo* writer, CdnsSection section, const unsigned char* owner,
+                        const DnsZoneNode* node, const DnsZoneRRset* rrset) {
+    CdnsResourceRecordInfo info = {.type = (CdnsRecordType)rrset->type, .clas = CDNS_RC_IN, .ttl = rrset->ttl};
+    u_int32_t pos = rrset->offset;
+    for(int i = 0;i < rrset->count;i++) {
+        const unsigned char* rdata;
+        if(!nextZoneRecord(node, &pos, &rdata, &info.rdlength)) {
+            return CDNS_ERR_MALFORMED;
+        }
+        int err = cdnsAddRecord((CdnsResponseWriteinfo*)writer, section, owner, &info, rdata);
+        if(err != 0) {
+            return err;
+        }
+    }
+    return 0;
+}
+// The SOA of the apex for a negative answer, with the TTL RFC 2308 asks for. owner is the
+// name looked up, so the apex is spelled as the query spelled it
+static int addZoneSoa(ResponseWriteInfo* writer, const DnsZone* zone, const unsigned char* owner, int ownerLength) {
+    const DnsZoneRRset* rrset = findZoneRRset(zone->apex, CDNS_RR_SOA);
+    u_int32_t pos = rrset != NULL ? rrset->offset : 0;
+    const unsigned char* rdata;
+    CdnsResourceRecordInfo info = {.type = CDNS_RR_SOA, .clas = CDNS_RC_IN};
+    if(rrset == NULL || !nextZoneRecord(zone->apex, &pos, &rdata, &info.rdlength) || info.rdlength < 20) {
+        return CDNS_ERR_MALFORMED;
+    }
+    u_int32_t minimum = readU32(rdata + info.rdlength - 4);
+    info.ttl = rrset->ttl < minimum ? rrset->ttl : minimum;
+    return cdnsAddRecord((CdnsResponseWriteinfo*)writer, CdnsSectionAuthority,
+                         owner + ownerLength - zone->apex->nameLength, &info, rdata);
+}
+// A referral to the child zone at node, with the addresses of its servers that the zone
+// holds as glue
+static int addZoneReferral(ResponseWriteInfo* writer, const DnsZone* zone, const unsigned char* owner,
+                           const DnsZoneNode* node) {
+    const DnsZoneRRset* ns = findZoneRRset(node, CDNS_RR_NS);
+    int err = addZoneRRset(writer, CdnsSectionAuthority, owner, node, ns);
+    u_int32_t pos = ns->offset;
+    for(int i = 0;err == 0 && i < ns->count;i++) {
+        const unsigned char* rdata;
+        u_int16_t rdlength;
+        unsigned char target[CDNS_NAME_MAX_LENGTH];
+        if(!nextZoneRecord(node, &pos, &rdata, &rdlength) || rdlength > CDNS_NAME_MAX_LENGTH) {
+            break;
+        }
+        memcpy(target, rdata, rdlength);
+        const DnsZoneNode* glue = findZoneName(zone, target, rdlength);
+        for(int t = 0;glue != NULL && t < 2 && err == 0;t++) {
+            const DnsZoneRRset* address = findZoneRRset(glue, t == 0 ? CDNS_RR_A : CDNS_RR_AAAA);
+            if(address != NULL) {
+                err = addZoneRRset(writer, CdnsSectionAdditional, rdata, glue, address);
+            }
+        }
+    }
+    // Glue that doesn't fit is left out, the resolver can look it up
+    return err == CDNS_ERR_TOO_LARGE && writer->header.nscount > 0 ? 0 : err;
+}
+// Answers a query for a name in the loaded zone, before the cache or callback sees it.
+// Returns false for names outside the zone and for queries a zone can't answer
+static bool answerFromZone(DnsWorker* worker, ResponseCycleData* cycle, const DnsZone* zone) {
+    CdnsPacketReadInfo* request;
+    CdnsQuestion question;
+    if(cycle->requestHeader.opcode != CDNS_OP_QUERY || cycle->requestHeader.qdcount != 1 ||
+       cdnsGetRequestReadInfo((CdnsResponseContext*)cycle, &request) != 0 ||
+       cdnsGetQuestion(request, 0, &question) != 0) {
+        return false;
+    }
+    // Zone transfers are left to the callback
+    if((question.qclass != CDNS_RC_IN && question.qclass != CDNS_RR_ALL) || question.qtype == CDNS_RR_AXFR ||
+       question.qtype == CDNS_RR_IXFR) {
+        return false;
+    }
+    // The name as the query spelled it, for the response, and a copy that lookups lowercase
+    unsigned char owner[CDNS_NAME_MAX_LENGTH];
+    unsigned char folded[CDNS_NAME_MAX_LENGTH];
+    int length;
+    if(cdnsReadName(request, request->questions[0], owner, sizeof(owner), &length) != 0) {
+        return false;
+    }
+    memcpy(folded, owner, length);
+    DnsZoneMatch match;
+    lookupZone(zone, folded, length, question.qtype, &match);
+    if(match.result == ZONE_OUTSIDE) {
+        return false;
+    }
+    ResponseWriteInfo* writer = &cycle->writer;
+    int err = cdnsAddQuestion((CdnsResponseWriteinfo*)writer, owner, question.qtype, question.qclass);
+    writer->header.aa = match.result != ZONE_DELEGATION;
+    for(int hops = 0;err == 0;hops++) {
+        const DnsZoneNode* node = match.node;
+        if(match.result == ZONE_DELEGATION) {
+            err = addZoneReferral(writer, zone, owner + match.suffix, node);
+            break;
+        }
+        if(match.result == ZONE_NXDOMAIN) {
+            writer->header.rcode = 3;
+            err = addZoneSoa(writer, zone, owner, length);
+            break;
+        }
+        if(question.qtype == CDNS_RR_ALL) {
+            const DnsZoneRRset* rrsets = zoneNodeRRsets(node);
+            for(int i = 0;err == 0 && i < node->numRRsets;i++) {
+                err = addZoneRRset(writer, CdnsSectionAnswer, owner, node, &rrsets[i]);
+            }
+            if(node->numRRsets == 0 && err == 0) {
+                err = addZoneSoa(writer, zone, owner, length);
+            }
+            break;
+        }
+        const DnsZoneRRset* rrset = findZoneRRset(node, question.qtype);
+        if(rrset != NULL) {
+            err = addZoneRRset(writer, CdnsSectionAnswer, owner, node, rrset);
+            break;
+        }
+        const DnsZoneRRset* cname = findZoneRRset(node, CDNS_RR_CNAME);
+        if(cname == NULL) {
+            err = addZoneSoa(writer, zone, owner, length);
+            break;
+        }
+        // Followed within the zone, the resolver picks up where the zone ends
+        err = addZoneRRset(writer, CdnsSectionAnswer, owner, node, cname);
+        u_int32_t pos = cname->offset;
+        const unsigned char* target;
+        u_int16_t targetLength;
+        if(err != 0 || hops == ZONE_MAX_CNAMES || !nextZoneRecord(node, &pos, &target, &targetLength) ||
+           targetLength > CDNS_NAME_MAX_LENGTH) {
+            break;
+        }
+        memcpy(owner, target, targetLength);
+        memcpy(folded, target, targetLength);
+        length = targetLength;
+        lookupZone(zone, folded, length, question.qtype, &match);
+        if(match.result == ZONE_OUTSIDE) {
+            break;
+        }
+    }
+    if(err == CDNS_ERR_TOO_LARGE) {
+        writer->header.tc = 1;
+    } else if(err != 0) {
+        // Only a damaged image gets here
+        writer->header.rcode = 2;
+        writer->header.aa = 0;
+    }
+    countStat(worker, STAT_ZONE_ANSWERS, 1);
+    cdnsSendResponse((CdnsResponseWriteinfo*)writer);
+    return true;
+}
+// Starts the callback for a freshly received request. Returns false if the request was
+// rejected, in which case the slot is still the caller's to release
+static bool dispatchRequest(DnsWorker* worker, size_t idx, int listener, int length) {
+    DnsState* state = worker->state;
+    ResponseCycleData* cycle = getCycle(worker, idx);
+    countStat(worker, STAT_QUERIES_RECEIVED, 1);
+    if(length < CDNS_HEADER_SIZE) {
+        countStat(worker, STAT_QUERIES_DROPPED, 1);
+        return false;
+    }
+    readHeader(cycle->request, &cycle->requestHeader);
+    if(cycle->requestHeader.qr != 0) {
+        countStat(worker, STAT_QUERIES_DROPPED, 1);
+        return false;
+    }
+    cycle->receivedAt = worker->readAt;
+    cycle->context.dns = state;
+    cycle->context.worker = worker;
+    cycle->context.index = (int)idx;
+    cycle->listener = listener;
+    cycle->requestLength = length;
+    cycle->ownedRequests = -1;
+    cycle->awaitPending = 0;
+    cycle->waitTimer.pprev = NULL;
+    cycle->finished = false;
+    cycle->requestIndexed = false;
+    memset(&cycle->writer, 0, sizeof(ResponseWriteInfo));
+    cycle->writer.header.id = cycle->requestHeader.id;
+    cycle->writer.header.qr = 1;
+    cycle->writer.header.opcode = cycle->requestHeader.opcode;
+    cycle->writer.header.rd = cycle->requestHeader.rd;
+    // Names in the zone and cache hits never wake the callback
+    DnsLoadedZone* zone = atomic_load_explicit(&state->zone, memory_order_acquire);
+    if(zone != NULL && answerFromZone(worker, cycle, &zone->zone)) {
+        finishCycle(worker, idx);
+        return true;
+    }
+    if(state->cacheAutoAnswer && worker->cache.buckets != NULL && answerFromCache(worker, cycle)) {
+        finishCycle(worker, idx);
+        return true;
+    }
+    runCycle(worker, idx, true);
+    return true;
+}
+// Takes the listeners out of the epoll set while every slot is busy, so that pending
+// datagrams don't wake the worker over and over. Those waiting for file descriptors stay out
+static void setListenersPaused(DnsWorker* worker, bool paused) {
+    struct epoll_event event;
+    for(int i = 0;i < worker->state->numListeners;i++) {
+        // UDP listeners on io_uring are held back by not rearming their receives instead
+        if(worker->ring != NULL && worker->ring->files[i] != -1) {
+            continue;
+        }
+        event.events = paused || worker->listeners[i].acceptPaused ? 0 : EPOLLIN;
+        event.data.u64 = eventTag(EVENT_LISTENER, i);
+        epoll_ctl(worker->epollFd, EPOLL_CTL_MOD, worker->listeners[i].socket, &event);
+    }
+    worker->listenersPaused = paused;
+}
+// Drains a UDP listener, up to batchSize datagrams per recvmmsg
+static void receiveBatches(DnsWorker* worker, int listener) {
+    DnsState* state = worker->state;
+    DnsBatchIo* batch = &worker->batch;
+    int sock = worker->listeners[listener].socket;
+    while(!atomic_load_explicit(&state->stopRequested, memory_order_relaxed)) {
+        int count = 0;
+        while(count < batch->batchSize &&
+              allocPoolEntry(&worker->cyclePool, &batch->recvSlots[count])) {
+            ResponseCycleData* cycle = getCycle(worker, batch->recvSlots[count]);
+            struct msghdr* hdr = &batch->recvMessages[count].msg_hdr;
+            hdr->msg_name = &cycle->client;
+            hdr->msg_namelen = sizeof(DnsSockAddr);
+            batch->recvIovecs[count].iov_base = cycle->request;
+            batch->recvIovecs[count].iov_len = CDNS_UDP_BUFFER_SIZE;
+            count++;
+        }
+        if(count == 0) {
+            // Every slot is busy, leave the datagrams in the socket buffer for now
+            countStat(worker, STAT_REQUEST_SLOTS_EXHAUSTED, 1);
+            setListenersPaused(worker, true);
+            return;
+        }
+        int r = recvmmsg(sock, batch->recvMessages, count, MSG_DONTWAIT, NULL);
+        if(r > 0) {
+            worker->readAt = monotonicUs();
+            addStat(&batch->stats.recvBatches, 1);
+            addStat(&batch->stats.recvPackets, r);
+            recordBatchFill(batch->stats.recvFill, r, batch->batchSize);
+        }
+        for(int i = 0;i < count;i++) {
+            size_t idx = batch->recvSlots[i];
+            bool started = false;
+            if(i < r && (batch->recvMessages[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+                countStat(worker, STAT_QUERIES_RECEIVED, 1);
+                countStat(worker, STAT_QUERIES_DROPPED, 1);
+            } else if(i < r) {
+                ResponseCycleData* cycle = getCycle(worker, idx);
+                cycle->clientLength = batch->recvMessages[i].msg_hdr.msg_namelen;
+                cycle->connection = -1;
+                started = dispatchRequest(worker, idx, listener, batch->recvMessages[i].msg_len);
+            }
+            if(!started) {
+                freeCycle(worker, idx);
+            }
+        }
+        flushResponses(worker);
+        if(r < count) {
+            return;
+        }
+    }
+}
+// Sends a request again over TCP after its UDP reply came back truncated, to the upstream
+// of the pool that sent that reply. Returns false if it could not be sent, and the
+// truncated reply is used
+static bool fallBackToTcp(DnsWorker* worker, u_int32_t idx, int upstream, u_int64_t now) {
+    DnsState* state = worker->state;
+    OutgoingRequestTrackingData* req = getRequest(worker, idx);
+    cancelHedge(worker, idx);
+    removeMatch(worker, idx);
+    removeInflight(worker, idx);
+    if(req->pool != NULL) {
+        setUpstream(req, req->pool, upstream);
+    }
+    req->tcp = true;
+    if(transmitRequest(worker, idx) != 0) {
+        return false;
+    }
+    if(state->coalesce) {
+        insertInflight(worker, idx);
+    }
+    countStat(worker, STAT_UPSTREAM_TCP_FALLBACKS, 1);
+    if(req->pool != NULL) {
+        countUpstream(worker, req->pool, req->upstream, UPSTREAM_QUERIES);
+    }
+    // Timed afresh, so the reply over TCP is a sample of its own
+    req->sentAt = now;
+    req->resendCount = 0;
+    cancelTimer(&worker->timers, &req->resendTimer);
+    scheduleTimer(&worker->timers, &req->resendTimer, worker->timers.now + state->resendDelay);
+    return true;
+}
+// Matches a reply from an upstream server to its outgoing request and resumes the cycle
+// waiting on it. A truncated UDP reply has the request sent again over TCP instead
+static void handleUpstreamReply(DnsWorker* worker, int socketIndex, const unsigned char* packet, int length,
+                                const DnsSockAddr* from) {
+    u_int64_t question;
+    if(from->sa.sa_family != AF_INET || !questionHash(packet, length, &question)) {
+        return;
+    }
+    u_int32_t idx = findMatch(worker, from, socketIndex, readU16(packet), question);
+    if(idx == CDNS_POOL_NONE) {
+        return;
+    }
+    OutgoingRequestTrackingData* req = getRequest(worker, idx);
+    u_int64_t now = monotonicUs();
+    countStat(worker, STAT_UPSTREAM_REPLIES, 1);
+    recordLatency(&worker->stats.upstreamRtt, now - req->sentAt);
+    if(req->pool != NULL) {
+        noteUpstreamReply(worker, req, now);
+    }
+    int upstream = req->upstream;
+    if(req->hedgeOf != -1) {
+        // The hedge won, so its reply answers the request it duplicates
+        idx = req->hedgeOf;
+        req = getRequest(worker, idx);
+        noteUpstreamBeaten(worker, req, now - req->sentAt);
+    } else if(req->hedge != -1) {
+        OutgoingRequestTrackingData* hedge = getRequest(worker, req->hedge);
+        noteUpstreamBeaten(worker, hedge, now - hedge->sentAt);
+    }
+    if((packet[2] & 0x02) && socketIndex < UPSTREAM_TCP_SOCKET_BASE && worker->state->tcpFallback &&
+       fallBackToTcp(worker, idx, upstream, now)) {
+        return;
+    }
+    cancelHedge(worker, idx);
+    removeMatch(worker, idx);
+    removeInflight(worker, idx);
+    cancelTimer(&worker->timers, &req->resendTimer);
+    if(!reserveReply(req, length)) {
+        req->failed = true;
+        completeFollowers(worker, idx);
+        if(requestSettled(worker, req)) {
+            runCycle(worker, req->owner, false);
+        }
+        return;
+    }
+    memcpy(req->response, packet, length);
+    // A hedge's reply carries the hedge's id
+    req->response[0] = req->writer.header.id >> 8;
+    req->response[1] = req->writer.header.id & 0xFF;
+    req->responseLength = length;
+    readHeader(req->response, &req->responseHeader);
+    req->responseIndexed = false;
+    req->answered = true;
+    completeFollowers(worker, idx);
+    if(requestSettled(worker, req)) {
+        runCycle(worker, req->owner, false);
+    }
+}
+static void receiveUpstream(DnsWorker* worker, int socketIndex) {
+    DnsBatchIo* batch = &worker->batch;
+    int sock = worker->upstreamSockets[socketIndex];
+    while(true) {
+        for(int i = 0;i < batch->batchSize;i++) {
+            struct msghdr* hdr = &batch->recvMessages[i].msg_hdr;
+            hdr->msg_name = &batch->scratchAddrs[i];
+            hdr->msg_namelen = sizeof(DnsSockAddr);
+            batch->recvIovecs[i].iov_base = batch->scratch + (size_t)i * CDNS_UDP_BUFFER_SIZE;
+            batch->recvIovecs[i].iov_len = CDNS_UDP_BUFFER_SIZE;
+        }
+        int r = recvmmsg(sock, batch->recvMessages, batch->batchSize, MSG_DONTWAIT, NULL);
+        if(r <= 0) {
+            return;
+        }
+        for(int i = 0;i < r;i++) {
+            struct mmsghdr* message = &batch->recvMessages[i];
+            if(message->msg_len < CDNS_HEADER_SIZE || (message->msg_hdr.msg_flags & MSG_TRUNC)) {
+                continue;
+            }
+            handleUpstreamReply(worker, socketIndex, batch->recvIovecs[i].iov_base, message->msg_len,
+                                &batch->scratchAddrs[i]);
+        }
+        flushResponses(worker);
+        if(r < batch->batchSize) {
+            return;
+        }
+    }
+}
+// Makes room for a reply of length bytes off a TCP upstream, at least the UDP buffer size
+// so small replies don't grow it one by one
+static void growUpstreamReply(DnsUpstreamConnection* conn, int length) {
+    int capacity = length > CDNS_UDP_BUFFER_SIZE ? length : CDNS_UDP_BUFFER_SIZE;
+    unsigned char* reply = (unsigned char*)realloc(conn->reply, capacity);
+    if(reply != NULL) {
+        conn->reply = reply;
+        conn->replyCapacity = capacity;
+    }
+}
+// Reads replies off a TCP upstream connection until the socket is drained, or fails it
+// once the upstream closes it
+static void readUpstreamConnection(DnsWorker* worker, int c) {
+    DnsUpstreamConnection* conn = &worker->upstreamConnections[c];
+    unsigned char data[4096];
+    while(true) {
+        ssize_t n = recv(conn->socket, data, sizeof(data), MSG_DONTWAIT);
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return;
+        }
+        if(n <= 0) {
+            failUpstreamConnection(worker, c);
+            return;
+        }
+        for(int pos = 0;pos < n;) {
+            if(conn->lengthHave < 2) {
+                conn->lengthBytes[conn->lengthHave++] = data[pos++];
+                conn->readLength = readU16(conn->lengthBytes);
+                conn->readHave = 0;
+                if(conn->lengthHave == 2 && conn->readLength > conn->replyCapacity) {
+                    growUpstreamReply(conn, conn->readLength);
+                }
+                continue;
+            }
+            int take = conn->readLength - conn->readHave < n - pos ? conn->readLength - conn->readHave : n - pos;
+            // A reply there was no memory for is read past and dropped, so the request is
+            // sent again
+            if(conn->readLength <= conn->replyCapacity) {
+                memcpy(conn->reply + conn->readHave, data + pos, take);
+            }
+            conn->readHave += take;
+            pos += take;
+            if(conn->readHave < conn->readLength) {
+                continue;
+            }
+            conn->lengthHave = 0;
+            int length = conn->readLength;
+            if(length < CDNS_HEADER_SIZE || length > conn->replyCapacity) {
+                continue;
+            }
+            conn->failures = 0;
+            handleUpstreamReply(worker, UPSTREAM_TCP_SOCKET_BASE + c, conn->reply, length, &conn->destination);
+        }
+        flushResponses(worker);
+    }
+}
+static void handleUpstreamConnectionEvent(DnsWorker* worker, int c, u_int32_t events) {
+    DnsUpstreamConnection* conn = &worker->upstreamConnections[c];
+    // Left over from a socket closed earlier in the same batch
+    if(!conn->active || conn->socket == -1) {
+        return;
+    }
+    if(!conn->connected) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if(getsockopt(conn->socket, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0) {
+            failUpstreamConnection(worker, c);
+            return;
+        }
+        if(!(events & EPOLLOUT)) {
+            return;
+        }
+        conn->connected = true;
+    }
+    if(events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        readUpstreamConnection(worker, c);
+        if(conn->socket == -1 || !conn->connected) {
+            return;
+        }
+    }
+    writeUpstreamConnection(worker, c);
+}
+// Arms a multishot receive on every registered socket without one, except on listeners
+// while datagrams are held for a slot
+static void armRing(DnsWorker* worker) {
+    DnsWorkerRing* ring = worker->ring;
+    if(!ring->needsArming) {
+        return;
+    }
+    int numListeners = worker->state->numListeners;
+    ring->needsArming = false;
+    for(u_int32_t i = 0;i < ring->numFiles;i++) {
+        if(ring->armed[i] || ring->files[i] == -1) {
+            continue;
+        }
+        if((int)i < numListeners && ring->numHeld > 0) {
+            ring->needsArming = true;
+            continue;
+        }
+        bool listener = (int)i < numListeners;
+        ringReceive(&ring->ring, i, &ring->recvHeader, listener ? ring->listenerBuffers.group :
+                    ring->upstreamBuffers.group, ringTag(listener ? RING_RECV_LISTENER : RING_RECV_UPSTREAM, i));
+        ring->armed[i] = true;
+    }
+    ringSubmit(&ring->ring);
+}
+// Hands a listener datagram in a ring buffer to the callback in the given slot, and gives
+// the buffer back
+static void deliverRingDatagram(DnsWorker* worker, u_int32_t idx, int listener, u_int16_t buffer, int length) {
+    DnsBufferRing* buffers = &worker->ring->listenerBuffers;
+    const struct io_uring_recvmsg_out* out;
+    const unsigned char* payload;
+    u_int32_t payloadLength;
+    bool started = false;
+    if(parseRingDatagram(ringBuffer(buffers, buffer), length, sizeof(DnsSockAddr), &out, &payload,
+                         &payloadLength)) {
+        if(out->flags & MSG_TRUNC) {
+            countStat(worker, STAT_QUERIES_RECEIVED, 1);
+            countStat(worker, STAT_QUERIES_DROPPED, 1);
+        } else {
+            ResponseCycleData* cycle = getCycle(worker, idx);
+            cycle->clientLength = out->namelen < sizeof(DnsSockAddr) ? out->namelen : sizeof(DnsSockAddr);
+            memcpy(&cycle->client, out + 1, cycle->clientLength);
+            memcpy(cycle->request, payload, payloadLength);
+            cycle->connection = -1;
+            started = dispatchRequest(worker, idx, listener, payloadLength);
+        }
+    }
+    if(!started) {
+        freeCycle(worker, idx);
+    }
+    recycleBuffer(buffers, buffer);
+}
+// Takes a listener datagram from the ring. Once no slot is free, it and every datagram
+// after it are held in their buffers until slots free up, and the listeners are paused
+static void receiveRingDatagram(DnsWorker* worker, int listener, u_int16_t buffer, int length) {
+    DnsWorkerRing* ring = worker->ring;
+    u_int32_t idx;
+    if(ring->numHeld == 0 && allocPoolEntry(&worker->cyclePool, &idx)) {
+        deliverRingDatagram(worker, idx, listener, buffer, length);
+        return;
+    }
+    if(ring->numHeld == 0) {
+        countStat(worker, STAT_REQUEST_SLOTS_EXHAUSTED, 1);
+        setListenersPaused(worker, true);
+    }
+    DnsRingHeld* held = &ring->held[(ring->heldStart + ring->numHeld) & (ring->listenerBuffers.count - 1)];
+    held->listener = (u_int16_t)listener;
+    held->buffer = buffer;
+    held->length = length;
+    ring->numHeld++;
+}
+// Delivers held datagrams while slots are free
+static void releaseHeldDatagrams(DnsWorker* worker) {
+    DnsWorkerRing* ring = worker->ring;
+    if(ring->numHeld == 0) {
+        return;
+    }
+    u_int32_t idx;
+    while(ring->numHeld > 0 && allocPoolEntry(&worker->cyclePool, &idx)) {
+        DnsRingHeld held = ring->held[ring->heldStart];
+        ring->heldStart = (ring->heldStart + 1) & (ring->listenerBuffers.count - 1);
+        ring->numHeld--;
+        deliverRingDatagram(worker, idx, held.listener, held.buffer, held.length);
+    }
+    publishBuffers(&ring->listenerBuffers);
+    flushResponses(worker);
+    if(ring->numHeld == 0) {
+        ring->needsArming = true;
+    }
+}
+// Matches an upstream reply in a ring buffer straight from the buffer, and gives it back
+static void receiveRingReply(DnsWorker* worker, int socketIndex, u_int16_t buffer, int length) {
+    DnsBufferRing* buffers = &worker->ring->upstreamBuffers;
+    const struct io_uring_recvmsg_out* out;
+    const unsigned char* payload;
+    u_int32_t payloadLength;
+    if(parseRingDatagram(ringBuffer(buffers, buffer), length, sizeof(DnsSockAddr), &out, &payload,
+                         &payloadLength) &&
+       payloadLength >= CDNS_HEADER_SIZE && !(out->flags & MSG_TRUNC)) {
+        DnsSockAddr from;
+        memset(&from, 0, sizeof(from));
+        memcpy(&from, out + 1, out->namelen < sizeof(DnsSockAddr) ? out->namelen : sizeof(DnsSockAddr));
+        handleUpstreamReply(worker, socketIndex, payload, (int)payloadLength, &from);
+    }
+    recycleBuffer(buffers, buffer);
+}
+// Handles the io_uring completions: datagrams from listeners and upstream sockets, the
+// results of sent responses, and receives that ended and need rearming
+static void reapRing(DnsWorker* worker) {
+    DnsWorkerRing* ring = worker->ring;
+    DnsBatchIo* batch = &worker->batch;
+    int numListeners = worker->state->numListeners;
+    for(int round = 0;round < RING_REAP_BATCHES;round++) {
+        int handled = 0;
+        int datagrams = 0;
+        struct io_uring_cqe* cqe;
+        while(handled < batch->batchSize && (cqe = ringCompletion(&ring->ring)) != NULL) {
+            u_int64_t data = cqe->user_data;
+            int res = cqe->res;
+            u_int32_t flags = cqe->flags;
+            ringConsume(&ring->ring);
+            handled++;
+            u_int64_t payload = data & RING_PAYLOAD_MASK;
+            if((enum DnsRingOp)(data >> 56) == RING_SEND) {
+                if(res >= 0) {
+                    addStat(&batch->stats.sendPackets, 1);
+                    countStat(worker, STAT_RESPONSES_SENT, 1);
+                    recordLatency(&worker->stats.endToEnd, payload);
+                } else {
+                    // Socket buffer full or the client is unreachable, UDP responses are best effort
+                    addStat(&batch->stats.sendDropped, 1);
+                    countStat(worker, STAT_QUERIES_DROPPED, 1);
+                }
+                continue;
+            }
+            u_int32_t file = (u_int32_t)payload;
+            if(!(flags & IORING_CQE_F_MORE)) {
+                // Ended by running out of buffers, a cancellation or an error
+                ring->armed[file] = false;
+                ring->needsArming = true;
+                ring->unsupported |= res == -EINVAL;
+            }
+            if(!(flags & IORING_CQE_F_BUFFER)) {
+                continue;
+            }
+            if(datagrams++ == 0) {
+                worker->readAt = monotonicUs();
+            }
+            u_int16_t buffer = (u_int16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+            if((int)file < numListeners) {
+                receiveRingDatagram(worker, (int)file, buffer, res);
+            } else {
+                receiveRingReply(worker, (int)file - numListeners, buffer, res);
+            }
+        }
+        if(datagrams > 0) {
+            addStat(&batch->stats.recvBatches, 1);
+            addStat(&batch->stats.recvPackets, datagrams);
+            recordBatchFill(batch->stats.recvFill, datagrams, batch->batchSize);
+            publishBuffers(&ring->listenerBuffers);
+            publishBuffers(&ring->upstreamBuffers);
+        }
+        flushResponses(worker);
+        if(handled < batch->batchSize) {
+            break;
+        }
+    }
+    armRing(worker);
+}
+// Moves the UDP sockets back to epoll, for a kernel with io_uring but without multishot
+// receives
+static void leaveRing(DnsWorker* worker) {
+    DnsWorkerRing* ring = worker->ring;
+    int numListeners = worker->state->numListeners;
+    struct epoll_event event = {.events = EPOLLIN};
+    epoll_ctl(worker->epollFd, EPOLL_CTL_DEL, ring->ring.fd, NULL);
+    for(u_int32_t i = 0;i < ring->numFiles;i++) {
+        if(ring->files[i] == -1) {
+            continue;
+        }
+        bool listener = (int)i < numListeners;
+        event.events = listener && worker->listenersPaused ? 0 : EPOLLIN;
+        event.data.u64 = listener ? eventTag(EVENT_LISTENER, i) : eventTag(EVENT_UPSTREAM, i - numListeners);
+        epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, ring->files[i], &event);
+    }
+    atomic_store_explicit(&worker->batch.stats.ringThreads, 0, memory_order_relaxed);
+    worker->ring = NULL;
+    destroyWorkerRing(ring);
+}
+static void pauseAccepting(DnsWorker* worker, int listener) {
+    struct epoll_event event = {.events = 0};
+    event.data.u64 = eventTag(EVENT_LISTENER, listener);
+    epoll_ctl(worker->epollFd, EPOLL_CTL_MOD, worker->listeners[listener].socket, &event);
+    worker->listeners[listener].acceptPaused = true;
+    if(!timerScheduled(&worker->acceptTimer)) {
+        worker->acceptTimer.kind = TIMER_ACCEPT;
+        scheduleTimer(&worker->timers, &worker->acceptTimer, monotonicMs() + ACCEPT_BACKOFF_MS);
+    }
+}
+static void resumeAccepting(DnsWorker* worker) {
+    struct epoll_event event = {.events = worker->listenersPaused ? 0 : EPOLLIN};
+    for(int i = 0;i < worker->state->numListeners;i++) {
+        if(worker->listeners[i].acceptPaused) {
+            worker->listeners[i].acceptPaused = false;
+            event.data.u64 = eventTag(EVENT_LISTENER, i);
+            epoll_ctl(worker->epollFd, EPOLL_CTL_MOD, worker->listeners[i].socket, &event);
+        }
+    }
+}
+static void acceptConnections(DnsWorker* worker, int listener) {
+    DnsState* state = worker->state;
+    // Bounded so a flood of connections cannot starve everything else on this worker
+    for(int i = 0;i < state->batchSize;i++) {
+        int sock = accept4(worker->listeners[listener].socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(sock == -1) {
+            if(errno == EINTR) continue;
+            if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                // The connection stays pending and the listener readable, so it is left
+                // out of the epoll set for a while rather than woken for over and over
+                pauseAccepting(worker, listener);
+            }
+            return;
+        }
+        u_int32_t idx;
+        if(!allocPoolEntry(&worker->connectionPool, &idx)) {
+            // At tcpMaxConnections
+            close(sock);
+            continue;
+        }
+        int one = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        DnsTcpConnection* conn = getConnection(worker, idx);
+        conn->socket = sock;
+        conn->listener = listener;
+        conn->http = worker->listeners[listener].config.proto == CdnsProtoHttp;
+        conn->httpState = HTTP_METHOD;
+        conn->readClosed = false;
+        conn->paused = false;
+        conn->inFlight = 0;
+        conn->lengthHave = 0;
+        conn->readCycle = -1;
+        conn->writeHead = -1;
+        conn->writeTail = -1;
+        conn->events = EPOLLIN;
+        struct epoll_event event = {.events = EPOLLIN};
+        event.data.u64 = eventTag(EVENT_CONNECTION, idx);
+        if(epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, sock, &event) != 0) {
+            close(sock);
+            freePoolEntry(&worker->connectionPool, idx);
+            continue;
+        }
+        conn->open = true;
+        scheduleTimer(&worker->timers, &conn->idleTimer, monotonicMs() + state->tcpIdleTimeout);
+    }
+}
+// Takes a slot for the next query off a connection, unless the client already has
+// TCP_MAX_PIPELINED of them or none is free
+static bool startStreamQuery(DnsWorker* worker, DnsTcpConnection* conn) {
+    u_int32_t slot;
+    if(connectionBacklog(conn) >= TCP_MAX_PIPELINED || !allocPoolEntry(&worker->cyclePool, &slot)) {
+        return false;
+    }
+    conn->readCycle = (int)slot;
+    conn->readHave = 0;
+    return true;
+}
+// Copies length-prefixed queries straight into response cycle slots, dispatching each as
+// soon as it is complete. Returns how much was consumed, which falls short if the client
+// ran out of slots, or -1 if the connection was closed
+static int consumeDnsFrames(DnsWorker* worker, u_int32_t idx, const unsigned char* data, int n) {
+    DnsTcpConnection* conn = getConnection(worker, idx);
+    u_int32_t generation = conn->generation;
+    int pos = 0;
+    while(pos < n) {
+        if(conn->readCycle == -1) {
+            while(conn->lengthHave < 2 && pos < n) {
+                conn->lengthBytes[conn->lengthHave++] = data[pos++];
+            }
+            if(conn->lengthHave < 2) {
+                break;
+            }
+            int length = readU16(conn->lengthBytes);
+            // Queries never come close to the buffer size, so a client sending one that
+            // does is not worth keeping
+            if(length < CDNS_HEADER_SIZE || length > CDNS_UDP_BUFFER_SIZE) {
+                closeConnection(worker, idx);
+                return -1;
+            }
+            if(!startStreamQuery(worker, conn)) {
+                break;
+            }
+            conn->readLength = length;
+        }
+        ResponseCycleData* cycle = getCycle(worker, conn->readCycle);
+        int take = n - pos < conn->readLength - conn->readHave ? n - pos : conn->readLength - conn->readHave;
+        memcpy(cycle->request + conn->readHave, data + pos, take);
+        pos += take;
+        conn->readHave += take;
+        if(conn->readHave < conn->readLength) {
+            break;
+        }
+        u_int32_t slot = conn->readCycle;
+        conn->readCycle = -1;
+        conn->lengthHave = 0;
+        cycle->connection = (int)idx;
+        cycle->connectionGeneration = generation;
+        cycle->clientLength = 0;
+        conn->inFlight++;
+        if(!dispatchRequest(worker, slot, conn->listener, conn->readLength)) {
+            conn->inFlight--;
+            freeCycle(worker, slot);
+        }
+        if(conn->generation != generation) {
+            return -1;
+        }
+    }
+    return pos;
+}
+static const char* const httpMethods[] = {"GET", "POST"};
+static const char* const httpParams[] = {"dns"};
+static const char* const httpVersions[] = {"HTTP/1.1", "HTTP/1.0"};
+static const char* const httpHeaders[] = {"content-length", "content-type", "connection"};
+static const char* const httpMediaTypes[] = {"application/dns-message"};
+static const char* const httpConnectionOptions[] = {"close", "keep-alive"};
+// Narrows the candidates, one bit per token, to those whose next character is c
+static u_int8_t matchTokens(const char* const* tokens, int numTokens, u_int8_t candidates, int pos, char c) {
+    candidates &= (1 << numTokens) - 1;
+    for(int i = 0;i < numTokens;i++) {
+        if((candidates & (1 << i)) && tokens[i][pos] != c) {
+            candidates &= ~(1 << i);
+        }
+    }
+    return candidates;
+}
+// The candidate that is matched in full after pos characters, -1 if none
+static int matchedToken(const char* const* tokens, int numTokens, u_int8_t candidates, int pos) {
+    for(int i = 0;i < numTokens;i++) {
+        if((candidates & (1 << i)) && tokens[i][pos] == '\0') {
+            return i;
+        }
+    }
+    return -1;
+}
+#define MATCH_TOKEN(conn, tokens, c)                                                                           \
+    do {                                                                                                       \
+        if((conn)->httpCandidates != 0) {                                                                      \
+            (conn)->httpCandidates = matchTokens(tokens, sizeof(tokens) / sizeof(tokens[0]),                  \
+                                                 (conn)->httpCandidates, (conn)->httpMatch++, (c));            \
+        }                                                                                                      \
+    } while(0)
+#define MATCHED_TOKEN(conn, tokens)                                                                            \
+    matchedToken(tokens, sizeof(tokens) / sizeof(tokens[0]), (conn)->httpCandidates, (conn)->httpMatch)
+static void resetTokenMatch(DnsTcpConnection* conn) {
+    conn->httpCandidates = 0xFF;
+    conn->httpMatch = 0;
+}
+static int base64UrlValue(unsigned char c) {
+    if(c >= 'A' && c <= 'Z') return c - 'A';
+    if(c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if(c >= '0' && c <= '9') return c - '0' + 52;
+    if(c == '-') return 62;
+    if(c == '_') return 63;
+    return -1;
+}
+// Rejects the request being read unless it was already rejected for something else
+static void failHttpRequest(DnsWorker* worker, DnsTcpConnection* conn, int status) {
+    ResponseCycleData* cycle = getCycle(worker, conn->readCycle);
+    if(cycle->httpStatus == 0) {
+        cycle->httpStatus = status;
+    }
+}
+// Decodes one character of the dns parameter straight into the request buffer
+static void decodeDnsParam(DnsWorker* worker, DnsTcpConnection* conn, unsigned char c) {
+    // Padding is not supposed to be sent, but is harmless
+    if(c == '=') {
+        return;
+    }
+    int value = base64UrlValue(c);
+    if(value < 0) {
+        failHttpRequest(worker, conn, 400);
+        return;
+    }
+    conn->httpBits = (conn->httpBits << 6) | value;
+    conn->httpNumBits += 6;
+    if(conn->httpNumBits >= 8) {
+        conn->httpNumBits -= 8;
+        if(conn->readHave == CDNS_UDP_BUFFER_SIZE) {
+            failHttpRequest(worker, conn, 400);
+            return;
+        }
+        getCycle(worker, conn->readCycle)->request[conn->readHave++] = (conn->httpBits >> conn->httpNumBits) & 0xFF;
+    }
+}
+static void endDnsParam(DnsWorker* worker, DnsTcpConnection* conn) {
+    // A single character left over can't have come from whole bytes
+    if(conn->httpNumBits >= 6) {
+        failHttpRequest(worker, conn, 400);
+    }
+    conn->httpBits = 0;
+    conn->httpNumBits = 0;
+}
+// Queues the request just read, so its answer goes out in order, and hands it to the
+// callback or answers it with the error it was given
+static void completeHttpRequest(DnsWorker* worker, u_int32_t idx) {
+    DnsTcpConnection* conn = getConnection(worker, idx);
+    u_int32_t slot = conn->readCycle;
+    ResponseCycleData* cycle = getCycle(worker, slot);
+    conn->readCycle = -1;
+    conn->httpState = HTTP_METHOD;
+    bool keepAlive = (conn->httpFlags & HTTP_VERSION_10) ? (conn->httpFlags & HTTP_KEEP_ALIVE) != 0
+                                                         : (conn->httpFlags & HTTP_CLOSE) == 0;
+    if(!keepAlive) {
+        // Nothing more is read, and the connection closes once this is answered
+        conn->readClosed = true;
+    }
+    cycle->context.worker = worker;
+    cycle->context.index = (int)slot;
+    cycle->connection = (int)idx;
+    cycle->connectionGeneration = conn->generation;
+    cycle->clientLength = 0;
+    cycle->writer.queued = false;
+    appendWrite(worker, conn, cycle);
+    conn->inFlight++;
+    if(cycle->httpStatus != 0 || !dispatchRequest(worker, slot, conn->listener, conn->readHave)) {
+        if(cycle->httpStatus == 0) {
+            cycle->httpStatus = 400;
+        }
+        cycle->ownedRequests = -1;
+        memset(&cycle->writer, 0, sizeof(ResponseWriteInfo));
+        finishCycle(worker, slot);
+    }
+}
+// Works out what to do with a request once its headers are read. A POST body is read
+// into the request buffer, any other body is skipped
+static void endHttpHeaders(DnsWorker* worker, u_int32_t idx) {
+    DnsTcpConnection* conn = getConnection(worker, idx);
+    u_int16_t flags = conn->httpFlags;
+    u_int32_t bodyLength = (flags & HTTP_HAS_LENGTH) ? conn->httpBits : 0;
+    if(flags & HTTP_GET) {
+        if(!(flags & HTTP_HAS_DNS)) {
+            failHttpRequest(worker, conn, 400);
+        }
+    } else if(flags & HTTP_POST) {
+        conn->readHave = 0;
+        if(!(flags & HTTP_HAS_LENGTH)) {
+            // A chunked body can't be told apart from the next request
+            failHttpRequest(worker, conn, 411);
+            conn->httpFlags = (flags | HTTP_CLOSE) & ~(HTTP_KEEP_ALIVE | HTTP_VERSION_10);
+        } else if(!(flags & HTTP_DNS_MESSAGE)) {
+            failHttpRequest(worker, conn, 415);
+        } else if(bodyLength > CDNS_UDP_BUFFER_SIZE) {
+            failHttpRequest(worker, conn, 413);
         }
+    } else {
+        failHttpRequest(worker, conn, 405);
     }
-    free(state->listeners);
-    free(state);
-    destroyCollection(&state->reqDataCollection);
-    destroyCollection(&state->resDataCollection);
+    conn->httpBits = bodyLength;
+    if(bodyLength > 0) {
+        conn->httpState = HTTP_BODY;
+    } else {
+        completeHttpRequest(worker, idx);
+    }
+}
+// Parses HTTP requests a character at a time as they arrive, so the request line and
+// headers are never buffered: the only thing kept is the dns parameter of a GET, decoded
+// into the slot the request will run in, or the body of a POST, copied there. Returns how
+// much was consumed, which falls short if the client ran out of slots or asked for the
+// connection to close, or -1 if the connection was closed
+static int parseHttp(DnsWorker* worker, u_int32_t idx, const unsigned char* data, int n) {
+    DnsTcpConnection* conn = getConnection(worker, idx);
+    u_int32_t generation = conn->generation;
+    int pos = 0;
+    while(pos < n && !conn->readClosed) {
+        if(conn->httpState == HTTP_BODY) {
+            ResponseCycleData* cycle = getCycle(worker, conn->readCycle);
+            int take = (u_int32_t)(n - pos) < conn->httpBits ? n - pos : (int)conn->httpBits;
+            if((conn->httpFlags & HTTP_POST) && cycle->httpStatus == 0) {
+                memcpy(cycle->request + conn->readHave, data + pos, take);
+                conn->readHave += take;
+            }
+            pos += take;
+            conn->httpBits -= take;
+            if(conn->httpBits == 0) {
+                completeHttpRequest(worker, idx);
+                if(conn->generation != generation) {
+                    return -1;
+                }
+            }
+            continue;
+        }
+        unsigned char c = data[pos];
+        if(conn->readCycle == -1) {
+            // Blank lines between requests are allowed
+            if(c == '\r' || c == '\n') {
+                pos++;
+                continue;
+            }
+            if(!startStreamQuery(worker, conn)) {
+                break;
+            }
+            getCycle(worker, conn->readCycle)->httpStatus = 0;
+            conn->httpFlags = 0;
+            conn->httpCount = 0;
+            conn->httpBits = 0;
+            conn->httpNumBits = 0;
+            resetTokenMatch(conn);
+        }
+        pos++;
+        if(++conn->httpCount > HTTP_MAX_HEADER_BYTES) {
+            closeConnection(worker, idx);
+            return -1;
+        }
+        bool malformed = false;
+        switch(conn->httpState) {
+        case HTTP_METHOD:
+            if(c == ' ') {
+                int method = MATCHED_TOKEN(conn, httpMethods);
+                malformed = conn->httpMatch == 0;
+                conn->httpFlags |= method == 0 ? HTTP_GET : method == 1 ? HTTP_POST : 0;
+                conn->httpState = HTTP_PATH;
+            } else if(c <= ' ' || c >= 0x7F) {
+                malformed = true;
+            } else {
+                MATCH_TOKEN(conn, httpMethods, c);
+            }
+            break;
+        case HTTP_PATH:
+            if(c == '?') {
+                resetTokenMatch(conn);
+                conn->httpState = HTTP_PARAM_NAME;
+            } else if(c == ' ') {
+                resetTokenMatch(conn);
+                conn->httpState = HTTP_VERSION;
+            } else if(c < ' ' || c >= 0x7F) {
+                malformed = true;
+            }
+            break;
+        case HTTP_PARAM_NAME:
+        case HTTP_PARAM_VALUE:
+        case HTTP_PARAM_SKIP:
+            if(c == '&' || c == ' ') {
+                if(conn->httpState == HTTP_PARAM_VALUE) {
+                    endDnsParam(worker, conn);
+                }
+                resetTokenMatch(conn);
+                conn->httpState = c == ' ' ? HTTP_VERSION : HTTP_PARAM_NAME;
+            } else if(c < ' ' || c >= 0x7F) {
+                malformed = true;
+            } else if(conn->httpState == HTTP_PARAM_VALUE) {
+                decodeDnsParam(worker, conn, c);
+            } else if(conn->httpState == HTTP_PARAM_NAME) {
+                if(c == '=') {
+                    if(MATCHED_TOKEN(conn, httpParams) == 0) {
+                        if(conn->httpFlags & HTTP_HAS_DNS) {
+                            failHttpRequest(worker, conn, 400);
+                        }
+                        conn->httpFlags |= HTTP_HAS_DNS;
+                        conn->httpState = HTTP_PARAM_VALUE;
+                    } else {
+                        conn->httpState = HTTP_PARAM_SKIP;
+                    }
+                } else {
+                    MATCH_TOKEN(conn, httpParams, c);
+                }
+            }
+            break;
+        case HTTP_VERSION:
+            if(c == '\n') {
+                int version = MATCHED_TOKEN(conn, httpVersions);
+                malformed = version == -1;
+                conn->httpFlags |= version == 1 ? HTTP_VERSION_10 : 0;
+                // Content-Length goes here from now on
+                conn->httpBits = 0;
+                conn->httpState = HTTP_LINE_START;
+            } else if(c != '\r') {
+                MATCH_TOKEN(conn, httpVersions, c);
+            }
+            break;
+        case HTTP_LINE_START:
+            if(c == '\r') {
+                break;
+            }
+            if(c == '\n') {
+                endHttpHeaders(worker, idx);
+                if(conn->generation != generation) {
+                    return -1;
+                }
+                break;
+            }
+            // Continuation lines are obsolete
+            if(c == ' ' || c == '\t') {
+                malformed = true;
+                break;
+            }
+            resetTokenMatch(conn);
+            conn->httpState = HTTP_HEADER_NAME;
+            // fall through
+        case HTTP_HEADER_NAME:
+            if(c == ':') {
+                int header = MATCHED_TOKEN(conn, httpHeaders);
+                malformed = conn->httpMatch == 0;
+                conn->httpState = header == 0   ? HTTP_CONTENT_LENGTH
+                                  : header == 1 ? HTTP_CONTENT_TYPE
+                                  : header == 2 ? HTTP_CONNECTION
+                                                : HTTP_HEADER_SKIP;
+                resetTokenMatch(conn);
+            } else if(c <= ' ' || c >= 0x7F) {
+                malformed = true;
+            } else {
+                MATCH_TOKEN(conn, httpHeaders, lowerAscii(c));
+            }
+            break;
+        case HTTP_CONTENT_LENGTH:
+            if(c >= '0' && c <= '9') {
+                conn->httpBits = conn->httpBits * 10 + (c - '0');
+                conn->httpFlags |= HTTP_HAS_LENGTH;
+                // Far past anything that could be accepted, which is only read to skip it
+                malformed = conn->httpBits > (1u << 24);
+            } else if(c == '\n') {
+                conn->httpState = HTTP_LINE_START;
+            } else if(c != ' ' && c != '\t' && c != '\r') {
+                malformed = true;
+            }
+            break;
+        case HTTP_CONTENT_TYPE:
+        case HTTP_CONNECTION:
+            if(conn->httpMatch == 0 && (c == ' ' || c == '\t')) {
+                break;
+            }
+            if(c == ';' || c == ',' || c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+                if(conn->httpState == HTTP_CONTENT_TYPE) {
+                    if(MATCHED_TOKEN(conn, httpMediaTypes) == 0) {
+                        conn->httpFlags |= HTTP_DNS_MESSAGE;
+                    }
+                    // Parameters don't matter
+                    conn->httpState = HTTP_HEADER_SKIP;
+                } else {
+                    int option = MATCHED_TOKEN(conn, httpConnectionOptions);
+                    conn->httpFlags |= option == 0 ? HTTP_CLOSE : option == 1 ? HTTP_KEEP_ALIVE : 0;
+                    resetTokenMatch(conn);
+                }
+                if(c == '\n') {
+                    conn->httpState = HTTP_LINE_START;
+                }
+            } else if(conn->httpState == HTTP_CONTENT_TYPE) {
+                MATCH_TOKEN(conn, httpMediaTypes, lowerAscii(c));
+            } else {
+                MATCH_TOKEN(conn, httpConnectionOptions, lowerAscii(c));
+            }
+            break;
+        case HTTP_HEADER_SKIP:
+            if(c == '\n') {
+                conn->httpState = HTTP_LINE_START;
+            }
+            break;
+        case HTTP_BODY:
+            break;
+        }
+        if(malformed) {
+            closeConnection(worker, idx);
+            return -1;
+        }
+    }
+    return pos;
+}
+// Reads whatever the client has sent and hands it to the parser for the connection's
+// protocol. Queries go straight into response cycle slots and are dispatched as soon as
+// they are complete, so several can be in flight at once and an idle connection holds no
+// buffers
+static void readConnection(DnsWorker* worker, u_int32_t idx) {
+    DnsTcpConnection* conn = getConnection(worker, idx);
+    u_int32_t generation = conn->generation;
+    unsigned char* buffer = worker->batch.scratch;
+    int bufferSize = worker->batch.batchSize * CDNS_UDP_BUFFER_SIZE;
+    bool received = false;
+    while(conn->generation == generation && !conn->readClosed) {
+        int room = TCP_MAX_PIPELINED - connectionBacklog(conn);
+        // A query or HTTP request part way through being read already holds its slot, but
+        // only joins the backlog once it is complete
+        if(conn->readCycle != -1) {
+            room--;
+        }
+        if(room > (int)poolAvailable(&worker->cyclePool)) {
+            room = (int)poolAvailable(&worker->cyclePool);
+        }
+        if(room <= 0 && conn->readCycle == -1) {
+            break;
+        }
+        // Every query takes at least this many bytes, so reading no more than this never
+        // starts more queries than there are slots for
+        int limit = room > 0 ? room * (conn->http ? HTTP_MIN_REQUEST_BYTES : 2 + CDNS_HEADER_SIZE) : 0;
+        if(!conn->http && conn->readCycle != -1) {
+            limit += conn->readLength - conn->readHave;
+        }
+        bool peek = false;
+        if(limit == 0) {
+            // Only the request being read may go on. How much is left of it isn't known,
+            // so the data is peeked at and what the parser took is read for real
+            // afterwards
+            peek = true;
+            limit = bufferSize;
+        }
+        int n = (int)recv(conn->socket, buffer, limit < bufferSize ? limit : bufferSize,
+                          MSG_DONTWAIT | (peek ? MSG_PEEK : 0));
+        if(n == 0) {
+            // Queries already read are still answered, a partial one is dropped
+            conn->readClosed = true;
+            if(conn->readCycle != -1) {
+                freeCycle(worker, conn->readCycle);
+                conn->readCycle = -1;
+            }
+            break;
+        }
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+            closeConnection(worker, idx);
+            return;
+        }
+        received = true;
+        worker->readAt = monotonicUs();
+        int consumed = conn->http ? parseHttp(worker, idx, buffer, n) : consumeDnsFrames(worker, idx, buffer, n);
+        if(consumed < 0) {
+            return;
+        }
+        if(peek && consumed > 0) {
+            recv(conn->socket, buffer, consumed, MSG_DONTWAIT);
+        }
+        if(consumed < n) {
+            break;
+        }
+    }
+    if(conn->generation != generation) {
+        return;
+    }
+    if(received) {
+        cancelTimer(&worker->timers, &conn->idleTimer);
+        scheduleTimer(&worker->timers, &conn->idleTimer, monotonicMs() + worker->state->tcpIdleTimeout);
+    }
+    settleConnection(worker, idx);
+}
+static void handleConnectionEvent(DnsWorker* worker, u_int32_t idx, u_int32_t events) {
+    DnsTcpConnection* conn = getConnection(worker, idx);
+    if(!conn->open) {
+        // Closed by an earlier event of the same epoll_wait
+        return;
+    }
+    // Reset, or shut down both ways, so no answer could be written anyway
+    if(events & (EPOLLERR | EPOLLHUP)) {
+        closeConnection(worker, idx);
+        return;
+    }
+    u_int32_t generation = conn->generation;
+    if(events & EPOLLOUT) {
+        writeConnection(worker, idx);
+        if(conn->generation != generation) {
+            return;
+        }
+    }
+    if(events & EPOLLIN) {
+        readConnection(worker, idx);
+    } else {
+        settleConnection(worker, idx);
+    }
+}
+// Gives connections that were starved of slots another go once some are free
+static void resumeConnections(DnsWorker* worker) {
+    while(worker->pausedConnections != -1 && poolAvailable(&worker->cyclePool) > 0) {
+        u_int32_t idx = worker->pausedConnections;
+        unlinkPausedConnection(worker, idx);
+        updateConnectionEvents(worker, idx);
+    }
+}
+static void runWorker(DnsWorker* worker);
+static void* workerThread(void* worker) {
+    runWorker((DnsWorker*)worker);
+    return NULL;
+}
+// Must be called with connections.lock held
+static int startWorkerThread(DnsState* state, int index) {
+    DnsConnections* connections = &state->connections;
+    if(pthread_create(&connections->threads[index], NULL, workerThread, &connections->workers[index]) != 0) {
+        return CDNS_ERR_THREADS;
+    }
+    connections->numRunning++;
     return 0;
 }
-int cdnsSetCallback(CdnsState *_state, const CdnsCallbackDescriptor* callback) {
-    if(callback->callback == NULL) {
-        return CDNS_ERR_INVALID_CALLBACK;
+// Adds a worker with its own sockets, unless maxThreads is reached or cdnsStop was called
+static void addWorker(DnsState* state) {
+    DnsConnections* connections = &state->connections;
+    pthread_mutex_lock(&connections->lock);
+    int index = atomic_load(&state->numThreads);
+    if(index < state->maxThreads && !atomic_load(&state->stopRequested)) {
+        DnsWorker* worker = &connections->workers[index];
+        if(createWorker(state, worker, index) == 0) {
+            atomic_store(&state->numThreads, index + 1);
+            startWorkerThread(state, index);
+        } else {
+            destroyWorker(worker);
+            atomic_store_explicit(&connections->growRetryAt, monotonicMs() + GROW_RETRY_MS, memory_order_relaxed);
+        }
     }
-    DnsState* state = (DnsState*)_state;
-    if(!state->paused) {
-        return CDNS_ERR_MODIFY_WHILE_RUNNING;
+    pthread_mutex_unlock(&connections->lock);
+}
+// The cycle pool is made once the callback, and so the size of its per cycle data, is known
+static bool createCyclePool(DnsWorker* worker) {
+    DnsState* state = worker->state;
+    if(!poolCreated(&worker->cyclePool)) {
+        if(createPool(&worker->cyclePool, sizeof(ResponseCycleData) + state->callback.perCallbackDataSize,
+                      state->threadRequests, initCycle, NULL) != 0) {
+            destroyPool(&worker->cyclePool);
+            return false;
+        }
     }
-    state->callback = *callback;
-    return createCollection(&state->resDataCollection, sizeof(ResponseCycleData) + callback->perCallbackDataSize, state->maxThreads * state->threadRequests);
+    return true;
+}
+static void runWorker(DnsWorker* worker) {
+    DnsState* state = worker->state;
+    if(state->numWorkerCpus > 0) {
+        pinWorker(worker);
+    }
+    if(!createCyclePool(worker)) {
+        return;
+    }
+    if(worker->ring != NULL) {
+        // Receives are owned by the thread that armed them and cancelled when it exits, so
+        // those of an earlier thread running this worker are rearmed from this one
+        reapRing(worker);
+    }
+    if(state->snapshotInterval > 0 && worker->cache.buckets != NULL && worker->snapshotTimer.pprev == NULL) {
+        scheduleTimer(&worker->timers, &worker->snapshotTimer, monotonicMs() + state->snapshotInterval);
+        armTimer(worker);
+    }
+    // Blocks in epoll_wait until a socket is readable, a timer is due or cdnsStop is called,
+    // so an idle worker uses no CPU
+    while(!atomic_load(&state->stopRequested)) {
+        atomic_store(&worker->zoneEpoch, ZONE_IDLE);
+        int n = epoll_wait(worker->epollFd, worker->events, state->batchSize, -1);
+        atomic_store(&worker->zoneEpoch, atomic_load(&state->zoneEpoch));
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            break;
+        }
+        for(int i = 0;i < n;i++) {
+            u_int64_t tag = worker->events[i].data.u64;
+            int index = (int)(u_int32_t)tag;
+            switch((enum DnsEventKind)(tag >> 32)) {
+            case EVENT_LISTENER:
+                if(worker->listeners[index].config.proto != CdnsProtoUdp) {
+                    acceptConnections(worker, index);
+                } else {
+                    receiveBatches(worker, index);
+                }
+                break;
+            case EVENT_UPSTREAM:
+                receiveUpstream(worker, index);
+                break;
+            case EVENT_CONNECTION:
+                handleConnectionEvent(worker, index, worker->events[i].events);
+                break;
+            case EVENT_TIMER: {
+                u_int64_t expirations;
+                while(read(worker->timerFd, &expirations, sizeof(expirations)) > 0) {}
+                break;
+            }
+            case EVENT_WAKE:
+                break;
+            case EVENT_RING:
+                reapRing(worker);
+                break;
+            case EVENT_UPSTREAM_CONNECTION:
+                handleUpstreamConnectionEvent(worker, index, worker->events[i].events);
+                break;
+            }
+        }
+        runTimers(worker);
+        flushResponses(worker);
+        if(atomic_load_explicit(&state->numRetiredZones, memory_order_relaxed) > 0 &&
+           pthread_mutex_trylock(&state->connections.lock) == 0) {
+            reclaimZones(state);
+            pthread_mutex_unlock(&state->connections.lock);
+        }
+        if(worker->ring != NULL) {
+            releaseHeldDatagrams(worker);
+            armRing(worker);
+            if(worker->ring->unsupported) {
+                leaveRing(worker);
+            }
+        }
+        u_int32_t available = poolAvailable(&worker->cyclePool);
+        if(worker->listenersPaused && available > 0) {
+            setListenersPaused(worker, false);
+        }
+        resumeConnections(worker);
+        if(available < worker->cyclePool.maxEntries / GROW_FREE_FRACTION &&
+           atomic_load_explicit(&state->numThreads, memory_order_relaxed) < state->maxThreads &&
+           monotonicMs() >= atomic_load_explicit(&state->connections.growRetryAt, memory_order_relaxed)) {
+            addWorker(state);
+        }
+    }
+    atomic_store(&worker->zoneEpoch, ZONE_IDLE);
+}
+static void clearStop(DnsState* state) {
+    u_int64_t drained;
+    while(read(state->wakeFd, &drained, sizeof(drained)) > 0) {}
+    atomic_store(&state->stopRequested, false);
 }
 int cdnsPoll(CdnsState *_state) {
     DnsState* state = (DnsState*)_state;
     if(state->callback.callback == NULL) {
         return CDNS_ERR_NO_CALLBACK;
     }
-    if(state->listening) {
+    if(state->listening || state->connections.numRunning > 0) {
         return CDNS_ERR_ALREADY_LISTENING;
     }
     state->paused = false;
     state->listening = true;
-    // TODO
+    state->snapshotStale = true;
+    startSnapshotThread(state);
+    DnsConnections* connections = &state->connections;
+    pthread_mutex_lock(&connections->lock);
+    for(int i = 1;i < atomic_load(&state->numThreads);i++) {
+        int err = startWorkerThread(state, i);
+        if(err != 0) {
+            pthread_mutex_unlock(&connections->lock);
+            atomic_store(&state->stopRequested, true);
+            state->listening = false;
+            return err;
+        }
+    }
+    pthread_mutex_unlock(&connections->lock);
+    // The calling thread runs worker 0, and is pinned only while it does
+    cpu_set_t affinity;
+    bool pinned = state->numWorkerCpus > 0 &&
+                  pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &affinity) == 0;
+    runWorker(&connections->workers[0]);
+    if(pinned) {
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &affinity);
+    }
+    if(connections->numRunning == 0) {
+        clearStop(state);
+    }
+    state->listening = false;
+    return 0;
+}
+// Hands the stub replies to handleUpstreamReply, along with those to requests the
+// callbacks they resume send meanwhile. A reply stays in the ring until it is handled, so
+// new ones never overwrite it
+static void deliverReplayReplies(DnsWorker* worker) {
+    DnsReplay* replay = worker->replay;
+    while(replay->numPending > 0) {
+        DnsReplayReply* reply = &replay->pending[replay->pendingHead];
+        replay->stats.upstreamReplies++;
+        enum DnsReplayStage stage = switchStage(replay, REPLAY_UPSTREAM);
+        handleUpstreamReply(worker, reply->socketIndex, reply->packet, reply->length, &reply->from);
+        switchStage(replay, stage);
+        replay->pendingHead = (replay->pendingHead + 1) % REPLAY_MAX_PENDING;
+        replay->numPending--;
+    }
+    flushResponses(worker);
+}
+// Lets the replay make progress without a new query: sleeps until the next timer or
+// untilUs, whichever comes first, unless stub replies are pending, then handles the
+// timers and replies that are due. Returns false if nothing could ever happen, as no
+// timer is set and untilUs is UINT64_MAX
+static bool stepReplay(DnsWorker* worker, u_int64_t untilUs) {
+    DnsReplay* replay = worker->replay;
+    if(replay->numPending == 0) {
+        u_int64_t deadline = nextTimerDeadline(&worker->timers);
+        u_int64_t wake = deadline != UINT64_MAX && deadline * 1000 < untilUs ? deadline * 1000 : untilUs;
+        if(wake == UINT64_MAX) {
+            return false;
+        }
+        enum DnsReplayStage stage = switchStage(replay, REPLAY_IDLE);
+        struct timespec at = {.tv_sec = (time_t)(wake / 1000000), .tv_nsec = (long)(wake % 1000000) * 1000};
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL) == EINTR) {}
+        switchStage(replay, stage);
+    }
+    runTimers(worker);
+    flushResponses(worker);
+    deliverReplayReplies(worker);
+    return true;
+}
+int cdnsReplay(CdnsState *_state, const CdnsReplayConfig *config, CdnsReplayStats *out) {
+    DnsState* state = (DnsState*)_state;
+    if(state->callback.callback == NULL) {
+        return CDNS_ERR_NO_CALLBACK;
+    }
+    if(state->listening || state->connections.numRunning > 0) {
+        return CDNS_ERR_ALREADY_LISTENING;
+    }
+    DnsWorker* worker = &state->connections.workers[0];
+    if(!createCyclePool(worker)) {
+        return CDNS_ERR_MEM;
+    }
+    DnsReplay replay;
+    memset(&replay, 0, sizeof(DnsReplay));
+    replay.config = config;
+    replay.pending = malloc(sizeof(DnsReplayReply) * REPLAY_MAX_PENDING);
+    if(replay.pending == NULL) {
+        return CDNS_ERR_MEM;
+    }
+    u_int64_t slots = worker->cyclePool.allocations + worker->requestPool.allocations;
+    u_int32_t chunks = poolChunks(&worker->cyclePool) + poolChunks(&worker->requestPool);
+    u_int64_t stores = worker->cache.stores;
+    state->listening = true;
+    state->snapshotStale = true;
+    worker->replay = &replay;
+    atomic_store(&worker->zoneEpoch, atomic_load(&state->zoneEpoch));
+    u_int64_t start = monotonicUs();
+    replay.stageStart = readCycles();
+    int batched = 0;
+    for(int i = 0;i < config->numQueries;i++) {
+        const CdnsReplayQuery* query = &config->queries[i];
+        if(config->pace == CdnsReplayTimed) {
+            u_int64_t due = start + (query->timeUs - config->queries[0].timeUs);
+            while(monotonicUs() < due) {
+                stepReplay(worker, due);
+            }
+        }
+        u_int32_t idx;
+        bool allocated;
+        while(!(allocated = allocPoolEntry(&worker->cyclePool, &idx))) {
+            // Every slot is busy until a reply or a timer finishes a cycle
+            countStat(worker, STAT_REQUEST_SLOTS_EXHAUSTED, 1);
+            if(!stepReplay(worker, UINT64_MAX)) {
+                break;
+            }
+        }
+        replay.stats.queries++;
+        if(!allocated || query->length > CDNS_UDP_BUFFER_SIZE) {
+            // Either way the query would not have been read
+            countStat(worker, STAT_QUERIES_RECEIVED, 1);
+            countStat(worker, STAT_QUERIES_DROPPED, 1);
+            if(allocated) {
+                freeCycle(worker, idx);
+            }
+            continue;
+        }
+        if(batched == 0) {
+            worker->readAt = monotonicUs();
+        }
+        ResponseCycleData* cycle = getCycle(worker, idx);
+        memcpy(cycle->request, query->packet, query->length);
+        memset(&cycle->client, 0, sizeof(DnsSockAddr));
+        cycle->client.in4.sin_family = AF_INET;
+        cycle->client.in4.sin_addr.s_addr = query->clientAddress;
+        cycle->client.in4.sin_port = htons(query->clientPort);
+        cycle->clientLength = sizeof(struct sockaddr_in);
+        cycle->connection = -1;
+        if(!dispatchRequest(worker, idx, -1, query->length)) {
+            freeCycle(worker, idx);
+        }
+        deliverReplayReplies(worker);
+        // Flushed and timed a batch at a time, as receiveBatches does
+        if(++batched == state->batchSize) {
+            batched = 0;
+            runTimers(worker);
+            flushResponses(worker);
+        }
+    }
+    flushResponses(worker);
+    while(poolAvailable(&worker->cyclePool) < worker->cyclePool.maxEntries && stepReplay(worker, UINT64_MAX)) {}
+    switchStage(&replay, REPLAY_IDLE);
+    replay.stats.elapsedUs = monotonicUs() - start;
+    replay.stats.slotAllocations = worker->cyclePool.allocations + worker->requestPool.allocations - slots;
+    replay.stats.chunkAllocations = poolChunks(&worker->cyclePool) + poolChunks(&worker->requestPool) - chunks;
+    replay.stats.cacheAllocations = worker->cache.stores - stores;
+    replay.stats.dispatchCycles = replay.stageCycles[REPLAY_DISPATCH];
+    replay.stats.callbackCycles = replay.stageCycles[REPLAY_CALLBACK];
+    replay.stats.upstreamCycles = replay.stageCycles[REPLAY_UPSTREAM];
+    replay.stats.sendCycles = replay.stageCycles[REPLAY_SEND];
+    if(out != NULL) {
+        *out = replay.stats;
+    }
+    atomic_store(&worker->zoneEpoch, ZONE_IDLE);
+    worker->replay = NULL;
+    free(replay.pending);
     state->listening = false;
     return 0;
 }
+int cdnsStop(CdnsState *_state) {
+    DnsState* state = (DnsState*)_state;
+    atomic_store(&state->stopRequested, true);
+    u_int64_t one = 1;
+    if(write(state->wakeFd, &one, sizeof(one)) != sizeof(one)) {
+        return CDNS_ERR_UNDEFINED;
+    }
+    return 0;
+}
 int cdnsPause(CdnsState *_state) {
     DnsState* state = (DnsState*)_state;
     if(state->listening) {
         return CDNS_ERR_INVALID_PAUSE;
     }
+    DnsConnections* connections = &state->connections;
+    if(connections->numRunning > 0) {
+        // Background workers only exit once cdnsStop was called
+        cdnsStop(_state);
+        // Workers may still be adding threads, so keep joining until none are left
+        for(int i = 1;;i++) {
+            pthread_mutex_lock(&connections->lock);
+            bool done = i >= atomic_load(&state->numThreads);
+            pthread_mutex_unlock(&connections->lock);
+            if(done) break;
+            pthread_join(connections->threads[i], NULL);
+        }
+        connections->numRunning = 0;
+        clearStop(state);
+    }
+    stopSnapshotThread(state);
+    saveCaches(state);
     state->paused = true;
-    // TODO
     return 0;
 }
 
 int cdnsGetResponseReadInfo(CdnsResponseContext *context, CdnsRequestId id, CdnsPacketReadInfo **out) {
-    return CDNS_ERR_UNDEFINED;
-}
\ No newline at end of file
+    ResponseCycleData* cycle = (ResponseCycleData*)context;
+    OutgoingRequestTrackingData* req = findRequest(cycle->context.worker, id);
+    if(req == NULL || req->owner != cycle->context.index) {
+        return CDNS_ERR_UNKNOWN_REQUEST;
+    }
+    if(req->failed) {
+        return CDNS_ERR_REQ_SERVER;
+    }
+    if(!req->answered) {
+        *out = NULL;
+        return 0;
+    }
+    if(!req->responseIndexed) {
+        req->responseIndexResult = indexPacket(req->response, req->responseLength, &req->responseHeader, &req->responseInfo,
+                                               req->responseEntries, CDNS_MAX_ENTRIES(req->responseCapacity));
+        req->responseIndexed = true;
+    }
+    *out = &req->responseInfo;
+    return req->responseIndexResult;
+}
+int cdnsAwaitRequests(CdnsResponseContext *context, const CdnsRequestId *ids, int count, CdnsAwaitMode mode,
+                      u_int64_t timeoutMs, CdnsCallbackCycleInfo *out) {
+    ResponseCycleData* cycle = (ResponseCycleData*)context;
+    DnsWorker* worker = cycle->context.worker;
+    for(int i = 0;i < count;i++) {
+        OutgoingRequestTrackingData* req = findRequest(worker, ids[i]);
+        if(req == NULL || req->owner != cycle->context.index) {
+            return CDNS_ERR_UNKNOWN_REQUEST;
+        }
+    }
+    stopAwaiting(worker, cycle);
+    cycle->awaitDone = 0;
+    cycle->awaitAll = mode == CdnsAwaitAll;
+    for(int i = 0;i < count;i++) {
+        OutgoingRequestTrackingData* req = findRequest(worker, ids[i]);
+        if(req->awaited) {
+            // Listed twice
+            continue;
+        }
+        if(req->sent && !req->answered && !req->failed) {
+            req->awaited = true;
+            cycle->awaitPending++;
+        } else {
+            cycle->awaitDone++;
+        }
+    }
+    out->status = CdnsPollMany;
+    out->data.ms = timeoutMs;
+    return 0;
+}
+int cdnsGetRequestReadInfo(CdnsResponseContext *context, CdnsPacketReadInfo **out) {
+    ResponseCycleData* cycle = (ResponseCycleData*)context;
+    // Indexed on first use, so callbacks that never look at the request don't pay for it
+    if(!cycle->requestIndexed) {
+        cycle->requestIndexResult = indexPacket(cycle->request, cycle->requestLength, &cycle->requestHeader,
+                                                &cycle->requestInfo, cycle->requestEntries,
+                                                CDNS_MAX_ENTRIES(CDNS_UDP_BUFFER_SIZE));
+        cycle->requestIndexed = true;
+    }
+    *out = &cycle->requestInfo;
+    return cycle->requestIndexResult;
+}
+int cdnsGetResponseWriter(CdnsResponseContext *context, CdnsResponseWriteinfo **out) {
+    ResponseCycleData* cycle = (ResponseCycleData*)context;
+    *out = (CdnsResponseWriteinfo*)&cycle->writer;
+    return 0;
+}
+int cdnsWritableResponseHeader(CdnsResponseWriteinfo *_writer, CdnsPacketHeader **out) {
+    ResponseWriteInfo* writer = (ResponseWriteInfo*)_writer;
+    *out = &writer->header;
+    return 0;
+}
+int cdnsWriteRecord(CdnsResponseWriteinfo *_writer, void *record, int length) {
+    ResponseWriteInfo* writer = (ResponseWriteInfo*)_writer;
+    ResponseCycleData* cycle = writerCycle(writer);
+    if(!growResponse(cycle, CDNS_HEADER_SIZE + writer->length + length)) {
+        return CDNS_ERR_TOO_LARGE;
+    }
+    memcpy(cycle->response + CDNS_HEADER_SIZE + writer->length, record, length);
+    writer->length += length;
+    return 0;
+}
+int cdnsAddQuestion(CdnsResponseWriteinfo *_writer, const void *name, u_int16_t type, u_int16_t clas) {
+    ResponseWriteInfo* writer = (ResponseWriteInfo*)_writer;
+    ResponseCycleData* cycle = writerCycle(writer);
+    int length = CDNS_HEADER_SIZE + writer->length;
+    int err;
+    // A failed write leaves the packet as it was, so it is retried once there is more room
+    do {
+        err = addQuestion(cycle->response, cycle->responseCapacity, &length, &writer->names, &writer->header, name,
+                          type, clas);
+    } while(err == CDNS_ERR_TOO_LARGE && growResponse(cycle, cycle->responseCapacity + 1));
+    writer->length = length - CDNS_HEADER_SIZE;
+    return err;
+}
+int cdnsAddRecord(CdnsResponseWriteinfo *_writer, CdnsSection section, const void *name,
+                  const CdnsResourceRecordInfo *info, const void *rdata) {
+    ResponseWriteInfo* writer = (ResponseWriteInfo*)_writer;
+    ResponseCycleData* cycle = writerCycle(writer);
+    int length = CDNS_HEADER_SIZE + writer->length;
+    int err;
+    do {
+        err = addRecord(cycle->response, cycle->responseCapacity, &length, &writer->names, &writer->header, section,
+                        name, info, rdata);
+    } while(err == CDNS_ERR_TOO_LARGE && growResponse(cycle, cycle->responseCapacity + 1));
+    writer->length = length - CDNS_HEADER_SIZE;
+    return err;
+}
+// Key that a UDP response is rate limited under: the client's prefix and what kind of
+// response it is
+static u_int64_t rateLimitKey(const ResponseCycleData* cycle) {
+    const unsigned char* prefix;
+    int prefixLength;
+    if(cycle->client.sa.sa_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&cycle->client.in6.sin6_addr)) {
+        // IPv4 clients of a dual-stack socket share a /24 as on an IPv4 one
+        prefix = cycle->client.in6.sin6_addr.s6_addr + 12;
+        prefixLength = RRL_IPV4_PREFIX_BYTES;
+    } else if(cycle->client.sa.sa_family == AF_INET6) {
+        prefix = cycle->client.in6.sin6_addr.s6_addr;
+        prefixLength = RRL_IPV6_PREFIX_BYTES;
+    } else {
+        prefix = (const unsigned char*)&cycle->client.in4.sin_addr.s_addr;
+        prefixLength = RRL_IPV4_PREFIX_BYTES;
+    }
+    // Errors, and anything whose question can't be read, count per client alone
+    u_int64_t kind = 0;
+    u_int64_t hash = 0xcbf29ce484222325ull;
+    const unsigned char* name = cycle->request + CDNS_HEADER_SIZE;
+    int limit = cycle->requestLength - CDNS_HEADER_SIZE;
+    int rcode = cycle->writer.header.rcode;
+    if(rcode == 0 && questionHash(cycle->request, cycle->requestLength, &hash)) {
+        kind = 1;
+    } else if(rcode == 3 && limit > 0 && name[0] != 0 && name[0] < limit) {
+        // Random subdomains of one name are one flood
+        unsigned char folded[CDNS_MAX_NAME_LENGTH];
+        u_int64_t parent = hash;
+        if(nameKernels()->foldName(name + 1 + name[0], limit - 1 - name[0], folded, &parent) > 0) {
+            hash = parent;
+            kind = 2;
+        }
+    }
+    return hashBytes(prefix, prefixLength, hash ^ kind);
+}
+// Replaces a response with the header and question alone, with TC set so the client
+// retries over TCP
+static void truncateResponse(ResponseCycleData* cycle) {
+    ResponseWriteInfo* writer = &cycle->writer;
+    int nameLength = uncompressedNameLength(cycle->request + CDNS_HEADER_SIZE,
+                                            cycle->requestLength - CDNS_HEADER_SIZE);
+    bool question = cycle->requestHeader.qdcount == 1 && nameLength > 0 &&
+                    CDNS_HEADER_SIZE + nameLength + 4 <= cycle->requestLength;
+    writer->length = 0;
+    if(question) {
+        writer->length = nameLength + 4;
+        memcpy(cycle->response + CDNS_HEADER_SIZE, cycle->request + CDNS_HEADER_SIZE, writer->length);
+    }
+    writer->header.tc = 1;
+    writer->header.qdcount = question;
+    writer->header.ancount = 0;
+    writer->header.nscount = 0;
+    writer->header.arcount = 0;
+}
+// Counts a UDP response against the rate limit and returns whether it is still sent,
+// possibly truncated
+static bool allowResponse(DnsWorker* worker, ResponseCycleData* cycle) {
+    DnsState* state = worker->state;
+    u_int32_t count = countRate(&worker->rateSketch, rateLimitKey(cycle), (u_int32_t)(cycle->receivedAt / 1000000));
+    if(count <= state->rrlRate) {
+        return true;
+    }
+    countStat(worker, STAT_RRL_LIMITED, 1);
+    if(state->rrlAction == CdnsRrlPass) {
+        return true;
+    }
+    if(state->rrlAction == CdnsRrlSlip && ++worker->sinceSlip >= state->rrlSlip) {
+        worker->sinceSlip = 0;
+        truncateResponse(cycle);
+        countStat(worker, STAT_RRL_SLIPPED, 1);
+        return true;
+    }
+    return false;
+}
+// Fits the response to what the client can receive, with an OPT record answering the
+// request's if it sent one. Over TCP there is no payload size to keep to beyond what the
+// length prefix allows
+static void fitResponse(DnsWorker* worker, ResponseCycleData* cycle, bool stream) {
+    ResponseWriteInfo* writer = &cycle->writer;
+    CdnsPacketReadInfo* request;
+    CdnsEdns requested;
+    bool edns = cdnsGetRequestReadInfo((CdnsResponseContext*)cycle, &request) == 0 &&
+                cdnsGetEdns(request, &requested) == 0;
+    int length = CDNS_HEADER_SIZE + writer->length;
+    // Room for an OPT record is made rather than records dropped for it
+    if(stream && edns) {
+        growResponse(cycle, length + OPT_RECORD_SIZE);
+    }
+    int limit = stream ? cycle->responseCapacity : CDNS_CLASSIC_UDP_SIZE;
+    // Nothing to check in a small response without additional records to a client without EDNS
+    if(!edns && writer->header.arcount == 0 && length <= limit) {
+        return;
+    }
+    CdnsEdns offered = {.udpSize = worker->state->ednsUdpSize, .dnssecOk = edns && requested.dnssecOk};
+    if(edns && !stream) {
+        limit = requested.udpSize < offered.udpSize ? requested.udpSize : offered.udpSize;
+        limit = limit > CDNS_CLASSIC_UDP_SIZE ? limit : CDNS_CLASSIC_UDP_SIZE;
+    }
+    if(!fitMessage(cycle->response, &length, &writer->header, limit, edns ? &offered : NULL) && length > limit) {
+        // Records that don't add up can't be cut apart, so only the header is left
+        writer->header.tc = 1;
+        writer->header.qdcount = 0;
+        writer->header.ancount = 0;
+        writer->header.nscount = 0;
+        writer->header.arcount = 0;
+        length = CDNS_HEADER_SIZE;
+    }
+    writer->length = length - CDNS_HEADER_SIZE;
+}
+int cdnsSendResponse(CdnsResponseWriteinfo *_writer) {
+    ResponseWriteInfo* writer = (ResponseWriteInfo*)_writer;
+    if(writer->queued) {
+        return 0;
+    }
+    ResponseCycleData* cycle = writerCycle(writer);
+    if(cycle->connection != -1) {
+        fitResponse(cycle->context.worker, cycle, true);
+        writeHeader(&writer->header, cycle->response);
+        writer->queued = true;
+        queueTcpResponse(cycle->context.worker, cycle);
+        return 0;
+    }
+    DnsWorker* worker = cycle->context.worker;
+    if(worker->state->rrlRate != 0 && !allowResponse(worker, cycle)) {
+        // Dropped, but done with as if it had been sent
+        writer->queued = true;
+        writer->flushed = true;
+        countStat(worker, STAT_QUERIES_DROPPED, 1);
+        return 0;
+    }
+    if(worker->replay != NULL) {
+        enum DnsReplayStage stage = switchStage(worker->replay, REPLAY_SEND);
+        fitResponse(worker, cycle, false);
+        switchStage(worker->replay, stage);
+    } else {
+        fitResponse(worker, cycle, false);
+    }
+    DnsBatchIo* batch = &worker->batch;
+    if(batch->numQueued == batch->batchSize) {
+        flushResponses(cycle->context.worker);
+    }
+    writeHeader(&writer->header, cycle->response);
+    writer->queued = true;
+    batch->sendSlots[batch->numQueued++] = cycle->context.index;
+    return 0;
+}
+int cdnsGetBatchStats(CdnsState *_state, CdnsBatchStats *out) {
+    DnsState* state = (DnsState*)_state;
+    memset(out, 0, sizeof(CdnsBatchStats));
+    for(int i = 0;i < atomic_load(&state->numThreads);i++) {
+        const DnsBatchStats* stats = &state->connections.workers[i].batch.stats;
+        out->recvBatches += atomic_load_explicit(&stats->recvBatches, memory_order_relaxed);
+        out->recvPackets += atomic_load_explicit(&stats->recvPackets, memory_order_relaxed);
+        out->sendBatches += atomic_load_explicit(&stats->sendBatches, memory_order_relaxed);
+        out->sendPackets += atomic_load_explicit(&stats->sendPackets, memory_order_relaxed);
+        out->sendDropped += atomic_load_explicit(&stats->sendDropped, memory_order_relaxed);
+        out->ringThreads += atomic_load_explicit(&stats->ringThreads, memory_order_relaxed);
+        for(int j = 0;j < CDNS_BATCH_FILL_BUCKETS;j++) {
+            out->recvFill[j] += atomic_load_explicit(&stats->recvFill[j], memory_order_relaxed);
+            out->sendFill[j] += atomic_load_explicit(&stats->sendFill[j], memory_order_relaxed);
+        }
+    }
+    return 0;
+}
+int cdnsGetStats(CdnsState *_state, CdnsStats *out) {
+    DnsState* state = (DnsState*)_state;
+    memset(out, 0, sizeof(CdnsStats));
+    u_int64_t counters[STAT_NUM_COUNTERS] = {0};
+    for(int i = 0;i < atomic_load(&state->numThreads);i++) {
+        const DnsStats* stats = &state->connections.workers[i].stats;
+        for(int j = 0;j < STAT_NUM_COUNTERS;j++) {
+            counters[j] += atomic_load_explicit(&stats->counters[j], memory_order_relaxed);
+        }
+        sumHistogram(&out->endToEnd, &stats->endToEnd);
+        sumHistogram(&out->upstreamRtt, &stats->upstreamRtt);
+    }
+    out->queriesReceived = counters[STAT_QUERIES_RECEIVED];
+    out->responsesSent = counters[STAT_RESPONSES_SENT];
+    out->queriesDropped = counters[STAT_QUERIES_DROPPED];
+    out->upstreamSent = counters[STAT_UPSTREAM_SENT];
+    out->upstreamReplies = counters[STAT_UPSTREAM_REPLIES];
+    out->upstreamRetransmits = counters[STAT_UPSTREAM_RETRANSMITS];
+    out->upstreamTimeouts = counters[STAT_UPSTREAM_TIMEOUTS];
+    out->requestSlotsExhausted = counters[STAT_REQUEST_SLOTS_EXHAUSTED];
+    out->outgoingSlotsExhausted = counters[STAT_OUTGOING_SLOTS_EXHAUSTED];
+    out->zoneAnswers = counters[STAT_ZONE_ANSWERS];
+    out->rrlLimited = counters[STAT_RRL_LIMITED];
+    out->rrlSlipped = counters[STAT_RRL_SLIPPED];
+    out->upstreamTcpFallbacks = counters[STAT_UPSTREAM_TCP_FALLBACKS];
+    out->upstreamTcpConnects = counters[STAT_UPSTREAM_TCP_CONNECTS];
+    out->cacheRestored = counters[STAT_CACHE_RESTORED];
+    return 0;
+}
+u_int64_t cdnsLatencyPercentile(const CdnsLatencyHistogram *histogram, double percentile) {
+    if(histogram->total == 0) {
+        return 0;
+    }
+    u_int64_t target = (u_int64_t)(histogram->total * percentile / 100.0 + 0.5);
+    u_int64_t seen = 0;
+    for(int i = 0;i < CDNS_LATENCY_BUCKETS;i++) {
+        seen += histogram->counts[i];
+        if(seen >= target && seen > 0) {
+            u_int64_t top = latencyBucketTop(i);
+            return top < histogram->maxUs ? top : histogram->maxUs;
+        }
+    }
+    return histogram->maxUs;
+}
+int cdnsCreateRequest(CdnsResponseContext *context, CdnsRequestWriteInfo **out) {
+    ResponseCycleData* cycle = (ResponseCycleData*)context;
+    DnsWorker* worker = cycle->context.worker;
+    u_int32_t idx;
+    if(!poolCreated(&worker->requestPool)) {
+        return CDNS_ERR_OUTGOING_FULL;
+    }
+    if(!allocPoolEntry(&worker->requestPool, &idx)) {
+        countStat(worker, STAT_OUTGOING_SLOTS_EXHAUSTED, 1);
+        return CDNS_ERR_OUTGOING_FULL;
+    }
+    OutgoingRequestTrackingData* req = getRequest(worker, idx);
+    req->worker = worker;
+    req->id.data = (u_int64_t)req->generation << 32 | idx;
+    req->owner = cycle->context.index;
+    req->nextOwned = cycle->ownedRequests;
+    cycle->ownedRequests = (int)idx;
+    req->sent = false;
+    req->answered = false;
+    req->failed = false;
+    req->awaited = false;
+    req->resendCount = 0;
+    req->pool = NULL;
+    req->hedge = -1;
+    req->hedgeOf = -1;
+    req->tcp = false;
+    req->connection = -1;
+    memset(&req->writer, 0, sizeof(RequestWriteInfo));
+    req->writer.header.rd = 1;
+    *out = (CdnsRequestWriteInfo*)&req->writer;
+    return 0;
+}
+int cdnsWritableRequestHeader(CdnsRequestWriteInfo *_writer, CdnsPacketHeader **out) {
+    RequestWriteInfo* writer = (RequestWriteInfo*)_writer;
+    *out = &writer->header;
+    return 0;
+}
+int cdnsWriteQuestion(CdnsRequestWriteInfo *_writer, void *question, int length) {
+    OutgoingRequestTrackingData* req = (OutgoingRequestTrackingData*)_writer;
+    if(CDNS_HEADER_SIZE + req->writer.length + length > CDNS_UDP_BUFFER_SIZE) {
+        return CDNS_ERR_TOO_LARGE;
+    }
+    memcpy(req->request + CDNS_HEADER_SIZE + req->writer.length, question, length);
+    req->writer.length += length;
+    return 0;
+}
+// Binds a UDP socket to a random unprivileged port, leaving the choice to the kernel if
+// a few random picks are all taken
+static int makeUpstreamSocket(DnsWorker* worker) {
+    int sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(sock == -1) {
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    for(int attempt = 0;attempt < 8;attempt++) {
+        addr.sin_port = htons(1024 + randomU16(&worker->random) % (65536 - 1024));
+        if(bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+            return sock;
+        }
+    }
+    addr.sin_port = 0;
+    if(bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+// Opens the worker's upstream sockets on first use
+static int openUpstreamSockets(DnsWorker* worker) {
+    if(worker->upstreamSockets != NULL) {
+        return 0;
+    }
+    int count = worker->state->upstreamPorts;
+    worker->upstreamSockets = (int*)malloc(sizeof(int) * count);
+    if(worker->upstreamSockets == NULL) {
+        return CDNS_ERR_MEM;
+    }
+    for(int i = 0;i < count;i++) {
+        worker->upstreamSockets[i] = -1;
+    }
+    for(int i = 0;i < count;i++) {
+        int sock = makeUpstreamSocket(worker);
+        if(sock == -1) {
+            return CDNS_ERR_UNDEFINED;
+        }
+        worker->upstreamSockets[i] = sock;
+        DnsWorkerRing* ring = worker->ring;
+        u_int32_t file = worker->state->numListeners + i;
+        if(ring != NULL && ringUpdateFile(&ring->ring, file, sock)) {
+            // Armed before the worker next waits, replies that beat that wait in the socket buffer
+            ring->files[file] = sock;
+            ring->needsArming = true;
+            continue;
+        }
+        struct epoll_event event = {.events = EPOLLIN};
+        event.data.u64 = eventTag(EVENT_UPSTREAM, i);
+        if(epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, sock, &event) != 0) {
+            return CDNS_ERR_UNDEFINED;
+        }
+    }
+    return 0;
+}
+// Checks that a destination is one requests can be sent to
+static int checkDestination(const CdnsRequestDestination* destination) {
+    if(destination->protocol == CdnsProtoHttp) {
+        return CDNS_ERR_HTTP;
+    }
+    // The address field only has room for IPv4
+    if(destination->netProtocol != CdnsNetProtoInet4) {
+        return CDNS_ERR_UNDEFINED;
+    }
+    return 0;
+}
+static void makeDestination(const CdnsRequestDestination* destination, DnsSockAddr* out) {
+    memset(out, 0, sizeof(DnsSockAddr));
+    out->in4.sin_family = AF_INET;
+    out->in4.sin_port = htons(destination->port);
+    out->in4.sin_addr.s_addr = (u_int32_t)destination->address;
+}
+// Sends a request whose destination is set, or has it share the reply of an identical
+// one already in flight
+static int startRequest(OutgoingRequestTrackingData* req, CdnsRequestId *id) {
+    DnsWorker* worker = req->worker;
+    int err = worker->replay != NULL ? 0 : openUpstreamSockets(worker);
+    if(err != 0) {
+        return err;
+    }
+    int length = CDNS_HEADER_SIZE + req->writer.length;
+    CdnsEdns offered = {.udpSize = worker->state->ednsUdpSize};
+    // An OPT record the callback wrote keeps its DO bit and version, and only has its
+    // payload size held to what the upstream sockets receive
+    int opt = findOpt(req->request, length, &req->writer.header);
+    if(opt != -1) {
+        readOptFields(req->request + opt, &offered);
+        offered.udpSize = offered.udpSize < CDNS_CLASSIC_UDP_SIZE ? CDNS_CLASSIC_UDP_SIZE
+                          : offered.udpSize > worker->state->ednsUdpSize ? worker->state->ednsUdpSize
+                          : offered.udpSize;
+    }
+    fitMessage(req->request, &length, &req->writer.header, CDNS_UDP_BUFFER_SIZE, &offered);
+    req->writer.length = length - CDNS_HEADER_SIZE;
+    req->requestLength = length;
+    // Hashing reads qdcount from the wire, the id is written again once it is chosen
+    writeHeader(&req->writer.header, req->request);
+    if(!questionHash(req->request, req->requestLength, &req->questionHash)) {
+        return CDNS_ERR_MALFORMED;
+    }
+    u_int32_t idx = (u_int32_t)(req->id.data & 0xFFFFFFFF);
+    if(worker->state->coalesce) {
+        u_int32_t leader = findInflight(worker, req);
+        if(leader != CDNS_POOL_NONE) {
+            // The same query is already on its way, so wait for its reply instead
+            attachFollower(worker, leader, idx);
+            req->sent = true;
+            *id = req->id;
+            return 0;
+        }
+    }
+    err = transmitRequest(worker, idx);
+    if(err != 0) {
+        return err;
+    }
+    if(worker->state->coalesce) {
+        insertInflight(worker, idx);
+    }
+    countStat(worker, STAT_UPSTREAM_SENT, 1);
+    req->sentAt = monotonicUs();
+    req->sent = true;
+    u_int64_t now = monotonicMs();
+    scheduleTimer(&worker->timers, &req->resendTimer, now + worker->state->resendDelay);
+    if(req->pool != NULL) {
+        countUpstream(worker, req->pool, req->upstream, UPSTREAM_QUERIES);
+        if(req->pool->hedge && req->pool->numUpstreams > 1) {
+            u_int64_t delay = hedgeDelay(worker, req);
+            // Otherwise the resend comes first anyway
+            if(delay < (u_int64_t)worker->state->resendDelay) {
+                scheduleTimer(&worker->timers, &req->hedgeTimer, now + delay);
+            }
+        }
+    }
+    *id = req->id;
+    return 0;
+}
+int cdnsSendRequest(CdnsRequestWriteInfo *_writer, CdnsRequestDestination destination, CdnsRequestId *id) {
+    OutgoingRequestTrackingData* req = (OutgoingRequestTrackingData*)_writer;
+    if(req->sent) {
+        *id = req->id;
+        return 0;
+    }
+    int err = checkDestination(&destination);
+    if(err != 0) {
+        return err;
+    }
+    makeDestination(&destination, &req->destination);
+    req->destinationLength = sizeof(struct sockaddr_in);
+    req->tcp = destination.protocol == CdnsProtoTcp;
+    return startRequest(req, id);
+}
+int cdnsCreateUpstreamPool(CdnsState *_state, const CdnsUpstreamPoolConfig *config, CdnsUpstreamPool **out) {
+    DnsState* state = (DnsState*)_state;
+    if(config->numUpstreams < 1) {
+        return CDNS_ERR_UNDEFINED;
+    }
+    for(int i = 0;i < config->numUpstreams;i++) {
+        int err = checkDestination(&config->upstreams[i]);
+        if(err != 0) {
+            return err;
+        }
+    }
+    DnsUpstreamPool* pool = (DnsUpstreamPool*)malloc(sizeof(DnsUpstreamPool));
+    if(pool == NULL) {
+        return CDNS_ERR_MEM;
+    }
+    size_t numEstimates = (size_t)state->maxThreads * config->numUpstreams;
+    pool->destinations = (DnsSockAddr*)malloc(sizeof(DnsSockAddr) * config->numUpstreams);
+    pool->streams = (bool*)malloc(sizeof(bool) * config->numUpstreams);
+    pool->estimates = (DnsUpstreamEstimate*)aligned_alloc(CDNS_CACHE_LINE, sizeof(DnsUpstreamEstimate) * numEstimates);
+    if(pool->destinations == NULL || pool->streams == NULL || pool->estimates == NULL) {
+        free(pool->destinations);
+        free(pool->streams);
+        free(pool->estimates);
+        free(pool);
+        return CDNS_ERR_MEM;
+    }
+    memset(pool->estimates, 0, sizeof(DnsUpstreamEstimate) * numEstimates);
+    for(int i = 0;i < config->numUpstreams;i++) {
+        makeDestination(&config->upstreams[i], &pool->destinations[i]);
+        pool->streams[i] = config->upstreams[i].protocol == CdnsProtoTcp;
+    }
+    pool->state = state;
+    pool->numUpstreams = config->numUpstreams;
+    pool->explorePercent = config->explorePercent != 0 ? config->explorePercent : DEFAULT_EXPLORE_PERCENT;
+    pool->hedge = config->hedge;
+    pool->hedgeMinDelay = config->hedgeMinDelayMs;
+    pthread_mutex_lock(&state->connections.lock);
+    pool->next = state->pools;
+    state->pools = pool;
+    pthread_mutex_unlock(&state->connections.lock);
+    *out = (CdnsUpstreamPool*)pool;
+    return 0;
+}
+int cdnsSendPooledRequest(CdnsRequestWriteInfo *_writer, CdnsUpstreamPool *_pool, CdnsRequestId *id) {
+    OutgoingRequestTrackingData* req = (OutgoingRequestTrackingData*)_writer;
+    DnsUpstreamPool* pool = (DnsUpstreamPool*)_pool;
+    if(req->sent) {
+        *id = req->id;
+        return 0;
+    }
+    setUpstream(req, pool, pickUpstream(req->worker, pool, -1, true));
+    return startRequest(req, id);
+}
+int cdnsGetUpstreamStats(CdnsUpstreamPool *_pool, int index, CdnsUpstreamStats *out) {
+    DnsUpstreamPool* pool = (DnsUpstreamPool*)_pool;
+    if(index < 0 || index >= pool->numUpstreams) {
+        return CDNS_ERR_UNDEFINED;
+    }
+    memset(out, 0, sizeof(CdnsUpstreamStats));
+    u_int64_t counters[UPSTREAM_NUM_COUNTERS] = {0};
+    int measured = 0;
+    int sending = 0;
+    double loss = 0;
+    DnsWorker* workers = pool->state->connections.workers;
+    for(int i = 0;i < atomic_load(&pool->state->numThreads);i++) {
+        const DnsUpstreamEstimate* estimate = upstreamEstimate(&workers[i], pool, index);
+        u_int64_t queries = atomic_load_explicit(&estimate->counters[UPSTREAM_QUERIES], memory_order_relaxed);
+        for(int j = 0;j < UPSTREAM_NUM_COUNTERS;j++) {
+            counters[j] += atomic_load_explicit(&estimate->counters[j], memory_order_relaxed);
+        }
+        u_int32_t srtt = atomic_load_explicit(&estimate->srttUs, memory_order_relaxed);
+        if(srtt != 0) {
+            out->srttUs += srtt;
+            out->rttVarUs += atomic_load_explicit(&estimate->rttVarUs, memory_order_relaxed);
+            measured++;
+        }
+        if(queries != 0) {
+            loss += atomic_load_explicit(&estimate->loss, memory_order_relaxed) / 65536.0;
+            sending++;
+        }
+    }
+    if(measured > 0) {
+        out->srttUs /= measured;
+        out->rttVarUs /= measured;
+    }
+    out->lossRate = sending > 0 ? loss / sending : 0;
+    out->queries = counters[UPSTREAM_QUERIES];
+    out->replies = counters[UPSTREAM_REPLIES];
+    out->timeouts = counters[UPSTREAM_TIMEOUTS];
+    out->hedges = counters[UPSTREAM_HEDGES];
+    out->hedgesWon = counters[UPSTREAM_HEDGES_WON];
+    return 0;
+}
+int cdnsCacheAnswer(CdnsResponseContext *context, bool *answered) {
+    ResponseCycleData* cycle = (ResponseCycleData*)context;
+    *answered = !cycle->writer.queued && answerFromCache(cycle->context.worker, cycle);
+    return 0;
+}
+int cdnsCacheStore(CdnsResponseContext *context, const CdnsPacketReadInfo *response) {
+    ResponseCycleData* cycle = (ResponseCycleData*)context;
+    return storeCacheEntry(&cycle->context.worker->cache, response, monotonicMs());
+}
+int cdnsCompileZone(const char *zonePath, const char *origin, const char *imagePath, int *errorLine) {
+    return compileZone(zonePath, origin, imagePath, errorLine);
+}
+int cdnsLoadZone(CdnsState *_state, const char *imagePath) {
+    DnsState* state = (DnsState*)_state;
+    DnsLoadedZone* zone = NULL;
+    if(imagePath != NULL) {
+        zone = (DnsLoadedZone*)calloc(1, sizeof(DnsLoadedZone));
+        if(zone == NULL) {
+            return CDNS_ERR_MEM;
+        }
+        int fd = open(imagePath, O_RDONLY | O_CLOEXEC);
+        struct stat info;
+        void* image = MAP_FAILED;
+        if(fd != -1 && fstat(fd, &info) == 0 && info.st_size > 0) {
+            // Shared, so every server mapping the image shares its pages
+            image = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        if(fd != -1) {
+            close(fd);
+        }
+        if(image == MAP_FAILED || !openZoneImage((const unsigned char*)image, info.st_size, &zone->zone)) {
+            if(image != MAP_FAILED) {
+                munmap(image, info.st_size);
+            }
+            free(zone);
+            return CDNS_ERR_ZONE;
+        }
+    }
+    DnsLoadedZone* old = atomic_exchange(&state->zone, zone);
+    pthread_mutex_lock(&state->connections.lock);
+    if(old != NULL) {
+        old->retiredAt = atomic_fetch_add(&state->zoneEpoch, 1) + 1;
+        old->next = state->retiredZones;
+        state->retiredZones = old;
+        atomic_fetch_add(&state->numRetiredZones, 1);
+    }
+    reclaimZones(state);
+    pthread_mutex_unlock(&state->connections.lock);
+    return 0;
+}
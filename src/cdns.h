@@ -26,6 +26,7 @@ typedef struct CdnsRequestInfo {
 } CdnsRequestInfo;
 /// The cdns server instance. This can also make requests itself.
 typedef struct CdnsState CdnsState;
+typedef struct CdnsUpstreamPool CdnsUpstreamPool;
 /// Context used to handle a dns request
 typedef struct CdnsResponseContext CdnsResponseContext;
 /// On what condition the callback is exiting
@@ -39,7 +40,16 @@ typedef enum CdnsCallbackCycleStatus {
   CdnsWaitMs,
   /// The response should await some other outgoing request
   CdnsPoll,
+  /// The response should await the requests given to cdnsAwaitRequests
+  CdnsPollMany,
 } CdnsCallbackCycleStatus;
+/// When a callback waiting on several outgoing requests is resumed
+typedef enum CdnsAwaitMode {
+  /// Once any one of them is answered or gives up
+  CdnsAwaitAny,
+  /// Once every one of them is answered or has given up
+  CdnsAwaitAll
+} CdnsAwaitMode;
 typedef union CdnsCallbackCycleData {
   u_int64_t ms;
   CdnsRequestId id;
@@ -47,7 +57,8 @@ typedef union CdnsCallbackCycleData {
 /// Whether/how a callback cycle should continue
 typedef struct CdnsCallbackCycleInfo {
   CdnsCallbackCycleStatus status;
-  /// The data, either a CdnsRequestId or an integer number of milliseconds
+  /// The data, either a CdnsRequestId or an integer number of milliseconds.
+  /// For CdnsPollMany, the deadline in milliseconds, 0 for none
   CdnsCallbackCycleData data;
 } CdnsCallbackCycleInfo;
 
@@ -60,13 +71,70 @@ typedef enum CdnsProtocolType {
   CdnsProtoTcp,
   CdnsProtoHttp
 } CdnsProtocolType;
+/// What becomes of a UDP response over the response rate limit
+typedef enum CdnsRrlAction {
+  /// One in rrlSlip is sent empty with TC set, so that a real client retries
+  /// over TCP, and the rest are dropped
+  CdnsRrlSlip,
+  /// Every one is dropped
+  CdnsRrlDrop,
+  /// Every one is sent and only counted, to size the limit before enforcing it
+  CdnsRrlPass
+} CdnsRrlAction;
+/// How a thread waits for and moves UDP datagrams
+typedef enum CdnsIoBackend {
+  /// epoll for readiness, recvmmsg and sendmmsg for the datagrams
+  CdnsIoEpoll,
+  /// io_uring with multishot receives into provided buffer rings on registered
+  /// files, and every response of a batch sent in one submission. Threads fall
+  /// back to epoll where the kernel lacks any of that or refuses io_uring
+  CdnsIoUring
+} CdnsIoBackend;
 typedef struct CdnsRequestDestination {
   CdnsNetworkProtocolType netProtocol;
   CdnsProtocolType protocol;
+  /// IPv4 address in network byte order, in the low 32 bits
   u_int64_t address;
+  /// Port in host byte order
   u_int16_t port;
 } CdnsRequestDestination;
 
+/// A set of interchangeable upstream servers that requests are spread over
+typedef struct CdnsUpstreamPoolConfig {
+  /// The number of upstreams
+  int numUpstreams;
+  /// A pointer to a list of UDP or TCP destinations
+  CdnsRequestDestination *upstreams;
+  /// Defaults to 5. Percent of requests sent to a random upstream rather than the
+  /// fastest one, so that the estimates of the others stay current
+  unsigned int explorePercent;
+  /// Defaults to false. If set, a request that is still unanswered once its
+  /// upstream's smoothed RTT plus four times its RTT variation has passed is also
+  /// sent to the next fastest upstream, and whichever reply comes first is used
+  bool hedge;
+  /// Defaults to 0. Lower bound on the time before a hedged request is sent
+  unsigned int hedgeMinDelayMs;
+} CdnsUpstreamPoolConfig;
+
+/// What the threads have learned about one upstream of a pool
+typedef struct CdnsUpstreamStats {
+  /// Smoothed RTT and its mean variation, averaged over the threads that have
+  /// measured them. 0 until a reply arrives
+  u_int64_t srttUs;
+  u_int64_t rttVarUs;
+  /// Recent share of queries that went unanswered until their resend, 0 to 1
+  double lossRate;
+  /// Queries sent, resends and hedges included
+  u_int64_t queries;
+  u_int64_t replies;
+  /// Queries that were resent or given up on without a reply
+  u_int64_t timeouts;
+  /// Hedged queries sent to this upstream
+  u_int64_t hedges;
+  /// Hedged queries sent to this upstream that were answered first
+  u_int64_t hedgesWon;
+} CdnsUpstreamStats;
+
 /// Returns whether the current callback cycle can be completed.
 ///
 /// Parameters: context, data pointer, whether this is the first call for a
@@ -91,7 +159,10 @@ typedef struct CdnsListenerConfig {
   char addr[16];
   /// The network type(IPv4 or IPv6)
   CdnsNetworkProtocolType netProto;
-  /// The carrier protocol type(UDP, TCP, or HTTP(also over TCP))
+  /// The carrier protocol type(UDP, TCP, or HTTP(also over TCP)). HTTP
+  /// listeners speak plaintext HTTP/1.1 and take queries the RFC 8484 way, as a
+  /// GET with a base64url dns parameter or a POST of application/dns-message,
+  /// on any path. TLS is left to a proxy in front
   CdnsProtocolType proto;
 } CdnsListenerConfig;
 typedef struct CdnsConfig {
@@ -99,12 +170,28 @@ typedef struct CdnsConfig {
   int numListeners;
   /// A pointer to a list of listener configs
   CdnsListenerConfig *listeners;
-  /// Defaults to 1 thread
+  /// Defaults to 1 thread. Every thread binds its own SO_REUSEPORT socket for
+  /// each listener, and the kernel spreads incoming queries between them
   unsigned int initialThreads;
   /// Defaults to 1 thread. If this is higher than initialThreads, then new
-  /// threads may be dynamically created when needed
+  /// threads may be dynamically created when a thread's threadRequests slots
+  /// are close to full
   unsigned int maxThreads;
+  /// Defaults to none, which leaves threads where the scheduler puts them. CPUs
+  /// to pin threads to, thread i on workerCpus[i % numWorkerCpus]. Thread 0 is
+  /// the one calling cdnsPoll, which gets its affinity back when cdnsPoll
+  /// returns. A page of a thread's memory comes from the NUMA node of its CPU
+  /// if it is first touched once the thread is pinned, or while the thread is
+  /// set up, as pages are placed when first touched. Heap pages that were
+  /// already in use stay where they are. Its listeners steer a packet to the
+  /// first thread pinned to the CPU that took it off the NIC, by the RX queue
+  /// it arrived on. Packets taken by other CPUs are spread by the kernel's hash
+  /// as usual. Steering needs CAP_BPF or CAP_SYS_ADMIN and Linux 4.19, and
+  /// without them every packet is spread by the hash
+  const unsigned int *workerCpus;
+  unsigned int numWorkerCpus;
   /// Defaults to 256. Maximum requests handled by a single thread concurrently.
+  /// Memory for them is allocated in chunks of 64 as load requires
   unsigned int threadRequests;
   /// Defaults to zero. The maximum number of outgoing DNS
   /// requests(useful for a proxy/redirecting DNS) that can be active at once
@@ -114,6 +201,73 @@ typedef struct CdnsConfig {
   unsigned int resendDelayMs;
   /// Defaults to 10. Number of times to resend a DNS request before giving up.
   unsigned int maxResendCount;
+  /// Defaults to 32. Maximum number of datagrams received by a single
+  /// recvmmsg call or sent by a single sendmmsg call on a UDP listener.
+  unsigned int batchSize;
+  /// Defaults to 0, which disables the cache. Bytes of responses each thread
+  /// may keep in its response cache
+  unsigned int cacheBytes;
+  /// Defaults to false. If set, cache hits are not answered before the
+  /// callback runs, and callbacks have to call cdnsCacheAnswer themselves
+  bool cacheSkipAutoAnswer;
+  /// Defaults to none. File the response caches are saved to, written beside
+  /// it and renamed over it, by cdnsPause and cdnsDestroyDns once threads have
+  /// run since the last save. cdnsCreateDns maps the file left by an earlier
+  /// run, if there is one, and a thread missing in its cache takes the answer
+  /// from the file as long as it is fresh by the wall clock, with its TTLs
+  /// reduced by the time since it was stored. Entries are checked as they are
+  /// read, so a damaged file costs answers but not the time to scan it
+  const char *cacheSnapshotPath;
+  /// Defaults to 0, which saves only on cdnsPause and cdnsDestroyDns.
+  /// Otherwise ms between saves by a background thread while cdnsPoll runs.
+  /// Each thread copies its cache out a slice at a time between batches, so
+  /// none of them stops for the save
+  unsigned int cacheSnapshotIntervalMs;
+  /// Defaults to 8. UDP sockets each thread opens for upstream requests, each
+  /// bound to a random source port. Every request goes out on a random one of
+  /// them with a random id, so a spoofed reply has to guess both
+  unsigned int upstreamPorts;
+  /// Defaults to false. Unless set, a request identical to one that is still
+  /// waiting for its reply on the same thread is not sent again, and gets a copy
+  /// of that reply instead
+  bool upstreamSkipCoalescing;
+  /// Defaults to 2. TCP connections each thread keeps open to one upstream.
+  /// Requests to a TCP destination are pipelined over them, the least loaded
+  /// taking the next one, and a further connection is opened only once those
+  /// already open each carry 32 requests. Connections are reopened with backoff
+  /// while requests wait on them, and closed after tcpIdleTimeoutMs without any
+  unsigned int upstreamTcpConnections;
+  /// Defaults to false. Unless set, a request whose UDP reply comes back
+  /// truncated is sent again over TCP to the same upstream, and the callback
+  /// only sees the reply to that, of up to 65535 bytes
+  bool upstreamSkipTcpFallback;
+  /// Defaults to 1024. Open TCP and HTTP connections each thread accepts,
+  /// further connections are closed straight away
+  unsigned int tcpMaxConnections;
+  /// Defaults to 10000. TCP and HTTP connections with no query in flight and
+  /// nothing received for this long are closed
+  unsigned int tcpIdleTimeoutMs;
+  /// Defaults to CdnsIoEpoll. Used for UDP listeners and upstream sockets, TCP
+  /// and HTTP connections always use epoll
+  CdnsIoBackend ioBackend;
+  /// Defaults to 0, which turns response rate limiting off. UDP responses per
+  /// second, up to 65534, that each thread sends to one client /24 or /56 for
+  /// the same kind of response: answers count per qname and type, NXDOMAIN per
+  /// parent of the qname so that random subdomains share a count, and errors per
+  /// client alone. Counted in a fixed size sketch that may overestimate but
+  /// never underestimates
+  unsigned int rrlResponsesPerSecond;
+  /// Defaults to CdnsRrlSlip
+  CdnsRrlAction rrlAction;
+  /// Defaults to 2. For CdnsRrlSlip, one in this many responses over the limit
+  /// is sent truncated
+  unsigned int rrlSlip;
+  /// Defaults to 1232, which fits in one IPv6 packet on practically every path,
+  /// and can only be lowered, to no less than 512. The UDP payload size offered
+  /// in the OPT record of responses and upstream requests. A client gets
+  /// responses up to the smaller of this and the size its own OPT record offers,
+  /// and 512 bytes if it sent none
+  unsigned int ednsUdpSize;
 } CdnsConfig;
 
 /// Type of resource record
@@ -249,18 +403,223 @@ typedef struct CdnsPacket {
   CdnsPacketHeader header;
 } CdnsPacket;
 
+/// An indexed packet. The packet is not copied, everything here points into
+/// the buffer it was received in
 typedef struct CdnsPacketReadInfo {
+  /// Answer, authority and additional records combined
   u_int32_t numRecords;
   /// The size of the question or record blob, whichever is valid
   u_int32_t blobSize;
+  /// The header, decoded into host byte order
   CdnsPacketHeader *header;
+  /// Everything following the header on the wire, blobSize bytes long
+  void *blob;
+  /// header->qdcount entries, each pointing at a question's possibly compressed
+  /// qname. Use cdnsGetQuestion to read the type and class that follow it
   CdnsQuestion **questions;
+  /// numRecords entries, each pointing at a record's possibly compressed owner
+  /// name, in answer, authority, additional order. Use cdnsGetRecord to read
+  /// the rest
   void **records;
 } CdnsPacketReadInfo;
 
+/// The EDNS(0) OPT pseudo-record of a packet, as in RFC 6891
+typedef struct CdnsEdns {
+  /// Largest UDP payload the sender can receive
+  u_int16_t udpSize;
+  /// Upper 8 bits of the 12 bit response code
+  u_int8_t extendedRcode;
+  u_int8_t version;
+  /// DNSSEC OK, the sender wants DNSSEC records
+  bool dnssecOk;
+} CdnsEdns;
+
+/// Number of buckets in the batch fill histograms of CdnsBatchStats
+#define CDNS_BATCH_FILL_BUCKETS 8
+
+/// Counters for the batched UDP path, summed over all threads
+typedef struct CdnsBatchStats {
+  /// Number of recvmmsg calls that returned at least one datagram, or on
+  /// io_uring, of reaps of the completion queue that did
+  u_int64_t recvBatches;
+  /// Number of datagrams received
+  u_int64_t recvPackets;
+  /// Number of sendmmsg calls, or io_uring submissions of responses
+  u_int64_t sendBatches;
+  /// Number of datagrams handed to the kernel
+  u_int64_t sendPackets;
+  /// Number of responses dropped because the socket buffer was full
+  u_int64_t sendDropped;
+  /// How full each receive batch was, in fractions of batchSize. The last
+  /// bucket counts completely full batches
+  u_int64_t recvFill[CDNS_BATCH_FILL_BUCKETS];
+  /// How full each send batch was, in fractions of batchSize
+  u_int64_t sendFill[CDNS_BATCH_FILL_BUCKETS];
+  /// Number of threads on io_uring. With CdnsIoUring, the others fell back to
+  /// epoll
+  u_int64_t ringThreads;
+} CdnsBatchStats;
+
+/// Number of buckets in a CdnsLatencyHistogram
+#define CDNS_LATENCY_BUCKETS 240
+
+/// Log-bucketed latencies in microseconds. Bucket b holds exactly b us below 16,
+/// above that every power of two is split into 8 equal buckets, so a bucket is never
+/// wider than an eighth of the values in it. Latencies past the last bucket, over an
+/// hour, are counted in it
+typedef struct CdnsLatencyHistogram {
+  u_int64_t counts[CDNS_LATENCY_BUCKETS];
+  /// Sum of counts
+  u_int64_t total;
+  u_int64_t sumUs;
+  u_int64_t maxUs;
+} CdnsLatencyHistogram;
+
+/// A query for cdnsReplay, as captured off the wire
+typedef struct CdnsReplayQuery {
+  const void *packet;
+  int length;
+  /// When it was captured, in us from any starting point
+  u_int64_t timeUs;
+  /// Client address in network byte order and port in host byte order
+  u_int32_t clientAddress;
+  u_int16_t clientPort;
+} CdnsReplayQuery;
+
+/// How cdnsReplay paces the queries
+typedef enum CdnsReplayPace {
+  /// Each query as soon as the one before it has been dispatched
+  CdnsReplayFast,
+  /// Each query at its capture time relative to the first one
+  CdnsReplayTimed
+} CdnsReplayPace;
+
+/// The queries to replay, and what stands in for the network meanwhile
+typedef struct CdnsReplayConfig {
+  const CdnsReplayQuery *queries;
+  int numQueries;
+  CdnsReplayPace pace;
+  /// Answers an upstream request in place of the upstream: writes the reply,
+  /// whose id is matched as it is, to reply and returns its length, or returns 0
+  /// to leave the request unanswered. Replies are handled once the callback
+  /// that sent the request returns. NULL leaves every request unanswered
+  int (*upstream)(void *context, const void *request, int length, void *reply,
+                  int capacity);
+  /// Called with each response in place of sending it. May be NULL
+  void (*response)(void *context, u_int32_t clientAddress,
+                   u_int16_t clientPort, const void *packet, int length);
+  void *context;
+} CdnsReplayConfig;
+
+/// What a cdnsReplay run did and where its time went. Cycles are counted with
+/// the TSC on x86-64, and are ns elsewhere
+typedef struct CdnsReplayStats {
+  u_int64_t queries;
+  u_int64_t responses;
+  /// Times the callback was run, first runs and resumptions alike
+  u_int64_t callbacks;
+  u_int64_t upstreamRequests;
+  u_int64_t upstreamReplies;
+  /// Response cycle and outgoing request slots taken from their pools
+  u_int64_t slotAllocations;
+  /// Chunks the pools grew by, and responses stored in the cache, each of which
+  /// is a malloc
+  u_int64_t chunkAllocations;
+  u_int64_t cacheAllocations;
+  /// Cycles spent reading queries and looking them up in the zone and cache,
+  /// in the callback, in the upstream stub and matching its replies, and in
+  /// fitting and handing out responses. Each cycle counts in one stage only
+  u_int64_t dispatchCycles;
+  u_int64_t callbackCycles;
+  u_int64_t upstreamCycles;
+  u_int64_t sendCycles;
+  u_int64_t elapsedUs;
+} CdnsReplayStats;
+
+/// Counters and latencies summed over all threads
+typedef struct CdnsStats {
+  /// Queries read off every listener, UDP, TCP and HTTP
+  u_int64_t queriesReceived;
+  /// Responses handed to the kernel
+  u_int64_t responsesSent;
+  /// Queries that got no response: malformed, truncated, finished by the callback
+  /// without one, or whose UDP response the socket would not take
+  u_int64_t queriesDropped;
+  /// Queries sent upstream, not counting resends or requests coalesced into one
+  /// already in flight
+  u_int64_t upstreamSent;
+  /// Upstream replies matched to a request
+  u_int64_t upstreamReplies;
+  /// Upstream queries sent again after resendDelayMs without a reply
+  u_int64_t upstreamRetransmits;
+  /// Upstream requests given up on after maxResendCount resends
+  u_int64_t upstreamTimeouts;
+  /// Times a listener or connection stopped reading because every threadRequests
+  /// slot was busy
+  u_int64_t requestSlotsExhausted;
+  /// cdnsCreateRequest calls that failed because all threadOutgoingRequests slots
+  /// were busy
+  u_int64_t outgoingSlotsExhausted;
+  /// Queries answered from the zone loaded by cdnsLoadZone
+  u_int64_t zoneAnswers;
+  /// UDP responses over the response rate limit, whatever rrlAction did with
+  /// them. Those dropped also count in queriesDropped
+  u_int64_t rrlLimited;
+  /// UDP responses over the limit sent truncated instead
+  u_int64_t rrlSlipped;
+  /// Upstream requests sent again over TCP because their UDP reply was truncated
+  u_int64_t upstreamTcpFallbacks;
+  /// TCP connections opened to upstreams, reconnects included
+  u_int64_t upstreamTcpConnects;
+  /// Cache misses answered from the snapshot mapped by cdnsCreateDns
+  u_int64_t cacheRestored;
+  /// From the read that delivered a query to its response being handed to the
+  /// kernel. Cache hits answered without the callback included
+  CdnsLatencyHistogram endToEnd;
+  /// From an upstream query's first send to its reply, resends included
+  CdnsLatencyHistogram upstreamRtt;
+} CdnsStats;
+
 typedef struct CdnsResponseWriteinfo CdnsResponseWriteinfo;
 typedef struct CdnsRequestWriteInfo CdnsRequestWriteInfo;
 
+/// The record sections of a packet, which must be written in this order
+typedef enum CdnsSection {
+  CdnsSectionAnswer,
+  CdnsSectionAuthority,
+  CdnsSectionAdditional
+} CdnsSection;
+
+/// Names kept per packet for compression. Names written once the table is full
+/// can still point at earlier ones, but later names can't point at them
+#define CDNS_COMPRESSION_NAMES 32
+
+/// Where earlier names start in a packet being built, so later names can point
+/// at them. Internal, only public so it can live inside CdnsPacketBuilder
+typedef struct CdnsNameTable {
+  int numNames;
+  /// 0 while only questions are written, then the last CdnsSection written + 1
+  int section;
+  u_int16_t offsets[CDNS_COMPRESSION_NAMES];
+  /// Case-insensitive hash of the name from each offset to its end
+  u_int32_t hashes[CDNS_COMPRESSION_NAMES];
+  /// Open addressing index on the hashes, entry number + 1, 0 if empty
+  u_int8_t slots[2 * CDNS_COMPRESSION_NAMES];
+} CdnsNameTable;
+
+/// Builds a packet into a buffer owned by the caller, compressing names the
+/// same way the response writer does. Nothing is allocated
+typedef struct CdnsPacketBuilder {
+  /// In host byte order, encoded by cdnsFinishPacket. The counts are kept up to
+  /// date as questions and records are added
+  CdnsPacketHeader header;
+  unsigned char *buffer;
+  int capacity;
+  /// Bytes written so far, the header included
+  int length;
+  CdnsNameTable names;
+} CdnsPacketBuilder;
+
 /// Creates a DNS instance
 int cdnsCreateDns(CdnsState **state, const CdnsConfig *config);
 /// Sets the callback for a DNS instance. Must be called before cdnsPoll
@@ -269,6 +628,17 @@ int cdnsSetCallback(CdnsState *state, const CdnsCallbackDescriptor *callback);
 /// connections are still being processed in the background if multiple threads
 /// are used.
 int cdnsPoll(CdnsState *state);
+/// Runs queries through the dispatch path of the first thread on the calling
+/// thread, in place of cdnsPoll and without any sockets: responses and
+/// upstream requests go to the hooks of config. Returns once every query has
+/// been dispatched and every callback has finished. Timers keep running on
+/// the clock, so a request the stub leaves unanswered takes its resends
+/// before it fails. Counters go to cdnsGetStats as well as to out
+int cdnsReplay(CdnsState *state, const CdnsReplayConfig *config,
+               CdnsReplayStats *out);
+/// Makes a running cdnsPoll return as soon as it finishes its current batch.
+/// Safe to call from another thread or from a signal handler.
+int cdnsStop(CdnsState *state);
 /// Should be called when the DNS server is not polling. Will close all
 /// currently pending requests if multiple threads are used
 int cdnsPause(CdnsState *state);
@@ -276,33 +646,169 @@ int cdnsPause(CdnsState *state);
 int cdnsDestroyDns(CdnsState *state);
 /// Gets the string representation of an error value
 char *cdnsGetErrorString(int error);
+/// Copies the batch counters of the UDP listeners into out. May be called
+/// while cdnsPoll is running.
+int cdnsGetBatchStats(CdnsState *state, CdnsBatchStats *out);
+/// Sums the counters and latency histograms of every thread into out. May be
+/// called while cdnsPoll is running, without slowing the threads down. Counters
+/// are read one at a time, so totals may be a few queries apart from each other
+int cdnsGetStats(CdnsState *state, CdnsStats *out);
+/// Latency in microseconds below which the given percentage, 0 to 100, of the
+/// histogram falls, rounded up to the top of its bucket. 0 for an empty histogram
+u_int64_t cdnsLatencyPercentile(const CdnsLatencyHistogram *histogram,
+                                double percentile);
 
 /// Sets the read info for a request previously made if a response has been
 /// received, zero otherwise. May return an error if there was an error with the
-/// response
+/// response. Requests stay readable until the callback cycle that made them
+/// completes
 int cdnsGetResponseReadInfo(CdnsResponseContext *context, CdnsRequestId req,
                             CdnsPacketReadInfo **out);
+/// Waits on count requests made by this cycle at once, which the callback does
+/// by returning the info this sets. The callback is resumed a single time, once
+/// mode is met or timeoutMs after it returned, if that is not 0. Requests that
+/// are still waiting then have a NULL cdnsGetResponseReadInfo, and can be
+/// awaited again
+int cdnsAwaitRequests(CdnsResponseContext *context, const CdnsRequestId *ids,
+                      int count, CdnsAwaitMode mode, u_int64_t timeoutMs,
+                      CdnsCallbackCycleInfo *out);
 
+/// Answers the current request from the thread's response cache, if it holds
+/// a fresh answer. The cached packet is queued with the request's id and its
+/// TTLs reduced by the time spent in the cache. If *answered is set, the
+/// callback should return CdnsReturned
+int cdnsCacheAnswer(CdnsResponseContext *context, bool *answered);
+/// Stores a response, usually one from an upstream server, in the thread's
+/// response cache under its first question. Only NOERROR and NXDOMAIN
+/// responses that are not truncated are kept, for as long as their shortest
+/// TTL
+int cdnsCacheStore(CdnsResponseContext *context,
+                   const CdnsPacketReadInfo *response);
+
+/// Compiles the RFC 1035 master file at zonePath, for the zone named origin
+/// (for example "example.com."), into an image at imagePath that
+/// cdnsLoadZone maps. The image is written beside imagePath and renamed over
+/// it, so a running server never reads a partial one. $ORIGIN and $TTL are
+/// understood, $INCLUDE is not. Records of types other than A, AAAA, NS,
+/// CNAME, PTR, DNAME, MX, SOA, TXT, SPF, SRV and CAA must be written in the
+/// generic \# form. The apex needs an SOA record. Fails with CDNS_ERR_ZONE,
+/// setting errorLine to the line at fault or to 0 if the files could not be
+/// read or written
+int cdnsCompileZone(const char *zonePath, const char *origin,
+                    const char *imagePath, int *errorLine);
+/// Maps a compiled zone image and answers queries for names in it before the
+/// cache or callback sees them, authoritatively, with referrals for delegated
+/// names and wildcards expanded. Queries for other names are not touched. May
+/// be called at any time from any thread: the new image takes over from the
+/// old one atomically, and the old one is unmapped once no thread can still be
+/// reading it. NULL unloads the zone
+int cdnsLoadZone(CdnsState *state, const char *imagePath);
+
+/// Validates and indexes a packet in place. header and entries are filled in
+/// and must outlive out. entries needs room for every question and record.
+/// Fails with CDNS_ERR_MALFORMED if any length or compression pointer is bad
+int cdnsParsePacket(const void *packet, int length, CdnsPacketReadInfo *out,
+                    CdnsPacketHeader *header, void **entries, int capacity);
+/// Decompresses a name of an indexed packet, such as questions[i] or
+/// records[i], into out as uncompressed length-prefixed labels ending in a
+/// zero byte. Names are only decompressed when this is called
+int cdnsReadName(const CdnsPacketReadInfo *info, const void *name,
+                 unsigned char *out, int capacity, int *length);
+/// Reads the type and class of a question, in host byte order
+int cdnsGetQuestion(const CdnsPacketReadInfo *info, u_int32_t index,
+                    CdnsQuestion *out);
+/// Reads the fixed fields of a record, in host byte order. rdata may be NULL,
+/// otherwise it is pointed at the record's rdlength bytes of data
+int cdnsGetRecord(const CdnsPacketReadInfo *info, u_int32_t index,
+                  CdnsResourceRecordInfo *out, const void **rdata);
+/// Reads the OPT record in the additional section of an indexed packet. Fails
+/// with CDNS_ERR_UNDEFINED if there is none
+int cdnsGetEdns(const CdnsPacketReadInfo *info, CdnsEdns *out);
+
+/// Creates an outgoing request owned by the current callback cycle. Fails with
+/// CDNS_ERR_OUTGOING_FULL once threadOutgoingRequests are in use
 int cdnsCreateRequest(CdnsResponseContext *context, CdnsRequestWriteInfo **out);
+/// The id is ignored, cdnsSendRequest picks a random one. An OPT record offering
+/// ednsUdpSize is added when the request is sent, in place of any written
 int cdnsWritableRequestHeader(CdnsRequestWriteInfo *writer,
                               CdnsPacketHeader **out);
 /// You can write either a single question or multiple with this call. No
 /// validation is done.
 int cdnsWriteQuestion(CdnsRequestWriteInfo *writer, void *question, int length);
+/// Sends the request. Returning CdnsPoll with the id parks the callback until
+/// the reply arrives. Requests to a TCP destination share the thread's
+/// connections to it, see upstreamTcpConnections, and are not resent, only
+/// given up on after maxResendCount resend delays
 int cdnsSendRequest(CdnsRequestWriteInfo *writer,
                     CdnsRequestDestination destination, CdnsRequestId *id);
+/// Creates a pool of upstreams to send requests to with cdnsSendPooledRequest.
+/// Pools are freed along with the state
+int cdnsCreateUpstreamPool(CdnsState *state,
+                           const CdnsUpstreamPoolConfig *config,
+                           CdnsUpstreamPool **out);
+/// Sends the request to the upstream of the pool with the lowest smoothed RTT,
+/// weighted by its loss rate. Upstreams no reply has come from yet are tried
+/// first. Resends go to whichever upstream is fastest by then, so a server that
+/// stops answering is left after its first timeout
+int cdnsSendPooledRequest(CdnsRequestWriteInfo *writer, CdnsUpstreamPool *pool,
+                          CdnsRequestId *id);
+/// Sums what every thread has learned about upstream index of the pool. May be
+/// called while cdnsPoll is running
+int cdnsGetUpstreamStats(CdnsUpstreamPool *pool, int index,
+                         CdnsUpstreamStats *out);
 
+/// Gets the read info of the request being handled, indexing it on the first
+/// call. Valid until the callback cycle completes
 int cdnsGetRequestReadInfo(CdnsResponseContext *context,
                            CdnsPacketReadInfo **out);
+/// Gets the response writer of the request being handled. The header starts
+/// out as a reply to the request, with the same id
 int cdnsGetResponseWriter(CdnsResponseContext *context,
                           CdnsResponseWriteinfo **out);
+/// The header is in host byte order and is encoded when the response is sent
 int cdnsWritableResponseHeader(CdnsResponseWriteinfo *writer,
                                CdnsPacketHeader **out);
 /// You can write either a single record or multiple with this call. No
-/// validation is done.
+/// validation is done, and the header counts are left to the caller. Names in
+/// raw records are not used for compressing later ones
 int cdnsWriteRecord(CdnsResponseWriteinfo *writer, void *record, int length);
+/// Adds a question to the response and counts it in qdcount. name is
+/// uncompressed length-prefixed labels ending in a zero byte, as cdnsReadName
+/// produces. It is written as a pointer to the longest matching suffix of a
+/// name already in the response. Questions must come before any record
+int cdnsAddQuestion(CdnsResponseWriteinfo *writer, const void *name,
+                    u_int16_t type, u_int16_t clas);
+/// Adds a record to a section of the response and counts it there. The owner
+/// name is compressed as in cdnsAddQuestion. rdata is info->rdlength bytes,
+/// with any names in it uncompressed: those of NS, CNAME, PTR, MX and SOA
+/// records are compressed too, and the rdlength written is adjusted to match.
+/// Fails with CDNS_ERR_SECTION_ORDER if a later section already has records,
+/// and with CDNS_ERR_TOO_LARGE, leaving the response as it was, if it doesn't
+/// fit
+int cdnsAddRecord(CdnsResponseWriteinfo *writer, CdnsSection section,
+                  const void *name, const CdnsResourceRecordInfo *info,
+                  const void *rdata);
+/// Queues the response. Queued responses are sent in batches once the
+/// current batch of callbacks has run. Any OPT record written is replaced by
+/// one answering the request's, or dropped if the request had none. Over UDP,
+/// additional records that don't fit the client's payload size are left out,
+/// and if answers or authority records don't fit either only the question is
+/// sent, with TC set
 int cdnsSendResponse(CdnsResponseWriteinfo *writer);
 
+/// Starts a packet in buffer. The header is zeroed and room left for it
+int cdnsInitPacketBuilder(CdnsPacketBuilder *builder, void *buffer,
+                          int capacity);
+/// cdnsAddQuestion for a packet builder
+int cdnsBuildQuestion(CdnsPacketBuilder *builder, const void *name,
+                      u_int16_t type, u_int16_t clas);
+/// cdnsAddRecord for a packet builder
+int cdnsBuildRecord(CdnsPacketBuilder *builder, CdnsSection section,
+                    const void *name, const CdnsResourceRecordInfo *info,
+                    const void *rdata);
+/// Encodes the header into the buffer and sets length to the packet's size
+int cdnsFinishPacket(CdnsPacketBuilder *builder, int *length);
+
 inline unsigned char _cdnsReverseByte(unsigned char b) {
   b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
   b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
@@ -358,6 +864,12 @@ inline u_int64_t cdnsToLittleEndianArbitrary(u_int64_t value, int numBits) {
 #define CDNS_ERR_INVALID_PAUSE 9
 #define CDNS_ERR_REQ_SERVER 10
 #define CDNS_ERR_MODIFY_WHILE_RUNNING 11
-#define CDNS_ERR_NONBLOCKING_UNSUPPORTED
+#define CDNS_ERR_NONBLOCKING_UNSUPPORTED 12
+#define CDNS_ERR_TOO_LARGE 13
+#define CDNS_ERR_OUTGOING_FULL 14
+#define CDNS_ERR_UNKNOWN_REQUEST 15
+#define CDNS_ERR_MALFORMED 16
+#define CDNS_ERR_SECTION_ORDER 17
+#define CDNS_ERR_ZONE 18
 
 #endif
\ No newline at end of file
@@ -0,0 +1,226 @@
+#ifndef _CDNS_NAME_H_
+#define _CDNS_NAME_H_
+
+// Internal to cdns, shared with the benchmarks. Kernels for uncompressed wire format
+// names: folding a name to lowercase while validating and hashing it, and comparing two
+// names ignoring case. Folding comes in a scalar and an SSE2 version, comparing in an AVX2
+// one as well, and the best the CPU supports is picked at runtime. Every version gives the
+// same results, hashes included.
+//
+// Lowercasing works on the whole name at once, length bytes included: those are at most
+// 63, below 'A', so they are never changed and never equal to a lowercased letter.
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CDNS_NAME_X86 1
+#endif
+
+#define CDNS_NAME_MAX_LENGTH 255
+
+/// Validates the uncompressed name at name, no longer than limit bytes, and writes it
+/// lowercased to out, which may be name itself. Returns its length, root label included,
+/// or -1 if it is malformed or compressed. Up to min(limit, CDNS_NAME_MAX_LENGTH) bytes may
+/// be read, and the bytes of out past the name within that many may be overwritten
+typedef int (*DnsFoldName)(const unsigned char* name, int limit, unsigned char* out, u_int64_t* hash);
+/// Whether two byte strings of the same length are equal ignoring ASCII case
+typedef bool (*DnsNameEqual)(const unsigned char* a, const unsigned char* b, int length);
+
+typedef struct DnsNameKernels {
+    const char* name;
+    DnsFoldName foldName;
+    DnsNameEqual nameEqual;
+} DnsNameKernels;
+
+static inline unsigned char foldAscii(unsigned char c) {
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+// Length of the uncompressed name, found by following the label lengths
+static inline int uncompressedNameLength(const unsigned char* name, int limit) {
+    if(limit > CDNS_NAME_MAX_LENGTH) {
+        limit = CDNS_NAME_MAX_LENGTH;
+    }
+    int pos = 0;
+    while(pos < limit) {
+        int len = name[pos];
+        if(len == 0) {
+            return pos + 1;
+        }
+        if(len > 63) {
+            return -1;
+        }
+        pos += 1 + len;
+    }
+    return -1;
+}
+// The hash takes a little-endian word of the folded name at a time, the last one padded
+// with zeros, so the vector versions can feed it straight from their registers
+static inline u_int64_t nameHashStart(int length) {
+    return 0x243F6A8885A308D3ull ^ (u_int64_t)length;
+}
+static inline u_int64_t nameHashWord(u_int64_t hash, u_int64_t word) {
+    hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+    return hash ^ (hash >> 29);
+}
+static inline u_int64_t nameHashFinish(u_int64_t hash) {
+    hash *= 0xBF58476D1CE4E5B9ull;
+    return hash ^ (hash >> 32);
+}
+
+static inline int foldNameScalar(const unsigned char* name, int limit, unsigned char* out, u_int64_t* hash) {
+    int length = uncompressedNameLength(name, limit);
+    if(length < 0) {
+        return -1;
+    }
+    u_int64_t h = nameHashStart(length);
+    for(int i = 0;i < length;i += 8) {
+        u_int64_t word = 0;
+        for(int j = 0;j < 8 && i + j < length;j++) {
+            out[i + j] = foldAscii(name[i + j]);
+            word |= (u_int64_t)out[i + j] << (8 * j);
+        }
+        h = nameHashWord(h, word);
+    }
+    *hash = nameHashFinish(h);
+    return length;
+}
+static inline bool nameEqualScalar(const unsigned char* a, const unsigned char* b, int length) {
+    for(int i = 0;i < length;i++) {
+        if(foldAscii(a[i]) != foldAscii(b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#ifdef CDNS_NAME_X86
+// Adding 128 - 'A' moves 'A'..'Z' to the bottom of the signed range, where a single
+// signed compare picks them out
+static inline __m128i foldSse2(__m128i v) {
+    __m128i shifted = _mm_add_epi8(v, _mm_set1_epi8((char)(128 - 'A')));
+    __m128i upper = _mm_cmplt_epi8(shifted, _mm_set1_epi8((char)(-128 + 26)));
+    return _mm_add_epi8(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+static const unsigned char nameTailMask[32] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+};
+// Folds and hashes the last bytes of a name, fewer than 16. With a whole vector of room
+// to read and write, the bytes past the name are masked to zero, otherwise they are
+// copied through a zeroed buffer so nothing past the name is touched
+static inline u_int64_t foldTailSse2(const unsigned char* name, int count, int room, unsigned char* out,
+                                     u_int64_t h) {
+    __m128i v;
+    if(room >= 16) {
+        __m128i mask = _mm_loadu_si128((const __m128i*)(nameTailMask + 16 - count));
+        v = _mm_and_si128(foldSse2(_mm_loadu_si128((const __m128i*)name)), mask);
+        _mm_storeu_si128((__m128i*)out, v);
+    } else {
+        unsigned char tail[16] = {0};
+        memcpy(tail, name, count);
+        v = foldSse2(_mm_loadu_si128((const __m128i*)tail));
+        _mm_storeu_si128((__m128i*)tail, v);
+        memcpy(out, tail, count);
+    }
+    h = nameHashWord(h, (u_int64_t)_mm_cvtsi128_si64(v));
+    if(count > 8) {
+        h = nameHashWord(h, (u_int64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(v, v)));
+    }
+    return h;
+}
+static inline int foldNameSse2(const unsigned char* name, int limit, unsigned char* out, u_int64_t* hash) {
+    int length = uncompressedNameLength(name, limit);
+    if(length < 0) {
+        return -1;
+    }
+    int room = limit < CDNS_NAME_MAX_LENGTH ? limit : CDNS_NAME_MAX_LENGTH;
+    u_int64_t h = nameHashStart(length);
+    int i = 0;
+    for(;i + 16 <= length;i += 16) {
+        __m128i v = foldSse2(_mm_loadu_si128((const __m128i*)(name + i)));
+        _mm_storeu_si128((__m128i*)(out + i), v);
+        h = nameHashWord(h, (u_int64_t)_mm_cvtsi128_si64(v));
+        h = nameHashWord(h, (u_int64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(v, v)));
+    }
+    if(i < length) {
+        h = foldTailSse2(name + i, length - i, room - i, out + i, h);
+    }
+    *hash = nameHashFinish(h);
+    return length;
+}
+static inline bool nameEqualSse2(const unsigned char* a, const unsigned char* b, int length) {
+    if(length < 16) {
+        return nameEqualScalar(a, b, length);
+    }
+    int i = 0;
+    for(;i + 16 <= length;i += 16) {
+        __m128i x = foldSse2(_mm_loadu_si128((const __m128i*)(a + i)));
+        __m128i y = foldSse2(_mm_loadu_si128((const __m128i*)(b + i)));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xFFFF) {
+            return false;
+        }
+    }
+    if(i < length) {
+        // The last 16 bytes, overlapping what was already compared
+        __m128i x = foldSse2(_mm_loadu_si128((const __m128i*)(a + length - 16)));
+        __m128i y = foldSse2(_mm_loadu_si128((const __m128i*)(b + length - 16)));
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) == 0xFFFF;
+    }
+    return true;
+}
+
+__attribute__((target("avx2"))) static inline __m256i foldAvx2(__m256i v) {
+    __m256i shifted = _mm256_add_epi8(v, _mm256_set1_epi8((char)(128 - 'A')));
+    __m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(-128 + 26)), shifted);
+    return _mm256_add_epi8(v, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+__attribute__((target("avx2"))) static inline bool nameEqualAvx2(const unsigned char* a, const unsigned char* b,
+                                                                  int length) {
+    if(length < 32) {
+        return nameEqualSse2(a, b, length);
+    }
+    int i = 0;
+    for(;i + 32 <= length;i += 32) {
+        __m256i x = foldAvx2(_mm256_loadu_si256((const __m256i*)(a + i)));
+        __m256i y = foldAvx2(_mm256_loadu_si256((const __m256i*)(b + i)));
+        if((u_int32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)) != 0xFFFFFFFFu) {
+            return false;
+        }
+    }
+    if(i < length) {
+        __m256i x = foldAvx2(_mm256_loadu_si256((const __m256i*)(a + length - 32)));
+        __m256i y = foldAvx2(_mm256_loadu_si256((const __m256i*)(b + length - 32)));
+        return (u_int32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)) == 0xFFFFFFFFu;
+    }
+    return true;
+}
+#endif
+
+static const DnsNameKernels nameKernelsScalar = {"scalar", foldNameScalar, nameEqualScalar};
+#ifdef CDNS_NAME_X86
+static const DnsNameKernels nameKernelsSse2 = {"sse2", foldNameSse2, nameEqualSse2};
+// Folding stays on SSE2: names are mostly shorter than 32 bytes, and moving four words out
+// of a 256-bit register into the hash made an AVX2 version about 10% slower
+static const DnsNameKernels nameKernelsAvx2 = {"avx2", foldNameSse2, nameEqualAvx2};
+#endif
+
+// The fastest kernels the CPU runs, chosen on first use. Every x86-64 CPU has SSE2
+static inline const DnsNameKernels* nameKernels(void) {
+    static const DnsNameKernels* _Atomic selected = NULL;
+    const DnsNameKernels* kernels = atomic_load_explicit(&selected, memory_order_relaxed);
+    if(kernels == NULL) {
+#ifdef CDNS_NAME_X86
+        __builtin_cpu_init();
+        kernels = __builtin_cpu_supports("avx2") ? &nameKernelsAvx2 : &nameKernelsSse2;
+#else
+        kernels = &nameKernelsScalar;
+#endif
+        atomic_store_explicit(&selected, kernels, memory_order_relaxed);
+    }
+    return kernels;
+}
+
+#endif
@@ -0,0 +1,175 @@
+#ifndef _CDNS_POOL_H_
+#define _CDNS_POOL_H_
+
+// Internal to cdns, shared with the benchmarks. Fixed size entries handed out by index.
+// Memory grows a chunk at a time and is never moved, so pointers to entries stay valid
+// for the life of the pool. Only the owning thread allocates, but any thread may free:
+// the owner keeps a plain LIFO free list, other threads push onto a lock free Treiber
+// stack that the owner takes whole once its own list runs dry. cdns itself only frees on
+// the owning thread; the remote stack is there for the pool benchmark.
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#define CDNS_CACHE_LINE 64
+#define CDNS_POOL_CHUNK_SHIFT 6
+#define CDNS_POOL_CHUNK_SIZE (1u << CDNS_POOL_CHUNK_SHIFT)
+#define CDNS_POOL_NONE UINT32_MAX
+
+/// Called on every entry of a newly allocated chunk
+typedef void (*DnsPoolInit)(void* entry, u_int32_t idx, void* arg);
+
+typedef struct DnsPool {
+    /// Rounded up to a cache line, so entries never share one
+    size_t entrySize;
+    u_int32_t maxEntries;
+    /// Entries in the chunks allocated so far
+    u_int32_t numEntries;
+    /// Enough pointers for maxEntries, filled in as chunks are allocated
+    unsigned char** chunks;
+    /// Next free index for every entry, one array per chunk, stored after its entries
+    u_int32_t** links;
+    /// Owner's free list
+    u_int32_t localHead;
+    u_int32_t numLocalFree;
+    /// Entries freed by other threads
+    _Atomic u_int32_t remoteHead;
+    /// Entries handed out over the life of the pool, for measuring allocation churn
+    u_int64_t allocations;
+    DnsPoolInit init;
+    void* initArg;
+} DnsPool;
+
+static inline int createPool(DnsPool* pool, size_t entrySize, u_int32_t maxEntries, DnsPoolInit init, void* initArg) {
+    memset(pool, 0, sizeof(DnsPool));
+    pool->entrySize = (entrySize + CDNS_CACHE_LINE - 1) & ~(size_t)(CDNS_CACHE_LINE - 1);
+    pool->maxEntries = maxEntries;
+    pool->localHead = CDNS_POOL_NONE;
+    atomic_init(&pool->remoteHead, CDNS_POOL_NONE);
+    pool->init = init;
+    pool->initArg = initArg;
+    size_t numChunks = (maxEntries + CDNS_POOL_CHUNK_SIZE - 1) >> CDNS_POOL_CHUNK_SHIFT;
+    pool->chunks = (unsigned char**)calloc(numChunks > 0 ? numChunks : 1, sizeof(unsigned char*));
+    pool->links = (u_int32_t**)calloc(numChunks > 0 ? numChunks : 1, sizeof(u_int32_t*));
+    if(pool->chunks == NULL || pool->links == NULL) {
+        return -1;
+    }
+    return 0;
+}
+// Chunks allocated so far, the last one possibly short
+static inline u_int32_t poolChunks(const DnsPool* pool) {
+    return (pool->numEntries + CDNS_POOL_CHUNK_SIZE - 1) >> CDNS_POOL_CHUNK_SHIFT;
+}
+static inline void destroyPool(DnsPool* pool) {
+    if(pool->chunks != NULL) {
+        for(u_int32_t i = 0;i < poolChunks(pool);i++) {
+            free(pool->chunks[i]);
+        }
+    }
+    free(pool->chunks);
+    free(pool->links);
+    memset(pool, 0, sizeof(DnsPool));
+}
+static inline bool poolCreated(const DnsPool* pool) {
+    return pool->chunks != NULL;
+}
+static inline void* poolEntry(const DnsPool* pool, u_int32_t idx) {
+    return pool->chunks[idx >> CDNS_POOL_CHUNK_SHIFT] + (size_t)(idx & (CDNS_POOL_CHUNK_SIZE - 1)) * pool->entrySize;
+}
+static inline u_int32_t* poolLink(const DnsPool* pool, u_int32_t idx) {
+    return &pool->links[idx >> CDNS_POOL_CHUNK_SHIFT][idx & (CDNS_POOL_CHUNK_SIZE - 1)];
+}
+// Whether idx names an entry that has been allocated at some point, for validating ids
+// that came off the wire
+static inline bool poolContains(const DnsPool* pool, u_int64_t idx) {
+    return idx < pool->numEntries;
+}
+// Allocates the next chunk and puts its entries on the owner's free list
+static inline bool growPool(DnsPool* pool) {
+    if(pool->numEntries >= pool->maxEntries) {
+        return false;
+    }
+    size_t entriesBytes = pool->entrySize * CDNS_POOL_CHUNK_SIZE;
+    unsigned char* chunk = (unsigned char*)aligned_alloc(CDNS_CACHE_LINE,
+                                                         entriesBytes + sizeof(u_int32_t) * CDNS_POOL_CHUNK_SIZE);
+    if(chunk == NULL) {
+        return false;
+    }
+    u_int32_t chunkIndex = pool->numEntries >> CDNS_POOL_CHUNK_SHIFT;
+    pool->chunks[chunkIndex] = chunk;
+    pool->links[chunkIndex] = (u_int32_t*)(chunk + entriesBytes);
+    u_int32_t first = pool->numEntries;
+    u_int32_t count = pool->maxEntries - first < CDNS_POOL_CHUNK_SIZE ? pool->maxEntries - first : CDNS_POOL_CHUNK_SIZE;
+    pool->numEntries += CDNS_POOL_CHUNK_SIZE;
+    // Pushed in reverse so the lowest index comes out first
+    for(u_int32_t i = count;i-- > 0;) {
+        u_int32_t idx = first + i;
+        if(pool->init != NULL) {
+            pool->init(poolEntry(pool, idx), idx, pool->initArg);
+        }
+        *poolLink(pool, idx) = pool->localHead;
+        pool->localHead = idx;
+    }
+    pool->numLocalFree += count;
+    // Indexes past maxEntries in the last chunk are never handed out
+    if(pool->numEntries > pool->maxEntries) {
+        pool->numEntries = pool->maxEntries;
+    }
+    return true;
+}
+// Moves everything other threads have freed onto the owner's list. Taking the whole stack
+// with one exchange means a pop never races a push, so there is no ABA problem
+static inline bool reclaimRemote(DnsPool* pool) {
+    u_int32_t head = atomic_exchange_explicit(&pool->remoteHead, CDNS_POOL_NONE, memory_order_acquire);
+    if(head == CDNS_POOL_NONE) {
+        return false;
+    }
+    u_int32_t tail = head;
+    u_int32_t count = 1;
+    while(*poolLink(pool, tail) != CDNS_POOL_NONE) {
+        tail = *poolLink(pool, tail);
+        count++;
+    }
+    *poolLink(pool, tail) = pool->localHead;
+    pool->localHead = head;
+    pool->numLocalFree += count;
+    return true;
+}
+// Owner thread only
+static inline bool allocPoolEntry(DnsPool* pool, u_int32_t* out) {
+    if(pool->localHead == CDNS_POOL_NONE && !reclaimRemote(pool) && !growPool(pool)) {
+        return false;
+    }
+    u_int32_t idx = pool->localHead;
+    pool->localHead = *poolLink(pool, idx);
+    pool->numLocalFree--;
+    pool->allocations++;
+    *out = idx;
+    return true;
+}
+// Owner thread only
+static inline void freePoolEntry(DnsPool* pool, u_int32_t idx) {
+    *poolLink(pool, idx) = pool->localHead;
+    pool->localHead = idx;
+    pool->numLocalFree++;
+}
+// Any thread
+static inline void freePoolEntryRemote(DnsPool* pool, u_int32_t idx) {
+    u_int32_t* link = poolLink(pool, idx);
+    u_int32_t head = atomic_load_explicit(&pool->remoteHead, memory_order_relaxed);
+    do {
+        *link = head;
+    } while(!atomic_compare_exchange_weak_explicit(&pool->remoteHead, &head, idx, memory_order_release,
+                                                   memory_order_relaxed));
+}
+// Entries the owner could allocate without failing, not counting remote frees it has not
+// reclaimed yet
+static inline u_int32_t poolAvailable(const DnsPool* pool) {
+    return pool->numLocalFree + (pool->maxEntries - pool->numEntries);
+}
+
+#endif
@@ -0,0 +1,316 @@
+#ifndef _CDNS_RING_H_
+#define _CDNS_RING_H_
+
+// Internal to cdns, shared with the benchmarks. A minimal io_uring: the rings are set up
+// and driven through the raw system calls, so there is no dependency on liburing, and
+// only what the UDP sockets need is here: submission and completion queues, registered
+// files and provided buffer rings for multishot receives.
+//
+// There is no SQPOLL thread, so nothing is submitted until ringSubmit, and every request
+// that can complete without waiting, such as a send with MSG_DONTWAIT, has completed by
+// the time it returns.
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+typedef struct DnsRing {
+    int fd;
+    /// Submission queue. Requests are written at localTail and published by ringSubmit
+    _Atomic u_int32_t* sqHead;
+    _Atomic u_int32_t* sqTail;
+    _Atomic u_int32_t* sqFlags;
+    u_int32_t sqMask;
+    u_int32_t sqEntries;
+    u_int32_t localTail;
+    struct io_uring_sqe* sqes;
+    /// Completion queue
+    _Atomic u_int32_t* cqHead;
+    _Atomic u_int32_t* cqTail;
+    u_int32_t cqMask;
+    struct io_uring_cqe* cqes;
+    void* sqMap;
+    size_t sqMapLength;
+    void* cqMap;
+    size_t cqMapLength;
+    size_t sqesLength;
+} DnsRing;
+
+/// Buffers the kernel picks from for receives, each bufferSize bytes
+typedef struct DnsBufferRing {
+    struct io_uring_buf_ring* ring;
+    size_t ringLength;
+    unsigned char* buffers;
+    u_int32_t count;
+    u_int32_t bufferSize;
+    u_int16_t group;
+    /// Buffers are given back at localTail and published by publishBuffers
+    u_int16_t localTail;
+} DnsBufferRing;
+
+static inline int ringSetupCall(u_int32_t entries, struct io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+static inline int ringEnterCall(int fd, u_int32_t submit, u_int32_t wait, u_int32_t flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+static inline int ringRegisterCall(int fd, u_int32_t opcode, const void* arg, u_int32_t count) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+static inline void destroyRing(DnsRing* ring) {
+    if(ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqesLength);
+    }
+    if(ring->cqMap != NULL && ring->cqMap != ring->sqMap) {
+        munmap(ring->cqMap, ring->cqMapLength);
+    }
+    if(ring->sqMap != NULL) {
+        munmap(ring->sqMap, ring->sqMapLength);
+    }
+    if(ring->fd != -1) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(DnsRing));
+    ring->fd = -1;
+}
+// Sets up a ring with room for sqEntries requests and cqEntries completions. Returns false,
+// with errno set, if the kernel has no io_uring or refuses it, for example under seccomp
+static inline bool createRing(DnsRing* ring, u_int32_t sqEntries, u_int32_t cqEntries) {
+    memset(ring, 0, sizeof(DnsRing));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP | IORING_SETUP_SUBMIT_ALL;
+    params.cq_entries = cqEntries;
+    ring->fd = ringSetupCall(sqEntries, &params);
+    if(ring->fd < 0) {
+        ring->fd = -1;
+        return false;
+    }
+    // Completions are never dropped when the queue is full, they wait in the kernel
+    if(!(params.features & IORING_FEAT_NODROP)) {
+        destroyRing(ring);
+        return false;
+    }
+    ring->sqMapLength = params.sq_off.array + params.sq_entries * sizeof(u_int32_t);
+    ring->cqMapLength = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sqMapLength = ring->sqMapLength > ring->cqMapLength ? ring->sqMapLength : ring->cqMapLength;
+        ring->cqMapLength = ring->sqMapLength;
+    }
+    ring->sqMap = mmap(NULL, ring->sqMapLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                       IORING_OFF_SQ_RING);
+    if(ring->sqMap == MAP_FAILED) {
+        ring->sqMap = NULL;
+        destroyRing(ring);
+        return false;
+    }
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cqMap = ring->sqMap;
+    } else {
+        ring->cqMap = mmap(NULL, ring->cqMapLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                           IORING_OFF_CQ_RING);
+        if(ring->cqMap == MAP_FAILED) {
+            ring->cqMap = NULL;
+            destroyRing(ring);
+            return false;
+        }
+    }
+    ring->sqesLength = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqesLength, PROT_READ | PROT_WRITE,
+                                            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        destroyRing(ring);
+        return false;
+    }
+    unsigned char* sq = (unsigned char*)ring->sqMap;
+    unsigned char* cq = (unsigned char*)ring->cqMap;
+    ring->sqHead = (_Atomic u_int32_t*)(sq + params.sq_off.head);
+    ring->sqTail = (_Atomic u_int32_t*)(sq + params.sq_off.tail);
+    ring->sqFlags = (_Atomic u_int32_t*)(sq + params.sq_off.flags);
+    ring->sqMask = *(u_int32_t*)(sq + params.sq_off.ring_mask);
+    ring->sqEntries = params.sq_entries;
+    // Entries of the submission queue always name the request in the same position
+    u_int32_t* array = (u_int32_t*)(sq + params.sq_off.array);
+    for(u_int32_t i = 0;i < params.sq_entries;i++) {
+        array[i] = i;
+    }
+    ring->localTail = atomic_load_explicit(ring->sqTail, memory_order_relaxed);
+    ring->cqHead = (_Atomic u_int32_t*)(cq + params.cq_off.head);
+    ring->cqTail = (_Atomic u_int32_t*)(cq + params.cq_off.tail);
+    ring->cqMask = *(u_int32_t*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return true;
+}
+// Hands every request written since the last call to the kernel. Returns the number taken
+// or a negative errno
+static inline int ringSubmit(DnsRing* ring) {
+    u_int32_t pending = ring->localTail - atomic_load_explicit(ring->sqTail, memory_order_relaxed);
+    atomic_store_explicit(ring->sqTail, ring->localTail, memory_order_release);
+    if(pending == 0) {
+        return 0;
+    }
+    int r;
+    do {
+        r = ringEnterCall(ring->fd, pending, 0, 0);
+    } while(r < 0 && errno == EINTR);
+    return r < 0 ? -errno : r;
+}
+// A zeroed request to fill in, submitting what is queued first if the queue is full
+static inline struct io_uring_sqe* ringRequest(DnsRing* ring) {
+    if(ring->localTail - atomic_load_explicit(ring->sqHead, memory_order_acquire) == ring->sqEntries) {
+        ringSubmit(ring);
+    }
+    struct io_uring_sqe* sqe = &ring->sqes[ring->localTail & ring->sqMask];
+    ring->localTail++;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+// The oldest completion, or NULL if there is none. Completions that overflowed the queue are
+// brought in once it is empty
+static inline struct io_uring_cqe* ringCompletion(DnsRing* ring) {
+    u_int32_t head = atomic_load_explicit(ring->cqHead, memory_order_relaxed);
+    if(head == atomic_load_explicit(ring->cqTail, memory_order_acquire)) {
+        if(!(atomic_load_explicit(ring->sqFlags, memory_order_relaxed) & IORING_SQ_CQ_OVERFLOW)) {
+            return NULL;
+        }
+        ringEnterCall(ring->fd, 0, 0, IORING_ENTER_GETEVENTS);
+        if(head == atomic_load_explicit(ring->cqTail, memory_order_acquire)) {
+            return NULL;
+        }
+    }
+    return &ring->cqes[head & ring->cqMask];
+}
+// Releases the completion ringCompletion returned
+static inline void ringConsume(DnsRing* ring) {
+    atomic_store_explicit(ring->cqHead, atomic_load_explicit(ring->cqHead, memory_order_relaxed) + 1,
+                          memory_order_release);
+}
+// Registers a table of count files, -1 for slots filled in later by ringUpdateFile
+static inline bool ringRegisterFiles(DnsRing* ring, const int* fds, u_int32_t count) {
+    return ringRegisterCall(ring->fd, IORING_REGISTER_FILES, fds, count) == 0;
+}
+static inline bool ringUpdateFile(DnsRing* ring, u_int32_t index, int fd) {
+    struct io_uring_files_update update;
+    memset(&update, 0, sizeof(update));
+    update.offset = index;
+    update.fds = (u_int64_t)(uintptr_t)&fd;
+    return ringRegisterCall(ring->fd, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1;
+}
+
+static inline unsigned char* ringBuffer(const DnsBufferRing* buffers, u_int16_t id) {
+    return buffers->buffers + (size_t)id * buffers->bufferSize;
+}
+// Gives a buffer back to the kernel. It can be picked once publishBuffers is called
+static inline void recycleBuffer(DnsBufferRing* buffers, u_int16_t id) {
+    struct io_uring_buf* buf = &buffers->ring->bufs[buffers->localTail & (buffers->count - 1)];
+    buf->addr = (u_int64_t)(uintptr_t)ringBuffer(buffers, id);
+    buf->len = buffers->bufferSize;
+    buf->bid = id;
+    buffers->localTail++;
+}
+static inline void publishBuffers(DnsBufferRing* buffers) {
+    atomic_store_explicit((_Atomic u_int16_t*)&buffers->ring->tail, buffers->localTail, memory_order_release);
+}
+static inline void destroyBufferRing(DnsRing* ring, DnsBufferRing* buffers) {
+    if(buffers->ring != NULL) {
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.bgid = buffers->group;
+        if(ring->fd != -1) {
+            ringRegisterCall(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        }
+        munmap(buffers->ring, buffers->ringLength);
+    }
+    free(buffers->buffers);
+    memset(buffers, 0, sizeof(DnsBufferRing));
+}
+// Registers count buffers of bufferSize bytes as group. count must be a power of two.
+// Returns false if the kernel is too old for provided buffer rings
+static inline bool createBufferRing(DnsRing* ring, DnsBufferRing* buffers, u_int16_t group, u_int32_t count,
+                                    u_int32_t bufferSize) {
+    memset(buffers, 0, sizeof(DnsBufferRing));
+    buffers->group = group;
+    buffers->count = count;
+    buffers->bufferSize = bufferSize;
+    buffers->ringLength = (size_t)count * sizeof(struct io_uring_buf);
+    void* memory = mmap(NULL, buffers->ringLength, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    buffers->buffers = (unsigned char*)aligned_alloc(64, (size_t)count * bufferSize);
+    if(memory == MAP_FAILED || buffers->buffers == NULL) {
+        if(memory != MAP_FAILED) {
+            munmap(memory, buffers->ringLength);
+        }
+        free(buffers->buffers);
+        buffers->buffers = NULL;
+        return false;
+    }
+    buffers->ring = (struct io_uring_buf_ring*)memory;
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (u_int64_t)(uintptr_t)memory;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if(ringRegisterCall(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        munmap(memory, buffers->ringLength);
+        buffers->ring = NULL;
+        destroyBufferRing(ring, buffers);
+        return false;
+    }
+    for(u_int32_t i = 0;i < count;i++) {
+        recycleBuffer(buffers, (u_int16_t)i);
+    }
+    publishBuffers(buffers);
+    return true;
+}
+// A multishot recvmsg on a registered file into the buffers of group. header gives the
+// room for the source address, and has to stay valid while the receive is armed
+static inline void ringReceive(DnsRing* ring, u_int32_t file, const struct msghdr* header, u_int16_t group,
+                               u_int64_t userData) {
+    struct io_uring_sqe* sqe = ringRequest(ring);
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = (int)file;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->addr = (u_int64_t)(uintptr_t)header;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->buf_group = group;
+    sqe->user_data = userData;
+}
+// A sendmsg on a registered file that fails rather than wait for room in the socket
+// buffer, so it is done once ringSubmit returns and header need only last until then
+static inline void ringSend(DnsRing* ring, u_int32_t file, const struct msghdr* header, u_int64_t userData) {
+    struct io_uring_sqe* sqe = ringRequest(ring);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = (int)file;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (u_int64_t)(uintptr_t)header;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_DONTWAIT;
+    sqe->user_data = userData;
+}
+// Finds the source address and payload of a datagram received into a buffer by a multishot
+// recvmsg with nameRoom bytes for the address. Returns false if res does not cover them
+static inline bool parseRingDatagram(const unsigned char* buffer, int res, u_int32_t nameRoom,
+                                     const struct io_uring_recvmsg_out** out, const unsigned char** payload,
+                                     u_int32_t* payloadLength) {
+    if(res < 0 || (size_t)res < sizeof(struct io_uring_recvmsg_out) + nameRoom) {
+        return false;
+    }
+    *out = (const struct io_uring_recvmsg_out*)buffer;
+    *payload = buffer + sizeof(struct io_uring_recvmsg_out) + nameRoom;
+    u_int32_t room = (u_int32_t)res - sizeof(struct io_uring_recvmsg_out) - nameRoom;
+    *payloadLength = (*out)->payloadlen < room ? (*out)->payloadlen : room;
+    return true;
+}
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef _CDNS_RRL_H_
+#define _CDNS_RRL_H_
+
+// Internal to cdns, shared with the benchmarks. The count-min sketch behind response rate
+// limiting: RATE_ROWS rows of RATE_COLUMNS counters, each key counted in one counter per
+// row and estimated by the smallest of them, so the estimate can only be too high, by
+// roughly the traffic of other keys that share all of its counters. The memory and the
+// cost of counting a response are fixed, however many clients there are.
+//
+// Only counters at the current minimum are raised (conservative update), which keeps the
+// keys that share a counter with a flood from inheriting all of it. A counter holds the
+// second it counts in its top half, so counts start over every second without the sketch
+// ever being swept.
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#define RATE_ROWS 4
+#define RATE_COLUMNS 65536
+/// Largest count a counter holds, responses beyond it in a second are not told apart
+#define RATE_MAX_COUNT 0xFFFF
+
+typedef struct DnsRateSketch {
+    /// RATE_ROWS rows of RATE_COLUMNS, NULL while rate limiting is off
+    u_int32_t* counters;
+} DnsRateSketch;
+
+static inline bool createRateSketch(DnsRateSketch* sketch) {
+    sketch->counters = (u_int32_t*)calloc((size_t)RATE_ROWS * RATE_COLUMNS, sizeof(u_int32_t));
+    return sketch->counters != NULL;
+}
+static inline void destroyRateSketch(DnsRateSketch* sketch) {
+    free(sketch->counters);
+    sketch->counters = NULL;
+}
+// Counts a response for key in the given second, and returns the estimate of how many it
+// has had in that second, this one included
+static inline u_int32_t countRate(DnsRateSketch* sketch, u_int64_t key, u_int32_t second) {
+    // Finalizer from murmur3, then one counter per row from two halves of the result
+    key = (key ^ (key >> 33)) * 0xff51afd7ed558ccdull;
+    key = (key ^ (key >> 33)) * 0xc4ceb9fe1a85ec53ull;
+    key ^= key >> 33;
+    u_int32_t step = (u_int32_t)(key >> 32) | 1;
+    u_int32_t stamp = (second & 0xFFFF) << 16;
+    u_int32_t* cells[RATE_ROWS];
+    u_int32_t estimate = RATE_MAX_COUNT;
+    for(int row = 0;row < RATE_ROWS;row++) {
+        u_int32_t column = ((u_int32_t)key + row * step) & (RATE_COLUMNS - 1);
+        cells[row] = &sketch->counters[row * RATE_COLUMNS + column];
+        u_int32_t count = (*cells[row] & 0xFFFF0000) == stamp ? *cells[row] & 0xFFFF : 0;
+        estimate = count < estimate ? count : estimate;
+    }
+    if(estimate < RATE_MAX_COUNT) {
+        estimate++;
+    }
+    for(int row = 0;row < RATE_ROWS;row++) {
+        u_int32_t count = (*cells[row] & 0xFFFF0000) == stamp ? *cells[row] & 0xFFFF : 0;
+        if(count < estimate) {
+            *cells[row] = stamp | estimate;
+        }
+    }
+    return estimate;
+}
+
+#endif
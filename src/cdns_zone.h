@@ -0,0 +1,1206 @@
+#ifndef _CDNS_ZONE_H_
+#define _CDNS_ZONE_H_
+
+// Internal to cdns, shared with the benchmarks. Compiled zone images: an RFC 1035 master
+// file turned into a read-only image that is mapped straight into memory and used in
+// place, so loading even a zone of millions of records takes no time and every process
+// serving it shares the same pages.
+//
+// The image is a header, a hash table and the nodes. There is a node for every name that
+// owns records and for every name between those and the apex, so empty non-terminals
+// exist. A node holds its lowercased name, a directory of its RRsets and then the records
+// of each, pre-encoded as on the wire with names uncompressed. The table is keyed on the
+// hash the name kernels compute while folding, open addressed with linear probing and at
+// most half full, 8 slots to a cache line, so finding a name costs about one miss into
+// the table and one into the node.
+//
+// Images are in the byte order of the machine that compiled them. Lookups check every
+// offset they follow against the image, so a corrupt image gives wrong answers rather
+// than reads outside the mapping, without having to be scanned when it is loaded.
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cdns.h"
+#include "cdns_name.h"
+#include "cdns_pool.h"
+
+#define CDNS_ZONE_MAGIC "CDNSZONE"
+#define CDNS_ZONE_VERSION 1
+#define CDNS_ZONE_BYTE_ORDER 0x01020304u
+/// Node flag, set if the node has NS records
+#define CDNS_ZONE_HAS_NS 1
+/// Tokens in one entry of a master file
+#define CDNS_ZONE_MAX_TOKENS 512
+#define CDNS_ZONE_MAX_RDATA 65535
+#define CDNS_RR_IXFR 251
+#define CDNS_RR_AXFR 252
+#define CDNS_RR_SPF 99
+#define CDNS_RR_CAA 257
+
+typedef struct DnsZoneHeader {
+    char magic[8];
+    u_int32_t version;
+    u_int32_t byteOrder;
+    /// Slots in the table, a power of two
+    u_int32_t tableSize;
+    u_int32_t numNodes;
+    u_int64_t numRecords;
+    u_int64_t tableOffset;
+    u_int64_t nodesOffset;
+    u_int64_t nodesLength;
+    /// Of the whole image
+    u_int64_t length;
+    /// Offset of the apex node in the nodes
+    u_int32_t apex;
+    u_int32_t reserved;
+} DnsZoneHeader;
+
+typedef struct DnsZoneSlot {
+    /// High half of the name's hash
+    u_int32_t tag;
+    /// Offset of the node + 1, 0 if the slot is empty
+    u_int32_t node;
+} DnsZoneSlot;
+
+/// 4 byte aligned. Followed by the name, padded to 4 bytes, then numRRsets DnsZoneRRset,
+/// then their records
+typedef struct DnsZoneNode {
+    /// Of the whole node
+    u_int32_t length;
+    u_int8_t nameLength;
+    u_int8_t flags;
+    u_int16_t numRRsets;
+} DnsZoneNode;
+
+typedef struct DnsZoneRRset {
+    u_int16_t type;
+    u_int16_t count;
+    u_int32_t ttl;
+    /// From the start of the node to count records, each a 2 byte rdlength and its rdata
+    u_int32_t offset;
+} DnsZoneRRset;
+
+/// A mapped image
+typedef struct DnsZone {
+    const unsigned char* image;
+    size_t length;
+    const DnsZoneSlot* table;
+    u_int32_t mask;
+    const unsigned char* nodes;
+    u_int64_t nodesLength;
+    const DnsZoneNode* apex;
+} DnsZone;
+
+typedef enum DnsZoneResult {
+    /// The name is not at or below the apex
+    ZONE_OUTSIDE,
+    /// node is the name's
+    ZONE_FOUND,
+    /// node is the wildcard that stands in for the name
+    ZONE_WILDCARD,
+    /// node is a delegation above the name
+    ZONE_DELEGATION,
+    /// The name does not exist
+    ZONE_NXDOMAIN,
+} DnsZoneResult;
+
+typedef struct DnsZoneMatch {
+    DnsZoneResult result;
+    const DnsZoneNode* node;
+    /// Where the name of node, or the apex's name if there is no node, starts within the
+    /// name looked up
+    int suffix;
+} DnsZoneMatch;
+
+static inline const unsigned char* zoneNodeName(const DnsZoneNode* node) {
+    return (const unsigned char*)(node + 1);
+}
+static inline const DnsZoneRRset* zoneNodeRRsets(const DnsZoneNode* node) {
+    return (const DnsZoneRRset*)(zoneNodeName(node) + ((node->nameLength + 3) & ~3));
+}
+static inline u_int32_t zoneNodeHeaderLength(int nameLength, int numRRsets) {
+    return sizeof(DnsZoneNode) + ((nameLength + 3) & ~3) + numRRsets * sizeof(DnsZoneRRset);
+}
+// The node at an offset, or NULL if it would not lie within the image
+static inline const DnsZoneNode* zoneNodeAt(const DnsZone* zone, u_int64_t offset) {
+    if(offset % 4 != 0 || offset + sizeof(DnsZoneNode) > zone->nodesLength) {
+        return NULL;
+    }
+    const DnsZoneNode* node = (const DnsZoneNode*)(zone->nodes + offset);
+    if(node->length > zone->nodesLength - offset ||
+       zoneNodeHeaderLength(node->nameLength, node->numRRsets) > node->length) {
+        return NULL;
+    }
+    return node;
+}
+// Checks the header of an image and sets zone up to read it
+static inline bool openZoneImage(const unsigned char* image, size_t length, DnsZone* zone) {
+    const DnsZoneHeader* header = (const DnsZoneHeader*)image;
+    if(length < sizeof(DnsZoneHeader) || memcmp(header->magic, CDNS_ZONE_MAGIC, 8) != 0 ||
+       header->version != CDNS_ZONE_VERSION || header->byteOrder != CDNS_ZONE_BYTE_ORDER ||
+       header->length != length || header->tableSize == 0 || (header->tableSize & (header->tableSize - 1)) != 0 ||
+       header->tableOffset % 8 != 0 || header->tableOffset > length ||
+       (u_int64_t)header->tableSize * sizeof(DnsZoneSlot) > length - header->tableOffset ||
+       header->nodesOffset % 4 != 0 || header->nodesOffset > length ||
+       header->nodesLength > length - header->nodesOffset) {
+        return false;
+    }
+    zone->image = image;
+    zone->length = length;
+    zone->table = (const DnsZoneSlot*)(image + header->tableOffset);
+    zone->mask = header->tableSize - 1;
+    zone->nodes = image + header->nodesOffset;
+    zone->nodesLength = header->nodesLength;
+    zone->apex = zoneNodeAt(zone, header->apex);
+    return zone->apex != NULL;
+}
+// Node of a lowercased name, given the hash foldName computed for it, or NULL
+static inline const DnsZoneNode* findZoneNode(const DnsZone* zone, const unsigned char* name, int length,
+                                              u_int64_t hash) {
+    u_int32_t tag = (u_int32_t)(hash >> 32);
+    for(u_int32_t pos = (u_int32_t)hash & zone->mask, probes = 0;probes <= zone->mask;
+        pos = (pos + 1) & zone->mask, probes++) {
+        const DnsZoneSlot* slot = &zone->table[pos];
+        if(slot->node == 0) {
+            return NULL;
+        }
+        if(slot->tag != tag) {
+            continue;
+        }
+        const DnsZoneNode* node = zoneNodeAt(zone, slot->node - 1);
+        if(node != NULL && node->nameLength == length && nameKernels()->nameEqual(zoneNodeName(node), name, length)) {
+            return node;
+        }
+    }
+    return NULL;
+}
+// Folds a name in place and finds its node
+static inline const DnsZoneNode* findZoneName(const DnsZone* zone, unsigned char* name, int length) {
+    u_int64_t hash;
+    if(nameKernels()->foldName(name, length, name, &hash) != length) {
+        return NULL;
+    }
+    return findZoneNode(zone, name, length, hash);
+}
+static inline const DnsZoneRRset* findZoneRRset(const DnsZoneNode* node, u_int16_t type) {
+    const DnsZoneRRset* rrsets = zoneNodeRRsets(node);
+    for(int i = 0;i < node->numRRsets;i++) {
+        if(rrsets[i].type == type) {
+            return &rrsets[i];
+        }
+    }
+    return NULL;
+}
+// Reads the record of a node at *pos and moves past it. False once the records would run
+// past the node
+static inline bool nextZoneRecord(const DnsZoneNode* node, u_int32_t* pos, const unsigned char** rdata,
+                                  u_int16_t* rdlength) {
+    if(*pos > node->length || node->length - *pos < 2) {
+        return false;
+    }
+    const unsigned char* at = (const unsigned char*)node + *pos;
+    u_int16_t length;
+    memcpy(&length, at, 2);
+    if(node->length - *pos - 2 < length) {
+        return false;
+    }
+    *rdata = at + 2;
+    *rdlength = length;
+    *pos += 2 + length;
+    return true;
+}
+
+// Finds what answers a query for name, which is lowercased in place. Walks down from the
+// apex one label at a time, so that a delegation on the way is found before the name
+static inline void lookupZone(const DnsZone* zone, unsigned char* name, int length, u_int16_t qtype,
+                              DnsZoneMatch* out) {
+    const unsigned char* origin = zoneNodeName(zone->apex);
+    int originLength = zone->apex->nameLength;
+    u_int64_t hash;
+    out->node = NULL;
+    out->result = ZONE_OUTSIDE;
+    if(nameKernels()->foldName(name, length, name, &hash) != length || length < originLength) {
+        return;
+    }
+    int starts[CDNS_NAME_MAX_LENGTH / 2 + 1];
+    int numLabels = 0;
+    for(int pos = 0;name[pos] != 0;pos += 1 + name[pos]) {
+        starts[numLabels++] = pos;
+    }
+    // The root label counts as one, so the root zone works too
+    starts[numLabels++] = length - 1;
+    int apex = numLabels - 1;
+    while(apex >= 0 && starts[apex] > length - originLength) {
+        apex--;
+    }
+    if(apex < 0 || starts[apex] != length - originLength || memcmp(name + starts[apex], origin, originLength) != 0) {
+        return;
+    }
+    out->node = zone->apex;
+    out->suffix = starts[apex];
+    int encloser = apex;
+    for(int i = apex - 1;i >= 0;i--) {
+        int suffixLength = length - starts[i];
+        nameKernels()->foldName(name + starts[i], suffixLength, name + starts[i], &hash);
+        const DnsZoneNode* node = findZoneNode(zone, name + starts[i], suffixLength, hash);
+        if(node == NULL) {
+            break;
+        }
+        encloser = i;
+        out->node = node;
+        out->suffix = starts[i];
+        // Data at a delegation belongs to the child zone, except the DS records
+        if((node->flags & CDNS_ZONE_HAS_NS) && !(i == 0 && qtype == CDNS_RR_DS)) {
+            out->result = ZONE_DELEGATION;
+            return;
+        }
+    }
+    if(encloser == 0) {
+        out->result = ZONE_FOUND;
+        return;
+    }
+    // No such name, but a wildcard child of its closest encloser may stand in for it
+    unsigned char wildcard[CDNS_NAME_MAX_LENGTH + 2];
+    int encloserLength = length - starts[encloser];
+    wildcard[0] = 1;
+    wildcard[1] = '*';
+    memcpy(wildcard + 2, name + starts[encloser], encloserLength);
+    if(encloserLength + 2 <= CDNS_NAME_MAX_LENGTH) {
+        const DnsZoneNode* node = findZoneName(zone, wildcard, encloserLength + 2);
+        if(node != NULL) {
+            out->node = node;
+            out->suffix = 0;
+            out->result = ZONE_WILDCARD;
+            return;
+        }
+    }
+    out->node = NULL;
+    out->suffix = starts[apex];
+    out->result = ZONE_NXDOMAIN;
+}
+
+// Compiling
+
+typedef struct ZoneLexer {
+    const char* p;
+    const char* end;
+    int line;
+    int parens;
+    /// Until something other than a line break is read on the current line
+    bool lineStart;
+} ZoneLexer;
+
+typedef struct ZoneToken {
+    const char* text;
+    int length;
+    bool quoted;
+    /// Whether the token starts in the first column, which makes it the owner name
+    bool firstColumn;
+    int line;
+} ZoneToken;
+
+enum ZoneLexResult {
+    ZONE_LEX_TOKEN,
+    ZONE_LEX_END_OF_ENTRY,
+    ZONE_LEX_END_OF_FILE,
+    ZONE_LEX_ERROR,
+};
+
+typedef struct ZoneBuffer {
+    unsigned char* data;
+    size_t length;
+    size_t capacity;
+} ZoneBuffer;
+
+typedef struct ZoneRecord {
+    /// Offset of the lowercased owner name in the names buffer
+    u_int32_t owner;
+    u_int8_t ownerLength;
+    u_int16_t type;
+    u_int16_t rdlength;
+    u_int32_t ttl;
+    /// Offset in the rdata buffer
+    u_int64_t rdata;
+} ZoneRecord;
+
+/// A name in the names buffer
+typedef struct ZoneName {
+    u_int32_t offset;
+    u_int8_t length;
+} ZoneName;
+
+typedef struct ZoneCompiler {
+    ZoneLexer lexer;
+    unsigned char apex[CDNS_NAME_MAX_LENGTH + 1];
+    int apexLength;
+    /// For relative names, changed by $ORIGIN
+    unsigned char origin[CDNS_NAME_MAX_LENGTH + 1];
+    int originLength;
+    /// For records without a TTL, from $TTL or else the last TTL given
+    u_int32_t defaultTtl;
+    bool haveDefaultTtl;
+    bool ttlDirective;
+    unsigned char owner[CDNS_NAME_MAX_LENGTH + 1];
+    int ownerLength;
+    ZoneBuffer names;
+    ZoneBuffer rdata;
+    ZoneRecord* records;
+    size_t numRecords;
+    size_t recordCapacity;
+    unsigned char scratch[CDNS_ZONE_MAX_RDATA];
+} ZoneCompiler;
+
+static inline bool zoneReserve(ZoneBuffer* buffer, size_t more) {
+    if(buffer->length + more <= buffer->capacity) {
+        return true;
+    }
+    size_t capacity = buffer->capacity > 0 ? buffer->capacity : 4096;
+    while(capacity < buffer->length + more) {
+        capacity *= 2;
+    }
+    unsigned char* data = (unsigned char*)realloc(buffer->data, capacity);
+    if(data == NULL) {
+        return false;
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return true;
+}
+static inline bool zoneAppend(ZoneBuffer* buffer, const void* data, size_t length) {
+    if(!zoneReserve(buffer, length)) {
+        return false;
+    }
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    return true;
+}
+
+static inline int nextZoneToken(ZoneLexer* lexer, ZoneToken* out) {
+    while(lexer->p < lexer->end) {
+        char c = *lexer->p;
+        if(c == '\n') {
+            lexer->p++;
+            lexer->line++;
+            lexer->lineStart = true;
+            if(lexer->parens == 0) {
+                return ZONE_LEX_END_OF_ENTRY;
+            }
+            continue;
+        }
+        if(c == ';') {
+            while(lexer->p < lexer->end && *lexer->p != '\n') {
+                lexer->p++;
+            }
+            continue;
+        }
+        bool firstColumn = lexer->lineStart;
+        lexer->lineStart = false;
+        if(c == ' ' || c == '\t' || c == '\r') {
+            lexer->p++;
+            continue;
+        }
+        if(c == '(' || c == ')') {
+            if(c == ')' && lexer->parens == 0) {
+                return ZONE_LEX_ERROR;
+            }
+            lexer->parens += c == '(' ? 1 : -1;
+            lexer->p++;
+            continue;
+        }
+        out->firstColumn = firstColumn;
+        out->line = lexer->line;
+        out->quoted = c == '"';
+        if(out->quoted) {
+            lexer->p++;
+        }
+        out->text = lexer->p;
+        while(lexer->p < lexer->end) {
+            c = *lexer->p;
+            if(out->quoted ? c == '"' : strchr(" \t\r\n;()\"", c) != NULL) {
+                break;
+            }
+            if(c == '\\' && lexer->p + 1 < lexer->end) {
+                lexer->p++;
+            }
+            if(*lexer->p == '\n') {
+                lexer->line++;
+            }
+            lexer->p++;
+        }
+        out->length = (int)(lexer->p - out->text);
+        if(out->quoted) {
+            if(lexer->p == lexer->end) {
+                return ZONE_LEX_ERROR;
+            }
+            lexer->p++;
+        }
+        return ZONE_LEX_TOKEN;
+    }
+    return ZONE_LEX_END_OF_FILE;
+}
+// Reads the tokens of the next entry that has any. Returns ZONE_LEX_END_OF_FILE once there
+// are none left
+static inline int readZoneEntry(ZoneLexer* lexer, ZoneToken* tokens, int* count) {
+    *count = 0;
+    while(true) {
+        int result = nextZoneToken(lexer, &tokens[*count]);
+        if(result == ZONE_LEX_ERROR) {
+            return result;
+        }
+        if(result == ZONE_LEX_TOKEN) {
+            if(++*count == CDNS_ZONE_MAX_TOKENS) {
+                return ZONE_LEX_ERROR;
+            }
+            continue;
+        }
+        if(result == ZONE_LEX_END_OF_FILE && lexer->parens != 0) {
+            return ZONE_LEX_ERROR;
+        }
+        if(*count > 0) {
+            return ZONE_LEX_END_OF_ENTRY;
+        }
+        if(result == ZONE_LEX_END_OF_FILE) {
+            return result;
+        }
+    }
+}
+// Decodes one character of a token, \X and \DDD escapes included. Returns the byte, or -1
+// if a \DDD escape is out of range
+static inline int zoneChar(const ZoneToken* token, int* i, bool* escaped) {
+    *escaped = false;
+    unsigned char c = token->text[(*i)++];
+    if(c != '\\' || *i == token->length) {
+        return c;
+    }
+    *escaped = true;
+    const char* p = token->text + *i;
+    if(token->length - *i >= 3 && p[0] >= '0' && p[0] <= '9' && p[1] >= '0' && p[1] <= '9' && p[2] >= '0' &&
+       p[2] <= '9') {
+        *i += 3;
+        int value = (p[0] - '0') * 100 + (p[1] - '0') * 10 + (p[2] - '0');
+        return value <= 255 ? value : -1;
+    }
+    return (unsigned char)token->text[(*i)++];
+}
+static inline bool zoneTokenIs(const ZoneToken* token, const char* text) {
+    return (int)strlen(text) == token->length && strncasecmp(token->text, text, token->length) == 0;
+}
+// Text to wire format, with origin appended to relative names. Returns the length or -1
+static inline int parseZoneName(const ZoneToken* token, const unsigned char* origin, int originLength,
+                                unsigned char* out) {
+    if(zoneTokenIs(token, "@")) {
+        memcpy(out, origin, originLength);
+        return originLength;
+    }
+    if(zoneTokenIs(token, ".")) {
+        out[0] = 0;
+        return 1;
+    }
+    int labelStart = 0;
+    int length = 1;
+    for(int i = 0;i < token->length;) {
+        bool escaped;
+        int c = zoneChar(token, &i, &escaped);
+        if(c < 0) {
+            return -1;
+        }
+        if(c == '.' && !escaped) {
+            int label = length - labelStart - 1;
+            if(label == 0) {
+                return -1;
+            }
+            out[labelStart] = label;
+            labelStart = length++;
+            if(i == token->length) {
+                out[labelStart] = 0;
+                return labelStart + 1;
+            }
+            continue;
+        }
+        if(length - labelStart - 1 == 63 || length >= CDNS_NAME_MAX_LENGTH) {
+            return -1;
+        }
+        out[length++] = c;
+    }
+    int label = length - labelStart - 1;
+    if(label == 0 || length + originLength > CDNS_NAME_MAX_LENGTH) {
+        return -1;
+    }
+    out[labelStart] = label;
+    memcpy(out + length, origin, originLength);
+    return length + originLength;
+}
+static inline bool parseZoneNumber(const ZoneToken* token, u_int64_t max, u_int64_t* out) {
+    if(token->length == 0 || token->length > 20) {
+        return false;
+    }
+    u_int64_t value = 0;
+    for(int i = 0;i < token->length;i++) {
+        char c = token->text[i];
+        if(c < '0' || c > '9') {
+            return false;
+        }
+        value = value * 10 + (c - '0');
+    }
+    *out = value;
+    return value <= max;
+}
+// Seconds, either plain or in units such as 1h30m
+static inline bool parseZoneTtl(const ZoneToken* token, u_int32_t* out) {
+    u_int64_t total = 0;
+    u_int64_t value = 0;
+    bool digits = false;
+    for(int i = 0;i < token->length;i++) {
+        char c = token->text[i];
+        if(c >= '0' && c <= '9') {
+            value = value * 10 + (c - '0');
+            digits = true;
+            if(value > UINT32_MAX) {
+                return false;
+            }
+            continue;
+        }
+        const char* units = "smhdw";
+        const char* unit = strchr(units, c | 0x20);
+        static const u_int32_t seconds[] = {1, 60, 3600, 86400, 604800};
+        if(!digits || unit == NULL || *unit == 0) {
+            return false;
+        }
+        total += value * seconds[unit - units];
+        value = 0;
+        digits = false;
+    }
+    if(digits) {
+        total += value;
+    } else if(token->length == 0 || (token->text[token->length - 1] >= '0' && token->text[token->length - 1] <= '9')) {
+        return false;
+    }
+    if(total > UINT32_MAX) {
+        return false;
+    }
+    *out = (u_int32_t)total;
+    return true;
+}
+
+typedef struct ZoneTypeName {
+    const char* name;
+    u_int16_t type;
+} ZoneTypeName;
+
+static const ZoneTypeName zoneTypeNames[] = {
+    {"A", CDNS_RR_A}, {"NS", CDNS_RR_NS}, {"CNAME", CDNS_RR_CNAME}, {"SOA", CDNS_RR_SOA},
+    {"PTR", CDNS_RR_PTR}, {"MX", CDNS_RR_MX}, {"TXT", CDNS_RR_TXT}, {"RP", CDNS_RR_RP},
+    {"AFSDB", CDNS_RR_AFSDB}, {"AAAA", CDNS_RR_AAAA}, {"LOC", CDNS_RR_LOC}, {"SRV", CDNS_RR_SRV},
+    {"NAPTR", CDNS_RR_NAPTR}, {"CERT", CDNS_RR_CERT}, {"DNAME", CDNS_RR_DNAME}, {"DS", CDNS_RR_DS},
+    {"SSHFP", CDNS_RR_SSHFP}, {"RRSIG", CDNS_RR_RRSIG}, {"NSEC", CDNS_RR_NSEC}, {"DNSKEY", CDNS_RR_DNSKEY},
+    {"NSEC3", CDNS_RR_NSEC3}, {"NSEC3PARAM", CDNS_RR_NSEC3PARAM}, {"TLSA", CDNS_RR_TSLA},
+    {"SVCB", CDNS_RR_SVCB}, {"HTTPS", CDNS_RR_HTTPS}, {"SPF", CDNS_RR_SPF}, {"CAA", CDNS_RR_CAA},
+};
+
+// A type mnemonic or TYPEnnn, -1 if the token is neither
+static inline int parseZoneType(const ZoneToken* token) {
+    for(size_t i = 0;i < sizeof(zoneTypeNames) / sizeof(zoneTypeNames[0]);i++) {
+        if(zoneTokenIs(token, zoneTypeNames[i].name)) {
+            return zoneTypeNames[i].type;
+        }
+    }
+    u_int64_t type;
+    if(token->length > 4 && strncasecmp(token->text, "TYPE", 4) == 0) {
+        ZoneToken number = {token->text + 4, token->length - 4, false, false, token->line};
+        if(parseZoneNumber(&number, UINT16_MAX, &type)) {
+            return (int)type;
+        }
+    }
+    return -1;
+}
+static inline bool isZoneClass(const ZoneToken* token) {
+    return zoneTokenIs(token, "IN") || zoneTokenIs(token, "CH") || zoneTokenIs(token, "HS") ||
+           (token->length > 5 && strncasecmp(token->text, "CLASS", 5) == 0);
+}
+static inline int zoneHexDigit(char c) {
+    if(c >= '0' && c <= '9') return c - '0';
+    c |= 0x20;
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+// A <character-string>, a length byte and up to 255 bytes. Returns the bytes written or -1
+static inline int parseZoneString(const ZoneToken* token, unsigned char* out, int room) {
+    int length = 0;
+    for(int i = 0;i < token->length;) {
+        bool escaped;
+        int c = zoneChar(token, &i, &escaped);
+        if(c < 0 || length == 255 || length + 2 > room) {
+            return -1;
+        }
+        out[1 + length++] = c;
+    }
+    if(room < 1) {
+        return -1;
+    }
+    out[0] = length;
+    return length + 1;
+}
+static inline void putZoneU16(unsigned char* out, u_int64_t value) {
+    out[0] = value >> 8;
+    out[1] = value & 0xFF;
+}
+static inline void putZoneU32(unsigned char* out, u_int64_t value) {
+    putZoneU16(out, value >> 16);
+    putZoneU16(out + 2, value & 0xFFFF);
+}
+// Encodes the rdata of a record into compiler->scratch from its tokens. Returns the
+// rdlength or -1
+static inline int parseZoneRdata(ZoneCompiler* compiler, u_int16_t type, const ZoneToken* tokens, int count) {
+    unsigned char* out = compiler->scratch;
+    const unsigned char* origin = compiler->origin;
+    int originLength = compiler->originLength;
+    u_int64_t value;
+    // RFC 3597: \# and the length, then the data in hex
+    if(count >= 2 && zoneTokenIs(&tokens[0], "\\#") && !tokens[0].quoted) {
+        if(!parseZoneNumber(&tokens[1], CDNS_ZONE_MAX_RDATA, &value)) {
+            return -1;
+        }
+        int length = 0;
+        for(int t = 2;t < count;t++) {
+            if(tokens[t].length % 2 != 0) {
+                return -1;
+            }
+            for(int i = 0;i < tokens[t].length;i += 2) {
+                int high = zoneHexDigit(tokens[t].text[i]);
+                int low = zoneHexDigit(tokens[t].text[i + 1]);
+                if(high < 0 || low < 0 || length == (int)value) {
+                    return -1;
+                }
+                out[length++] = high << 4 | low;
+            }
+        }
+        return length == (int)value ? length : -1;
+    }
+    switch(type) {
+    case CDNS_RR_A:
+    case CDNS_RR_AAAA: {
+        char address[INET6_ADDRSTRLEN];
+        if(count != 1 || tokens[0].quoted || tokens[0].length >= INET6_ADDRSTRLEN) {
+            return -1;
+        }
+        memcpy(address, tokens[0].text, tokens[0].length);
+        address[tokens[0].length] = 0;
+        int family = type == CDNS_RR_A ? AF_INET : AF_INET6;
+        return inet_pton(family, address, out) == 1 ? (family == AF_INET ? 4 : 16) : -1;
+    }
+    case CDNS_RR_NS:
+    case CDNS_RR_CNAME:
+    case CDNS_RR_PTR:
+    case CDNS_RR_DNAME:
+        return count == 1 ? parseZoneName(&tokens[0], origin, originLength, out) : -1;
+    case CDNS_RR_MX: {
+        if(count != 2 || !parseZoneNumber(&tokens[0], UINT16_MAX, &value)) {
+            return -1;
+        }
+        putZoneU16(out, value);
+        int length = parseZoneName(&tokens[1], origin, originLength, out + 2);
+        return length < 0 ? -1 : length + 2;
+    }
+    case CDNS_RR_SRV: {
+        if(count != 4) {
+            return -1;
+        }
+        for(int i = 0;i < 3;i++) {
+            if(!parseZoneNumber(&tokens[i], UINT16_MAX, &value)) {
+                return -1;
+            }
+            putZoneU16(out + 2 * i, value);
+        }
+        int length = parseZoneName(&tokens[3], origin, originLength, out + 6);
+        return length < 0 ? -1 : length + 6;
+    }
+    case CDNS_RR_SOA: {
+        if(count != 7) {
+            return -1;
+        }
+        int mname = parseZoneName(&tokens[0], origin, originLength, out);
+        if(mname < 0) {
+            return -1;
+        }
+        int rname = parseZoneName(&tokens[1], origin, originLength, out + mname);
+        if(rname < 0) {
+            return -1;
+        }
+        int length = mname + rname;
+        for(int i = 2;i < 7;i++) {
+            u_int32_t time;
+            if(!parseZoneTtl(&tokens[i], &time)) {
+                return -1;
+            }
+            putZoneU32(out + length, time);
+            length += 4;
+        }
+        return length;
+    }
+    case CDNS_RR_TXT:
+    case CDNS_RR_SPF: {
+        int length = 0;
+        for(int i = 0;i < count;i++) {
+            int written = parseZoneString(&tokens[i], out + length, CDNS_ZONE_MAX_RDATA - length);
+            if(written < 0) {
+                return -1;
+            }
+            length += written;
+        }
+        return count > 0 ? length : -1;
+    }
+    case CDNS_RR_CAA: {
+        // Flags, tag and the value, which takes up the rest of the rdata
+        if(count != 3 || !parseZoneNumber(&tokens[0], UINT8_MAX, &value)) {
+            return -1;
+        }
+        out[0] = value;
+        int tag = parseZoneString(&tokens[1], out + 1, CDNS_ZONE_MAX_RDATA - 1);
+        if(tag < 2) {
+            return -1;
+        }
+        int length = 1 + tag;
+        for(int i = 0;i < tokens[2].length;) {
+            bool escaped;
+            int c = zoneChar(&tokens[2], &i, &escaped);
+            if(c < 0 || length == CDNS_ZONE_MAX_RDATA) {
+                return -1;
+            }
+            out[length++] = c;
+        }
+        return length;
+    }
+    default:
+        // Anything else has to be given in the generic form
+        return -1;
+    }
+}
+static inline bool addZoneRecord(ZoneCompiler* compiler, u_int16_t type, u_int32_t ttl, int rdlength) {
+    if(compiler->numRecords == compiler->recordCapacity) {
+        size_t capacity = compiler->recordCapacity > 0 ? compiler->recordCapacity * 2 : 1024;
+        ZoneRecord* records = (ZoneRecord*)realloc(compiler->records, capacity * sizeof(ZoneRecord));
+        if(records == NULL) {
+            return false;
+        }
+        compiler->records = records;
+        compiler->recordCapacity = capacity;
+    }
+    ZoneRecord* record = &compiler->records[compiler->numRecords];
+    // Records of the same owner usually follow each other, so they share its name
+    ZoneRecord* previous = compiler->numRecords > 0 ? record - 1 : NULL;
+    if(previous != NULL && previous->ownerLength == compiler->ownerLength &&
+       memcmp(compiler->names.data + previous->owner, compiler->owner, compiler->ownerLength) == 0) {
+        record->owner = previous->owner;
+    } else {
+        if(compiler->names.length + compiler->ownerLength > UINT32_MAX ||
+           !zoneAppend(&compiler->names, compiler->owner, compiler->ownerLength)) {
+            return false;
+        }
+        record->owner = (u_int32_t)(compiler->names.length - compiler->ownerLength);
+    }
+    record->ownerLength = compiler->ownerLength;
+    record->type = type;
+    record->ttl = ttl;
+    record->rdlength = rdlength;
+    record->rdata = compiler->rdata.length;
+    if(!zoneAppend(&compiler->rdata, compiler->scratch, rdlength)) {
+        return false;
+    }
+    compiler->numRecords++;
+    return true;
+}
+// Handles one entry of the master file
+static inline int compileZoneEntry(ZoneCompiler* compiler, ZoneToken* tokens, int count) {
+    if(!tokens[0].quoted && tokens[0].length > 0 && tokens[0].text[0] == '$') {
+        if(zoneTokenIs(&tokens[0], "$ORIGIN") && count == 2) {
+            unsigned char origin[CDNS_NAME_MAX_LENGTH + 1];
+            int length = parseZoneName(&tokens[1], compiler->origin, compiler->originLength, origin);
+            if(length < 0) {
+                return CDNS_ERR_ZONE;
+            }
+            nameKernels()->foldName(origin, length, compiler->origin, &(u_int64_t){0});
+            compiler->originLength = length;
+            return 0;
+        }
+        if(zoneTokenIs(&tokens[0], "$TTL") && count == 2 && parseZoneTtl(&tokens[1], &compiler->defaultTtl)) {
+            compiler->haveDefaultTtl = true;
+            compiler->ttlDirective = true;
+            return 0;
+        }
+        // $INCLUDE and $GENERATE are not supported
+        return CDNS_ERR_ZONE;
+    }
+    int t = 0;
+    if(tokens[0].firstColumn) {
+        compiler->ownerLength = parseZoneName(&tokens[0], compiler->origin, compiler->originLength, compiler->owner);
+        if(compiler->ownerLength < 0) {
+            return CDNS_ERR_ZONE;
+        }
+        nameKernels()->foldName(compiler->owner, compiler->ownerLength, compiler->owner, &(u_int64_t){0});
+        t++;
+    } else if(compiler->ownerLength == 0) {
+        return CDNS_ERR_ZONE;
+    }
+    // The owner has to be at or below the apex
+    int below = compiler->ownerLength - compiler->apexLength;
+    if(below < 0 || memcmp(compiler->owner + below, compiler->apex, compiler->apexLength) != 0) {
+        return CDNS_ERR_ZONE;
+    }
+    u_int32_t ttl = compiler->defaultTtl;
+    bool haveTtl = compiler->haveDefaultTtl;
+    int type = -1;
+    // TTL and class come in either order before the type
+    for(int fields = 0;t < count && fields < 3;t++, fields++) {
+        if(tokens[t].quoted) {
+            return CDNS_ERR_ZONE;
+        }
+        if(tokens[t].text[0] >= '0' && tokens[t].text[0] <= '9') {
+            if(!parseZoneTtl(&tokens[t], &ttl)) {
+                return CDNS_ERR_ZONE;
+            }
+            haveTtl = true;
+            // Without $TTL, records without a TTL take the one of the record before
+            if(!compiler->ttlDirective) {
+                compiler->defaultTtl = ttl;
+                compiler->haveDefaultTtl = true;
+            }
+        } else if(isZoneClass(&tokens[t])) {
+            if(!zoneTokenIs(&tokens[t], "IN") && !zoneTokenIs(&tokens[t], "CLASS1")) {
+                return CDNS_ERR_ZONE;
+            }
+        } else {
+            type = parseZoneType(&tokens[t++]);
+            break;
+        }
+    }
+    if(type < 0 || !haveTtl) {
+        return CDNS_ERR_ZONE;
+    }
+    int rdlength = parseZoneRdata(compiler, (u_int16_t)type, tokens + t, count - t);
+    if(rdlength < 0) {
+        return CDNS_ERR_ZONE;
+    }
+    if(!addZoneRecord(compiler, (u_int16_t)type, ttl, rdlength)) {
+        return CDNS_ERR_MEM;
+    }
+    return 0;
+}
+
+static inline int compareZoneNames(const unsigned char* a, int aLength, const unsigned char* b, int bLength) {
+    int c = memcmp(a, b, aLength < bLength ? aLength : bLength);
+    return c != 0 ? c : aLength - bLength;
+}
+// By owner, type and then rdata, so that duplicates end up next to each other
+static inline int compareZoneRecords(const void* x, const void* y, void* arg) {
+    const ZoneCompiler* compiler = (const ZoneCompiler*)arg;
+    const ZoneRecord* a = (const ZoneRecord*)x;
+    const ZoneRecord* b = (const ZoneRecord*)y;
+    int c = compareZoneNames(compiler->names.data + a->owner, a->ownerLength, compiler->names.data + b->owner,
+                             b->ownerLength);
+    if(c != 0) {
+        return c;
+    }
+    if(a->type != b->type) {
+        return a->type < b->type ? -1 : 1;
+    }
+    c = compareZoneNames(compiler->rdata.data + a->rdata, a->rdlength, compiler->rdata.data + b->rdata, b->rdlength);
+    return c != 0 ? c : (a->rdata < b->rdata ? -1 : a->rdata > b->rdata);
+}
+static inline int compareZoneNameRefs(const void* x, const void* y, void* arg) {
+    const unsigned char* names = (const unsigned char*)arg;
+    const ZoneName* a = (const ZoneName*)x;
+    const ZoneName* b = (const ZoneName*)y;
+    return compareZoneNames(names + a->offset, a->length, names + b->offset, b->length);
+}
+// Every owner name, and every name between one and the apex, sorted and each only once
+static inline ZoneName* collectZoneNames(ZoneCompiler* compiler, size_t* count) {
+    size_t capacity = 1024;
+    size_t numNames = 0;
+    ZoneName* names = (ZoneName*)malloc(capacity * sizeof(ZoneName));
+    for(size_t i = 0;names != NULL && i < compiler->numRecords;i++) {
+        const ZoneRecord* record = &compiler->records[i];
+        if(i > 0 && record->owner == record[-1].owner && record->ownerLength == record[-1].ownerLength) {
+            continue;
+        }
+        const unsigned char* name = compiler->names.data + record->owner;
+        for(int pos = 0;names != NULL && record->ownerLength - pos >= compiler->apexLength;pos += 1 + name[pos]) {
+            if(numNames == capacity) {
+                capacity *= 2;
+                ZoneName* grown = (ZoneName*)realloc(names, capacity * sizeof(ZoneName));
+                if(grown == NULL) {
+                    free(names);
+                }
+                names = grown;
+                if(names == NULL) {
+                    break;
+                }
+            }
+            names[numNames++] = (ZoneName){record->owner + pos, (u_int8_t)(record->ownerLength - pos)};
+            if(record->ownerLength - pos == compiler->apexLength) {
+                break;
+            }
+        }
+    }
+    if(names == NULL) {
+        return NULL;
+    }
+    qsort_r(names, numNames, sizeof(ZoneName), compareZoneNameRefs, compiler->names.data);
+    size_t unique = 0;
+    for(size_t i = 0;i < numNames;i++) {
+        if(unique == 0 || compareZoneNameRefs(&names[unique - 1], &names[i], compiler->names.data) != 0) {
+            names[unique++] = names[i];
+        }
+    }
+    *count = unique;
+    return names;
+}
+// Lays out a node and the records of its name, which start at records[*next] in sorted
+// order, and moves *next past them
+static inline int writeZoneNode(ZoneCompiler* compiler, const ZoneName* name, size_t* next, ZoneBuffer* nodes,
+                                u_int32_t* offset) {
+    const unsigned char* nameData = compiler->names.data + name->offset;
+    size_t first = *next;
+    size_t end = first;
+    int numRRsets = 0;
+    while(end < compiler->numRecords) {
+        const ZoneRecord* record = &compiler->records[end];
+        if(compareZoneNames(compiler->names.data + record->owner, record->ownerLength, nameData, name->length) != 0) {
+            break;
+        }
+        if(end == first || record->type != record[-1].type) {
+            numRRsets++;
+        }
+        end++;
+    }
+    *next = end;
+    if(!zoneReserve(nodes, 3) || numRRsets > UINT16_MAX) {
+        return CDNS_ERR_MEM;
+    }
+    while(nodes->length % 4 != 0) {
+        nodes->data[nodes->length++] = 0;
+    }
+    size_t start = nodes->length;
+    u_int32_t headerLength = zoneNodeHeaderLength(name->length, numRRsets);
+    if(start > UINT32_MAX - 1 || !zoneReserve(nodes, headerLength)) {
+        return CDNS_ERR_MEM;
+    }
+    memset(nodes->data + start, 0, headerLength);
+    memcpy(nodes->data + start + sizeof(DnsZoneNode), nameData, name->length);
+    nodes->length += headerLength;
+    u_int8_t flags = 0;
+    int rrset = -1;
+    for(size_t i = first;i < end;i++) {
+        const ZoneRecord* record = &compiler->records[i];
+        // Duplicate records are dropped
+        if(i > first && record->type == record[-1].type && record->rdlength == record[-1].rdlength &&
+           memcmp(compiler->rdata.data + record->rdata, compiler->rdata.data + record[-1].rdata,
+                  record->rdlength) == 0) {
+            continue;
+        }
+        DnsZoneRRset* rrsets = (DnsZoneRRset*)(nodes->data + start + headerLength - numRRsets * sizeof(DnsZoneRRset));
+        if(i == first || record->type != record[-1].type) {
+            rrset++;
+            rrsets[rrset].type = record->type;
+            rrsets[rrset].count = 0;
+            rrsets[rrset].ttl = record->ttl;
+            rrsets[rrset].offset = (u_int32_t)(nodes->length - start);
+            if(record->type == CDNS_RR_NS) {
+                flags |= CDNS_ZONE_HAS_NS;
+            }
+        }
+        // One TTL per RRset, the lowest given, as RFC 2181 wants them all the same
+        if(record->ttl < rrsets[rrset].ttl) {
+            rrsets[rrset].ttl = record->ttl;
+        }
+        if(rrsets[rrset].count == UINT16_MAX) {
+            return CDNS_ERR_ZONE;
+        }
+        rrsets[rrset].count++;
+        u_int16_t rdlength = record->rdlength;
+        if(!zoneAppend(nodes, &rdlength, 2) || !zoneAppend(nodes, compiler->rdata.data + record->rdata, rdlength)) {
+            return CDNS_ERR_MEM;
+        }
+    }
+    if(nodes->length - start > UINT32_MAX || nodes->length > UINT32_MAX - 1) {
+        return CDNS_ERR_ZONE;
+    }
+    DnsZoneNode node = {(u_int32_t)(nodes->length - start), name->length, flags, (u_int16_t)numRRsets};
+    memcpy(nodes->data + start, &node, sizeof(DnsZoneNode));
+    *offset = (u_int32_t)start;
+    return 0;
+}
+// Flushes the directory holding path, so that a file just renamed to path is still there
+// after a crash. The directory is the part of path before its last slash
+static inline bool syncParentDirectory(const char* path) {
+    const char* slash = strrchr(path, '/');
+    char* directory = slash == NULL ? strdup(".") : strndup(path, slash == path ? 1 : slash - path);
+    if(directory == NULL) {
+        return false;
+    }
+    int fd = open(directory, O_RDONLY | O_DIRECTORY);
+    free(directory);
+    if(fd == -1) {
+        return false;
+    }
+    bool synced = fsync(fd) == 0;
+    close(fd);
+    return synced;
+}
+static inline int writeZoneImage(ZoneCompiler* compiler, const char* imagePath) {
+    qsort_r(compiler->records, compiler->numRecords, sizeof(ZoneRecord), compareZoneRecords, compiler);
+    size_t numNames;
+    ZoneName* names = collectZoneNames(compiler, &numNames);
+    if(names == NULL) {
+        return CDNS_ERR_MEM;
+    }
+    u_int32_t tableSize = 16;
+    while(tableSize < numNames * 2) {
+        tableSize *= 2;
+    }
+    DnsZoneSlot* table = (DnsZoneSlot*)calloc(tableSize, sizeof(DnsZoneSlot));
+    ZoneBuffer nodes = {0};
+    int err = table != NULL ? 0 : CDNS_ERR_MEM;
+    DnsZoneHeader header;
+    memset(&header, 0, sizeof(header));
+    bool haveApex = false;
+    size_t next = 0;
+    for(size_t i = 0;err == 0 && i < numNames;i++) {
+        u_int32_t offset;
+        err = writeZoneNode(compiler, &names[i], &next, &nodes, &offset);
+        if(err != 0) {
+            break;
+        }
+        const DnsZoneNode* node = (const DnsZoneNode*)(nodes.data + offset);
+        if(node->nameLength == compiler->apexLength) {
+            header.apex = offset;
+            haveApex = findZoneRRset(node, CDNS_RR_SOA) != NULL;
+        }
+        u_int64_t hash;
+        unsigned char folded[CDNS_NAME_MAX_LENGTH];
+        nameKernels()->foldName(zoneNodeName(node), node->nameLength, folded, &hash);
+        u_int32_t pos = (u_int32_t)hash & (tableSize - 1);
+        while(table[pos].node != 0) {
+            pos = (pos + 1) & (tableSize - 1);
+        }
+        table[pos].tag = (u_int32_t)(hash >> 32);
+        table[pos].node = offset + 1;
+    }
+    // Negative answers need the SOA of the apex
+    if(err == 0 && !haveApex) {
+        err = CDNS_ERR_ZONE;
+    }
+    FILE* file = NULL;
+    char* temporary = NULL;
+    if(err == 0) {
+        memcpy(header.magic, CDNS_ZONE_MAGIC, 8);
+        header.version = CDNS_ZONE_VERSION;
+        header.byteOrder = CDNS_ZONE_BYTE_ORDER;
+        header.tableSize = tableSize;
+        header.numNodes = (u_int32_t)numNames;
+        header.numRecords = compiler->numRecords;
+        header.tableOffset = (sizeof(DnsZoneHeader) + CDNS_CACHE_LINE - 1) & ~(u_int64_t)(CDNS_CACHE_LINE - 1);
+        header.nodesOffset = header.tableOffset + (u_int64_t)tableSize * sizeof(DnsZoneSlot);
+        header.nodesLength = nodes.length;
+        header.length = header.nodesOffset + nodes.length;
+        // Written beside the image and renamed over it, so a server never maps half of one
+        temporary = (char*)malloc(strlen(imagePath) + 5);
+        if(temporary == NULL) {
+            err = CDNS_ERR_MEM;
+        } else {
+            sprintf(temporary, "%s.tmp", imagePath);
+            file = fopen(temporary, "wb");
+            static const unsigned char padding[CDNS_CACHE_LINE] = {0};
+            if(file == NULL || fwrite(&header, sizeof(header), 1, file) != 1 ||
+               fwrite(padding, header.tableOffset - sizeof(header), 1, file) != 1 ||
+               fwrite(table, sizeof(DnsZoneSlot), tableSize, file) != tableSize ||
+               (nodes.length > 0 && fwrite(nodes.data, nodes.length, 1, file) != 1) ||
+               fflush(file) != 0 || fsync(fileno(file)) != 0) {
+                err = CDNS_ERR_ZONE;
+            }
+            if(file != NULL && fclose(file) != 0) {
+                err = CDNS_ERR_ZONE;
+            }
+            if(err == 0 && (rename(temporary, imagePath) != 0 || !syncParentDirectory(imagePath))) {
+                err = CDNS_ERR_ZONE;
+            }
+            if(err != 0 && file != NULL) {
+                unlink(temporary);
+            }
+        }
+    }
+    free(temporary);
+    free(names);
+    free(table);
+    free(nodes.data);
+    return err;
+}
+// Compiles the master file at zonePath for the zone at origin into an image at imagePath.
+// errorLine is set to the line of the entry that could not be compiled, 0 for errors that
+// are not about any one line
+static inline int compileZone(const char* zonePath, const char* origin, const char* imagePath, int* errorLine) {
+    *errorLine = 0;
+    ZoneCompiler* compiler = (ZoneCompiler*)calloc(1, sizeof(ZoneCompiler));
+    if(compiler == NULL) {
+        return CDNS_ERR_MEM;
+    }
+    ZoneToken* tokens = (ZoneToken*)malloc(sizeof(ZoneToken) * CDNS_ZONE_MAX_TOKENS);
+    ZoneToken originToken = {origin, (int)strlen(origin), false, false, 0};
+    unsigned char root = 0;
+    compiler->apexLength = parseZoneName(&originToken, &root, 1, compiler->apex);
+    nameKernels()->foldName(compiler->apex, compiler->apexLength, compiler->apex, &(u_int64_t){0});
+    memcpy(compiler->origin, compiler->apex, sizeof(compiler->apex));
+    compiler->originLength = compiler->apexLength;
+    int err = tokens != NULL ? 0 : CDNS_ERR_MEM;
+    if(err == 0 && compiler->apexLength < 0) {
+        err = CDNS_ERR_ZONE;
+    }
+    int fd = err == 0 ? open(zonePath, O_RDONLY | O_CLOEXEC) : -1;
+    struct stat info;
+    const char* text = NULL;
+    if(err == 0 && (fd == -1 || fstat(fd, &info) != 0)) {
+        err = CDNS_ERR_ZONE;
+    } else if(err == 0 && info.st_size > 0) {
+        text = (const char*)mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(text == MAP_FAILED) {
+            text = NULL;
+            err = CDNS_ERR_ZONE;
+        }
+    }
+    if(err == 0 && text != NULL) {
+        compiler->lexer = (ZoneLexer){text, text + info.st_size, 1, 0, true};
+        while(err == 0) {
+            int count;
+            int result = readZoneEntry(&compiler->lexer, tokens, &count);
+            if(result == ZONE_LEX_END_OF_FILE) {
+                break;
+            }
+            err = result == ZONE_LEX_ERROR ? CDNS_ERR_ZONE : compileZoneEntry(compiler, tokens, count);
+            if(err != 0) {
+                *errorLine = count > 0 ? tokens[0].line : compiler->lexer.line;
+            }
+        }
+    }
+    if(err == 0) {
+        err = writeZoneImage(compiler, imagePath);
+    }
+    if(text != NULL) {
+        munmap((void*)text, info.st_size);
+    }
+    if(fd != -1) {
+        close(fd);
+    }
+    free(tokens);
+    free(compiler->names.data);
+    free(compiler->rdata.data);
+    free(compiler->records);
+    free(compiler);
+    return err;
+}
+
+#endif
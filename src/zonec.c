@@ -0,0 +1,23 @@
+#include <stdio.h>
+#include "cdns.h"
+
+// Usage: cdns-zonec origin zone-file image
+// Compiles an RFC 1035 master file into the image cdnsLoadZone maps, for example
+// cdns-zonec example.com. example.com.zone example.com.image
+int main(int argc, char** argv) {
+    if(argc != 4) {
+        fprintf(stderr, "usage: %s origin zone-file image\n", argv[0]);
+        return 1;
+    }
+    int line;
+    int err = cdnsCompileZone(argv[2], argv[1], argv[3], &line);
+    if(err != 0) {
+        if(line > 0) {
+            fprintf(stderr, "%s:%d: %s\n", argv[2], line, cdnsGetErrorString(err));
+        } else {
+            fprintf(stderr, "%s: %s\n", argv[2], cdnsGetErrorString(err));
+        }
+        return 1;
+    }
+    return 0;
+}